@@ -31,6 +31,22 @@
 #include "../pllmod_common.h"
 #include "algo_callback.h"
 
+/* evaluate model parameters and account for it in treeinfo statistics;
+ * partitions with partition_mask[p] == 0 are not recomputed */
+static double model_compute_loglh(pllmod_treeinfo_t * treeinfo,
+                                  const int * partition_mask)
+{
+  const double start_time = pllmod_time_wall();
+  double loglh = pllmod_treeinfo_compute_loglh_masked(treeinfo, 0,
+                                                      partition_mask);
+
+  treeinfo->stats.count[PLLMOD_TREEINFO_STATS_MODEL]++;
+  treeinfo->stats.time[PLLMOD_TREEINFO_STATS_MODEL] +=
+      pllmod_time_wall() - start_time;
+
+  return loglh;
+}
+
 double target_freqs_func(void *p, double *x)
 {
   struct freqs_params * params = (struct freqs_params *) p;
@@ -300,6 +316,7 @@ double target_func_onedim_treeinfo(void *p, double *x, double *fx, int * converg
   int param_to_optimize               = params->param_to_optimize;
   unsigned int num_parts              = params->num_opt_partitions;
   treeinfo_param_set_cb param_setter  = params->param_set_cb;
+  int * partition_mask                = converged ? params->partition_mask : NULL;
 
   double score = -INFINITY;
 
@@ -311,11 +328,16 @@ double target_func_onedim_treeinfo(void *p, double *x, double *fx, int * converg
   {
     pll_partition_t * partition = treeinfo->partitions[i];
 
+    if (partition_mask)
+      partition_mask[i] = 1;
+
     if (treeinfo->params_to_optimize[i] & param_to_optimize)
     {
       if (!partition || (converged && converged[j]))
       {
-        /* partitions has converged, skip it */
+        /* partitions has converged, skip it (and its LH computation) */
+        if (partition_mask)
+          partition_mask[i] = 0;
         j++;
         continue;
       }
@@ -335,7 +357,7 @@ double target_func_onedim_treeinfo(void *p, double *x, double *fx, int * converg
 
   /* compute negative score */
   if (x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * model_compute_loglh(treeinfo, partition_mask);
 
 //  printf("score: %lf\n", score);
 
@@ -462,7 +484,7 @@ double target_func_multidim_treeinfo(void * p, double ** x, double * fx,
 
   /* compute negative score */
   if(x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * model_compute_loglh(treeinfo, NULL);
 
   /* copy per-partition likelihood to the output array */
   if (fx)
@@ -565,7 +587,7 @@ double target_subst_params_func_multi(void * p, double ** x, double * fx,
 
   /* compute negative score */
   if(x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * model_compute_loglh(treeinfo, NULL);
 
   /* copy per-partition likelihood to the output array */
   if (fx)
@@ -675,7 +697,7 @@ double target_freqs_func_multi(void * p, double ** x, double * fx,
 
   /* compute negative score */
   if (x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * model_compute_loglh(treeinfo, NULL);
 
   /* copy per-partition likelihood to the output array */
   if (fx)
@@ -699,3 +721,244 @@ double target_freqs_func_multi(void * p, double ** x, double * fx,
 
   return score;
 }
+
+/* compute the model gradient of all local partitions for which parameters
+ * param_to_optimize are optimized and skip[part] == 0; returns an array of
+ * per-partition gradients (see pllmod_treeinfo_compute_model_gradient()) */
+static double ** model_compute_gradient(struct treeinfo_opt_params * params,
+                                        int param_to_optimize,
+                                        const int * skip)
+{
+  pllmod_treeinfo_t * treeinfo = params->treeinfo;
+  double ** gradient;
+  size_t i;
+  size_t part = 0;
+  int retval = PLL_FAILURE;
+
+  gradient = (double **) calloc(treeinfo->partition_count, sizeof(double *));
+  if (!gradient)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for model gradient\n");
+    return NULL;
+  }
+
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    pll_partition_t * partition = treeinfo->partitions[i];
+
+    if ((treeinfo->params_to_optimize[i] & param_to_optimize) != param_to_optimize)
+      continue;
+
+    if (partition && !skip[part])
+    {
+      gradient[i] = (double *) calloc(
+                          PLLMOD_TREEINFO_GRAD_SIZE(partition->states),
+                          sizeof(double));
+      if (!gradient[i])
+      {
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                         "Cannot allocate memory for model gradient\n");
+        goto cleanup;
+      }
+    }
+
+    part++;
+  }
+
+  const double start_time = pllmod_time_wall();
+
+  retval = pllmod_treeinfo_compute_model_gradient(treeinfo,
+                                                  params->params_index,
+                                                  gradient);
+
+  treeinfo->stats.count[PLLMOD_TREEINFO_STATS_MODEL]++;
+  treeinfo->stats.time[PLLMOD_TREEINFO_STATS_MODEL] +=
+      pllmod_time_wall() - start_time;
+
+cleanup:
+  if (!retval)
+  {
+    for (i = 0; i < treeinfo->partition_count; ++i)
+      free(gradient[i]);
+    free(gradient);
+    gradient = NULL;
+  }
+
+  return gradient;
+}
+
+static void model_free_gradient(pllmod_treeinfo_t * treeinfo, double ** gradient)
+{
+  size_t i;
+
+  for (i = 0; i < treeinfo->partition_count; ++i)
+    free(gradient[i]);
+  free(gradient);
+}
+
+int grad_subst_params_func_multi(void * p, double ** x, double ** g,
+                                 int * skip)
+{
+  struct treeinfo_opt_params * params = (struct treeinfo_opt_params *) p;
+
+  pllmod_treeinfo_t * treeinfo      = params->treeinfo;
+  unsigned int * subst_free_params  = params->num_free_params;
+
+  PLLMOD_UNUSED(x);
+
+  double ** gradient = model_compute_gradient(params,
+                                              PLLMOD_OPT_PARAM_SUBST_RATES,
+                                              skip);
+  if (!gradient)
+    return PLL_FAILURE;
+
+  size_t i, j, k, l;
+  size_t part = 0;
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_SUBST_RATES))
+      continue;
+
+    if (gradient[i])
+    {
+      int * symmetries          = treeinfo->subst_matrix_symmetries[i];
+      unsigned int states       = treeinfo->partitions[i]->states;
+      unsigned int subst_params = (states * (states-1))/2;
+
+      /* negative score: the gradient has to be negated as well */
+      if (symmetries)
+      {
+        /* rates with the same symmetry index share the same variable */
+        k = 0;
+        for (l = 0; l <= subst_free_params[part]; ++l)
+        {
+          if (l == (unsigned int)symmetries[subst_params - 1])
+            continue;
+
+          g[part][k] = 0.;
+          for (j = 0; j < subst_params; j++)
+          {
+            if ((unsigned int)symmetries[j] == l)
+              g[part][k] -= gradient[i][j];
+          }
+          k++;
+        }
+      }
+      else
+      {
+        for (k = 0; k < subst_params - 1; ++k)
+          g[part][k] = -gradient[i][k];
+      }
+    }
+
+    part++;
+  }
+
+  model_free_gradient(treeinfo, gradient);
+
+  return PLL_SUCCESS;
+}
+
+int grad_freqs_func_multi(void * p, double ** x, double ** g, int * skip)
+{
+  struct treeinfo_opt_params * params = (struct treeinfo_opt_params *) p;
+
+  pllmod_treeinfo_t * treeinfo      = params->treeinfo;
+  unsigned int params_index         = params->params_index;
+  unsigned int * fixed_freq_state   = params->fixed_var_index;
+
+  double ** gradient = model_compute_gradient(params,
+                                              PLLMOD_OPT_PARAM_FREQUENCIES,
+                                              skip);
+  if (!gradient)
+    return PLL_FAILURE;
+
+  size_t i, j;
+  size_t part = 0;
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_FREQUENCIES))
+      continue;
+
+    if (gradient[i])
+    {
+      pll_partition_t * partition = treeinfo->partitions[i];
+      unsigned int states         = partition->states;
+      const double * freqs        = partition->frequencies[params_index];
+      const double * freqs_grad   = gradient[i] +
+                                    PLLMOD_TREEINFO_GRAD_FREQS(states);
+      unsigned int fixed          = fixed_freq_state[part];
+      double sum_ratios           = 1.0;
+      double mean_grad            = 0.;
+      unsigned int cur_index;
+
+      for (j = 0; j < (states - 1); ++j)
+        sum_ratios += x[part][j];
+
+      for (j = 0; j < states; ++j)
+        mean_grad += freqs[j] * freqs_grad[j];
+
+      /* freqs[j] = x[j] / sum_ratios -> chain rule, negated score */
+      cur_index = 0;
+      for (j = 0; j < states; ++j)
+      {
+        if (j != fixed)
+        {
+          g[part][cur_index] = -(freqs_grad[j] - mean_grad) / sum_ratios;
+          cur_index++;
+        }
+      }
+    }
+
+    part++;
+  }
+
+  model_free_gradient(treeinfo, gradient);
+
+  return PLL_SUCCESS;
+}
+
+int grad_func_multidim_treeinfo(void * p, double ** x, double ** g, int * skip)
+{
+  struct treeinfo_opt_params * params = (struct treeinfo_opt_params *) p;
+
+  pllmod_treeinfo_t * treeinfo      = params->treeinfo;
+  int params_to_optimize            = params->param_to_optimize;
+
+  PLLMOD_UNUSED(x);
+
+  /* no analytic derivatives for free rates and weights */
+  if (params_to_optimize != (PLLMOD_OPT_PARAM_ALPHA | PLLMOD_OPT_PARAM_PINV))
+  {
+    pllmod_set_error(PLLMOD_ERROR_NOT_IMPLEMENTED,
+                     "Model gradient is not implemented for this parameter\n");
+    return PLL_FAILURE;
+  }
+
+  double ** gradient = model_compute_gradient(params, params_to_optimize, skip);
+  if (!gradient)
+    return PLL_FAILURE;
+
+  size_t i;
+  size_t part = 0;
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    if ((treeinfo->params_to_optimize[i] & params_to_optimize) != params_to_optimize)
+      continue;
+
+    if (gradient[i])
+    {
+      unsigned int states = treeinfo->partitions[i]->states;
+
+      g[part][0] = -gradient[i][PLLMOD_TREEINFO_GRAD_ALPHA(states)];
+      g[part][1] = -gradient[i][PLLMOD_TREEINFO_GRAD_PINV(states)];
+    }
+
+    part++;
+  }
+
+  model_free_gradient(treeinfo, gradient);
+
+  return PLL_SUCCESS;
+}
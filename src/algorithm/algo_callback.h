@@ -69,6 +69,7 @@ struct treeinfo_opt_params {
   unsigned int * num_free_params;   /* number of free params for each partition*/
   unsigned int * fixed_var_index;   /* which variable is not being optimized */
   treeinfo_param_set_cb param_set_cb;
+  int * partition_mask;             /* partitions to recompute (optional) */
 };
 
 
@@ -109,5 +110,19 @@ double target_subst_params_func_multi(void * p, double ** x, double * fx,
 double target_freqs_func_multi(void * p, double ** x, double * fx,
                                int * converged);
 
+/* analytic gradients for pllmod_opt_minimize_lbfgsb_multi_grad() */
+int grad_func_multidim_treeinfo(void * p, double ** x, double ** g,
+                                int * skip);
+
+int grad_subst_params_func_multi(void * p, double ** x, double ** g,
+                                 int * skip);
+
+int grad_freqs_func_multi(void * p, double ** x, double ** g, int * skip);
+
+
+/* parallel workers (see algo_search.c) */
+int algo_check_workers(pllmod_treeinfo_t ** treeinfo_list,
+                       unsigned int worker_count);
+
 
 #endif /* ALGO_CALLBACK_H_ */
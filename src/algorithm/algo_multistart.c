@@ -0,0 +1,309 @@
+/*
+Copyright (C) 2016 Alexey Kozlov, Diego Darriba, Tomas Flouri and Alexandros Stamatakis.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Contact: Alexey Kozlov <Alexey.Kozlov@h-its.org>,
+Heidelberg Institute for Theoretical Studies,
+Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+ /**
+  * @file algo_multistart.c
+  *
+  * @brief Multi-start tree search driver
+  *
+  * @author Alexey Kozlov
+  */
+
+#include "pllmod_algorithm.h"
+#include "../pllmod_common.h"
+
+typedef struct multistart_context
+{
+  const pllmod_multistart_params_t * params;
+  const pllmod_treeinfo_t * treeinfo;
+  pllmod_multistart_result_t * results;
+} multistart_context_t;
+
+static pll_utree_t * multistart_create_tree(const pllmod_multistart_params_t * params,
+                                            const pllmod_multistart_result_t * result)
+{
+  unsigned int score;
+
+  if (result->start_type == PLLMOD_ALGO_START_RANDOM)
+  {
+    return pllmod_utree_create_random(params->tip_count,
+                                      (const char * const *) params->tip_names,
+                                      result->seed);
+  }
+  else
+  {
+    return pllmod_utree_create_parsimony_multipart(params->tip_count,
+                                                   params->tip_names,
+                                                   params->partition_count,
+                                                   params->partitions,
+                                                   result->seed,
+                                                   &score);
+  }
+}
+
+static int multistart_search(const pllmod_multistart_params_t * params,
+                             const pllmod_treeinfo_t * template_treeinfo,
+                             pllmod_multistart_result_t * result)
+{
+  unsigned int round;
+  double loglh, new_loglh, improvement;
+  pll_utree_t * tree;
+  pllmod_treeinfo_t * treeinfo;
+  pllmod_search_session_t * session;
+  int retval = PLL_FAILURE;
+
+  const unsigned int start_index = result->start_index;
+
+  tree = multistart_create_tree(params, result);
+  if (!tree)
+    return PLL_FAILURE;
+
+  treeinfo = pllmod_treeinfo_clone_tree(template_treeinfo, tree);
+  pll_utree_destroy(tree, NULL);
+  if (!treeinfo)
+    return PLL_FAILURE;
+
+  session = pllmod_algo_search_session_create(treeinfo,
+                                              params->radius_min,
+                                              params->radius_max,
+                                              params->ntopol_keep,
+                                              params->thorough,
+                                              params->brlen_opt_method,
+                                              params->bl_min,
+                                              params->bl_max,
+                                              params->smoothings,
+                                              params->epsilon,
+                                              params->subtree_cutoff);
+  if (!session)
+    goto cleanup;
+
+  loglh = session->loglh;
+  for (round = 0; round < params->max_rounds; ++round)
+  {
+    new_loglh = pllmod_algo_search_session_round(session);
+    if (!new_loglh)
+      goto cleanup;
+
+    if (params->optimize_model)
+    {
+      new_loglh = params->optimize_model(treeinfo, start_index, params->cb_data);
+      if (!new_loglh)
+        goto cleanup;
+
+      /* model changed: subtrees have to be re-evaluated */
+      pllmod_algo_search_session_reset(session);
+    }
+
+    result->rounds++;
+
+    DBG("Start %u, round %u: %f\n", start_index, round, new_loglh);
+
+    /* the current tree is the one returned, even if this round made it
+     * slightly worse */
+    improvement = new_loglh - loglh;
+    loglh = new_loglh;
+
+    if (improvement < params->lh_epsilon)
+      break;
+  }
+
+  result->loglh = loglh;
+  result->tree = pll_utree_clone(treeinfo->tree);
+  if (result->tree)
+    retval = PLL_SUCCESS;
+
+cleanup:
+  pllmod_algo_search_session_destroy(session);
+  pllmod_treeinfo_destroy(treeinfo);
+
+  return retval;
+}
+
+static int multistart_task(void * data,
+                           unsigned int task_index,
+                           unsigned int thread_index)
+{
+  multistart_context_t * context = (multistart_context_t *) data;
+  pllmod_multistart_result_t * result = &context->results[task_index];
+
+  PLLMOD_UNUSED(thread_index);
+
+  /* failed starts are reported in the result set, other starts go on */
+  pllmod_reset_error();
+  if (!multistart_search(context->params, context->treeinfo, result))
+  {
+    result->error_code = pll_errno ? pll_errno : PLL_ERROR_PARAM_INVALID;
+    result->loglh = PLLMOD_OPT_LNL_UNLIKELY;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* best logLH first, failed starts last */
+static int multistart_result_cmp(const void * a, const void * b)
+{
+  const pllmod_multistart_result_t * ra = (const pllmod_multistart_result_t *) a;
+  const pllmod_multistart_result_t * rb = (const pllmod_multistart_result_t *) b;
+
+  if (!ra->tree != !rb->tree)
+    return ra->tree ? -1 : 1;
+  if (ra->loglh != rb->loglh)
+    return ra->loglh > rb->loglh ? -1 : 1;
+  return (ra->start_index > rb->start_index) - (ra->start_index < rb->start_index);
+}
+
+/**
+ * Run independent tree searches from multiple starting trees concurrently.
+ *
+ * Start i uses a random (i < `random_starts`) or a randomized stepwise
+ * addition parsimony tree with seed `random_seed`+i. For every start, the
+ * template `treeinfo` is cloned onto the starting tree
+ * (pllmod_treeinfo_clone_tree()), which then undergoes SPR rounds
+ * (`pllmod_algo_search_session_round()`), each followed by the optional
+ * `optimize_model` callback, until logLH improves by less than `lh_epsilon`
+ * or `max_rounds` are done. The final tree is cloned before the treeinfo of
+ * the start is destroyed, and the reported logLH is the one of that tree;
+ * `optimize_model` can be used to save its model parameters.
+ *
+ * Starts are processed by `thread_count` threads, so `optimize_model` is
+ * called concurrently for different starts and must be thread-safe. All
+ * starts share one read-only copy of the tip data of the template. Tip CLV
+ * indices of the starting trees follow the order of `tip_names`, which must
+ * match the template. The parallel reduction callback (MPI) of the template
+ * is not used.
+ *
+ * A failed start does not abort the others: its result has `error_code`
+ * set and no tree.
+ *
+ * @param params search settings and callbacks
+ *
+ * @return array of `random_starts`+`parsimony_starts` results sorted by
+ *         decreasing logLH, or NULL on error
+ */
+PLL_EXPORT pllmod_multistart_result_t *
+pllmod_algo_multistart_search(const pllmod_multistart_params_t * params)
+{
+  unsigned int i;
+  unsigned int start_count;
+  unsigned int thread_count;
+  pllmod_thread_pool_t * pool = NULL;
+  pllmod_treeinfo_t * shared_treeinfo = NULL;
+  multistart_context_t context;
+  pllmod_multistart_result_t * results;
+
+  if (!params || !params->treeinfo || !params->tip_names ||
+      params->tip_count < 4 || params->tip_count != params->treeinfo->tip_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Missing taxa or template treeinfo\n");
+    return NULL;
+  }
+
+  if (params->parsimony_starts &&
+      (!params->partitions || !params->partition_count))
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Parsimony starting trees require partitions\n");
+    return NULL;
+  }
+
+  start_count = params->random_starts + params->parsimony_starts;
+  if (!start_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "No starting trees requested\n");
+    return NULL;
+  }
+
+  results = (pllmod_multistart_result_t *) calloc(start_count,
+                                                  sizeof(pllmod_multistart_result_t));
+  if (!results)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for multi-start results\n");
+    return NULL;
+  }
+
+  for (i = 0; i < start_count; ++i)
+  {
+    results[i].start_index = i;
+    results[i].start_type = i < params->random_starts ?
+        PLLMOD_ALGO_START_RANDOM : PLLMOD_ALGO_START_PARSIMONY;
+    results[i].seed = params->random_seed + i;
+    results[i].loglh = PLLMOD_OPT_LNL_UNLIKELY;
+  }
+
+  thread_count = PLL_MIN(PLL_MAX(params->thread_count, 1), start_count);
+  if (thread_count > 1)
+  {
+    pool = pllmod_thread_pool_create(thread_count);
+    if (!pool)
+    {
+      free(results);
+      return NULL;
+    }
+  }
+
+  /* clones of a clone share its tip data, clones of the template would
+   * copy it for every start */
+  if (!params->treeinfo->tipdata)
+  {
+    shared_treeinfo = pllmod_treeinfo_clone(params->treeinfo);
+    if (!shared_treeinfo)
+    {
+      pllmod_thread_pool_destroy(pool);
+      free(results);
+      return NULL;
+    }
+  }
+
+  context.params = params;
+  context.treeinfo = shared_treeinfo ? shared_treeinfo : params->treeinfo;
+  context.results = results;
+
+  /* tasks do not fail, errors are stored per start */
+  pllmod_thread_pool_run(pool, start_count, multistart_task, &context);
+  pllmod_thread_pool_destroy(pool);
+  pllmod_treeinfo_destroy(shared_treeinfo);
+
+  qsort(results, start_count, sizeof(pllmod_multistart_result_t),
+        multistart_result_cmp);
+
+  pllmod_reset_error();
+
+  return results;
+}
+
+PLL_EXPORT void pllmod_algo_multistart_destroy(pllmod_multistart_result_t * results,
+                                               unsigned int count)
+{
+  unsigned int i;
+
+  if (!results)
+    return;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (results[i].tree)
+      pll_utree_destroy(results[i].tree, NULL);
+  }
+
+  free(results);
+}
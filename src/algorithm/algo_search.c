@@ -29,6 +29,7 @@ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
   */
 
 #include "pllmod_algorithm.h"
+#include "algo_callback.h"
 #include "../pllmod_common.h"
 
 /* if not defined, branch length optimization will use
@@ -41,6 +42,14 @@ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
 
 #define BRLEN_BUF_COUNT 12
 
+/* minimum number of samples required to derive adaptive SPR limits */
+#define ADAPTIVE_MIN_SAMPLES 10
+
+/* states of prune nodes in the search session */
+#define SESSION_NODE_EVAL   0   /* evaluate in the next round */
+#define SESSION_NODE_SKIP   1   /* unchanged since the last failed evaluation */
+#define SESSION_NODE_FAILED 2   /* failed in the current round */
+
 typedef struct spr_params
 {
   pll_bool_t thorough;
@@ -52,6 +61,11 @@ typedef struct spr_params
   int smoothings;
   int brlen_opt_method;
   double * brlen_buf[BRLEN_BUF_COUNT];
+  pll_unode_t ** regraft_nodes;      /* edge_count entries */
+  unsigned int * regraft_dist;       /* edge_count entries */
+  pllmod_spr_adaptive_t * adaptive;
+  unsigned char * node_state;        /* SESSION_NODE_* per prune node */
+  int incremental;                   /* CLVs are valid at the round start */
 } pllmod_search_params_t;
 
 typedef struct rollback_list
@@ -71,6 +85,15 @@ typedef struct node_entry {
   unsigned int rollback_num;
 } node_entry_t;
 
+/* state of a node before a tree rearrangement, see algo_journal_spr() */
+typedef struct journal_entry
+{
+  pll_unode_t * node;
+  pll_unode_t * back;
+  double length;
+  unsigned int pmatrix_index;
+} journal_entry_t;
+
 typedef struct bestnode_list
 {
   node_entry_t * list;
@@ -80,6 +103,57 @@ typedef struct bestnode_list
   double ** brlen_buffers;
 } pllmod_bestnode_list_t;
 
+/* per-thread state for the parallel SPR round: each thread evaluates
+ * candidate moves on its own treeinfo replica (CLVs, p-matrices, tree) */
+typedef struct spr_workers
+{
+  pllmod_thread_pool_t * pool;
+  unsigned int worker_count;
+  pllmod_treeinfo_t ** treeinfo;     /* [0] is the master treeinfo */
+  pllmod_treeinfo_topology_t * topol;
+  double * brlen_mem;
+  double ** brlen_buf;               /* BRLEN_BUF_COUNT buffers per worker */
+  pll_unode_t ** regraft_nodes;      /* edge_count entries per worker */
+  unsigned int * regraft_dist;       /* edge_count entries per worker */
+
+  /* current batch: one entry per pruned subtree */
+  pll_unode_t ** nodes;
+  node_entry_t * entries;
+  cutoff_info_t * cutoff_info;
+  const pllmod_search_params_t * params;
+  const cutoff_info_t * round_cutoff;
+  double lh_start;
+} pllmod_spr_workers_t;
+
+/* buffers of the SPR round, reused across rounds: all of them are carved
+ * from a single memory block, see pllmod_algo_spr_workspace_create() */
+struct pllmod_spr_workspace
+{
+  unsigned int tip_count;
+  unsigned int edge_count;
+  unsigned int brlen_set_count;
+  unsigned int ntopol_keep;
+
+  char * arena;
+  double * brlen_buf[BRLEN_BUF_COUNT];
+  pll_unode_t ** regraft_nodes;
+  unsigned int * regraft_dist;
+  pll_unode_t ** allnodes;
+  pll_tree_rollback_t * rollback2;
+  pllmod_rollback_list_t rollback_list;
+  pllmod_bestnode_list_t bestnode_list;
+
+  /* changes since the best tree of the round: rearrangements are logged,
+   * branch lengths are compared with their values at the mark */
+  journal_entry_t * journal;
+  size_t journal_size;
+  size_t journal_capacity;
+  double * journal_brlen;            /* brlen_set_count x edge_count */
+  pll_unode_t * journal_root;
+
+  pllmod_treeinfo_topology_t * tmp_topol;
+};
+
 static void algo_query_allnodes_recursive(pll_unode_t * node,
                                           pll_unode_t ** buffer,
                                           unsigned int * index)
@@ -107,44 +181,6 @@ static unsigned int algo_query_allnodes(pll_unode_t * root, pll_unode_t ** buffe
   return index;
 }
 
-static pllmod_rollback_list_t * algo_rollback_list_create(size_t slots)
-{
-  pllmod_rollback_list_t * rollback_list =
-    (pllmod_rollback_list_t *) calloc(1, sizeof(pllmod_rollback_list_t));
-  if (!rollback_list)
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory for rollback list\n");
-    return NULL;
-  }
-  rollback_list->current = 0;
-  rollback_list->round = 0;
-  rollback_list->size = slots;
-  if (slots > 0)
-  {
-    rollback_list->list =
-      (pll_tree_rollback_t *) calloc(slots, sizeof(pll_tree_rollback_t));
-    if (!rollback_list->list)
-    {
-      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                       "Cannot allocate memory for rollback list items\n");
-      free(rollback_list);
-      return NULL;
-    }
-  }
-  return rollback_list;
-}
-
-static void algo_rollback_list_destroy(pllmod_rollback_list_t * rollback_list)
-{
-  if (rollback_list)
-  {
-    if(rollback_list->list)
-      free(rollback_list->list);
-    free(rollback_list);
-  }
-}
-
 static pll_tree_rollback_t * algo_rollback_list_prev(
                                pllmod_rollback_list_t * rollback_list)
 {
@@ -184,90 +220,6 @@ static int algo_rollback_list_abspos(pllmod_rollback_list_t * rollback_list)
  *  best_node_list  *
  *                  */
 
-static void algo_bestnode_list_destroy(pllmod_bestnode_list_t * bestnode_list)
-{
- if (bestnode_list)
- {
-   if (bestnode_list->brlen_buffers)
-   {
-     for (size_t i = 0; i < bestnode_list->size; ++i)
-       free(bestnode_list->brlen_buffers[i]);
-     free(bestnode_list->brlen_buffers);
-   }
-   if (bestnode_list->list)
-     free(bestnode_list->list);
-   free(bestnode_list);
- }
-}
-
-static pllmod_bestnode_list_t * algo_bestnode_list_create(size_t slots,
-                                                          unsigned int brlen_set_count)
-{
-  pllmod_bestnode_list_t * bestnode_list =
-    (pllmod_bestnode_list_t *) calloc(1, sizeof(pllmod_bestnode_list_t));
-  if (!bestnode_list)
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory for best node list\n");
-    return NULL;
-  }
-  bestnode_list->current = 0;
-  bestnode_list->size = slots;
-  bestnode_list->brlen_set_count = brlen_set_count;
-  if (slots > 0)
-  {
-    bestnode_list->list = (node_entry_t *) calloc(slots, sizeof(node_entry_t));
-    if (!bestnode_list->list)
-    {
-      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                       "Cannot allocate memory for best node list items\n");
-      free(bestnode_list);
-      return NULL;
-    }
-
-#ifndef PLLMOD_SEARCH_BRLEN_DYNALLOC
-    if (brlen_set_count == 1)
-    {
-      bestnode_list->brlen_buffers = NULL;
-      for (size_t i = 0; i < slots; ++i)
-      {
-        bestnode_list->list[i].b1 = &bestnode_list->list[i].bb1;
-        bestnode_list->list[i].b2 = &bestnode_list->list[i].bb2;
-        bestnode_list->list[i].b3 = &bestnode_list->list[i].bb3;
-      }
-    }
-    else
-#endif
-    {
-      /* allocate branch length buffers to store unlinked branches */
-      bestnode_list->brlen_buffers = (double **) calloc(slots, sizeof(double *));
-      for (size_t i = 0; i < slots; ++i)
-      {
-        bestnode_list->brlen_buffers[i] = (double *) calloc(3*brlen_set_count,
-                                                            sizeof(double));
-      }
-      if (!bestnode_list->brlen_buffers || !bestnode_list->brlen_buffers[slots-1])
-      {
-        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                         "Cannot allocate memory for best node list items\n");
-        algo_bestnode_list_destroy(bestnode_list);
-        return NULL;
-      }
-
-      /* set branch lengths pointers to the corresponding slots */
-      for (size_t i = 0; i < slots; ++i)
-      {
-        bestnode_list->list[i].b1 = bestnode_list->brlen_buffers[i];
-        bestnode_list->list[i].b2 =
-            bestnode_list->brlen_buffers[i] + brlen_set_count;
-        bestnode_list->list[i].b3 =
-            bestnode_list->brlen_buffers[i] + 2*brlen_set_count;
-      }
-    }
-  }
-  return bestnode_list;
-}
-
 static void algo_bestnode_list_copy_entry(pllmod_bestnode_list_t * best_node_list,
                                           size_t idx,
                                           const node_entry_t * src)
@@ -354,6 +306,186 @@ static void algo_bestnode_list_print(pllmod_bestnode_list_t * best_node_list)
 #endif
 
 
+/* adaptive SPR radius and subtree skipping */
+
+static int algo_double_cmp(const void * a, const void * b)
+{
+  const double x = *((const double *) a);
+  const double y = *((const double *) b);
+
+  return (x > y) - (x < y);
+}
+
+static int algo_adaptive_round_start(pllmod_spr_adaptive_t * adaptive,
+                                     const pllmod_treeinfo_t * treeinfo,
+                                     const pllmod_search_params_t * params)
+{
+  unsigned int i;
+  unsigned long total = 0;
+  unsigned long sum = 0;
+  unsigned int drop_count = 0;
+
+  if (adaptive->node_count != treeinfo->subnode_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Adaptive SPR state was created for a different tree\n");
+    return PLL_FAILURE;
+  }
+
+  /* make room for all regraft distances of this round */
+  if (adaptive->hist_size < params->radius_max + 1)
+  {
+    unsigned long * hist =
+        (unsigned long *) realloc(adaptive->improve_hist,
+                                  (params->radius_max + 1) *
+                                  sizeof(unsigned long));
+    if (!hist)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for improvement histogram\n");
+      return PLL_FAILURE;
+    }
+
+    for (i = adaptive->hist_size; i <= params->radius_max; ++i)
+      hist[i] = 0;
+
+    adaptive->improve_hist = hist;
+    adaptive->hist_size = params->radius_max + 1;
+  }
+
+  adaptive->round++;
+
+  /* default radius: smallest distance which covers the requested quantile
+   * of all improvements found so far */
+  for (i = 0; i < adaptive->hist_size; ++i)
+    total += adaptive->improve_hist[i];
+
+  adaptive->stats.radius = params->radius_max;
+  if (total >= ADAPTIVE_MIN_SAMPLES)
+  {
+    for (i = 0; i < adaptive->hist_size; ++i)
+    {
+      sum += adaptive->improve_hist[i];
+      if (sum >= adaptive->radius_quantile * total)
+        break;
+    }
+    adaptive->stats.radius = PLL_MAX(params->radius_min,
+                                     PLL_MIN(i, params->radius_max));
+  }
+
+  /* skip cutoff: quantile of the LH drops observed in the previous round */
+  for (i = 0; i < adaptive->node_count; ++i)
+  {
+    if (adaptive->last_round[i] == adaptive->round - 1 &&
+        adaptive->best_drop[i] > 0.)
+      adaptive->drop_buf[drop_count++] = adaptive->best_drop[i];
+  }
+
+  adaptive->stats.drop_cutoff = INFINITY;
+  if (drop_count >= ADAPTIVE_MIN_SAMPLES && adaptive->skip_quantile < 1.)
+  {
+    qsort(adaptive->drop_buf, drop_count, sizeof(double), algo_double_cmp);
+    adaptive->stats.drop_cutoff =
+        adaptive->drop_buf[(unsigned int) (adaptive->skip_quantile *
+                                           (drop_count - 1))];
+  }
+
+  adaptive->stats.subtrees = 0;
+  adaptive->stats.subtrees_skipped = 0;
+  adaptive->stats.subtrees_improved = 0;
+  adaptive->stats.regrafts = 0;
+
+  return PLL_SUCCESS;
+}
+
+/* subtree did not improve for skip_rounds rounds, and its best regraft
+ * in the previous round was far worse than that of other subtrees */
+static int algo_adaptive_skip(const pllmod_spr_adaptive_t * adaptive,
+                              const pll_unode_t * p_edge)
+{
+  const unsigned int i = p_edge->node_index;
+
+  return adaptive->fail_count[i] >= adaptive->skip_rounds &&
+         adaptive->last_round[i] == adaptive->round - 1 &&
+         adaptive->best_drop[i] > adaptive->stats.drop_cutoff;
+}
+
+static unsigned int algo_adaptive_radius(const pllmod_spr_adaptive_t * adaptive,
+                                         const pll_unode_t * p_edge,
+                                         const pllmod_search_params_t * params)
+{
+  const unsigned int i = p_edge->node_index;
+  unsigned int radius = adaptive->stats.radius;
+
+  /* look a bit further than the last improvement of this subtree */
+  if (adaptive->improve_round[i])
+    radius = PLL_MAX(radius, adaptive->improve_dist[i] + 1);
+
+  return PLL_MAX(params->radius_min, PLL_MIN(radius, params->radius_max));
+}
+
+static void algo_adaptive_update(pllmod_spr_adaptive_t * adaptive,
+                                 const pll_unode_t * p_edge,
+                                 double lh_start,
+                                 double best_lh,
+                                 unsigned int best_dist,
+                                 unsigned int regrafts)
+{
+  const unsigned int i = p_edge->node_index;
+  const int improved = best_lh - lh_start > 1e-6;
+
+  /* subtree can be re-inserted twice per round in FAST mode:
+   * keep the improvement found by either of the passes */
+  if (adaptive->last_round[i] == adaptive->round)
+  {
+    adaptive->regraft_count[i] += regrafts;
+    if (!improved)
+      return;
+  }
+  else
+  {
+    adaptive->last_round[i] = adaptive->round;
+    adaptive->regraft_count[i] = regrafts;
+  }
+
+  if (improved)
+  {
+    adaptive->improve_round[i] = adaptive->round;
+    adaptive->improve_dist[i] = best_dist;
+    adaptive->fail_count[i] = 0;
+    adaptive->best_drop[i] = 0.;
+  }
+  else
+  {
+    adaptive->fail_count[i]++;
+    adaptive->best_drop[i] = lh_start - best_lh;
+  }
+}
+
+static void algo_adaptive_round_finish(pllmod_spr_adaptive_t * adaptive)
+{
+  unsigned int i;
+
+  for (i = 0; i < adaptive->node_count; ++i)
+  {
+    if (adaptive->skip_round[i] == adaptive->round)
+      adaptive->stats.subtrees_skipped++;
+
+    if (adaptive->last_round[i] != adaptive->round)
+      continue;
+
+    adaptive->stats.subtrees++;
+    adaptive->stats.regrafts += adaptive->regraft_count[i];
+
+    if (adaptive->improve_round[i] == adaptive->round)
+    {
+      adaptive->stats.subtrees_improved++;
+      if (adaptive->improve_dist[i] < adaptive->hist_size)
+        adaptive->improve_hist[adaptive->improve_dist[i]]++;
+    }
+  }
+}
+
 static double algo_optimize_bl_iterative(pll_unode_t * node,
                                          pllmod_treeinfo_t * treeinfo,
                                          const pllmod_search_params_t * params,
@@ -363,7 +495,69 @@ static double algo_optimize_bl_iterative(pll_unode_t * node,
 {
   int smoothings = (int) round(smooth_factor * params->smoothings);
 
-  double new_loglh = pllmod_opt_optimize_branch_lengths_local_multi(
+  /* in CLV pool mode, CLVs around node might not be resident, and the
+   * scheduled method moves the root as well */
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL ||
+      params->brlen_opt_method == PLLMOD_OPT_BLO_NEWTON_SCHEDULED)
+  {
+    pll_unode_t * old_root = treeinfo->root;
+
+    pllmod_treeinfo_set_root(treeinfo,
+                             pllmod_utree_is_tip(node) ? node->back : node);
+
+    double new_loglh = pllmod_algo_opt_brlen_treeinfo(treeinfo,
+                                                      params->bl_min,
+                                                      params->bl_max,
+                                                      lh_epsilon,
+                                                      smoothings,
+                                                      params->brlen_opt_method,
+                                                      radius);
+
+    pllmod_treeinfo_set_root(treeinfo, old_root);
+
+    assert(new_loglh || pll_errno);
+    return -1 * new_loglh;
+  }
+
+  const double start_time = pllmod_time_wall();
+
+  /* branch lengths will change behind treeinfo's back */
+  pllmod_treeinfo_invalidate_outward_clvs(treeinfo);
+
+  double new_loglh;
+  if (treeinfo->deriv_precomp_edges)
+  {
+    /* reuse sumtables of branches whose CLVs did not change */
+    pllmod_opt_sumtable_cache_t sumtable_cache;
+    sumtable_cache.sumtables = treeinfo->deriv_precomp_edges;
+    sumtable_cache.stamp = treeinfo->deriv_precomp_stamp;
+    sumtable_cache.version = treeinfo->clv_version;
+
+    new_loglh = pllmod_opt_optimize_branch_lengths_local_cached(
+                                                  treeinfo->partitions,
+                                                  treeinfo->partition_count,
+                                                  node,
+                                                  treeinfo->param_indices,
+                                                  &sumtable_cache,
+                                                  treeinfo->branch_lengths,
+                                                  treeinfo->brlen_scalers,
+                                                  params->bl_min,
+                                                  params->bl_max,
+                                                  lh_epsilon,
+                                                  smoothings,
+                                                  radius,
+                                                  1,       /* keep_update */
+                                                  params->brlen_opt_method,
+                                                  treeinfo->brlen_linkage,
+                                                  treeinfo->sum_mode,
+                                                  treeinfo->parallel_context,
+                                                  treeinfo->parallel_reduce_cb);
+
+    treeinfo->clv_version = sumtable_cache.version;
+  }
+  else
+  {
+    new_loglh = pllmod_opt_optimize_branch_lengths_local_multi_mode(
                                                   treeinfo->partitions,
                                                   treeinfo->partition_count,
                                                   node,
@@ -379,8 +573,17 @@ static double algo_optimize_bl_iterative(pll_unode_t * node,
                                                   1,       /* keep_update */
                                                   params->brlen_opt_method,
                                                   treeinfo->brlen_linkage,
+                                                  treeinfo->sum_mode,
                                                   treeinfo->parallel_context,
                                                   treeinfo->parallel_reduce_cb);
+  }
+
+  /* p-matrices have been updated behind treeinfo's back as well */
+  pllmod_treeinfo_sync_pmatrix_cache(treeinfo);
+
+  treeinfo->stats.count[PLLMOD_TREEINFO_STATS_BRLEN]++;
+  treeinfo->stats.time[PLLMOD_TREEINFO_STATS_BRLEN] +=
+      pllmod_time_wall() - start_time;
 
   if (new_loglh)
     return -1 * new_loglh;
@@ -473,6 +676,13 @@ int algo_update_pmatrix(pllmod_treeinfo_t * treeinfo,
       if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
         p_brlen *= treeinfo->brlen_scalers[p];
 
+      /* p-matrix is still up-to-date */
+      if (treeinfo->pmatrix_brlen[p][pmatrix_index] == p_brlen)
+      {
+        treeinfo->pmatrix_valid[p][pmatrix_index] = 1;
+        continue;
+      }
+
       int ret = pll_update_prob_matrices (treeinfo->partitions[p],
                                           treeinfo->param_indices[p],
                                           &pmatrix_index,
@@ -483,6 +693,7 @@ int algo_update_pmatrix(pllmod_treeinfo_t * treeinfo,
         return PLL_FAILURE;
 
       treeinfo->pmatrix_valid[p][pmatrix_index] = 1;
+      treeinfo->pmatrix_brlen[p][pmatrix_index] = p_brlen;
       updated++;
     }
   }
@@ -595,6 +806,42 @@ PLL_EXPORT int algo_utree_spr(pllmod_treeinfo_t * treeinfo,
   return retval;
 }
 
+/* invalidate CLVs which include the branch at `edge`, i.e., CLVs in the
+ * subtree at edge->back which point away from it, up to `depth` nodes away
+ * from the branch (depth < 0: no limit) */
+static void algo_invalidate_clvs_behind(pllmod_treeinfo_t * treeinfo,
+                                        pll_unode_t * edge,
+                                        int depth)
+{
+  pll_unode_t * node = edge->back;
+
+  if (!depth || !node->next)
+    return;
+
+  pllmod_treeinfo_invalidate_clv(treeinfo, node->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, node->next->next);
+
+  algo_invalidate_clvs_behind(treeinfo, node->next, depth - 1);
+  algo_invalidate_clvs_behind(treeinfo, node->next->next, depth - 1);
+}
+
+/* invalidate all CLVs which are outdated after an SPR move of the subtree at
+ * p_edge, where orig_prune_edge is the branch it has been pruned from */
+static void algo_invalidate_clvs_spr(pllmod_treeinfo_t * treeinfo,
+                                     pll_unode_t * p_edge,
+                                     pll_unode_t * orig_prune_edge)
+{
+  pllmod_treeinfo_invalidate_clv(treeinfo, p_edge);
+  pllmod_treeinfo_invalidate_clv(treeinfo, p_edge->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, p_edge->next->next);
+
+  algo_invalidate_clvs_behind(treeinfo, p_edge, -1);
+  algo_invalidate_clvs_behind(treeinfo, p_edge->next, -1);
+  algo_invalidate_clvs_behind(treeinfo, p_edge->next->next, -1);
+  algo_invalidate_clvs_behind(treeinfo, orig_prune_edge, -1);
+  algo_invalidate_clvs_behind(treeinfo, orig_prune_edge->back, -1);
+}
+
 static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
                               node_entry_t * entry,
                               cutoff_info_t * cutoff_info,
@@ -617,13 +864,35 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
   unsigned int * regraft_dist;
   int descent;
   double loglh;
+  double lh_start;
+  unsigned int radius_max;
+  unsigned int best_dist = 0;
+  int clv_depth;
 
   pll_unode_t * p_edge = entry->p_node;
+  pllmod_spr_adaptive_t * adaptive = params->adaptive;
   const size_t total_edge_count = treeinfo->tree->edge_count;
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
 
   entry->r_node = NULL;
   entry->lh = PLLMOD_OPT_LNL_UNLIKELY;
 
+  /* hopeless subtree: keep it in place for this round */
+  if (adaptive && algo_adaptive_skip(adaptive, p_edge))
+  {
+    adaptive->skip_round[p_edge->node_index] = adaptive->round;
+    return PLL_SUCCESS;
+  }
+
+  radius_max = adaptive ?
+      algo_adaptive_radius(adaptive, p_edge, params) : params->radius_max;
+
+  /* CLVs are recomputed while regrafting up to radius_max branches away from
+   * the pruning point, plus the branches optimized around the regraft point */
+  clv_depth = (int) radius_max + 2;
+
   /* init brlen buffer pointers */
   z1 = params->brlen_buf[0];
   z2 = params->brlen_buf[1];
@@ -641,8 +910,10 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
 
   pllmod_treeinfo_set_root(treeinfo, p_edge);
 
-  /* recompute all CLVs and p-matrices before pruning */
-  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  /* CLVs and p-matrices which are still valid after the previous pruning
+   * are reused */
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+  lh_start = loglh;
 
   /* PRUNE */
   orig_prune_edge = algo_utree_prune(treeinfo, params, p_edge);
@@ -662,18 +933,20 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
   pllmod_treeinfo_invalidate_clv(treeinfo, orig_prune_edge->back);
   pllmod_treeinfo_invalidate_pmatrix(treeinfo, orig_prune_edge);
 
+  /* CLVs which include the pruning point still contain the pruned subtree */
+  algo_invalidate_clvs_behind(treeinfo, orig_prune_edge, clv_depth);
+  algo_invalidate_clvs_behind(treeinfo, orig_prune_edge->back, clv_depth);
+
   /* recompute p-matrix for the original prune edge */
   algo_update_pmatrix(treeinfo, orig_prune_edge);
 
-  /* get list of candidate regrafting nodes in the given distance range */
-  regraft_nodes = (pll_unode_t **) calloc (total_edge_count,
-                                           sizeof(pll_unode_t *));
-  if (!regraft_nodes)
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory for regraft nodes\n");
+  /* cache constraint groups while the rest of the tree stays fixed */
+  if (!pllmod_treeinfo_set_constraint_subtree(treeinfo, p_edge))
     return PLL_FAILURE;
-  }
+
+  /* get list of candidate regrafting nodes in the given distance range */
+  regraft_nodes = params->regraft_nodes;
+  memset(regraft_nodes, 0, total_edge_count * sizeof(pll_unode_t *));
 
   retval = pllmod_utree_nodes_at_node_dist(treeinfo->root,
                                            &regraft_nodes[redge_count],
@@ -694,14 +967,7 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
   assert(retval == PLL_SUCCESS);
 
   /* initialize regraft distances */
-  regraft_dist = (unsigned int *) calloc(total_edge_count, sizeof(unsigned int));
-  if (!regraft_dist)
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory for regraft distances\n");
-    return PLL_FAILURE;
-  }
-
+  regraft_dist = params->regraft_dist;
   for (i = 0; i < redge_count; ++i)
     regraft_dist[i] = params->radius_min;
 
@@ -719,12 +985,40 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
 
     regraft_edges++;
 
-    /* regraft p_edge on r_edge*/
-    pllmod_treeinfo_get_branch_length_all(treeinfo, r_edge, regraft_length);
-
     /* distance to the current regraft edge */
     r_dist = regraft_dist[j];
 
+    if (!params->thorough)
+    {
+      /* FAST mode: score the insertion without regrafting */
+      loglh = pllmod_treeinfo_compute_loglh_regraft(treeinfo, p_edge, r_edge,
+                                                    params->bl_min);
+      if (isnan(loglh))
+      {
+        pllmod_treeinfo_set_constraint_subtree(treeinfo, NULL);
+        return PLL_FAILURE;
+      }
+
+      if (loglh > entry->lh)
+      {
+        entry->lh = loglh;
+        entry->r_node = r_edge;
+        best_dist = r_dist;
+        pllmod_treeinfo_get_branch_length_all(treeinfo, p_edge, entry->b1);
+        pllmod_treeinfo_get_branch_length_all(treeinfo, r_edge, entry->b2);
+        for (i = 0; i < brlen_set_count; ++i)
+        {
+          entry->b2[i] = PLL_MAX(entry->b2[i] / 2., params->bl_min);
+          entry->b3[i] = entry->b2[i];
+        }
+      }
+
+      goto next_edge;
+    }
+
+    /* regraft p_edge on r_edge*/
+    pllmod_treeinfo_get_branch_length_all(treeinfo, r_edge, regraft_length);
+
     /* regraft into the candidate branch */
     retval = algo_utree_regraft(treeinfo, params, p_edge, r_edge);
     assert(retval == PLL_SUCCESS);
@@ -763,9 +1057,7 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
 
       if (!loglh)
       {
-        free(regraft_nodes);
-        free(regraft_dist);
-
+        pllmod_treeinfo_set_constraint_subtree(treeinfo, NULL);
         return PLL_FAILURE;
       }
     }
@@ -777,6 +1069,7 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
 
       entry->lh = loglh;
       entry->r_node = r_edge;
+      best_dist = r_dist;
       pllmod_treeinfo_get_branch_length_all(treeinfo, p_edge, entry->b1);
       pllmod_treeinfo_get_branch_length_all(treeinfo, p_edge->next, entry->b2);
       pllmod_treeinfo_get_branch_length_all(treeinfo, p_edge->next->next, entry->b3);
@@ -802,7 +1095,8 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
     /* recompute p-matrix for the "old" regraft branch */
     algo_update_pmatrix(treeinfo, pruned_tree);
 
-    descent = r_dist < params->radius_max;
+next_edge:
+    descent = r_dist < radius_max;
     if (cutoff_info && loglh < cutoff_info->lh_start)
     {
       cutoff_info->lh_dec_count++;
@@ -811,6 +1105,10 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
                 (cutoff_info->lh_start - loglh) < cutoff_info->lh_cutoff;
     }
 
+    /* do not descend into regions of other constraint groups */
+    descent = descent &&
+              pllmod_treeinfo_check_constraint_region(treeinfo, p_edge, r_edge);
+
     if (r_edge->next && descent)
     {
       regraft_nodes[redge_count] = r_edge->next->back;
@@ -825,6 +1123,7 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
 
   /* done with regrafting; restore old root */
   pllmod_treeinfo_set_root(treeinfo, orig_prune_edge);
+  pllmod_treeinfo_set_constraint_subtree(treeinfo, NULL);
 
   /* re-insert into the original pruning branch */
   retval = pllmod_utree_regraft(p_edge, orig_prune_edge);
@@ -840,8 +1139,17 @@ static int best_reinsert_edge(pllmod_treeinfo_t * treeinfo,
   pllmod_treeinfo_invalidate_pmatrix(treeinfo, p_edge->next);
   pllmod_treeinfo_invalidate_pmatrix(treeinfo, p_edge->next->next);
 
-  free(regraft_nodes);
-  free(regraft_dist);
+  /* CLVs which include the pruning point have been computed without the
+   * subtree while regrafting */
+  pllmod_treeinfo_invalidate_clv(treeinfo, p_edge);
+  pllmod_treeinfo_invalidate_clv(treeinfo, p_edge->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, p_edge->next->next);
+  algo_invalidate_clvs_behind(treeinfo, p_edge->next, clv_depth);
+  algo_invalidate_clvs_behind(treeinfo, p_edge->next->next, clv_depth);
+
+  if (adaptive)
+    algo_adaptive_update(adaptive, p_edge, lh_start, entry->lh, best_dist,
+                         regraft_edges);
 
   return PLL_SUCCESS;
 }
@@ -855,7 +1163,7 @@ static double reinsert_nodes(pllmod_treeinfo_t * treeinfo, pll_unode_t ** nodes,
 {
   int i;
 
-  double loglh   = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  double loglh   = pllmod_treeinfo_compute_loglh(treeinfo, params->incremental);
   double best_lh = loglh;
 
   node_entry_t spr_entry;
@@ -877,6 +1185,11 @@ static double reinsert_nodes(pllmod_treeinfo_t * treeinfo, pll_unode_t ** nodes,
         pllmod_utree_is_tip(p_edge->next->next->back))
       continue;
 
+    /* subtree and its neighborhood did not change since the last round */
+    if (params->node_state &&
+        params->node_state[p_edge->node_index] == SESSION_NODE_SKIP)
+      continue;
+
     spr_entry.p_node = p_edge;
 
     if (cutoff_info)
@@ -889,6 +1202,9 @@ static double reinsert_nodes(pllmod_treeinfo_t * treeinfo, pll_unode_t ** nodes,
       return 0;
     }
 
+    if (params->node_state)
+      params->node_state[p_edge->node_index] = SESSION_NODE_FAILED;
+
     pll_unode_t * best_r_edge = spr_entry.r_node;
 
     /* original placement is the best for the current node -> move on to the next one */
@@ -911,8 +1227,13 @@ static double reinsert_nodes(pllmod_treeinfo_t * treeinfo, pll_unode_t ** nodes,
       if (!retval)
         return PLL_FAILURE;
 
+      algo_invalidate_clvs_spr(treeinfo, p_edge, orig_prune_edge);
+
       algo_unode_fix_length(treeinfo, orig_prune_edge, params->bl_min, params->bl_max);
 
+      if (params->node_state)
+        params->node_state[p_edge->node_index] = SESSION_NODE_EVAL;
+
       /* increment rollback slot counter to save SPR history */
       rollback = algo_rollback_list_next(rollback_list);
 
@@ -964,49 +1285,2562 @@ static double reinsert_nodes(pllmod_treeinfo_t * treeinfo, pll_unode_t ** nodes,
   return loglh;
 }
 
-PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
-                                        unsigned int radius_min,
-                                        unsigned int radius_max,
-                                        unsigned int ntopol_keep,
-                                        pll_bool_t thorough,
-                                        int brlen_opt_method,
-                                        double bl_min,
-                                        double bl_max,
-                                        int smoothings,
-                                        double epsilon,
-                                        cutoff_info_t * cutoff_info,
-                                        double subtree_cutoff)
+/*                   *
+ *  parallel search  *
+ *                   */
+
+/* check that the treeinfos of parallel workers (master first) hold the same
+ * data and can be used concurrently: no parallel reduction callback, and no
+ * partition shared by any two of them */
+int algo_check_workers(pllmod_treeinfo_t ** treeinfo_list,
+                       unsigned int worker_count)
 {
-  unsigned int i;
-  double loglh, best_lh;
-  pllmod_search_params_t params;
-  int retval;
-  int brlen_unlinked;
+  unsigned int w, v, p;
 
-  unsigned int allnodes_count;
-  pll_unode_t ** allnodes = NULL;
+  if (!treeinfo_list || !treeinfo_list[0] || !worker_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Empty treeinfo list or zero worker count\n");
+    return PLL_FAILURE;
+  }
 
-  size_t rollback_slots;
-  size_t toplist_slots;
-  unsigned int brlen_set_count;
-  pllmod_rollback_list_t * rollback_list = NULL;
-  pllmod_bestnode_list_t * bestnode_list = NULL;
+  const pllmod_treeinfo_t * master = treeinfo_list[0];
+  for (w = 0; w < worker_count; ++w)
+  {
+    const pllmod_treeinfo_t * replica = treeinfo_list[w];
+    if (!replica || replica->parallel_reduce_cb)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "Treeinfo %u is empty or uses a parallel reduction "
+                       "callback\n", w);
+      return PLL_FAILURE;
+    }
+    if (replica->tip_count != master->tip_count ||
+        replica->subnode_count != master->subnode_count ||
+        replica->partition_count != master->partition_count ||
+        replica->brlen_linkage != master->brlen_linkage)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "Treeinfo replica %u does not match the master treeinfo\n",
+                       w);
+      return PLL_FAILURE;
+    }
+
+    /* workers would write the same CLVs and p-matrices concurrently */
+    for (v = 0; v < w; ++v)
+    {
+      for (p = 0; p < master->partition_count; ++p)
+      {
+        if (replica->partitions[p] &&
+            replica->partitions[p] == treeinfo_list[v]->partitions[p])
+        {
+          pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                           "Treeinfo %u shares partition %u with treeinfo %u\n",
+                           w, p, v);
+          return PLL_FAILURE;
+        }
+      }
+    }
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int algo_sync_replicas(pllmod_spr_workers_t * workers)
+{
+  unsigned int w;
+
+  workers->topol = pllmod_treeinfo_get_topology(workers->treeinfo[0],
+                                                workers->topol);
+  if (!workers->topol)
+    return PLL_FAILURE;
+
+  for (w = 1; w < workers->worker_count; ++w)
+  {
+    if (!pllmod_treeinfo_set_topology(workers->treeinfo[w], workers->topol) ||
+        !pllmod_treeinfo_copy_model(workers->treeinfo[w], workers->treeinfo[0]))
+      return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static void algo_spr_workers_destroy(pllmod_spr_workers_t * workers)
+{
+  if (workers)
+  {
+    pllmod_thread_pool_destroy(workers->pool);
+    if (workers->topol)
+      pllmod_treeinfo_destroy_topology(workers->topol);
+    free(workers->brlen_mem);
+    free(workers->brlen_buf);
+    free(workers->regraft_nodes);
+    free(workers->regraft_dist);
+    free(workers->nodes);
+    free(workers->entries);
+    free(workers->cutoff_info);
+    free(workers);
+  }
+}
+
+static pllmod_spr_workers_t * algo_spr_workers_create(pllmod_treeinfo_t ** treeinfo_list,
+                                                      unsigned int worker_count)
+{
+  unsigned int i;
+  const pllmod_treeinfo_t * treeinfo = treeinfo_list[0];
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+  const size_t edge_count = treeinfo->tree->edge_count;
+
+  /* BRLEN_BUF_COUNT buffers per worker + 3 buffers per batch entry */
+  const size_t brlen_buf_count = (BRLEN_BUF_COUNT + 3) * worker_count;
+
+  pllmod_spr_workers_t * workers =
+      (pllmod_spr_workers_t *) calloc(1, sizeof(pllmod_spr_workers_t));
+  if (!workers)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for SPR workers\n");
+    return NULL;
+  }
+
+  workers->worker_count = worker_count;
+  workers->treeinfo = treeinfo_list;
+  workers->brlen_mem = (double *) calloc(brlen_buf_count * brlen_set_count,
+                                         sizeof(double));
+  workers->brlen_buf = (double **) calloc(brlen_buf_count, sizeof(double *));
+  workers->regraft_nodes = (pll_unode_t **) calloc(edge_count * worker_count,
+                                                   sizeof(pll_unode_t *));
+  workers->regraft_dist = (unsigned int *) calloc(edge_count * worker_count,
+                                                  sizeof(unsigned int));
+  workers->nodes = (pll_unode_t **) calloc(worker_count, sizeof(pll_unode_t *));
+  workers->entries = (node_entry_t *) calloc(worker_count, sizeof(node_entry_t));
+  workers->cutoff_info = (cutoff_info_t *) calloc(worker_count,
+                                                  sizeof(cutoff_info_t));
+
+  if (!workers->brlen_mem || !workers->brlen_buf || !workers->regraft_nodes ||
+      !workers->regraft_dist || !workers->nodes || !workers->entries ||
+      !workers->cutoff_info)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for SPR worker buffers\n");
+    algo_spr_workers_destroy(workers);
+    return NULL;
+  }
+
+  for (i = 0; i < brlen_buf_count; ++i)
+    workers->brlen_buf[i] = workers->brlen_mem + i * brlen_set_count;
+
+  /* buffers after the worker ones store the best branch lengths per entry */
+  for (i = 0; i < worker_count; ++i)
+  {
+    double ** entry_buf = workers->brlen_buf + BRLEN_BUF_COUNT * worker_count;
+    workers->entries[i].b1 = entry_buf[3*i];
+    workers->entries[i].b2 = entry_buf[3*i + 1];
+    workers->entries[i].b3 = entry_buf[3*i + 2];
+  }
+
+  workers->pool = pllmod_thread_pool_create(worker_count);
+  if (!workers->pool)
+  {
+    algo_spr_workers_destroy(workers);
+    return NULL;
+  }
+
+  return workers;
+}
+
+static int algo_reinsert_task(void * data,
+                              unsigned int task_index,
+                              unsigned int thread_index)
+{
+  pllmod_spr_workers_t * workers = (pllmod_spr_workers_t *) data;
+  pllmod_treeinfo_t * treeinfo = workers->treeinfo[thread_index];
+  node_entry_t * entry = &workers->entries[task_index];
+  cutoff_info_t * cutoff_info = NULL;
+  pllmod_search_params_t params = *workers->params;
+
+  /* worker-private branch length buffers */
+  memcpy(params.brlen_buf, workers->brlen_buf + thread_index * BRLEN_BUF_COUNT,
+         BRLEN_BUF_COUNT * sizeof(double *));
+  params.regraft_nodes = workers->regraft_nodes +
+                         thread_index * treeinfo->tree->edge_count;
+  params.regraft_dist = workers->regraft_dist +
+                        thread_index * treeinfo->tree->edge_count;
+
+  /* same subtree in the replica tree */
+  entry->p_node = treeinfo->subnodes[workers->nodes[task_index]->node_index];
+
+  if (workers->round_cutoff)
+  {
+    cutoff_info = &workers->cutoff_info[task_index];
+    cutoff_info->lh_start = workers->lh_start;
+    cutoff_info->lh_cutoff = workers->round_cutoff->lh_cutoff;
+    cutoff_info->lh_dec_count = 0;
+    cutoff_info->lh_dec_sum = 0.;
+  }
+
+  return best_reinsert_edge(treeinfo, entry, cutoff_info, &params);
+}
+
+/* same as reinsert_nodes(), but the best re-insertion for up to worker_count
+ * subtrees is searched concurrently. Out of every batch, only the best
+ * improving move is applied (and replicas are updated), other candidates
+ * are stored in the best node list */
+static double reinsert_nodes_parallel(pllmod_spr_workers_t * workers,
+                                      pll_unode_t ** nodes,
+                                      int node_count,
+                                      pllmod_rollback_list_t * rollback_list,
+                                      pllmod_bestnode_list_t * best_node_list,
+                                      cutoff_info_t * cutoff_info,
+                                      const pllmod_search_params_t * params)
+{
+  int i = 0;
+  unsigned int t, batch_size;
+  pllmod_treeinfo_t * treeinfo = workers->treeinfo[0];
+
+  double loglh   = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  double best_lh = loglh;
+
+  pll_tree_rollback_t * rollback = rollback_list->list + rollback_list->current;
+
+  if (!algo_sync_replicas(workers))
+    return 0;
+
+  workers->params = params;
+  workers->round_cutoff = cutoff_info;
+
+  while (i < node_count)
+  {
+    /* collect next batch of subtrees to prune */
+    batch_size = 0;
+    while (i < node_count && batch_size < workers->worker_count)
+    {
+      pll_unode_t * p_edge = nodes[i++];
+
+      assert(!pllmod_utree_is_tip(p_edge));
+
+      /* if remaining pruned tree would only contain 2 taxa, skip this node */
+      if (pllmod_utree_is_tip(p_edge->next->back) &&
+          pllmod_utree_is_tip(p_edge->next->next->back))
+        continue;
+
+      workers->nodes[batch_size++] = p_edge;
+    }
+
+    if (!batch_size)
+      break;
+
+    workers->lh_start = best_lh;
+
+    if (!pllmod_thread_pool_run(workers->pool, batch_size,
+                                algo_reinsert_task, workers))
+    {
+      /* return and spread error */
+      return 0;
+    }
+
+    /* map results back to the master tree and pick the best improving move */
+    int best_index = -1;
+    for (t = 0; t < batch_size; ++t)
+    {
+      node_entry_t * entry = &workers->entries[t];
+      pll_unode_t * p_edge = workers->nodes[t];
+      pll_unode_t * r_edge = entry->r_node ?
+                        treeinfo->subnodes[entry->r_node->node_index] : NULL;
+
+      entry->p_node = p_edge;
+      entry->r_node = r_edge;
+
+      if (cutoff_info)
+      {
+        cutoff_info->lh_dec_count += workers->cutoff_info[t].lh_dec_count;
+        cutoff_info->lh_dec_sum += workers->cutoff_info[t].lh_dec_sum;
+      }
+
+      /* original placement is the best for the current node */
+      if (!r_edge || r_edge == p_edge || r_edge == p_edge->back ||
+          r_edge->back == p_edge)
+      {
+        entry->r_node = NULL;
+        continue;
+      }
+
+      if (entry->lh - best_lh > 1e-6 &&
+          (best_index < 0 || entry->lh > workers->entries[best_index].lh))
+        best_index = t;
+    }
+
+    /* moves which were not applied could be still high enough to be in top-20 */
+    for (t = 0; t < batch_size; ++t)
+    {
+      node_entry_t * entry = &workers->entries[t];
+      if (entry->r_node && (int) t != best_index)
+      {
+        entry->rollback_num = algo_rollback_list_abspos(rollback_list);
+        algo_bestnode_list_save(best_node_list, entry);
+        loglh = entry->lh;
+      }
+    }
+
+    if (best_index >= 0)
+    {
+      /* re-apply best SPR move of the batch */
+      node_entry_t * spr_entry = &workers->entries[best_index];
+      pll_unode_t * p_edge = spr_entry->p_node;
+      pll_unode_t * orig_prune_edge = p_edge->next->back;
+
+      int retval = algo_utree_spr(treeinfo, params, p_edge, spr_entry->r_node,
+                                  rollback);
+      assert(retval == PLL_SUCCESS);
+      if (!retval)
+        return PLL_FAILURE;
+
+      algo_invalidate_clvs_spr(treeinfo, p_edge, orig_prune_edge);
+
+      algo_unode_fix_length(treeinfo, orig_prune_edge, params->bl_min, params->bl_max);
+
+      /* increment rollback slot counter to save SPR history */
+      rollback = algo_rollback_list_next(rollback_list);
+
+      if (params->thorough)
+      {
+        /* restore optimized branch length */
+        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge, spr_entry->b1);
+        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge->next, spr_entry->b2);
+        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge->next->next, spr_entry->b3);
+      }
+      else
+      {
+        /* make sure branches are within limits */
+        algo_unode_fix_length(treeinfo, p_edge->next, params->bl_min, params->bl_max);
+        algo_unode_fix_length(treeinfo, p_edge->next->next, params->bl_min, params->bl_max);
+      }
+
+      best_lh = spr_entry->lh;
+
+      DBG("New best: %f\n", best_lh);
+
+      /* propagate the new topology and branch lengths to the replicas */
+      if (!algo_sync_replicas(workers))
+        return 0;
+    }
+  }
+
+  return loglh;
+}
+
+/*                 *
+ *  change journal *
+ *                 */
+
+/* in linked/scaled mode, the tree holds the reference branch lengths */
+static double * algo_journal_brlen(pllmod_treeinfo_t * treeinfo,
+                                   pll_unode_t * edge,
+                                   unsigned int set)
+{
+  if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED)
+  {
+    unsigned int p = treeinfo->init_partition_idx[set];
+    return &treeinfo->branch_lengths[p][edge->pmatrix_index];
+  }
+  else
+    return &edge->length;
+}
+
+/* compare branch lengths with their values at the mark: either take the
+ * current ones (restore = 0), or write back the changed ones (restore = 1) */
+static void algo_journal_sync_brlen(pllmod_spr_workspace_t * workspace,
+                                    pllmod_treeinfo_t * treeinfo,
+                                    int restore)
+{
+  unsigned int i, set;
+
+  for (i = 0; i < treeinfo->subnode_count; ++i)
+  {
+    pll_unode_t * edge = treeinfo->subnodes[i];
+
+    /* visit every branch once */
+    if (edge->node_index > edge->back->node_index)
+      continue;
+
+    for (set = 0; set < workspace->brlen_set_count; ++set)
+    {
+      double * mark_length = workspace->journal_brlen +
+                             set * workspace->edge_count + edge->pmatrix_index;
+      double * length = algo_journal_brlen(treeinfo, edge, set);
+
+      if (*length == *mark_length)
+        continue;
+
+      if (!restore)
+      {
+        *mark_length = *length;
+        continue;
+      }
+
+      if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED)
+      {
+        pllmod_treeinfo_set_branch_length_partition(treeinfo,
+                                                    edge,
+                                                    treeinfo->init_partition_idx[set],
+                                                    *mark_length);
+      }
+      else
+        pllmod_treeinfo_set_branch_length(treeinfo, edge, *mark_length);
+
+      pllmod_treeinfo_invalidate_pmatrix(treeinfo, edge);
+      pllmod_treeinfo_invalidate_clv(treeinfo, edge);
+      pllmod_treeinfo_invalidate_clv(treeinfo, edge->back);
+    }
+  }
+}
+
+/* start a new journal at the current tree */
+static void algo_journal_mark(pllmod_spr_workspace_t * workspace,
+                              pllmod_treeinfo_t * treeinfo)
+{
+  workspace->journal_size = 0;
+  workspace->journal_root = treeinfo->root;
+  algo_journal_sync_brlen(workspace, treeinfo, 0);
+}
+
+static void algo_journal_node(pllmod_spr_workspace_t * workspace,
+                              pll_unode_t * node)
+{
+  journal_entry_t * entry = &workspace->journal[workspace->journal_size++];
+
+  assert(workspace->journal_size <= workspace->journal_capacity);
+
+  entry->node = node;
+  entry->back = node->back;
+  entry->length = node->length;
+  entry->pmatrix_index = node->pmatrix_index;
+}
+
+/* log the nodes rewired by pruning p_edge and regrafting it into r_edge,
+ * which is also what pllmod_tree_rollback() of an SPR does */
+static void algo_journal_spr(pllmod_spr_workspace_t * workspace,
+                             pll_unode_t * p_edge,
+                             pll_unode_t * r_edge)
+{
+  algo_journal_node(workspace, p_edge);
+  algo_journal_node(workspace, p_edge->back);
+  algo_journal_node(workspace, p_edge->next);
+  algo_journal_node(workspace, p_edge->next->back);
+  algo_journal_node(workspace, p_edge->next->next);
+  algo_journal_node(workspace, p_edge->next->next->back);
+  algo_journal_node(workspace, r_edge);
+  algo_journal_node(workspace, r_edge->back);
+}
+
+/* go back to the tree at the mark: the journal is replayed backwards, and
+ * only rewired nodes and changed branches are invalidated */
+static void algo_journal_undo(pllmod_spr_workspace_t * workspace,
+                              pllmod_treeinfo_t * treeinfo)
+{
+  while (workspace->journal_size > 0)
+  {
+    const journal_entry_t * entry =
+        &workspace->journal[--workspace->journal_size];
+    pll_unode_t * node = entry->node;
+
+    node->back = entry->back;
+    node->length = entry->length;
+    node->pmatrix_index = entry->pmatrix_index;
+
+    pllmod_treeinfo_invalidate_pmatrix(treeinfo, node);
+    pllmod_treeinfo_invalidate_clv(treeinfo, node);
+  }
+
+  pllmod_treeinfo_set_root(treeinfo, workspace->journal_root);
+
+  algo_journal_sync_brlen(workspace, treeinfo, 1);
+}
+
+/*                 *
+ *  SPR workspace  *
+ *                 */
+
+static size_t algo_arena_align(size_t size)
+{
+  const size_t align = 2 * sizeof(double);
+
+  return (size + align - 1) / align * align;
+}
+
+static int algo_spr_workspace_check(const pllmod_spr_workspace_t * workspace,
+                                    const pllmod_treeinfo_t * treeinfo,
+                                    unsigned int ntopol_keep)
+{
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+
+  if (workspace->tip_count != treeinfo->tip_count ||
+      workspace->edge_count != treeinfo->tree->edge_count ||
+      workspace->brlen_set_count != brlen_set_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "SPR workspace was created for a different treeinfo\n");
+    return PLL_FAILURE;
+  }
+
+  if (ntopol_keep > workspace->ntopol_keep)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "SPR workspace supports up to %u topologies, "
+                     "%u requested\n", workspace->ntopol_keep, ntopol_keep);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* prepare workspace buffers for a new round */
+static void algo_spr_workspace_reset(pllmod_spr_workspace_t * workspace,
+                                     pllmod_search_params_t * params)
+{
+  size_t i;
+  pllmod_rollback_list_t * rollback_list = &workspace->rollback_list;
+  pllmod_bestnode_list_t * bestnode_list = &workspace->bestnode_list;
+
+  memcpy(params->brlen_buf, workspace->brlen_buf,
+         BRLEN_BUF_COUNT * sizeof(double *));
+  params->regraft_nodes = workspace->regraft_nodes;
+  params->regraft_dist = workspace->regraft_dist;
+
+  rollback_list->current = 0;
+  rollback_list->round = 0;
+  rollback_list->size = params->ntopol_keep;
+
+  /* rollback slots follow the slot of rollback2 */
+  memset(workspace->rollback2, 0,
+         (workspace->ntopol_keep + 1) * sizeof(pll_tree_rollback_t));
+
+  /* keep branch length pointers of the entries */
+  bestnode_list->current = 0;
+  bestnode_list->size = params->thorough ?
+      params->ntopol_keep : params->ntopol_keep * 3;
+  for (i = 0; i < 3 * workspace->ntopol_keep; ++i)
+  {
+    node_entry_t * entry = &bestnode_list->list[i];
+    entry->p_node = NULL;
+    entry->r_node = NULL;
+    entry->lh = 0.;
+    entry->rollback_num = 0;
+  }
+}
+
+static double algo_spr_round(pllmod_treeinfo_t * treeinfo,
+                             pllmod_spr_workers_t * workers,
+                             unsigned int radius_min,
+                             unsigned int radius_max,
+                             unsigned int ntopol_keep,
+                             pll_bool_t thorough,
+                             int brlen_opt_method,
+                             double bl_min,
+                             double bl_max,
+                             int smoothings,
+                             double epsilon,
+                             cutoff_info_t * cutoff_info,
+                             double subtree_cutoff,
+                             pllmod_spr_adaptive_t * adaptive,
+                             pllmod_spr_workspace_t * workspace,
+                             pllmod_search_session_t * session)
+{
+  unsigned int i;
+  double loglh, best_lh;
+  pllmod_search_params_t params;
+  int retval;
+
+  unsigned int allnodes_count;
+  pll_unode_t ** allnodes;
+
+  pllmod_rollback_list_t * rollback_list;
+  pllmod_bestnode_list_t * bestnode_list;
   pll_tree_rollback_t * rollback;
   size_t rollback_counter;
-  pll_tree_rollback_t * rollback2 = NULL;
+  pll_tree_rollback_t * rollback2;
   int toplist_index;
 
   node_entry_t * spr_entry;
   pll_unode_t * p_edge, * r_edge;
 
-  pllmod_treeinfo_topology_t * best_topol = NULL;
-#ifndef  PLLMOD_SEARCH_GREEDY_BLO
-  pllmod_treeinfo_topology_t * tmp_topol = NULL;
-#endif
+  pllmod_spr_workspace_t * own_workspace = NULL;
+#ifndef  PLLMOD_SEARCH_GREEDY_BLO
+  pllmod_treeinfo_topology_t * tmp_topol = NULL;
+#endif
+
+  /* process search params */
+  params.thorough = thorough;
+  params.ntopol_keep = ntopol_keep;
+  params.radius_min = radius_min;
+  params.radius_max = radius_max;
+  params.bl_min = bl_min;
+  params.bl_max = bl_max;
+  params.smoothings = smoothings;
+  params.brlen_opt_method = brlen_opt_method;
+  params.adaptive = adaptive;
+  params.node_state = session ? session->node_state : NULL;
+  params.incremental = session ? session->warm : 0;
+
+  /* reset error */
+  pll_errno = 0;
+
+  /* without a caller-provided workspace, buffers live for this round only */
+  if (workspace)
+  {
+    if (!algo_spr_workspace_check(workspace, treeinfo, ntopol_keep))
+      return 0;
+  }
+  else
+  {
+    own_workspace = pllmod_algo_spr_workspace_create(treeinfo, ntopol_keep);
+    if (!own_workspace)
+      return 0;
+    workspace = own_workspace;
+  }
+
+  algo_spr_workspace_reset(workspace, &params);
+
+  rollback_list = &workspace->rollback_list;
+  bestnode_list = &workspace->bestnode_list;
+  rollback2 = workspace->rollback2;
+
+  if (adaptive && !algo_adaptive_round_start(adaptive, treeinfo, &params))
+    goto error_exit;
+
+  if (cutoff_info)
+  {
+    cutoff_info->lh_dec_count = 0;
+    cutoff_info->lh_dec_sum = 0.;
+  }
+
+  loglh   = pllmod_treeinfo_compute_loglh(treeinfo, params.incremental);
+  best_lh = loglh;
+
+  /* query all nodes */
+  allnodes_count = (treeinfo->tip_count - 2) * 3;
+  allnodes = workspace->allnodes;
+
+  unsigned int node_count = algo_query_allnodes(treeinfo->root, allnodes);
+  assert(node_count == allnodes_count);
+
+  loglh = workers ?
+      reinsert_nodes_parallel(workers,
+                              allnodes,
+                              allnodes_count,
+                              rollback_list,
+                              bestnode_list,
+                              cutoff_info,
+                              &params) :
+      reinsert_nodes(treeinfo,
+                     allnodes,
+                     allnodes_count,
+                     rollback_list,
+                     bestnode_list,
+                     cutoff_info,
+                     &params);
+  if (!loglh)
+  {
+    /* return and spread error */
+    goto error_exit;
+  }
+
+  /* SPRs were applied: CLVs must be recomputed from now on */
+  params.incremental = 0;
+
+  /* in FAST mode, we re-insert a subset of best-scoring subtrees with BLO
+   * (i.e., in SLOW mode) */
+  if (!params.thorough && bestnode_list->current > 0)
+  {
+    params.thorough = PLL_TRUE;
+    for (i = 0; bestnode_list->list[i].p_node != NULL; i++)
+    {
+      allnodes[i] = bestnode_list->list[i].p_node;
+      bestnode_list->list[i].p_node = NULL;
+    }
+
+    DBG("\nThorough re-insertion of %u best-scoring nodes...\n", i);
+
+    loglh = workers ?
+        reinsert_nodes_parallel(workers,
+                                allnodes,
+                                i,
+                                rollback_list,
+                                bestnode_list,
+                                cutoff_info,
+                                &params) :
+        reinsert_nodes(treeinfo,
+                       allnodes,
+                       i,
+                       rollback_list,
+                       bestnode_list,
+                       cutoff_info,
+                       &params);
+    if (!loglh)
+    {
+      /* return and spread error */
+      goto error_exit;
+    }
+  }
+
+  best_lh = algo_optimize_bl_all(treeinfo,
+                                 &params,
+                                 epsilon,
+                                 0.25);
+  DBG("Best tree LH after BLO: %f\n", best_lh);
+
+  if (!best_lh)
+  {
+    /* return and spread error */
+    goto error_exit;
+  }
+
+  /* best tree so far: changes made from now on will be journaled */
+  algo_journal_mark(workspace, treeinfo);
+
+  /* Restore best topologies and re-evaluate them after full BLO.
+  NOTE: some SPRs were applied (if they improved LH) and others weren't.
+  Therefore in order to restore the original topology, we need to either rollback
+  an SPR (if it was already applied), or re-do it again (if it wasn't applied).
+  We perform it by simultaneously iterating over the history of applied SPRs
+  (rollback_list) and over the list of not-applied SPRs which resulted
+  in topologies with the highest LH (bestnode_list).
+  */
+  rollback_counter = 0;
+  toplist_index = -1;
+  int undo_SPR = 0;
+
+#ifdef DEBUG
+  algo_bestnode_list_print(bestnode_list);
+#endif
+
+  while (rollback_counter < rollback_list->size)
+  {
+    const int rollback_num = algo_rollback_list_abspos(rollback_list);
+    toplist_index = algo_bestnode_list_next_index(bestnode_list,
+                                                  rollback_num,
+                                                  toplist_index);
+
+    if (toplist_index == -1)
+    {
+      /* no more topologies for this rollback, so we go one slot back */
+      rollback = algo_rollback_list_prev(rollback_list);
+
+      if (!rollback || !rollback->SPR.prune_edge)
+      {
+        DBG("  Rollback slot %d is empty, exiting the loop...\n",
+            rollback_list->current);
+        break;
+      }
+
+      DBG("  Rollback BL: %.12lf %.12lf %.12lf %.12lf\n\n", rollback->SPR.prune_bl,
+          rollback->SPR.prune_left_bl, rollback->SPR.prune_right_bl, rollback->SPR.regraft_bl);
+
+      DBG("  Undoing SPR %lu (slot %d)... ", rollback_counter,
+          rollback_list->current);
+
+      algo_journal_spr(workspace,
+                       (pll_unode_t *) rollback->SPR.prune_edge,
+                       (pll_unode_t *) rollback->SPR.regraft_edge);
+
+      retval = pllmod_tree_rollback(rollback);
+      assert(retval == PLL_SUCCESS);
+
+      rollback_counter++;
+
+      undo_SPR = 0;
+    }
+    else
+    {
+      if ((unsigned int) toplist_index > params.ntopol_keep)
+        continue;
+
+      spr_entry = &bestnode_list->list[toplist_index];
+      p_edge = spr_entry->p_node;
+      r_edge = spr_entry->r_node;
+
+      if (!p_edge)
+      {
+        DBG("    SPR slot %d is empty, exiting the loop...\n", toplist_index);
+        break;
+      }
+      else
+      {
+        DBG("    Evaluating topology %d (idx %d, clv %d -> idx %d, clv %d), old LH: %f... ",
+            toplist_index,
+            p_edge->node_index,
+            p_edge->clv_index,
+            r_edge->node_index,
+            r_edge->clv_index,
+            spr_entry->lh);
+      }
+
+      if (!pllmod_treeinfo_check_constraint(treeinfo, p_edge, r_edge))
+      {
+        DBG("Topological constraint check failed, skip the topology.\n");
+        continue;
+      }
+
+      /* re-apply best SPR move for the node */
+      algo_journal_spr(workspace, p_edge, r_edge);
+      retval = pllmod_utree_spr(p_edge, r_edge, rollback2);
+      assert(retval == PLL_SUCCESS);
+
+#ifndef  PLLMOD_SEARCH_GREEDY_BLO
+      /* save topology with original branch length before BLO */
+      tmp_topol = pllmod_treeinfo_get_topology(treeinfo, workspace->tmp_topol);
+      if (!tmp_topol)
+        goto error_exit;
+      workspace->tmp_topol = tmp_topol;
+#endif
+
+      /* make sure that original prune branch length does not exceed maximum */
+      algo_unode_fix_length(treeinfo, rollback2->SPR.regraft_edge, params.bl_min, params.bl_max);
+
+      /* restore optimized branch lengths */
+      if (thorough)
+      {
+        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge, spr_entry->b1);
+        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge->next, spr_entry->b2);
+        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge->next->next, spr_entry->b3);
+
+        DBG("RESTORE bl triplet[%d/%d]: %lf %lf %lf\n", toplist_index,
+            bestnode_list->brlen_set_count, spr_entry->b1[0], spr_entry->b2[0], spr_entry->b3[0]);
+      }
+      else
+      {
+        algo_unode_fix_length(treeinfo, p_edge, params.bl_min, params.bl_max);
+        algo_unode_fix_length(treeinfo, p_edge->next, params.bl_min, params.bl_max);
+        algo_unode_fix_length(treeinfo, p_edge->next->next, params.bl_min, params.bl_max);
+      }
+
+      undo_SPR = 1;
+    }
+
+    /* now optimize all the branches */
+    double loglh;
+    loglh = algo_optimize_bl_all(treeinfo,
+                                 &params,
+                                 epsilon,
+                                 0.25);
+
+    if (!loglh)
+    {
+      /* return and spread error */
+      goto error_exit;
+    }
+
+    DBG("  new LH after BLO: %f\n", loglh);
+    assert(loglh > -INFINITY);
+
+    if (loglh - best_lh > 0.01)
+    {
+      DBG("Best tree LH: %f\n", loglh);
+
+      algo_journal_mark(workspace, treeinfo);
+
+      best_lh = loglh;
+    }
+
+    if (undo_SPR)
+    {
+#ifndef  PLLMOD_SEARCH_GREEDY_BLO
+      /* restore original brlens */
+      retval = pllmod_treeinfo_set_topology(treeinfo, tmp_topol);
+      if (!retval)
+        goto error_exit;
+#endif
+
+      /* rollback the SPR */
+      algo_journal_spr(workspace,
+                       (pll_unode_t *) rollback2->SPR.prune_edge,
+                       (pll_unode_t *) rollback2->SPR.regraft_edge);
+      retval = pllmod_tree_rollback(rollback2);
+      assert(retval == PLL_SUCCESS);
+    }
+  }
+
+  /* update LH cutoff */
+  if (cutoff_info)
+  {
+    cutoff_info->lh_cutoff =
+        subtree_cutoff * (cutoff_info->lh_dec_sum / cutoff_info->lh_dec_count);
+  }
+
+  if (adaptive)
+    algo_adaptive_round_finish(adaptive);
+
+  /* restore the best tree */
+  algo_journal_undo(workspace, treeinfo);
+
+  pllmod_algo_spr_workspace_destroy(own_workspace);
+
+  /* update partials and CLVs */
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  if (fabs(loglh - best_lh) > 1e-6)
+  {
+    printf("LH mismatch: %.12f  != %.12f\n", best_lh, loglh);
+    assert(fabs(loglh - best_lh) < 1e-6);
+  }
+
+  return loglh;
+
+error_exit:
+  /* cleanup */
+  pllmod_algo_spr_workspace_destroy(own_workspace);
+
+  /* make sure libpll error code is set and exit */
+  assert(pll_errno);
+  return 0;
+}
+
+PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
+                                        unsigned int radius_min,
+                                        unsigned int radius_max,
+                                        unsigned int ntopol_keep,
+                                        pll_bool_t thorough,
+                                        int brlen_opt_method,
+                                        double bl_min,
+                                        double bl_max,
+                                        int smoothings,
+                                        double epsilon,
+                                        cutoff_info_t * cutoff_info,
+                                        double subtree_cutoff)
+{
+  return algo_spr_round(treeinfo, NULL, radius_min, radius_max, ntopol_keep,
+                        thorough, brlen_opt_method, bl_min, bl_max, smoothings,
+                        epsilon, cutoff_info, subtree_cutoff, NULL, NULL, NULL);
+}
+
+/**
+ * Perform an SPR round evaluating candidate moves with multiple threads.
+ *
+ * Every thread works on its own treeinfo, so that CLVs, p-matrices and the
+ * tree itself can be modified concurrently. `treeinfo_list[0]` is the master
+ * treeinfo: accepted moves are applied to it, and its final topology is the
+ * result of the round. The remaining treeinfos are replicas, which must be
+ * created with `pllmod_treeinfo_clone()` from the master (or from another
+ * replica), so that they have their own partitions with the same data.
+ * Treeinfos sharing a partition with the master or with each other are
+ * rejected. Before and
+ * after the round, replicas are set to the topology, branch lengths and
+ * model parameters of the master treeinfo.
+ *
+ * Subtrees are processed in batches of `worker_count`, and only the best
+ * improving move of a batch is applied. Thus, the search path might differ
+ * from that of `pllmod_algo_spr_round()`, which is used for `worker_count`=1.
+ *
+ * Parallel reduction callbacks are not supported here: replicas are evaluated
+ * concurrently and must not synchronize with other processes.
+ *
+ * @param treeinfo_list master treeinfo followed by worker_count-1 replicas
+ * @param worker_count number of threads
+ *
+ * Other parameters and return value are the same as in
+ * `pllmod_algo_spr_round()`
+ */
+PLL_EXPORT double pllmod_algo_spr_round_parallel(pllmod_treeinfo_t ** treeinfo_list,
+                                                 unsigned int worker_count,
+                                                 unsigned int radius_min,
+                                                 unsigned int radius_max,
+                                                 unsigned int ntopol_keep,
+                                                 pll_bool_t thorough,
+                                                 int brlen_opt_method,
+                                                 double bl_min,
+                                                 double bl_max,
+                                                 int smoothings,
+                                                 double epsilon,
+                                                 cutoff_info_t * cutoff_info,
+                                                 double subtree_cutoff)
+{
+  double loglh;
+  pllmod_spr_workers_t * workers;
+
+  if (!algo_check_workers(treeinfo_list, worker_count))
+    return 0;
+
+  if (worker_count == 1)
+    return pllmod_algo_spr_round(treeinfo_list[0], radius_min, radius_max,
+                                 ntopol_keep, thorough, brlen_opt_method,
+                                 bl_min, bl_max, smoothings, epsilon,
+                                 cutoff_info, subtree_cutoff);
+
+  workers = algo_spr_workers_create(treeinfo_list, worker_count);
+  if (!workers)
+    return 0;
+
+  loglh = algo_spr_round(treeinfo_list[0], workers, radius_min, radius_max,
+                         ntopol_keep, thorough, brlen_opt_method, bl_min,
+                         bl_max, smoothings, epsilon, cutoff_info,
+                         subtree_cutoff, NULL, NULL, NULL);
+
+  if (loglh && !algo_sync_replicas(workers))
+    loglh = 0;
+
+  algo_spr_workers_destroy(workers);
+
+  return loglh;
+}
+
+/**
+ * Create a workspace for the SPR round.
+ *
+ * The workspace holds all buffers needed by `pllmod_algo_spr_round_workspace()`
+ * (candidate regraft edges, branch lengths, rollback and best-move lists,
+ * change journal), such that repeated rounds on the same treeinfo do not
+ * allocate memory. Apart from the topology snapshot used without greedy
+ * branch length optimization, which is allocated with the first round, all
+ * buffers are carved from a single memory block.
+ *
+ * @param treeinfo treeinfo structure the workspace will be used with
+ * @param ntopol_keep maximum number of topologies kept per round
+ *
+ * @return SPR workspace, or NULL on error
+ */
+PLL_EXPORT pllmod_spr_workspace_t *
+pllmod_algo_spr_workspace_create(const pllmod_treeinfo_t * treeinfo,
+                                 unsigned int ntopol_keep)
+{
+  pllmod_spr_workspace_t * workspace;
+  size_t i;
+  size_t offset;
+  size_t brlen_size, regraft_size, allnodes_size, rollback_size;
+  size_t entry_size, entry_buf_size, entry_brlen_size, dist_size;
+  size_t journal_size, journal_brlen_size;
+
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Empty treeinfo\n");
+    return NULL;
+  }
+
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+  const size_t edge_count = treeinfo->tree->edge_count;
+  const size_t allnodes_count = (treeinfo->tip_count - 2) * 3;
+  const size_t entry_count = 3 * (size_t) ntopol_keep;
+  /* at most two SPRs per best-move entry and one per rollback slot, with
+   * 8 nodes each */
+  const size_t journal_capacity = 8 * (2 * entry_count + ntopol_keep);
+#ifndef PLLMOD_SEARCH_BRLEN_DYNALLOC
+  const int entry_brlen_dynamic = brlen_set_count > 1;
+#else
+  const int entry_brlen_dynamic = 1;
+#endif
+
+  workspace =
+      (pllmod_spr_workspace_t *) calloc(1, sizeof(pllmod_spr_workspace_t));
+  if (!workspace)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for SPR workspace\n");
+    return NULL;
+  }
+
+  workspace->tip_count = treeinfo->tip_count;
+  workspace->edge_count = edge_count;
+  workspace->brlen_set_count = brlen_set_count;
+  workspace->ntopol_keep = ntopol_keep;
+
+  /* arena layout */
+  brlen_size = algo_arena_align(BRLEN_BUF_COUNT * brlen_set_count *
+                                sizeof(double));
+  regraft_size = algo_arena_align(edge_count * sizeof(pll_unode_t *));
+  allnodes_size = algo_arena_align(allnodes_count * sizeof(pll_unode_t *));
+  rollback_size = algo_arena_align((ntopol_keep + 1) *
+                                   sizeof(pll_tree_rollback_t));
+  entry_size = algo_arena_align(entry_count * sizeof(node_entry_t));
+  entry_buf_size = entry_brlen_dynamic ?
+      algo_arena_align(entry_count * sizeof(double *)) : 0;
+  entry_brlen_size = entry_brlen_dynamic ?
+      algo_arena_align(3 * entry_count * brlen_set_count * sizeof(double)) : 0;
+  dist_size = algo_arena_align(edge_count * sizeof(unsigned int));
+  journal_size = algo_arena_align(journal_capacity * sizeof(journal_entry_t));
+  journal_brlen_size = algo_arena_align(brlen_set_count * edge_count *
+                                        sizeof(double));
+
+  workspace->arena = (char *) calloc(brlen_size + regraft_size +
+                                     allnodes_size + rollback_size +
+                                     entry_size + entry_buf_size +
+                                     entry_brlen_size + dist_size +
+                                     journal_size + journal_brlen_size, 1);
+  if (!workspace->arena)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for SPR workspace buffers\n");
+    free(workspace);
+    return NULL;
+  }
+
+  offset = 0;
+  for (i = 0; i < BRLEN_BUF_COUNT; ++i)
+  {
+    workspace->brlen_buf[i] =
+        (double *) (workspace->arena + offset) + i * brlen_set_count;
+  }
+  offset += brlen_size;
+
+  workspace->regraft_nodes = (pll_unode_t **) (workspace->arena + offset);
+  offset += regraft_size;
+
+  workspace->allnodes = (pll_unode_t **) (workspace->arena + offset);
+  offset += allnodes_size;
+
+  /* one slot for re-applying moves + ntopol_keep rollback slots */
+  workspace->rollback2 = (pll_tree_rollback_t *) (workspace->arena + offset);
+  workspace->rollback_list.list = ntopol_keep ? workspace->rollback2 + 1 : NULL;
+  workspace->rollback_list.size = ntopol_keep;
+  offset += rollback_size;
+
+  /* best node list, with enough slots for FAST mode */
+  workspace->bestnode_list.list = (node_entry_t *) (workspace->arena + offset);
+  workspace->bestnode_list.size = entry_count;
+  workspace->bestnode_list.brlen_set_count = brlen_set_count;
+  offset += entry_size;
+
+  if (entry_brlen_dynamic)
+  {
+    double ** entry_buf = (double **) (workspace->arena + offset);
+    double * entry_brlen = (double *) (workspace->arena + offset +
+                                       entry_buf_size);
+
+    workspace->bestnode_list.brlen_buffers = entry_buf;
+    for (i = 0; i < entry_count; ++i)
+    {
+      node_entry_t * entry = &workspace->bestnode_list.list[i];
+
+      entry_buf[i] = entry_brlen + 3 * i * brlen_set_count;
+      entry->b1 = entry_buf[i];
+      entry->b2 = entry_buf[i] + brlen_set_count;
+      entry->b3 = entry_buf[i] + 2 * brlen_set_count;
+    }
+    offset += entry_buf_size + entry_brlen_size;
+  }
+  else
+  {
+    for (i = 0; i < entry_count; ++i)
+    {
+      node_entry_t * entry = &workspace->bestnode_list.list[i];
+
+      entry->b1 = &entry->bb1;
+      entry->b2 = &entry->bb2;
+      entry->b3 = &entry->bb3;
+    }
+  }
+
+  workspace->regraft_dist = (unsigned int *) (workspace->arena + offset);
+  offset += dist_size;
+
+  workspace->journal = (journal_entry_t *) (workspace->arena + offset);
+  workspace->journal_capacity = journal_capacity;
+  offset += journal_size;
+
+  workspace->journal_brlen = (double *) (workspace->arena + offset);
+
+  return workspace;
+}
+
+PLL_EXPORT void pllmod_algo_spr_workspace_destroy(pllmod_spr_workspace_t * workspace)
+{
+  if (!workspace)
+    return;
+
+  if (workspace->tmp_topol)
+    pllmod_treeinfo_destroy_topology(workspace->tmp_topol);
+  free(workspace->arena);
+  free(workspace);
+}
+
+/**
+ * Same as `pllmod_algo_spr_round()`, but all buffers are taken from
+ * `workspace`, which must have been created for `treeinfo` with at least
+ * `ntopol_keep` topologies.
+ *
+ * A workspace must not be shared by concurrent rounds.
+ */
+PLL_EXPORT double pllmod_algo_spr_round_workspace(pllmod_treeinfo_t * treeinfo,
+                                                  unsigned int radius_min,
+                                                  unsigned int radius_max,
+                                                  unsigned int ntopol_keep,
+                                                  pll_bool_t thorough,
+                                                  int brlen_opt_method,
+                                                  double bl_min,
+                                                  double bl_max,
+                                                  int smoothings,
+                                                  double epsilon,
+                                                  cutoff_info_t * cutoff_info,
+                                                  double subtree_cutoff,
+                                                  pllmod_spr_workspace_t * workspace)
+{
+  if (!workspace)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Empty SPR workspace\n");
+    return 0;
+  }
+
+  return algo_spr_round(treeinfo, NULL, radius_min, radius_max, ntopol_keep,
+                        thorough, brlen_opt_method, bl_min, bl_max, smoothings,
+                        epsilon, cutoff_info, subtree_cutoff, NULL, workspace,
+                        NULL);
+}
+
+/*                  *
+ *  search session  *
+ *                  */
+
+/* mark the unodes of the tree node at distance dist and enqueue them */
+static void algo_session_mark(pllmod_search_session_t * session,
+                              pll_unode_t * node,
+                              unsigned int dist,
+                              unsigned int * tail)
+{
+  pll_unode_t * snode = node;
+
+  do
+  {
+    session->node_dist[snode->node_index] = dist;
+    session->queue[(*tail)++] = snode;
+    snode = snode->next;
+  }
+  while (snode && snode != node);
+}
+
+/* after a round: subtrees which failed and whose neighborhood (radius_max+1)
+ * did not change are skipped in the next round */
+static void algo_session_update(pllmod_search_session_t * session)
+{
+  unsigned int i;
+  unsigned int head = 0, tail = 0;
+  const pllmod_treeinfo_t * treeinfo = session->treeinfo;
+  const unsigned int radius = session->radius_max + 1;
+
+  for (i = 0; i < session->node_count; ++i)
+    session->node_dist[i] = radius + 1;
+
+  /* start from both ends of every edge which changed in this round */
+  for (i = 0; i < session->node_count; ++i)
+  {
+    pll_unode_t * snode = treeinfo->subnodes[i];
+    if (snode->back->node_index != session->node_back[i])
+    {
+      if (session->node_dist[i] > 0)
+        algo_session_mark(session, snode, 0, &tail);
+      session->node_back[i] = snode->back->node_index;
+    }
+  }
+
+  while (head < tail)
+  {
+    pll_unode_t * snode = session->queue[head++];
+    const unsigned int dist = session->node_dist[snode->node_index];
+
+    if (dist < radius && session->node_dist[snode->back->node_index] > dist + 1)
+      algo_session_mark(session, snode->back, dist + 1, &tail);
+  }
+
+  for (i = 0; i < session->node_count; ++i)
+  {
+    if (session->node_dist[i] <= radius)
+      session->node_state[i] = SESSION_NODE_EVAL;
+    else if (session->node_state[i] == SESSION_NODE_FAILED)
+      session->node_state[i] = SESSION_NODE_SKIP;
+  }
+}
+
+/**
+ * Create a session for a multi-round SPR search.
+ *
+ * The session keeps the SPR workspace, the LH cutoff state and valid CLVs
+ * across rounds. Subtrees which did not improve the tree in a round are
+ * skipped in subsequent rounds until the topology within `radius_max`+1
+ * of their pruning point changes. Branch length changes do not reset
+ * skipped subtrees.
+ *
+ * Parameters are the same as in `pllmod_algo_spr_round()`; `subtree_cutoff`
+ * equal to 0 disables the LH cutoff.
+ *
+ * @return search session, or NULL on error
+ */
+PLL_EXPORT pllmod_search_session_t *
+pllmod_algo_search_session_create(pllmod_treeinfo_t * treeinfo,
+                                  unsigned int radius_min,
+                                  unsigned int radius_max,
+                                  unsigned int ntopol_keep,
+                                  pll_bool_t thorough,
+                                  int brlen_opt_method,
+                                  double bl_min,
+                                  double bl_max,
+                                  int smoothings,
+                                  double epsilon,
+                                  double subtree_cutoff)
+{
+  pllmod_search_session_t * session;
+  unsigned int node_count;
+
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Empty treeinfo\n");
+    return NULL;
+  }
+
+  if (radius_min < 1 || radius_max < radius_min)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid SPR radius range: [%u, %u]\n",
+                     radius_min, radius_max);
+    return NULL;
+  }
+
+  session =
+      (pllmod_search_session_t *) calloc(1, sizeof(pllmod_search_session_t));
+  if (!session)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for search session\n");
+    return NULL;
+  }
+
+  node_count = treeinfo->subnode_count;
+
+  session->radius_min = radius_min;
+  session->radius_max = radius_max;
+  session->ntopol_keep = ntopol_keep;
+  session->thorough = thorough;
+  session->brlen_opt_method = brlen_opt_method;
+  session->bl_min = bl_min;
+  session->bl_max = bl_max;
+  session->smoothings = smoothings;
+  session->epsilon = epsilon;
+  session->subtree_cutoff = subtree_cutoff;
+  session->treeinfo = treeinfo;
+  session->node_count = node_count;
+
+  session->workspace = pllmod_algo_spr_workspace_create(treeinfo, ntopol_keep);
+  if (!session->workspace)
+  {
+    free(session);
+    return NULL;
+  }
+
+  session->node_state = (unsigned char *) calloc(node_count,
+                                                 sizeof(unsigned char));
+  session->node_back = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  session->node_dist = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  session->queue = (pll_unode_t **) calloc(node_count, sizeof(pll_unode_t *));
+
+  if (!session->node_state || !session->node_back || !session->node_dist ||
+      !session->queue)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for search session buffers\n");
+    pllmod_algo_search_session_destroy(session);
+    return NULL;
+  }
+
+  pllmod_algo_search_session_reset(session);
+
+  /* initial cutoff: 1/1000 of the starting logLH */
+  session->cutoff_info.lh_start = session->loglh;
+  session->cutoff_info.lh_cutoff = session->loglh / -1000.0;
+
+  return session;
+}
+
+/**
+ * Perform one SPR round in the session.
+ *
+ * @return tree logLH after the round, or 0 on error
+ */
+PLL_EXPORT double pllmod_algo_search_session_round(pllmod_search_session_t * session)
+{
+  unsigned int i;
+  double loglh;
+  cutoff_info_t * cutoff_info;
+
+  if (!session)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Empty search session\n");
+    return 0;
+  }
+
+  if (session->treeinfo->subnode_count != session->node_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Search session was created for a different tree\n");
+    return 0;
+  }
+
+  session->subtrees_skipped = 0;
+  for (i = 0; i < session->node_count; ++i)
+  {
+    if (session->node_state[i] == SESSION_NODE_SKIP)
+      session->subtrees_skipped++;
+  }
+
+  cutoff_info = session->subtree_cutoff > 0. ? &session->cutoff_info : NULL;
+
+  loglh = algo_spr_round(session->treeinfo, NULL,
+                         session->radius_min, session->radius_max,
+                         session->ntopol_keep, session->thorough,
+                         session->brlen_opt_method, session->bl_min,
+                         session->bl_max, session->smoothings,
+                         session->epsilon, cutoff_info,
+                         session->subtree_cutoff, NULL,
+                         session->workspace, session);
+
+  if (!loglh)
+  {
+    /* tree state is unknown: evaluate everything in the next round */
+    pllmod_algo_search_session_reset(session);
+    return 0;
+  }
+
+  algo_session_update(session);
+
+  session->round++;
+  session->loglh = loglh;
+  session->warm = PLL_TRUE;
+
+  return loglh;
+}
+
+/**
+ * Forget skipped subtrees and recompute all CLVs.
+ *
+ * Must be called whenever the tree, its branch lengths or the model were
+ * changed outside of `pllmod_algo_search_session_round()`.
+ */
+PLL_EXPORT void pllmod_algo_search_session_reset(pllmod_search_session_t * session)
+{
+  unsigned int i;
+  pllmod_treeinfo_t * treeinfo;
+
+  if (!session)
+    return;
+
+  treeinfo = session->treeinfo;
+
+  for (i = 0; i < session->node_count; ++i)
+  {
+    session->node_state[i] = SESSION_NODE_EVAL;
+    session->node_back[i] = treeinfo->subnodes[i]->back->node_index;
+  }
+
+  session->loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  session->warm = PLL_TRUE;
+}
+
+PLL_EXPORT void pllmod_algo_search_session_destroy(pllmod_search_session_t * session)
+{
+  if (!session)
+    return;
+
+  pllmod_algo_spr_workspace_destroy(session->workspace);
+  free(session->node_state);
+  free(session->node_back);
+  free(session->node_dist);
+  free(session->queue);
+  free(session);
+}
+
+/**
+ * Create the state of the adaptive SPR search.
+ *
+ * The state records, for every pruned subtree, the regraft distance of its
+ * last improvement and the LH drop of its best regraft, and must be passed
+ * to all subsequent calls of `pllmod_algo_spr_round_adaptive()` for the
+ * same tree.
+ *
+ * @param treeinfo treeinfo structure
+ * @param radius_quantile fraction of improvements found so far which must be
+ *                        within the default regraft radius, in [0,1]
+ * @param skip_quantile quantile of the LH drops of the previous round above
+ *                      which subtrees are skipped, in [0,1] (1 = never skip)
+ * @param skip_rounds number of consecutive rounds without improvement before
+ *                    a subtree can be skipped
+ *
+ * @return adaptive SPR state, or NULL on error
+ */
+PLL_EXPORT pllmod_spr_adaptive_t *
+pllmod_algo_spr_adaptive_create(const pllmod_treeinfo_t * treeinfo,
+                                double radius_quantile,
+                                double skip_quantile,
+                                unsigned int skip_rounds)
+{
+  pllmod_spr_adaptive_t * adaptive;
+  unsigned int node_count;
+
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Empty treeinfo\n");
+    return NULL;
+  }
+
+  if (radius_quantile < 0. || radius_quantile > 1. ||
+      skip_quantile < 0. || skip_quantile > 1.)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Quantiles must be in the range [0,1]\n");
+    return NULL;
+  }
+
+  adaptive = (pllmod_spr_adaptive_t *) calloc(1, sizeof(pllmod_spr_adaptive_t));
+  if (!adaptive)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for adaptive SPR state\n");
+    return NULL;
+  }
+
+  node_count = treeinfo->subnode_count;
+
+  adaptive->radius_quantile = radius_quantile;
+  adaptive->skip_quantile = skip_quantile;
+  adaptive->skip_rounds = skip_rounds;
+  adaptive->node_count = node_count;
+  adaptive->stats.drop_cutoff = INFINITY;
+
+  adaptive->last_round = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  adaptive->skip_round = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  adaptive->improve_round = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  adaptive->improve_dist = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  adaptive->fail_count = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  adaptive->regraft_count = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  adaptive->best_drop = (double *) calloc(node_count, sizeof(double));
+  adaptive->drop_buf = (double *) calloc(node_count, sizeof(double));
+
+  if (!adaptive->last_round || !adaptive->skip_round ||
+      !adaptive->improve_round || !adaptive->improve_dist ||
+      !adaptive->fail_count || !adaptive->regraft_count ||
+      !adaptive->best_drop || !adaptive->drop_buf)
+  {
+    pllmod_algo_spr_adaptive_destroy(adaptive);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for adaptive SPR state\n");
+    return NULL;
+  }
+
+  return adaptive;
+}
+
+PLL_EXPORT void pllmod_algo_spr_adaptive_destroy(pllmod_spr_adaptive_t * adaptive)
+{
+  if (!adaptive)
+    return;
+
+  free(adaptive->improve_hist);
+  free(adaptive->last_round);
+  free(adaptive->skip_round);
+  free(adaptive->improve_round);
+  free(adaptive->improve_dist);
+  free(adaptive->fail_count);
+  free(adaptive->regraft_count);
+  free(adaptive->best_drop);
+  free(adaptive->drop_buf);
+  free(adaptive);
+}
+
+/**
+ * Perform an SPR round with a regraft radius and subtree skipping learned
+ * from the previous rounds.
+ *
+ * The default radius of a round is the smallest regraft distance covering
+ * `radius_quantile` of all improvements found so far; subtrees which improved
+ * before are allowed one step beyond the distance of their last improvement.
+ * `radius_min` and `radius_max` still bound the radius of every subtree.
+ * Subtrees which did not improve for `skip_rounds` rounds, and whose best
+ * regraft in the previous round lost more LH than `skip_quantile` of the
+ * other subtrees, are kept in place for one round and re-evaluated in the
+ * next one. The statistics of the round are stored in `adaptive->stats`.
+ *
+ * @param adaptive state created with `pllmod_algo_spr_adaptive_create()`
+ *
+ * Other parameters and return value are the same as in
+ * `pllmod_algo_spr_round()`
+ */
+PLL_EXPORT double pllmod_algo_spr_round_adaptive(pllmod_treeinfo_t * treeinfo,
+                                                 unsigned int radius_min,
+                                                 unsigned int radius_max,
+                                                 unsigned int ntopol_keep,
+                                                 pll_bool_t thorough,
+                                                 int brlen_opt_method,
+                                                 double bl_min,
+                                                 double bl_max,
+                                                 int smoothings,
+                                                 double epsilon,
+                                                 cutoff_info_t * cutoff_info,
+                                                 double subtree_cutoff,
+                                                 pllmod_spr_adaptive_t * adaptive)
+{
+  if (!adaptive)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Empty adaptive SPR state\n");
+    return 0;
+  }
+
+  return algo_spr_round(treeinfo, NULL, radius_min, radius_max, ntopol_keep,
+                        thorough, brlen_opt_method, bl_min, bl_max, smoothings,
+                        epsilon, cutoff_info, subtree_cutoff, adaptive, NULL,
+                        NULL);
+}
+
+/* NNI search */
+
+/* number of branches affected by an NNI move: central one and 4 adjacent */
+#define NNI_BRLEN_COUNT 5
+
+typedef struct nni_entry
+{
+  pll_unode_t * edge;
+  int type;
+  double lh;
+  double * brlen;       /* branch lengths after the move */
+  double * brlen_orig;  /* branch lengths before the move */
+} nni_entry_t;
+
+static int algo_nni_entry_cmp(const void * a, const void * b)
+{
+  const nni_entry_t * e1 = (const nni_entry_t *) a;
+  const nni_entry_t * e2 = (const nni_entry_t *) b;
+
+  /* sort by decreasing likelihood */
+  return (e1->lh < e2->lh) - (e1->lh > e2->lh);
+}
+
+static void algo_nni_get_brlens(const pllmod_treeinfo_t * treeinfo,
+                                pll_unode_t * edge,
+                                double * brlen,
+                                unsigned int brlen_set_count)
+{
+  pllmod_treeinfo_get_branch_length_all(treeinfo, edge, brlen);
+  brlen += brlen_set_count;
+  pllmod_treeinfo_get_branch_length_all(treeinfo, edge->next, brlen);
+  brlen += brlen_set_count;
+  pllmod_treeinfo_get_branch_length_all(treeinfo, edge->next->next, brlen);
+  brlen += brlen_set_count;
+  pllmod_treeinfo_get_branch_length_all(treeinfo, edge->back->next, brlen);
+  brlen += brlen_set_count;
+  pllmod_treeinfo_get_branch_length_all(treeinfo, edge->back->next->next, brlen);
+}
+
+static void algo_nni_set_brlens(pllmod_treeinfo_t * treeinfo,
+                                pll_unode_t * edge,
+                                const double * brlen,
+                                unsigned int brlen_set_count)
+{
+  pll_unode_t * nodes[NNI_BRLEN_COUNT];
+  unsigned int i;
+
+  nodes[0] = edge;
+  nodes[1] = edge->next;
+  nodes[2] = edge->next->next;
+  nodes[3] = edge->back->next;
+  nodes[4] = edge->back->next->next;
+
+  for (i = 0; i < NNI_BRLEN_COUNT; ++i)
+  {
+    pllmod_treeinfo_set_branch_length_all(treeinfo, nodes[i],
+                                          brlen + i * brlen_set_count);
+    pllmod_treeinfo_invalidate_pmatrix(treeinfo, nodes[i]);
+  }
+}
+
+/* CLVs at both ends of the central branch depend on the swapped subtrees */
+static void algo_nni_invalidate_clvs(pllmod_treeinfo_t * treeinfo,
+                                     pll_unode_t * edge)
+{
+  pllmod_treeinfo_invalidate_clv(treeinfo, edge);
+  pllmod_treeinfo_invalidate_clv(treeinfo, edge->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, edge->next->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, edge->back);
+  pllmod_treeinfo_invalidate_clv(treeinfo, edge->back->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, edge->back->next->next);
+}
+
+/* an NNI move is equivalent to pruning the subtree which changes sides of
+ * the central branch and regrafting it onto the subtree which stays at the
+ * other side, so it is checked as such an SPR move */
+static int algo_nni_check_constraint(pllmod_treeinfo_t * treeinfo,
+                                     pll_unode_t * edge,
+                                     int type)
+{
+  pll_unode_t * left1 = edge->next->back;
+  pll_unode_t * left2 = edge->next->next->back;
+  pll_unode_t * right1 = edge->back->next->back;
+  pll_unode_t * right2 = edge->back->next->next->back;
+  pll_unode_t * moved;
+  pll_unode_t * kept;
+  int retval;
+
+  if (!treeinfo->constraint)
+    return PLL_SUCCESS;
+
+  /* apply the move to find out which subtrees are swapped */
+  if (!pllmod_utree_nni(edge, type, NULL))
+    return PLL_FAILURE;
+
+  moved = (edge->next->back == left1 || edge->next->next->back == left1) ?
+      left2 : left1;
+  kept = (edge->back->next->back == right1 ||
+          edge->back->next->next->back == right1) ? right1 : right2;
+
+  /* undo the move */
+  retval = pllmod_utree_nni(edge, type, NULL);
+  assert(retval == PLL_SUCCESS);
+
+  return pllmod_treeinfo_check_constraint(treeinfo, moved->back, kept);
+}
+
+/* score both NNI moves at the given inner branch, and store the best one in
+ * entry if it improves over entry->lh; the tree is left unchanged */
+static int algo_nni_evaluate_edge(pllmod_treeinfo_t * treeinfo,
+                                  const pllmod_search_params_t * params,
+                                  nni_entry_t * entry)
+{
+  const int types[2] = {PLL_UTREE_MOVE_NNI_LEFT, PLL_UTREE_MOVE_NNI_RIGHT};
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+  pll_unode_t * edge = entry->edge;
+  pll_tree_rollback_t rollback_info;
+  unsigned int t;
+  int retval;
+  double loglh;
+
+  /* place root at the central branch: only the CLVs at both of its ends
+   * have to be recomputed after a move */
+  pllmod_treeinfo_set_root(treeinfo, edge);
+  pllmod_treeinfo_compute_loglh(treeinfo, 1);
+
+  algo_nni_get_brlens(treeinfo, edge, entry->brlen_orig, brlen_set_count);
+
+  for (t = 0; t < 2; ++t)
+  {
+    if (!algo_nni_check_constraint(treeinfo, edge, types[t]))
+      continue;
+
+    retval = pllmod_utree_nni(edge, types[t], &rollback_info);
+    assert(retval == PLL_SUCCESS);
+
+    algo_nni_invalidate_clvs(treeinfo, edge);
+
+    loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+
+    if (params->thorough)
+    {
+      /* optimize the central branch and 4 adjacent ones */
+      loglh = algo_optimize_bl_triplet(edge, treeinfo, params, 1.0);
+      if (loglh)
+        loglh = algo_optimize_bl_triplet(edge->back, treeinfo, params, 1.0);
+
+      if (!loglh)
+        return PLL_FAILURE;
+    }
+
+    if (loglh > entry->lh)
+    {
+      entry->lh = loglh;
+      entry->type = types[t];
+      algo_nni_get_brlens(treeinfo, edge, entry->brlen, brlen_set_count);
+    }
+
+    /* undo the move and restore original branch lengths */
+    retval = pllmod_tree_rollback(&rollback_info);
+    assert(retval == PLL_SUCCESS);
+
+    algo_nni_invalidate_clvs(treeinfo, edge);
+    if (params->thorough)
+      algo_nni_set_brlens(treeinfo, edge, entry->brlen_orig, brlen_set_count);
+  }
+
+  return PLL_SUCCESS;
+}
+
+static void algo_nni_mark_node(char * node_used, const pll_unode_t * node)
+{
+  node_used[node->node_index] = 1;
+  if (node->next)
+  {
+    node_used[node->next->node_index] = 1;
+    node_used[node->next->next->node_index] = 1;
+  }
+}
+
+/* check if an NNI move at edge conflicts with an applied one, i.e., if one of
+ * the nodes at both ends of edge is marked. In thorough mode, the lengths of
+ * the 4 adjacent branches are changed as well, so the nodes at their far ends
+ * are marked too: this way, moves which share an adjacent branch conflict. */
+static int algo_nni_nodes_used(char * node_used, pll_unode_t * edge, int mark,
+                               pll_bool_t thorough)
+{
+  pll_unode_t * ends[2] = {edge, edge->back};
+  unsigned int e;
+
+  for (e = 0; e < 2; ++e)
+  {
+    pll_unode_t * node = ends[e];
+    if (node_used[node->node_index] || node_used[node->next->node_index] ||
+        node_used[node->next->next->node_index])
+      return 1;
+  }
+
+  if (mark)
+  {
+    for (e = 0; e < 2; ++e)
+    {
+      pll_unode_t * node = ends[e];
+      algo_nni_mark_node(node_used, node);
+
+      if (thorough)
+      {
+        algo_nni_mark_node(node_used, node->next->back);
+        algo_nni_mark_node(node_used, node->next->next->back);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Perform an NNI round.
+ *
+ * In every pass, both alternative NNI moves are scored at every inner
+ * branch. Scoring a move requires recomputing only the CLVs at both ends of
+ * the branch, since the CLVs of the four surrounding subtrees stay valid. If
+ * `thorough` is set, the central branch and the 4 adjacent ones are
+ * optimized for every move.
+ *
+ * Moves which improve the likelihood by more than `epsilon` are then applied
+ * in batch, starting with the best one and skipping moves which share a node
+ * with an already applied one (in thorough mode, also moves which share one
+ * of the optimized branches). If the resulting tree is worse than the one
+ * with only the best move applied, all other moves are rolled back, and if
+ * the likelihood still decreased, the best move is rolled back as well.
+ * Passes are repeated until no further improvement is found.
+ *
+ * Branch lengths are not optimized globally at the end of the round.
+ *
+ * @param treeinfo treeinfo structure
+ * @param thorough optimize branch lengths around every NNI move
+ * @param brlen_opt_method branch length optimization method
+ * @param bl_min minimum branch length
+ * @param bl_max maximum branch length
+ * @param smoothings number of iterations for branch length optimization
+ * @param epsilon minimum likelihood improvement to accept a move
+ *
+ * @return the log-likelihood of the resulting tree, or 0 on error
+ */
+PLL_EXPORT double pllmod_algo_nni_round(pllmod_treeinfo_t * treeinfo,
+                                        pll_bool_t thorough,
+                                        int brlen_opt_method,
+                                        double bl_min,
+                                        double bl_max,
+                                        int smoothings,
+                                        double epsilon)
+{
+  unsigned int i, j;
+  unsigned int node_count;
+  unsigned int cand_count;
+  unsigned int applied;
+  int retval;
+  int improved;
+  double loglh, new_loglh;
+  pllmod_search_params_t params;
+
+  pll_unode_t ** allnodes = NULL;
+  nni_entry_t * entries = NULL;
+  double * brlen_mem = NULL;
+  pll_tree_rollback_t * rollback_list = NULL;
+  char * node_used = NULL;
+
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+  const size_t brlen_size = NNI_BRLEN_COUNT * brlen_set_count;
+
+  /* reset error */
+  pll_errno = 0;
+
+  /* no inner branches */
+  if (treeinfo->tip_count < 4)
+    return pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  const unsigned int inner_edge_count = treeinfo->tip_count - 3;
+  const unsigned int allnodes_count = (treeinfo->tip_count - 2) * 3;
+
+  /* process search params */
+  memset(&params, 0, sizeof(pllmod_search_params_t));
+  params.thorough = thorough;
+  params.bl_min = bl_min;
+  params.bl_max = bl_max;
+  params.smoothings = smoothings;
+  params.brlen_opt_method = brlen_opt_method;
+
+  allnodes = (pll_unode_t **) calloc(allnodes_count, sizeof(pll_unode_t *));
+  entries = (nni_entry_t *) calloc(inner_edge_count, sizeof(nni_entry_t));
+  brlen_mem = (double *) calloc(2 * inner_edge_count * brlen_size,
+                                sizeof(double));
+  rollback_list = (pll_tree_rollback_t *) calloc(inner_edge_count,
+                                                 sizeof(pll_tree_rollback_t));
+  node_used = (char *) calloc(treeinfo->subnode_count, sizeof(char));
+
+  if (!allnodes || !entries || !brlen_mem || !rollback_list || !node_used)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for NNI round\n");
+    goto error_exit;
+  }
+
+  for (i = 0; i < inner_edge_count; ++i)
+  {
+    entries[i].brlen = brlen_mem + 2 * i * brlen_size;
+    entries[i].brlen_orig = entries[i].brlen + brlen_size;
+  }
+
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  do
+  {
+    /* score NNI moves at every inner branch */
+    node_count = algo_query_allnodes(treeinfo->root, allnodes);
+    assert(node_count == allnodes_count);
+
+    cand_count = 0;
+    for (i = 0; i < node_count; ++i)
+    {
+      pll_unode_t * edge = allnodes[i];
+      nni_entry_t * entry = &entries[cand_count];
+
+      /* visit every inner branch only once */
+      if (!edge->back->next || edge->node_index > edge->back->node_index)
+        continue;
+
+      entry->edge = edge;
+      entry->type = 0;
+      entry->lh = loglh + epsilon;
+
+      if (!algo_nni_evaluate_edge(treeinfo, &params, entry))
+        goto error_exit;
+
+      if (entry->type)
+        cand_count++;
+    }
+
+    DBG("NNI pass: %u improving moves, LH: %f\n", cand_count, loglh);
+
+    if (!cand_count)
+      break;
+
+    qsort(entries, cand_count, sizeof(nni_entry_t), algo_nni_entry_cmp);
+
+    /* apply non-conflicting moves, best first; applied moves are moved to
+     * the beginning of the list */
+    memset(node_used, 0, treeinfo->subnode_count * sizeof(char));
+    applied = 0;
+    for (i = 0; i < cand_count; ++i)
+    {
+      nni_entry_t * entry = &entries[i];
+
+      if (algo_nni_nodes_used(node_used, entry->edge, 1, thorough))
+        continue;
+
+      retval = pllmod_utree_nni(entry->edge, entry->type,
+                                &rollback_list[applied]);
+      assert(retval == PLL_SUCCESS);
+
+      if (thorough)
+        algo_nni_set_brlens(treeinfo, entry->edge, entry->brlen,
+                            brlen_set_count);
+
+      if (i != applied)
+      {
+        nni_entry_t tmp = entries[applied];
+        entries[applied] = *entry;
+        *entry = tmp;
+      }
+      applied++;
+    }
+
+    new_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+    DBG("NNI pass: %u moves applied, LH: %f\n", applied, new_loglh);
+
+    /* moves are not independent: keep only the best one */
+    if (applied > 1 && new_loglh < entries[0].lh)
+    {
+      for (j = applied - 1; j > 0; --j)
+      {
+        retval = pllmod_tree_rollback(&rollback_list[j]);
+        assert(retval == PLL_SUCCESS);
+
+        if (thorough)
+          algo_nni_set_brlens(treeinfo, entries[j].edge, entries[j].brlen_orig,
+                              brlen_set_count);
+      }
+      applied = 1;
+
+      new_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    }
+
+    /* the tree got worse: revert the whole batch */
+    if (new_loglh < loglh)
+    {
+      DBG("NNI pass: LH decreased (%f -> %f), reverting\n", loglh, new_loglh);
+
+      retval = pllmod_tree_rollback(&rollback_list[0]);
+      assert(retval == PLL_SUCCESS);
+
+      if (thorough)
+        algo_nni_set_brlens(treeinfo, entries[0].edge, entries[0].brlen_orig,
+                            brlen_set_count);
+
+      new_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    }
+
+    improved = (new_loglh - loglh > epsilon);
+    loglh = new_loglh;
+  }
+  while (improved);
+
+  free(allnodes);
+  free(entries);
+  free(brlen_mem);
+  free(rollback_list);
+  free(node_used);
+
+  /* update partials and CLVs */
+  return pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+error_exit:
+  /* cleanup */
+  free(allnodes);
+  free(entries);
+  free(brlen_mem);
+  free(rollback_list);
+  free(node_used);
+
+  /* make sure libpll error code is set and exit */
+  assert(pll_errno);
+  return 0;
+}
+
+/* TBR search */
+
+/* branches whose length is changed by a TBR move: bisection branch,
+ * 2 + 2 branches around it and both reconnection branches */
+#define TBR_BRLEN_COUNT 7
+
+typedef struct tbr_entry
+{
+  pll_unode_t * b_edge;
+  pll_unode_t * r_edge1;  /* reconnection branch in the subtree at b_edge */
+  pll_unode_t * r_edge2;  /* reconnection branch in the subtree at
+                             b_edge->back, NULL = keep the subtree root */
+  double lh;
+} tbr_entry_t;
+
+typedef struct tbr_context
+{
+  pllmod_treeinfo_t * treeinfo;
+  const pllmod_search_params_t * params;
+  cutoff_info_t * cutoff_info;
+  unsigned int brlen_set_count;
+
+  /* current bisection: b_edge is pruned, and the subtree at b_edge->back
+   * is re-rooted at branches within radius */
+  pll_unode_t * b_edge;
+  pll_unode_t * orig_prune_edge;
+  pll_unode_t ** regraft_nodes;
+  unsigned int regraft_count;
+
+  /* best reconnections for the current bisection, sorted by likelihood */
+  tbr_entry_t * best;
+  unsigned int best_count;
+  unsigned int best_size;
+
+  /* branch lengths before the move, see algo_utree_tbr() */
+  pll_unode_t * brlen_nodes[TBR_BRLEN_COUNT];
+  double * brlen;
+} tbr_context_t;
+
+static void algo_tbr_keep(tbr_context_t * ctx,
+                          pll_unode_t * r_edge1,
+                          pll_unode_t * r_edge2,
+                          double lh)
+{
+  unsigned int i;
+
+  if (ctx->best_count == ctx->best_size &&
+      lh <= ctx->best[ctx->best_count-1].lh)
+    return;
+
+  if (ctx->best_count < ctx->best_size)
+    ctx->best_count++;
+
+  /* insertion into the sorted list, the worst entry drops out */
+  for (i = ctx->best_count - 1; i > 0 && ctx->best[i-1].lh < lh; --i)
+    ctx->best[i] = ctx->best[i-1];
+
+  ctx->best[i].b_edge = ctx->b_edge;
+  ctx->best[i].r_edge1 = r_edge1;
+  ctx->best[i].r_edge2 = r_edge2;
+  ctx->best[i].lh = lh;
+}
+
+/* score reconnections of the subtree at b_edge->back, with its current root,
+ * to all candidate branches in the other subtree */
+static int algo_tbr_score_reconnections(tbr_context_t * ctx,
+                                        pll_unode_t * r_edge2,
+                                        double * best_lh)
+{
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  cutoff_info_t * cutoff_info = ctx->cutoff_info;
+  unsigned int i;
+  double loglh;
+
+  for (i = 0; i < ctx->regraft_count; ++i)
+  {
+    pll_unode_t * r_edge1 = ctx->regraft_nodes[i];
+
+    /* both subtrees at their original position = original tree */
+    if (!r_edge2 && (r_edge1 == ctx->orig_prune_edge ||
+                     r_edge1 == ctx->orig_prune_edge->back))
+      continue;
+
+    if (!pllmod_treeinfo_check_constraint(treeinfo, ctx->b_edge, r_edge1))
+      continue;
+
+    loglh = pllmod_treeinfo_compute_loglh_regraft(treeinfo, ctx->b_edge,
+                                                  r_edge1,
+                                                  ctx->params->bl_min);
+    if (isnan(loglh))
+      return PLL_FAILURE;
+
+    if (cutoff_info && loglh < cutoff_info->lh_start)
+    {
+      cutoff_info->lh_dec_count++;
+      cutoff_info->lh_dec_sum += cutoff_info->lh_start - loglh;
+    }
+
+    if (loglh > *best_lh)
+      *best_lh = loglh;
+
+    algo_tbr_keep(ctx, r_edge1, r_edge2, loglh);
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* move the root of the subtree at b_edge->back onto branch r_edge, which is
+ * adjacent to its current position through the node at `crossed` */
+static void algo_tbr_move_subtree_root(tbr_context_t * ctx,
+                                       pll_unode_t * r_edge,
+                                       pll_unode_t * crossed)
+{
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  pll_unode_t * root = ctx->b_edge->back;
+  pll_unode_t * joined_edge;
+  int retval;
+
+  joined_edge = algo_utree_prune(treeinfo, ctx->params, root);
+  retval = algo_utree_regraft(treeinfo, ctx->params, root, r_edge);
+  assert(retval == PLL_SUCCESS);
+  PLLMOD_UNUSED(retval);
+
+  /* only the CLVs at the subtree root and at the crossed node change */
+  pllmod_treeinfo_invalidate_clv(treeinfo, root);
+  pllmod_treeinfo_invalidate_clv(treeinfo, root->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, root->next->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, crossed);
+  pllmod_treeinfo_invalidate_clv(treeinfo, crossed->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, crossed->next->next);
+
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, joined_edge);
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, root->next);
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, root->next->next);
+
+  algo_update_pmatrix(treeinfo, joined_edge);
+  algo_update_pmatrix(treeinfo, root->next);
+  algo_update_pmatrix(treeinfo, root->next->next);
+}
+
+/* re-root the subtree at b_edge->back at all branches behind `far` (which
+ * points away from the original root position) up to the maximum radius,
+ * and score all reconnections for every root */
+static int algo_tbr_reroot_descent(tbr_context_t * ctx,
+                                   pll_unode_t * far,
+                                   unsigned int depth)
+{
+  const cutoff_info_t * cutoff_info = ctx->cutoff_info;
+  pll_unode_t * r_edges[2];
+  unsigned int k;
+  int descent;
+
+  if (!far->next || depth >= ctx->params->radius_max)
+    return PLL_SUCCESS;
+
+  r_edges[0] = far->next;
+  r_edges[1] = far->next->next;
+
+  for (k = 0; k < 2; ++k)
+  {
+    pll_unode_t * r_edge = r_edges[k];
+    pll_unode_t * next_far = r_edge->back;
+    double best_lh = PLLMOD_OPT_LNL_UNLIKELY;
+
+    algo_tbr_move_subtree_root(ctx, r_edge, far);
+
+    if (!algo_tbr_score_reconnections(ctx, r_edge, &best_lh))
+      return PLL_FAILURE;
+
+    descent = !cutoff_info ||
+              (cutoff_info->lh_start - best_lh) < cutoff_info->lh_cutoff;
+
+    if (descent && !algo_tbr_reroot_descent(ctx, next_far, depth + 1))
+      return PLL_FAILURE;
+
+    /* move the root back to the branch at `far` */
+    algo_tbr_move_subtree_root(ctx, far, far);
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* find the best reconnections for the bisection at b_edge; the tree is left
+ * unchanged */
+static int algo_tbr_best_reconnections(tbr_context_t * ctx,
+                                       pll_unode_t * b_edge)
+{
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  const pllmod_search_params_t * params = ctx->params;
+  pll_unode_t * root = b_edge->back;
+  pll_unode_t * root_left;
+  unsigned int ncount;
+  int retval;
+  double best_lh = PLLMOD_OPT_LNL_UNLIKELY;
+
+  assert(!pllmod_utree_is_tip(b_edge) && !pllmod_utree_is_tip(root));
+
+  root_left = root->next->back;
+
+  /* original branch lengths at both bisection points */
+  double * z1 = params->brlen_buf[0];
+  double * z2 = params->brlen_buf[1];
+  double * z3 = params->brlen_buf[2];
+  double * c1 = params->brlen_buf[3];
+  double * c2 = params->brlen_buf[4];
+
+  pllmod_treeinfo_get_branch_length_all(treeinfo, b_edge, z1);
+  pllmod_treeinfo_get_branch_length_all(treeinfo, b_edge->next, z2);
+  pllmod_treeinfo_get_branch_length_all(treeinfo, b_edge->next->next, z3);
+  pllmod_treeinfo_get_branch_length_all(treeinfo, root->next, c1);
+  pllmod_treeinfo_get_branch_length_all(treeinfo, root->next->next, c2);
+
+  ctx->b_edge = b_edge;
+  ctx->best_count = 0;
+
+  pllmod_treeinfo_set_root(treeinfo, b_edge);
+
+  /* recompute all CLVs and p-matrices before pruning */
+  pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  /* PRUNE */
+  ctx->orig_prune_edge = algo_utree_prune(treeinfo, params, b_edge);
+  if (!ctx->orig_prune_edge)
+  {
+    /* check that errno was set correctly */
+    assert(pll_errno & PLLMOD_TREE_ERROR_SPR_MASK);
+    return PLL_FAILURE;
+  }
+
+  algo_unode_fix_length(treeinfo, ctx->orig_prune_edge, params->bl_min,
+                        params->bl_max);
+
+  pllmod_treeinfo_set_root(treeinfo, ctx->orig_prune_edge);
+
+  /* invalidate CLVs & p-matrix at the pruned edge */
+  pllmod_treeinfo_invalidate_clv(treeinfo, ctx->orig_prune_edge);
+  pllmod_treeinfo_invalidate_clv(treeinfo, ctx->orig_prune_edge->back);
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, ctx->orig_prune_edge);
+  algo_update_pmatrix(treeinfo, ctx->orig_prune_edge);
+
+  /* candidate reconnection branches in the remaining tree */
+  ctx->regraft_count = 0;
+  retval = pllmod_utree_nodes_at_node_dist(treeinfo->root,
+                                           ctx->regraft_nodes,
+                                           &ncount,
+                                           params->radius_min,
+                                           params->radius_max);
+  ctx->regraft_count += ncount;
+
+  if (!pllmod_utree_is_tip(treeinfo->root->back))
+  {
+    retval &= pllmod_utree_nodes_at_node_dist(treeinfo->root->back,
+                                              ctx->regraft_nodes + ctx->regraft_count,
+                                              &ncount,
+                                              params->radius_min,
+                                              params->radius_max);
+    ctx->regraft_count += ncount;
+  }
+  assert(retval == PLL_SUCCESS);
+
+  /* keep the pruned subtree root, i.e. SPR moves */
+  retval = algo_tbr_score_reconnections(ctx, NULL, &best_lh);
+
+  /* re-root the pruned subtree; with topological constraints, only
+   * SPR moves are considered */
+  if (retval && !treeinfo->constraint)
+  {
+    pll_unode_t * root_right = root->next->next->back;
+
+    retval = algo_tbr_reroot_descent(ctx, root_left, 0) &&
+             algo_tbr_reroot_descent(ctx, root_right, 0);
+
+    if (retval)
+    {
+      /* restore original branch lengths at the subtree root */
+      int left_first = (root->next->back == root_left);
+      pllmod_treeinfo_set_branch_length_all(treeinfo, root->next,
+                                            left_first ? c1 : c2);
+      pllmod_treeinfo_set_branch_length_all(treeinfo, root->next->next,
+                                            left_first ? c2 : c1);
+      pllmod_treeinfo_invalidate_pmatrix(treeinfo, root->next);
+      pllmod_treeinfo_invalidate_pmatrix(treeinfo, root->next->next);
+    }
+  }
+
+  if (!retval)
+    return PLL_FAILURE;
+
+  /* re-insert into the original pruning branch */
+  pllmod_treeinfo_set_root(treeinfo, ctx->orig_prune_edge);
+  retval = pllmod_utree_regraft(b_edge, ctx->orig_prune_edge);
+  assert(retval == PLL_SUCCESS || (pll_errno & PLLMOD_TREE_ERROR_SPR_MASK));
+
+  /* restore original branch length */
+  pllmod_treeinfo_set_branch_length_all(treeinfo, b_edge, z1);
+  pllmod_treeinfo_set_branch_length_all(treeinfo, b_edge->next, z2);
+  pllmod_treeinfo_set_branch_length_all(treeinfo, b_edge->next->next, z3);
+
+  /* invalidate p-matrices */
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, b_edge);
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, b_edge->next);
+  pllmod_treeinfo_invalidate_pmatrix(treeinfo, b_edge->next->next);
+
+  return PLL_SUCCESS;
+}
+
+/* apply a TBR move and set the branch lengths around both reconnection
+ * points: reconnection branches are split in halves, and bisection branches
+ * are joined. If the subtree at b_edge->back keeps its root, its branch
+ * lengths are kept as well */
+static int algo_utree_tbr(tbr_context_t * ctx,
+                          const tbr_entry_t * entry,
+                          pll_tree_rollback_t * rollback_info)
+{
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  const pllmod_search_params_t * params = ctx->params;
+  const unsigned int brlen_set_count = ctx->brlen_set_count;
+  pll_unode_t * b_edge = entry->b_edge;
+  pll_unode_t * root = b_edge->back;
+  pll_unode_t * left1 = b_edge->next->back;
+  pll_unode_t * right1 = b_edge->next->next->back;
+  pll_unode_t * left2 = root->next->back;
+  pll_unode_t * right2 = root->next->next->back;
+  pll_unode_t * r_edge1 = entry->r_edge1;
+  pll_unode_t * r_edge2 = entry->r_edge2 ? entry->r_edge2 : left2;
+  double * brlen = ctx->brlen;
+  double * half = params->brlen_buf[5];
+  double * joined = params->brlen_buf[6];
+  pll_tree_edge_t r_edge;
+  unsigned int i, k;
+  int join1, join2;
+
+  /* save branch lengths for algo_utree_tbr_rollback() */
+  ctx->brlen_nodes[0] = b_edge;
+  ctx->brlen_nodes[1] = b_edge->next;
+  ctx->brlen_nodes[2] = b_edge->next->next;
+  ctx->brlen_nodes[3] = root->next;
+  ctx->brlen_nodes[4] = root->next->next;
+  ctx->brlen_nodes[5] = r_edge1;
+  ctx->brlen_nodes[6] = r_edge2;
+
+  for (k = 0; k < TBR_BRLEN_COUNT; ++k)
+  {
+    pllmod_treeinfo_get_branch_length_all(treeinfo, ctx->brlen_nodes[k],
+                                          brlen + k * brlen_set_count);
+  }
+
+  r_edge.edge.utree.parent = r_edge1;
+  r_edge.edge.utree.child = r_edge2;
+  r_edge.length = b_edge->length;
+
+  if (!pllmod_utree_tbr(b_edge, &r_edge, rollback_info))
+    return PLL_FAILURE;
+
+  /* bisection branches are joined, unless reconnected there */
+  join1 = (r_edge1 != left1 && r_edge1 != right1);
+  join2 = (r_edge2 != left2 && r_edge2 != right2);
+
+  /* subtree at b_edge */
+  for (i = 0; i < brlen_set_count; ++i)
+  {
+    joined[i] = brlen[brlen_set_count + i] + brlen[2 * brlen_set_count + i];
+    half[i] = (join1 ? brlen[5 * brlen_set_count + i] : joined[i]) / 2.;
+  }
+
+  if (join1)
+  {
+    pllmod_treeinfo_set_branch_length_all(treeinfo, left1, joined);
+    algo_unode_fix_length(treeinfo, left1, params->bl_min, params->bl_max);
+    pllmod_treeinfo_invalidate_pmatrix(treeinfo, left1);
+  }
+
+  pllmod_treeinfo_set_branch_length_all(treeinfo, b_edge->next, half);
+  pllmod_treeinfo_set_branch_length_all(treeinfo, b_edge->next->next, half);
+
+  /* subtree at b_edge->back */
+  if (entry->r_edge2)
+  {
+    for (i = 0; i < brlen_set_count; ++i)
+    {
+      joined[i] = brlen[3 * brlen_set_count + i] + brlen[4 * brlen_set_count + i];
+      half[i] = (join2 ? brlen[6 * brlen_set_count + i] : joined[i]) / 2.;
+    }
+
+    if (join2)
+    {
+      pllmod_treeinfo_set_branch_length_all(treeinfo, left2, joined);
+      algo_unode_fix_length(treeinfo, left2, params->bl_min, params->bl_max);
+      pllmod_treeinfo_invalidate_pmatrix(treeinfo, left2);
+    }
+
+    pllmod_treeinfo_set_branch_length_all(treeinfo, root->next, half);
+    pllmod_treeinfo_set_branch_length_all(treeinfo, root->next->next, half);
+  }
+  else
+  {
+    /* reconnected at the original root: root->next is adjacent to left2 */
+    pllmod_treeinfo_set_branch_length_all(treeinfo, root->next,
+                                          brlen + 3 * brlen_set_count);
+    pllmod_treeinfo_set_branch_length_all(treeinfo, root->next->next,
+                                          brlen + 4 * brlen_set_count);
+  }
+
+  pllmod_treeinfo_set_branch_length_all(treeinfo, b_edge, brlen);
+
+  for (k = 0; k < 5; ++k)
+  {
+    algo_unode_fix_length(treeinfo, ctx->brlen_nodes[k], params->bl_min,
+                          params->bl_max);
+    pllmod_treeinfo_invalidate_pmatrix(treeinfo, ctx->brlen_nodes[k]);
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int algo_utree_tbr_rollback(tbr_context_t * ctx,
+                                   pll_tree_rollback_t * rollback_info)
+{
+  unsigned int k;
+
+  if (!pllmod_tree_rollback(rollback_info))
+    return PLL_FAILURE;
+
+  /* topology is restored, so are the branches at the saved nodes */
+  for (k = 0; k < TBR_BRLEN_COUNT; ++k)
+  {
+    pllmod_treeinfo_set_branch_length_all(ctx->treeinfo, ctx->brlen_nodes[k],
+                                          ctx->brlen + k * ctx->brlen_set_count);
+    pllmod_treeinfo_invalidate_pmatrix(ctx->treeinfo, ctx->brlen_nodes[k]);
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* apply a TBR move and return the log-likelihood of the resulting tree,
+ * optimizing the branches around the bisection branch in thorough mode */
+static double algo_tbr_evaluate_move(tbr_context_t * ctx,
+                                     const tbr_entry_t * entry,
+                                     pll_tree_rollback_t * rollback_info)
+{
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  pll_unode_t * b_edge = entry->b_edge;
+  double loglh;
+
+  if (!algo_utree_tbr(ctx, entry, rollback_info))
+    return 0;
+
+  pllmod_treeinfo_set_root(treeinfo, b_edge);
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  if (ctx->params->thorough)
+  {
+    loglh = algo_optimize_bl_triplet(b_edge, treeinfo, ctx->params, 1.0);
+    if (loglh)
+      loglh = algo_optimize_bl_triplet(b_edge->back, treeinfo, ctx->params,
+                                       1.0);
+  }
+
+  return loglh;
+}
+
+/**
+ * Perform a TBR round.
+ *
+ * Every inner branch is bisected in turn. The subtree at one side is pruned
+ * and, for every branch of the remaining tree within the radius range, the
+ * likelihood of reconnecting there is computed from the CLVs at both ends of
+ * that branch and the CLV of the pruned subtree, without applying the move
+ * (see `pllmod_treeinfo_compute_loglh_regraft()`). The pruned subtree is then
+ * re-rooted at branches up to `radius_max` away from its original root by
+ * moving the root one branch at a time, so that only two CLVs of the subtree
+ * change per step, and the reconnections are scored again for every root.
+ *
+ * In thorough mode, the `ntopol_keep` best reconnections of a bisection are
+ * applied and the five branches around the bisection branch are optimized;
+ * in fast mode, only the best reconnection is applied. The best move is kept
+ * if it improves the likelihood. All branches are optimized at the end of
+ * the round.
+ *
+ * With topological constraints, the pruned subtree is not re-rooted, i.e.
+ * only SPR moves are performed.
+ *
+ * Parameters and return value are the same as in `pllmod_algo_spr_round()`.
+ */
+PLL_EXPORT double pllmod_algo_tbr_round(pllmod_treeinfo_t * treeinfo,
+                                        unsigned int radius_min,
+                                        unsigned int radius_max,
+                                        unsigned int ntopol_keep,
+                                        pll_bool_t thorough,
+                                        int brlen_opt_method,
+                                        double bl_min,
+                                        double bl_max,
+                                        int smoothings,
+                                        double epsilon,
+                                        cutoff_info_t * cutoff_info,
+                                        double subtree_cutoff)
+{
+  unsigned int i, j;
+  unsigned int node_count;
+  int best_move;
+  int brlen_unlinked;
+  double loglh, best_lh, move_lh;
+  pllmod_search_params_t params;
+  tbr_context_t ctx;
+  pll_tree_rollback_t rollback_info;
+  pll_unode_t ** allnodes = NULL;
 
   double static_brlen_buf[BRLEN_BUF_COUNT];
 
   /* process search params */
+  memset(&params, 0, sizeof(pllmod_search_params_t));
   params.thorough = thorough;
   params.ntopol_keep = ntopol_keep;
   params.radius_min = radius_min;
@@ -1018,6 +3852,13 @@ PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
 
   brlen_unlinked = (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ? 1 : 0;
 
+  memset(&ctx, 0, sizeof(tbr_context_t));
+  ctx.treeinfo = treeinfo;
+  ctx.params = &params;
+  ctx.cutoff_info = cutoff_info;
+  ctx.brlen_set_count = brlen_unlinked ? treeinfo->init_partition_count : 1;
+  ctx.best_size = ntopol_keep ? ntopol_keep : 1;
+
   /* reset error */
   pll_errno = 0;
 
@@ -1029,22 +3870,17 @@ PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
             &static_brlen_buf[i];
   }
 
-  /* allocate rollback_info slots */
-  rollback_slots = params.ntopol_keep;
-  rollback_list = algo_rollback_list_create(rollback_slots);
-  if (!rollback_list)
-  {
-    /* return and spread error */
-    goto error_exit;
-  }
-
-  /* allocate best node slots */
-  toplist_slots = params.thorough ? params.ntopol_keep : params.ntopol_keep * 3;
-  brlen_set_count = brlen_unlinked ? treeinfo->init_partition_count : 1;
-  bestnode_list = algo_bestnode_list_create(toplist_slots, brlen_set_count);
-  if (!bestnode_list)
+  const unsigned int allnodes_count = (treeinfo->tip_count - 2) * 3;
+  allnodes = (pll_unode_t **) calloc(allnodes_count, sizeof(pll_unode_t *));
+  ctx.regraft_nodes = (pll_unode_t **) calloc(treeinfo->tree->edge_count,
+                                              sizeof(pll_unode_t *));
+  ctx.best = (tbr_entry_t *) calloc(ctx.best_size, sizeof(tbr_entry_t));
+  ctx.brlen = (double *) calloc(TBR_BRLEN_COUNT * ctx.brlen_set_count,
+                                sizeof(double));
+  if (!allnodes || !ctx.regraft_nodes || !ctx.best || !ctx.brlen)
   {
-    /* return and spread error */
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for TBR round\n");
     goto error_exit;
   }
 
@@ -1054,245 +3890,96 @@ PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
     cutoff_info->lh_dec_sum = 0.;
   }
 
-  loglh   = pllmod_treeinfo_compute_loglh(treeinfo, 0);
-  best_lh = loglh;
-
-  /* query all nodes */
-  allnodes_count = (treeinfo->tip_count - 2) * 3;
-  allnodes = (pll_unode_t **) calloc (allnodes_count, sizeof(pll_unode_t *));
-  if (!allnodes)
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory nodes list\n");
-    goto error_exit;
-  }
+  best_lh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
 
-  unsigned int node_count = algo_query_allnodes(treeinfo->root, allnodes);
+  node_count = algo_query_allnodes(treeinfo->root, allnodes);
   assert(node_count == allnodes_count);
 
-  loglh = reinsert_nodes(treeinfo,
-                         allnodes,
-                         allnodes_count,
-                         rollback_list,
-                         bestnode_list,
-                         cutoff_info,
-                         &params);
-  if (!loglh)
-  {
-    /* return and spread error */
-    goto error_exit;
-  }
-
-  /* in FAST mode, we re-insert a subset of best-scoring subtrees with BLO
-   * (i.e., in SLOW mode) */
-  if (!params.thorough && bestnode_list->current > 0)
-  {
-    params.thorough = PLL_TRUE;
-    for (i = 0; bestnode_list->list[i].p_node != NULL; i++)
-    {
-      allnodes[i] = bestnode_list->list[i].p_node;
-      bestnode_list->list[i].p_node = NULL;
-    }
-
-    DBG("\nThorough re-insertion of %u best-scoring nodes...\n", i);
-
-    loglh = reinsert_nodes(treeinfo,
-                           allnodes,
-                           i,
-                           rollback_list,
-                           bestnode_list,
-                           cutoff_info,
-                           &params);
-    if (!loglh)
-    {
-      /* return and spread error */
-      goto error_exit;
-    }
-  }
-
-  free(allnodes);
-  allnodes = NULL;
-
-  best_lh = algo_optimize_bl_all(treeinfo,
-                                 &params,
-                                 epsilon,
-                                 0.25);
-  DBG("Best tree LH after BLO: %f\n", best_lh);
-
-  if (!best_lh)
-  {
-    /* return and spread error */
-    goto error_exit;
-  }
-
-  best_topol = pllmod_treeinfo_get_topology(treeinfo, NULL);
-  if (!best_topol)
-    goto error_exit;
-
-  /* Restore best topologies and re-evaluate them after full BLO.
-  NOTE: some SPRs were applied (if they improved LH) and others weren't.
-  Therefore in order to restore the original topology, we need to either rollback
-  an SPR (if it was already applied), or re-do it again (if it wasn't applied).
-  We perform it by simultaneously iterating over the history of applied SPRs
-  (rollback_list) and over the list of not-applied SPRs which resulted
-  in topologies with the highest LH (bestnode_list).
-  */
-  rollback_counter = 0;
-  toplist_index = -1;
-  rollback2 = (pll_tree_rollback_t *) calloc(1, sizeof(pll_tree_rollback_t));
-  if (!rollback2)
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory for additional rollback list\n");
-    goto error_exit;
-  }
-  int undo_SPR = 0;
-
-#ifdef DEBUG
-  algo_bestnode_list_print(bestnode_list);
-#endif
-
-  while (rollback_counter < rollback_list->size)
+  for (i = 0; i < node_count; ++i)
   {
-    const int rollback_num = algo_rollback_list_abspos(rollback_list);
-    toplist_index = algo_bestnode_list_next_index(bestnode_list,
-                                                  rollback_num,
-                                                  toplist_index);
+    pll_unode_t * b_edge = allnodes[i];
 
-    if (toplist_index == -1)
-    {
-      /* no more topologies for this rollback, so we go one slot back */
-      rollback = algo_rollback_list_prev(rollback_list);
+    /* bisect every inner branch once */
+    if (pllmod_utree_is_tip(b_edge->back) ||
+        b_edge->node_index > b_edge->back->node_index)
+      continue;
 
-      if (!rollback || !rollback->SPR.prune_edge)
-      {
-        DBG("  Rollback slot %d is empty, exiting the loop...\n",
-            rollback_list->current);
-        break;
-      }
+    /* if remaining pruned tree would only contain 2 taxa, skip this node */
+    if (pllmod_utree_is_tip(b_edge->next->back) &&
+        pllmod_utree_is_tip(b_edge->next->next->back))
+      continue;
 
-      DBG("  Rollback BL: %.12lf %.12lf %.12lf %.12lf\n\n", rollback->SPR.prune_bl,
-          rollback->SPR.prune_left_bl, rollback->SPR.prune_right_bl, rollback->SPR.regraft_bl);
+    if (cutoff_info)
+      cutoff_info->lh_start = best_lh;
 
-      DBG("  Undoing SPR %lu (slot %d)... ", rollback_counter,
-          rollback_list->current);
+    if (!algo_tbr_best_reconnections(&ctx, b_edge))
+      goto error_exit;
 
-      retval = pllmod_tree_rollback(rollback);
-      assert(retval == PLL_SUCCESS);
+    if (!ctx.best_count)
+      continue;
 
-      rollback_counter++;
+    best_move = -1;
+    move_lh = best_lh;
 
-      undo_SPR = 0;
-    }
-    else
+    if (thorough)
     {
-      if ((unsigned int) toplist_index > params.ntopol_keep)
-        continue;
-
-      spr_entry = &bestnode_list->list[toplist_index];
-      p_edge = spr_entry->p_node;
-      r_edge = spr_entry->r_node;
-
-      if (!p_edge)
-      {
-        DBG("    SPR slot %d is empty, exiting the loop...\n", toplist_index);
-        break;
-      }
-      else
-      {
-        DBG("    Evaluating topology %d (idx %d, clv %d -> idx %d, clv %d), old LH: %f... ",
-            toplist_index,
-            p_edge->node_index,
-            p_edge->clv_index,
-            r_edge->node_index,
-            r_edge->clv_index,
-            spr_entry->lh);
-      }
-
-      if (!pllmod_treeinfo_check_constraint(treeinfo, p_edge, r_edge))
-      {
-        DBG("Topological constraint check failed, skip the topology.\n");
-        continue;
-      }
-
-      /* re-apply best SPR move for the node */
-      retval = pllmod_utree_spr(p_edge, r_edge, rollback2);
-      assert(retval == PLL_SUCCESS);
-
-#ifndef  PLLMOD_SEARCH_GREEDY_BLO
-      /* save topology with original branch length before BLO */
-      tmp_topol = pllmod_treeinfo_get_topology(treeinfo, tmp_topol);
-#endif
-
-      /* make sure that original prune branch length does not exceed maximum */
-      algo_unode_fix_length(treeinfo, rollback2->SPR.regraft_edge, params.bl_min, params.bl_max);
-
-      /* restore optimized branch lengths */
-      if (thorough)
+      /* evaluate the best reconnections with branch length optimization */
+      for (j = 0; j < ctx.best_count; ++j)
       {
-        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge, spr_entry->b1);
-        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge->next, spr_entry->b2);
-        pllmod_treeinfo_set_branch_length_all(treeinfo, p_edge->next->next, spr_entry->b3);
+        loglh = algo_tbr_evaluate_move(&ctx, &ctx.best[j], &rollback_info);
+        if (!loglh || !algo_utree_tbr_rollback(&ctx, &rollback_info))
+          goto error_exit;
 
-        DBG("RESTORE bl triplet[%d/%d]: %lf %lf %lf\n", toplist_index,
-            bestnode_list->brlen_set_count, spr_entry->b1[0], spr_entry->b2[0], spr_entry->b3[0]);
-      }
-      else
-      {
-        algo_unode_fix_length(treeinfo, p_edge, params.bl_min, params.bl_max);
-        algo_unode_fix_length(treeinfo, p_edge->next, params.bl_min, params.bl_max);
-        algo_unode_fix_length(treeinfo, p_edge->next->next, params.bl_min, params.bl_max);
+        if (loglh > move_lh)
+        {
+          move_lh = loglh;
+          best_move = (int) j;
+        }
       }
-
-      undo_SPR = 1;
     }
-
-    /* now optimize all the branches */
-    double loglh;
-    loglh = algo_optimize_bl_all(treeinfo,
-                                 &params,
-                                 epsilon,
-                                 0.25);
-
-    if (!loglh)
+    else if (ctx.best[0].lh > best_lh)
     {
-      /* return and spread error */
-      goto error_exit;
+      move_lh = ctx.best[0].lh;
+      best_move = 0;
     }
 
-    DBG("  new LH after BLO: %f\n", loglh);
-    assert(loglh > -INFINITY);
-
-    if (loglh - best_lh > 0.01)
+    /* LH improved -> apply the move */
+    if (best_move >= 0 && move_lh - best_lh > 1e-6)
     {
-      DBG("Best tree LH: %f\n", loglh);
+      DBG("TBR: %u / %u -> (%u %u)\n", b_edge->clv_index,
+          b_edge->back->clv_index, ctx.best[best_move].r_edge1->clv_index,
+          ctx.best[best_move].r_edge2 ?
+              ctx.best[best_move].r_edge2->clv_index : b_edge->back->clv_index);
 
-      best_topol = pllmod_treeinfo_get_topology(treeinfo, best_topol);
-      if (!best_topol)
+      loglh = algo_tbr_evaluate_move(&ctx, &ctx.best[best_move],
+                                     &rollback_info);
+      if (!loglh)
         goto error_exit;
 
-      best_lh = loglh;
-    }
-
-    if (undo_SPR)
-    {
-#ifndef  PLLMOD_SEARCH_GREEDY_BLO
-      /* restore original brlens */
-      retval = pllmod_treeinfo_set_topology(treeinfo, tmp_topol);
-      if (!retval)
+      if (loglh - best_lh > 1e-6)
+        best_lh = loglh;
+      else if (!algo_utree_tbr_rollback(&ctx, &rollback_info))
         goto error_exit;
-#endif
 
-      /* rollback the SPR */
-      retval = pllmod_tree_rollback(rollback2);
-      assert(retval == PLL_SUCCESS);
+      DBG("New best: %f\n", best_lh);
     }
   }
 
-  free(rollback2);
+  free(allnodes);
+  allnodes = NULL;
+
+  best_lh = algo_optimize_bl_all(treeinfo, &params, epsilon, 0.25);
+  DBG("Best tree LH after BLO: %f\n", best_lh);
+
+  if (!best_lh)
+  {
+    /* return and spread error */
+    goto error_exit;
+  }
 
-  algo_bestnode_list_destroy(bestnode_list);
-  algo_rollback_list_destroy(rollback_list);
+  free(ctx.regraft_nodes);
+  free(ctx.best);
+  free(ctx.brlen);
 
   if (brlen_unlinked)
   {
@@ -1301,44 +3988,27 @@ PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
   }
 
   /* update LH cutoff */
-  if (cutoff_info)
+  if (cutoff_info && cutoff_info->lh_dec_count)
   {
     cutoff_info->lh_cutoff =
         subtree_cutoff * (cutoff_info->lh_dec_sum / cutoff_info->lh_dec_count);
   }
 
-  if (best_topol)
-  {
-    retval = pllmod_treeinfo_set_topology(treeinfo, best_topol);
-    pllmod_treeinfo_destroy_topology(best_topol);
-    if (!retval)
-      goto error_exit;
-  }
+  return best_lh;
 
-#ifndef  PLLMOD_SEARCH_GREEDY_BLO
-  if (tmp_topol)
-    pllmod_treeinfo_destroy_topology(tmp_topol);
-#endif
+error_exit:
+  /* cleanup */
+  free(allnodes);
+  free(ctx.regraft_nodes);
+  free(ctx.best);
+  free(ctx.brlen);
 
-  /* update partials and CLVs */
-  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
-  if (fabs(loglh - best_lh) > 1e-6)
+  if (brlen_unlinked)
   {
-    printf("LH mismatch: %.12f  != %.12f\n", best_lh, loglh);
-    assert(fabs(loglh - best_lh) < 1e-6);
+    for (i = 0; i < BRLEN_BUF_COUNT; ++i)
+      free(params.brlen_buf[i]);
   }
 
-  return loglh;
-
-error_exit:
-  /* cleanup */
-  if (allnodes)
-    free(allnodes);
-  if (rollback2)
-    free(rollback2);
-  algo_bestnode_list_destroy(bestnode_list);
-  algo_rollback_list_destroy(rollback_list);
-
   /* make sure libpll error code is set and exit */
   assert(pll_errno);
   return 0;
@@ -750,6 +750,10 @@ double pllmod_algo_opt_onedim_treeinfo_custom(pllmod_treeinfo_t * treeinfo,
     double * param_vals = (double *) malloc(param_count * sizeof(double));
     int * opt_mask = (int *) calloc(param_count, sizeof(int));
 
+    /* converged partitions do not have to be recomputed */
+    int * partition_mask = (int *) calloc(treeinfo->partition_count,
+                                          sizeof(int));
+
     /* collect current values of parameters */
     unsigned int j = 0;
     for (i = 0; i < treeinfo->partition_count; ++i)
@@ -777,6 +781,7 @@ double pllmod_algo_opt_onedim_treeinfo_custom(pllmod_treeinfo_t * treeinfo,
     opt_params.param_to_optimize  = param_to_optimize;
     opt_params.num_opt_partitions = param_count;
     opt_params.param_set_cb       = params_setter;
+    opt_params.partition_mask     = partition_mask;
 
     /* run BRENT optimization for all partitions in parallel */
     int ret = pllmod_opt_minimize_brent_multi(param_count,
@@ -791,6 +796,7 @@ double pllmod_algo_opt_onedim_treeinfo_custom(pllmod_treeinfo_t * treeinfo,
 
     free(param_vals);
     free(opt_mask);
+    free(partition_mask);
 
     if (ret != PLL_SUCCESS)
     {
@@ -941,14 +947,141 @@ double pllmod_algo_opt_brlen_scalers_treeinfo(pllmod_treeinfo_t * treeinfo,
 }
 
 
-PLL_EXPORT
-double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
-                                             unsigned int params_index,
-                                             double min_rate,
-                                             double max_rate,
-                                             double bfgs_factor,
-                                             double tolerance)
+/* check that all workspaces of a parallel model optimization
+ * can be used concurrently and hold the same data */
+static int algo_check_model_workers(pllmod_treeinfo_t ** treeinfo_list,
+                                    unsigned int worker_count)
+{
+  if (!algo_check_workers(treeinfo_list, worker_count))
+    return PLL_FAILURE;
+
+  const pllmod_treeinfo_t * master = treeinfo_list[0];
+
+  /* one replica per thread of the master's pool */
+  const unsigned int thread_count = pllmod_thread_pool_size(
+                          (const pllmod_thread_pool_t *) master->thread_pool);
+  if (worker_count > 1 && thread_count > 1 && worker_count - 1 < thread_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "%u threads require as many treeinfo replicas, "
+                     "got %u\n", thread_count, worker_count - 1);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* copy branch lengths and model parameters from treeinfo_list[0] to the
+ * other workspaces, same as the SPR replicas */
+static int algo_sync_model_workers(pllmod_treeinfo_t ** treeinfo_list,
+                                   unsigned int worker_count)
+{
+  unsigned int w;
+  pllmod_treeinfo_topology_t * topol;
+  int retval = PLL_SUCCESS;
+
+  topol = pllmod_treeinfo_get_topology(treeinfo_list[0], NULL);
+  if (!topol)
+    return PLL_FAILURE;
+
+  for (w = 1; w < worker_count; ++w)
+  {
+    if (!pllmod_treeinfo_set_topology(treeinfo_list[w], topol) ||
+        !pllmod_treeinfo_copy_model(treeinfo_list[w], treeinfo_list[0]))
+    {
+      retval = PLL_FAILURE;
+      break;
+    }
+  }
+
+  pllmod_treeinfo_destroy_topology(topol);
+
+  return retval;
+}
+
+/* L-BFGS-B for all partitions; with replicas and a multi-threaded master,
+ * the finite-difference gradient is evaluated on the master's thread pool,
+ * one replica per thread */
+static double algo_minimize_lbfgsb_multi(pllmod_treeinfo_t ** treeinfo_list,
+                                         unsigned int worker_count,
+                                         struct treeinfo_opt_params * opt_params,
+                                         unsigned int xnum,
+                                         double ** x,
+                                         double ** xmin,
+                                         double ** xmax,
+                                         int ** bound,
+                                         unsigned int * n,
+                                         unsigned int nmax,
+                                         double factr,
+                                         double pgtol,
+                                         double (*target_funk)(void *,
+                                                               double **,
+                                                               double *,
+                                                               int *),
+                                         int (*grad_funk)(void *,
+                                                          double **,
+                                                          double **,
+                                                          int *))
+{
+  unsigned int t;
+  double score;
+  struct treeinfo_opt_params * worker_params;
+  void ** params;
+  void * pool = treeinfo_list[0]->thread_pool;
+  const unsigned int thread_count =
+                  pllmod_thread_pool_size((const pllmod_thread_pool_t *) pool);
+
+  if (worker_count < 2 || thread_count < 2)
+    return pllmod_opt_minimize_lbfgsb_multi_grad(xnum, x, xmin, xmax, bound,
+                                                 n, nmax, factr, pgtol,
+                                                 (void *) opt_params,
+                                                 target_funk, grad_funk);
+
+  /* model parameters of the master might have changed since the last call */
+  if (!algo_sync_model_workers(treeinfo_list, worker_count))
+    return (double) -INFINITY;
+
+  worker_params = (struct treeinfo_opt_params *) calloc(thread_count,
+                                         sizeof(struct treeinfo_opt_params));
+  params = (void **) calloc(thread_count, sizeof(void *));
+  if (!worker_params || !params)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for l-bfgs-b workers\n");
+    free(worker_params);
+    free(params);
+    return (double) -INFINITY;
+  }
+
+  /* the master uses the pool for its own computations, so all perturbed
+   * points are evaluated on replicas */
+  for (t = 0; t < thread_count; ++t)
+  {
+    worker_params[t] = *opt_params;
+    worker_params[t].treeinfo = treeinfo_list[t + 1];
+    params[t] = (void *) &worker_params[t];
+  }
+
+  score = pllmod_opt_minimize_lbfgsb_multi_par(xnum, x, xmin, xmax, bound,
+                                               n, nmax, factr, pgtol,
+                                               (void *) opt_params, params,
+                                               pool, target_funk, grad_funk);
+
+  free(worker_params);
+  free(params);
+
+  return score;
+}
+
+static double algo_opt_subst_rates_treeinfo(pllmod_treeinfo_t ** treeinfo_list,
+                                            unsigned int worker_count,
+                                            unsigned int params_index,
+                                            double min_rate,
+                                            double max_rate,
+                                            double bfgs_factor,
+                                            double tolerance)
 {
+  pllmod_treeinfo_t * treeinfo = treeinfo_list[0];
   unsigned int i, j, k, l;
 
   const double factor = bfgs_factor > 0. ? bfgs_factor : PLLMOD_ALGO_BFGS_FACTR;
@@ -1095,12 +1228,16 @@ double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
   opt_params.num_free_params    = subst_free_params;
   opt_params.fixed_var_index    = NULL;
 
-  cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
-                                              subst_free_params,
-                                              max_free_params,
-                                              factor, tolerance,
-                                              (void *) &opt_params,
-                                              target_subst_params_func_multi);
+  /* analytic gradient needs CLVs for both directions of every edge */
+  cur_logl = algo_minimize_lbfgsb_multi(treeinfo_list, worker_count,
+                                        &opt_params, part_count, x, lb, ub, bt,
+                                        subst_free_params,
+                                        max_free_params,
+                                        factor, tolerance,
+                                        target_subst_params_func_multi,
+                                        treeinfo->clv_mode ==
+                                          PLLMOD_TREEINFO_CLV_EDGE ?
+                                          grad_subst_params_func_multi : NULL);
 
   /* cleanup */
   for (i = 0; i < part_count; ++i)
@@ -1122,6 +1259,58 @@ double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
   return cur_logl;
 }
 
+PLL_EXPORT
+double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
+                                             unsigned int params_index,
+                                             double min_rate,
+                                             double max_rate,
+                                             double bfgs_factor,
+                                             double tolerance)
+{
+  return algo_opt_subst_rates_treeinfo(&treeinfo, 1, params_index, min_rate,
+                                       max_rate, bfgs_factor, tolerance);
+}
+
+/**
+ * Optimize substitution rates, evaluating finite-difference gradients with
+ * multiple threads.
+ *
+ * Same as pllmod_algo_opt_subst_rates_treeinfo() for treeinfo_list[0], but
+ * the gradient of every L-BFGS-B step is evaluated on the thread pool of
+ * treeinfo_list[0] (see pllmod_treeinfo_set_thread_count()), thread t using
+ * replica treeinfo_list[t+1] (see pllmod_opt_minimize_lbfgsb_multi_par()).
+ * Hence, at least as many replicas as threads are required. Replicas must be
+ * created with pllmod_treeinfo_clone(), must not share partitions and must
+ * not use a parallel reduction callback. Their branch lengths and model
+ * parameters are overwritten with those of treeinfo_list[0]. In edge CLV
+ * mode, the analytic gradient is used instead.
+ *
+ * @return the negative log-likelihood after optimization, or 0 on error
+ */
+PLL_EXPORT
+double pllmod_algo_opt_subst_rates_treeinfo_parallel(pllmod_treeinfo_t ** treeinfo_list,
+                                                     unsigned int worker_count,
+                                                     unsigned int params_index,
+                                                     double min_rate,
+                                                     double max_rate,
+                                                     double bfgs_factor,
+                                                     double tolerance)
+{
+  double cur_logl;
+
+  if (!algo_check_model_workers(treeinfo_list, worker_count))
+    return 0;
+
+  cur_logl = algo_opt_subst_rates_treeinfo(treeinfo_list, worker_count,
+                                           params_index, min_rate, max_rate,
+                                           bfgs_factor, tolerance);
+
+  if (worker_count > 1 && !algo_sync_model_workers(treeinfo_list, worker_count))
+    return 0;
+
+  return cur_logl;
+}
+
 PLL_EXPORT
 double pllmod_algo_opt_frequencies_treeinfo (pllmod_treeinfo_t * treeinfo,
                                              unsigned int params_index,
@@ -1272,12 +1461,16 @@ double pllmod_algo_opt_frequencies_treeinfo (pllmod_treeinfo_t * treeinfo,
 
   assert(part == part_count);
 
-  cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
-                                              num_free_params,
-                                              max_free_params,
-                                              factor, tolerance,
-                                              (void *) &opt_params,
-                                              target_freqs_func_multi);
+  /* analytic gradient needs CLVs for both directions of every edge */
+  cur_logl = pllmod_opt_minimize_lbfgsb_multi_grad(part_count, x, lb, ub, bt,
+                                                   num_free_params,
+                                                   max_free_params,
+                                                   factor, tolerance,
+                                                   (void *) &opt_params,
+                                                   target_freqs_func_multi,
+                                                   treeinfo->clv_mode ==
+                                                     PLLMOD_TREEINFO_CLV_EDGE ?
+                                                     grad_freqs_func_multi : NULL);
 
   /* cleanup */
   for (i = 0; i < part_count; ++i)
@@ -1397,12 +1590,16 @@ double pllmod_algo_opt_alpha_pinv_treeinfo(pllmod_treeinfo_t * treeinfo,
 
   assert(part == part_count);
 
-  cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
-                                              num_free_params,
-                                              max_free_params,
-                                              factor, tolerance,
-                                              (void *) &opt_params,
-                                              target_func_multidim_treeinfo);
+  /* analytic gradient needs CLVs for both directions of every edge */
+  cur_logl = pllmod_opt_minimize_lbfgsb_multi_grad(part_count, x, lb, ub, bt,
+                                                   num_free_params,
+                                                   max_free_params,
+                                                   factor, tolerance,
+                                                   (void *) &opt_params,
+                                                   target_func_multidim_treeinfo,
+                                                   treeinfo->clv_mode ==
+                                                     PLLMOD_TREEINFO_CLV_EDGE ?
+                                                     grad_func_multidim_treeinfo : NULL);
 
   /* cleanup */
   free(lb[0]);
@@ -1522,15 +1719,16 @@ static void renormalize_free_rates(pllmod_treeinfo_t * treeinfo)
   }
 }
 
-PLL_EXPORT
-double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
-                                               double min_rate,
-                                               double max_rate,
-                                               double min_brlen,
-                                               double max_brlen,
-                                               double bfgs_factor,
-                                               double tolerance)
+static double algo_opt_rates_weights_treeinfo(pllmod_treeinfo_t ** treeinfo_list,
+                                              unsigned int worker_count,
+                                              double min_rate,
+                                              double max_rate,
+                                              double min_brlen,
+                                              double max_brlen,
+                                              double bfgs_factor,
+                                              double tolerance)
 {
+  pllmod_treeinfo_t * treeinfo = treeinfo_list[0];
   const double factor = bfgs_factor > 0. ? bfgs_factor : PLLMOD_ALGO_BFGS_FACTR;
 
   unsigned int i;
@@ -1682,12 +1880,13 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
 
     opt_params.param_to_optimize = PLLMOD_OPT_PARAM_RATE_WEIGHTS;
 
-    cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
-                                                num_free_params,
-                                                max_free_params,
-                                                factor, tolerance,
-                                                (void *) &opt_params,
-                                                target_func_multidim_treeinfo);
+    cur_logl = algo_minimize_lbfgsb_multi(treeinfo_list, worker_count,
+                                          &opt_params, part_count,
+                                          x, lb, ub, bt,
+                                          num_free_params,
+                                          max_free_params,
+                                          factor, tolerance,
+                                          target_func_multidim_treeinfo, NULL);
 
     DBG("pllmod_algo_opt_rates_weights_treeinfo: AFTER WEIGHTS: logLH = %.15lf\n", cur_logl);
 
@@ -1723,12 +1922,13 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
 
     opt_params.param_to_optimize = PLLMOD_OPT_PARAM_FREE_RATES;
 
-    cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
-                                                num_free_params,
-                                                max_free_params,
-                                                factor, tolerance,
-                                                (void *) &opt_params,
-                                                target_func_multidim_treeinfo);
+    cur_logl = algo_minimize_lbfgsb_multi(treeinfo_list, worker_count,
+                                          &opt_params, part_count,
+                                          x, lb, ub, bt,
+                                          num_free_params,
+                                          max_free_params,
+                                          factor, tolerance,
+                                          target_func_multidim_treeinfo, NULL);
 
     DBG("pllmod_algo_opt_rates_weights_treeinfo: AFTER RATES: logLH = %.15lf\n", cur_logl);
   }
@@ -1826,6 +2026,487 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
   return -1 * cur_logl;
 }
 
+PLL_EXPORT
+double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
+                                               double min_rate,
+                                               double max_rate,
+                                               double min_brlen,
+                                               double max_brlen,
+                                               double bfgs_factor,
+                                               double tolerance)
+{
+  return algo_opt_rates_weights_treeinfo(&treeinfo, 1, min_rate, max_rate,
+                                         min_brlen, max_brlen, bfgs_factor,
+                                         tolerance);
+}
+
+/**
+ * Optimize free rates and rate weights, evaluating finite-difference
+ * gradients with multiple threads.
+ *
+ * Same as pllmod_algo_opt_rates_weights_treeinfo() for treeinfo_list[0],
+ * but the gradient of every L-BFGS-B step is evaluated on the thread pool of
+ * treeinfo_list[0], thread t using replica treeinfo_list[t+1] (see
+ * pllmod_algo_opt_subst_rates_treeinfo_parallel()).
+ *
+ * @return the negative log-likelihood after optimization, or 0 on error
+ */
+PLL_EXPORT
+double pllmod_algo_opt_rates_weights_treeinfo_parallel(pllmod_treeinfo_t ** treeinfo_list,
+                                                       unsigned int worker_count,
+                                                       double min_rate,
+                                                       double max_rate,
+                                                       double min_brlen,
+                                                       double max_brlen,
+                                                       double bfgs_factor,
+                                                       double tolerance)
+{
+  double cur_logl;
+
+  if (!algo_check_model_workers(treeinfo_list, worker_count))
+    return 0;
+
+  cur_logl = algo_opt_rates_weights_treeinfo(treeinfo_list, worker_count,
+                                             min_rate, max_rate, min_brlen,
+                                             max_brlen, bfgs_factor, tolerance);
+
+  if (worker_count > 1 && !algo_sync_model_workers(treeinfo_list, worker_count))
+    return 0;
+
+  return cur_logl;
+}
+
+/* CLV pool mode: pllmod_opt_* functions read CLVs of all nodes around the
+ * optimized edge, but only the CLVs at the root are guaranteed to be resident.
+ * Therefore, the root is moved to each edge in turn (in the same order as
+ * in pllmod_opt_optimize_branch_lengths_local_multi), and a single edge is
+ * optimized there */
+static int algo_opt_brlen_pool_edge(pllmod_treeinfo_t * treeinfo,
+                                    pll_unode_t * edge,
+                                    double min_brlen,
+                                    double max_brlen,
+                                    int opt_method,
+                                    int radius)
+{
+  pll_unode_t * root = pllmod_utree_is_tip(edge) ? edge->back : edge;
+
+  pllmod_treeinfo_set_root(treeinfo, root);
+
+  /* CLVs towards the root stay valid when the root edge changes */
+  if (isnan(pllmod_treeinfo_compute_loglh(treeinfo, 1)))
+    return PLL_FAILURE;
+
+  double loglh = pllmod_opt_optimize_branch_lengths_local_multi_mode(
+                                                    treeinfo->partitions,
+                                                    treeinfo->partition_count,
+                                                    root,
+                                                    treeinfo->param_indices,
+                                                    treeinfo->deriv_precomp,
+                                                    treeinfo->branch_lengths,
+                                                    treeinfo->brlen_scalers,
+                                                    min_brlen,
+                                                    max_brlen,
+                                                    0.,   /* lh_epsilon */
+                                                    1,    /* max_iters */
+                                                    0,    /* radius */
+                                                    1,    /* keep_update */
+                                                    opt_method,
+                                                    treeinfo->brlen_linkage,
+                                                    treeinfo->sum_mode,
+                                                    treeinfo->parallel_context,
+                                                    treeinfo->parallel_reduce_cb);
+
+  if (!loglh)
+    return PLL_FAILURE;
+
+  if (radius && edge->next)
+  {
+    if (!algo_opt_brlen_pool_edge(treeinfo, edge->next->back, min_brlen,
+                                  max_brlen, opt_method, radius - 1) ||
+        !algo_opt_brlen_pool_edge(treeinfo, edge->next->next->back, min_brlen,
+                                  max_brlen, opt_method, radius - 1))
+      return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static double algo_opt_brlen_pool(pllmod_treeinfo_t * treeinfo,
+                                  double min_brlen,
+                                  double max_brlen,
+                                  double lh_epsilon,
+                                  int max_iters,
+                                  int opt_method,
+                                  int radius)
+{
+  pll_unode_t * start = treeinfo->root;
+  double loglh, new_loglh;
+
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+  if (isnan(loglh))
+    return (double) PLL_FAILURE;
+
+  while (max_iters--)
+  {
+    if (!algo_opt_brlen_pool_edge(treeinfo, start, min_brlen, max_brlen,
+                                  opt_method, radius))
+      return (double) PLL_FAILURE;
+
+    if (radius &&
+        !algo_opt_brlen_pool_edge(treeinfo, start->back, min_brlen, max_brlen,
+                                  opt_method, radius - 1))
+      return (double) PLL_FAILURE;
+
+    pllmod_treeinfo_set_root(treeinfo, start);
+    new_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+    if (isnan(new_loglh))
+      return (double) PLL_FAILURE;
+
+    /* check convergence */
+    if (fabs(new_loglh - loglh) < lh_epsilon)
+      max_iters = 0;
+
+    loglh = new_loglh;
+  }
+
+  return -1 * loglh;
+}
+
+/* convergence-aware branch length optimization: every pass visits the
+ * queued edges by decreasing expected LH gain, which is the sum of LH gains
+ * at adjacent edges since the last visit */
+typedef struct algo_brlen_sched_entry
+{
+  double gain;
+  unsigned int edge_index;
+} algo_brlen_sched_entry_t;
+
+static int algo_brlen_sched_cmp(const void * a, const void * b)
+{
+  const algo_brlen_sched_entry_t * ea = (const algo_brlen_sched_entry_t *) a;
+  const algo_brlen_sched_entry_t * eb = (const algo_brlen_sched_entry_t *) b;
+
+  /* highest expected gain first, ties in traversal order */
+  if (ea->gain != eb->gain)
+    return ea->gain > eb->gain ? -1 : 1;
+  return (ea->edge_index > eb->edge_index) - (ea->edge_index < eb->edge_index);
+}
+
+static void algo_brlen_sched_collect(pll_unode_t * edge,
+                                     int radius,
+                                     pll_unode_t ** edges,
+                                     unsigned int * edge_count)
+{
+  edges[(*edge_count)++] = edge;
+
+  if (radius && edge->next)
+  {
+    algo_brlen_sched_collect(edge->next->back, radius - 1, edges, edge_count);
+    algo_brlen_sched_collect(edge->next->next->back, radius - 1, edges,
+                             edge_count);
+  }
+}
+
+/* edge CLV mode keeps CLVs for all directions: once the length of an edge
+ * has changed, CLVs pointing away from it are outdated. Only the ones within
+ * the optimized region (expected_gain is not NAN) can be used by later
+ * visits; expected_gain = NULL invalidates the rest of the tree as well */
+static void algo_brlen_sched_invalidate(pllmod_treeinfo_t * treeinfo,
+                                        const double * expected_gain,
+                                        pll_unode_t * node)
+{
+  if (!node->next)
+    return;
+
+  pllmod_treeinfo_invalidate_clv(treeinfo, node->next);
+  pllmod_treeinfo_invalidate_clv(treeinfo, node->next->next);
+
+  if (!expected_gain || !isnan(expected_gain[node->next->pmatrix_index]))
+    algo_brlen_sched_invalidate(treeinfo, expected_gain, node->next->back);
+  if (!expected_gain || !isnan(expected_gain[node->next->next->pmatrix_index]))
+    algo_brlen_sched_invalidate(treeinfo, expected_gain,
+                                node->next->next->back);
+}
+
+static void algo_brlen_sched_propagate(double * expected_gain,
+                                       const pll_unode_t * node,
+                                       double gain)
+{
+  if (!node->next)
+    return;
+
+  /* NAN marks edges outside of the optimized region */
+  if (!isnan(expected_gain[node->next->pmatrix_index]))
+    expected_gain[node->next->pmatrix_index] += gain;
+  if (!isnan(expected_gain[node->next->next->pmatrix_index]))
+    expected_gain[node->next->next->pmatrix_index] += gain;
+}
+
+static double algo_opt_brlen_scheduled(pllmod_treeinfo_t * treeinfo,
+                                       double min_brlen,
+                                       double max_brlen,
+                                       double lh_epsilon,
+                                       int max_iters,
+                                       int radius)
+{
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+  const unsigned int max_edge_count = treeinfo->tree->edge_count;
+  pll_unode_t * start = treeinfo->root;
+  pll_unode_t ** edges = NULL;
+  algo_brlen_sched_entry_t * queue = NULL;
+  double * expected_gain = NULL;
+  double * old_brlen = NULL;
+  double * new_brlen = NULL;
+  double loglh, pass_gain;
+  double result = (double) PLL_FAILURE;
+  unsigned int edge_count = 0;
+  unsigned int queue_size;
+  unsigned int i, m;
+  int changed = 0;
+
+  edges = (pll_unode_t **) calloc(max_edge_count, sizeof(pll_unode_t *));
+  queue = (algo_brlen_sched_entry_t *) calloc(max_edge_count,
+                                              sizeof(algo_brlen_sched_entry_t));
+  expected_gain = (double *) malloc(max_edge_count * sizeof(double));
+  old_brlen = (double *) calloc(brlen_set_count, sizeof(double));
+  new_brlen = (double *) calloc(brlen_set_count, sizeof(double));
+  if (!edges || !queue || !expected_gain || !old_brlen || !new_brlen)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for brlen optimization queue\n");
+    goto cleanup;
+  }
+
+  /* same edges as in pllmod_opt_optimize_branch_lengths_local_multi */
+  algo_brlen_sched_collect(start, radius, edges, &edge_count);
+  if (radius && start->back->next)
+  {
+    algo_brlen_sched_collect(start->back->next->back, radius - 1, edges,
+                             &edge_count);
+    algo_brlen_sched_collect(start->back->next->next->back, radius - 1, edges,
+                             &edge_count);
+  }
+
+  for (m = 0; m < max_edge_count; ++m)
+    expected_gain[m] = (double) NAN;
+
+  /* every edge is visited in the first pass */
+  for (i = 0; i < edge_count; ++i)
+    expected_gain[edges[i]->pmatrix_index] = INFINITY;
+
+  /* branch lengths will change behind treeinfo's back */
+  pllmod_treeinfo_invalidate_outward_clvs(treeinfo);
+
+  while (max_iters--)
+  {
+    /* queue edges whose neighborhood has changed enough */
+    queue_size = 0;
+    for (i = 0; i < edge_count; ++i)
+    {
+      m = edges[i]->pmatrix_index;
+      if (expected_gain[m] >= lh_epsilon)
+      {
+        queue[queue_size].gain = expected_gain[m];
+        queue[queue_size].edge_index = i;
+        queue_size++;
+      }
+    }
+
+    if (!queue_size)
+      break;
+
+    qsort(queue, queue_size, sizeof(algo_brlen_sched_entry_t),
+          algo_brlen_sched_cmp);
+
+    pass_gain = 0.;
+    for (i = 0; i < queue_size; ++i)
+    {
+      pll_unode_t * edge = edges[queue[i].edge_index];
+      pll_unode_t * root = pllmod_utree_is_tip(edge) ? edge->back : edge;
+      double edge_loglh, new_loglh, gain;
+
+      expected_gain[edge->pmatrix_index] = 0.;
+
+      /* CLVs at both ends of the edge must be up-to-date */
+      pllmod_treeinfo_set_root(treeinfo, root);
+      edge_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+      if (isnan(edge_loglh))
+        goto cleanup;
+
+      pllmod_treeinfo_get_branch_length_all(treeinfo, root, old_brlen);
+
+      if (!pllmod_opt_optimize_branch_lengths_edges_multi(
+                                                  treeinfo->partitions,
+                                                  treeinfo->partition_count,
+                                                  &root,
+                                                  1,
+                                                  &new_loglh,
+                                                  treeinfo->param_indices,
+                                                  treeinfo->deriv_precomp,
+                                                  treeinfo->branch_lengths,
+                                                  treeinfo->brlen_scalers,
+                                                  min_brlen,
+                                                  max_brlen,
+                                                  PLLMOD_OPT_BLO_NEWTON_SAFE,
+                                                  treeinfo->brlen_linkage,
+                                                  treeinfo->sum_mode,
+                                                  treeinfo->parallel_context,
+                                                  treeinfo->parallel_reduce_cb))
+        goto cleanup;
+
+      pllmod_treeinfo_get_branch_length_all(treeinfo, root, new_brlen);
+      if (!memcmp(old_brlen, new_brlen, brlen_set_count * sizeof(double)))
+        continue;
+
+      /* CLVs towards the root do not depend on the root edge length, so the
+       * score of the optimizer is the new tree log-likelihood */
+      gain = PLL_MAX(new_loglh - edge_loglh, 0.);
+      pass_gain += gain;
+
+      algo_brlen_sched_propagate(expected_gain, root, gain);
+      algo_brlen_sched_propagate(expected_gain, root->back, gain);
+
+      changed = 1;
+      if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE)
+      {
+        algo_brlen_sched_invalidate(treeinfo, expected_gain, root);
+        algo_brlen_sched_invalidate(treeinfo, expected_gain, root->back);
+      }
+    }
+
+    DBG("Scheduled BLO: visited %u edges, skipped %u, LH gain: %f\n",
+        queue_size, edge_count - queue_size, pass_gain);
+
+    treeinfo->stats.count[PLLMOD_TREEINFO_STATS_BRLEN_SKIP] +=
+        edge_count - queue_size;
+
+    /* check convergence */
+    if (pass_gain < lh_epsilon)
+      break;
+  }
+
+  /* CLVs outside of the optimized region pointing away from it */
+  if (changed && treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE)
+  {
+    algo_brlen_sched_invalidate(treeinfo, NULL, start);
+    algo_brlen_sched_invalidate(treeinfo, NULL, start->back);
+  }
+
+  pllmod_treeinfo_set_root(treeinfo, start);
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+  if (!isnan(loglh))
+    result = -1 * loglh;
+
+cleanup:
+  free(edges);
+  free(queue);
+  free(expected_gain);
+  free(old_brlen);
+  free(new_brlen);
+
+  return result;
+}
+
+static double algo_opt_brlen(pllmod_treeinfo_t * treeinfo,
+                             double min_brlen,
+                             double max_brlen,
+                             double lh_epsilon,
+                             int max_iters,
+                             int opt_method,
+                             int radius)
+{
+  double loglh;
+
+  if (opt_method == PLLMOD_OPT_BLO_NEWTON_SCHEDULED)
+  {
+    loglh = algo_opt_brlen_scheduled(treeinfo, min_brlen, max_brlen,
+                                     lh_epsilon, max_iters, radius);
+  }
+  else if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+  {
+    loglh = algo_opt_brlen_pool(treeinfo, min_brlen, max_brlen, lh_epsilon,
+                                max_iters, opt_method, radius);
+  }
+  else
+  {
+    /* branch lengths will change behind treeinfo's back */
+    pllmod_treeinfo_invalidate_outward_clvs(treeinfo);
+
+    if (treeinfo->deriv_precomp_edges)
+    {
+      /* reuse sumtables of branches whose CLVs did not change */
+      pllmod_opt_sumtable_cache_t sumtable_cache;
+      sumtable_cache.sumtables = treeinfo->deriv_precomp_edges;
+      sumtable_cache.stamp = treeinfo->deriv_precomp_stamp;
+      sumtable_cache.version = treeinfo->clv_version;
+
+      loglh = pllmod_opt_optimize_branch_lengths_local_cached(treeinfo->partitions,
+                                                          treeinfo->partition_count,
+                                                          treeinfo->root,
+                                                          treeinfo->param_indices,
+                                                          &sumtable_cache,
+                                                          treeinfo->branch_lengths,
+                                                          treeinfo->brlen_scalers,
+                                                          min_brlen,
+                                                          max_brlen,
+                                                          lh_epsilon,
+                                                          max_iters,
+                                                          radius,
+                                                          1,    /* keep_update */
+                                                          opt_method,
+                                                          treeinfo->brlen_linkage,
+                                                          treeinfo->sum_mode,
+                                                          treeinfo->parallel_context,
+                                                          treeinfo->parallel_reduce_cb
+                                                          );
+
+      treeinfo->clv_version = sumtable_cache.version;
+    }
+    else
+    {
+      loglh = pllmod_opt_optimize_branch_lengths_local_multi_mode(treeinfo->partitions,
+                                                               treeinfo->partition_count,
+                                                               treeinfo->root,
+                                                               treeinfo->param_indices,
+                                                               treeinfo->deriv_precomp,
+                                                               treeinfo->branch_lengths,
+                                                               treeinfo->brlen_scalers,
+                                                               min_brlen,
+                                                               max_brlen,
+                                                               lh_epsilon,
+                                                               max_iters,
+                                                               radius,
+                                                               1,    /* keep_update */
+                                                               opt_method,
+                                                               treeinfo->brlen_linkage,
+                                                               treeinfo->sum_mode,
+                                                               treeinfo->parallel_context,
+                                                               treeinfo->parallel_reduce_cb
+                                                               );
+    }
+  }
+
+  /* p-matrices have been updated behind treeinfo's back as well */
+  pllmod_treeinfo_sync_pmatrix_cache(treeinfo);
+
+  return loglh;
+}
+
+/**
+ * Optimize branch lengths within `radius` of the treeinfo root.
+ *
+ * With `opt_method` PLLMOD_OPT_BLO_NEWTON_SCHEDULED, branches are not swept
+ * in a fixed order: every pass only visits the branches whose adjacent
+ * branches gained at least `lh_epsilon` log-likelihood units since their
+ * last visit, highest gain first, so converged regions of the tree are
+ * skipped. Visits saved this way are counted in the
+ * PLLMOD_TREEINFO_STATS_BRLEN_SKIP statistics.
+ *
+ * @return the negative log-likelihood after optimization, or
+ *         PLL_FAILURE (0) on error
+ */
 PLL_EXPORT
 double pllmod_algo_opt_brlen_treeinfo(pllmod_treeinfo_t * treeinfo,
                                       double min_brlen,
@@ -1835,23 +2516,274 @@ double pllmod_algo_opt_brlen_treeinfo(pllmod_treeinfo_t * treeinfo,
                                       int opt_method,
                                       int radius)
 {
-  return pllmod_opt_optimize_branch_lengths_local_multi(treeinfo->partitions,
+  const double start_time = pllmod_time_wall();
+  double loglh;
+
+  loglh = algo_opt_brlen(treeinfo, min_brlen, max_brlen, lh_epsilon,
+                         max_iters, opt_method, radius);
+
+  treeinfo->stats.count[PLLMOD_TREEINFO_STATS_BRLEN]++;
+  treeinfo->stats.time[PLLMOD_TREEINFO_STATS_BRLEN] +=
+      pllmod_time_wall() - start_time;
+
+  return loglh;
+}
+
+/* parallel (Jacobi-style) branch length optimization: edges are split into
+ * chunks, and every thread uses its own sumtables */
+typedef struct algo_brlen_parallel
+{
+  pllmod_treeinfo_t * treeinfo;
+  pll_unode_t ** edges;
+  unsigned int edge_count;
+  unsigned int chunk_size;
+  double *** precomp;  /* thread_index -> per-partition sumtables */
+  double min_brlen;
+  double max_brlen;
+  int opt_method;
+} algo_brlen_parallel_t;
+
+static int algo_brlen_parallel_task(void * data,
+                                    unsigned int task_index,
+                                    unsigned int thread_index)
+{
+  algo_brlen_parallel_t * ctx = (algo_brlen_parallel_t *) data;
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  unsigned int first = task_index * ctx->chunk_size;
+  unsigned int count = PLL_MIN(ctx->chunk_size, ctx->edge_count - first);
+
+  return pllmod_opt_optimize_branch_lengths_edges_multi(treeinfo->partitions,
                                                         treeinfo->partition_count,
-                                                        treeinfo->root,
+                                                        ctx->edges + first,
+                                                        count,
+                                                        NULL,
                                                         treeinfo->param_indices,
-                                                        treeinfo->deriv_precomp,
+                                                        ctx->precomp[thread_index],
                                                         treeinfo->branch_lengths,
                                                         treeinfo->brlen_scalers,
-                                                        min_brlen,
-                                                        max_brlen,
-                                                        lh_epsilon,
-                                                        max_iters,
-                                                        radius,
-                                                        1,    /* keep_update */
-                                                        opt_method,
+                                                        ctx->min_brlen,
+                                                        ctx->max_brlen,
+                                                        ctx->opt_method,
                                                         treeinfo->brlen_linkage,
+                                                        treeinfo->sum_mode,
                                                         treeinfo->parallel_context,
-                                                        treeinfo->parallel_reduce_cb
-                                                        );
+                                                        treeinfo->parallel_reduce_cb);
+}
+
+/* thread 0 uses treeinfo's sumtables, the others get their own */
+static void algo_brlen_parallel_free(algo_brlen_parallel_t * ctx,
+                                     unsigned int thread_count)
+{
+  unsigned int t, p;
+
+  if (ctx->precomp)
+  {
+    for (t = 1; t < thread_count; ++t)
+    {
+      if (!ctx->precomp[t])
+        continue;
+
+      for (p = 0; p < ctx->treeinfo->partition_count; ++p)
+        pll_aligned_free(ctx->precomp[t][p]);
+      free(ctx->precomp[t]);
+    }
+    free(ctx->precomp);
+  }
+
+  free(ctx->edges);
+}
+
+static int algo_brlen_parallel_alloc(algo_brlen_parallel_t * ctx,
+                                     unsigned int thread_count)
+{
+  pllmod_treeinfo_t * treeinfo = ctx->treeinfo;
+  unsigned int i, t, p;
+
+  ctx->edges = (pll_unode_t **) calloc(treeinfo->tree->edge_count,
+                                       sizeof(pll_unode_t *));
+  ctx->precomp = (double ***) calloc(thread_count, sizeof(double **));
+  if (!ctx->edges || !ctx->precomp)
+    return PLL_FAILURE;
+
+  /* every edge once, in the same order on all ranks */
+  ctx->edge_count = 0;
+  for (i = 0; i < treeinfo->subnode_count; ++i)
+  {
+    pll_unode_t * node = treeinfo->subnodes[i];
+    if (node->next && (!node->back->next ||
+                       node->node_index < node->back->node_index))
+      ctx->edges[ctx->edge_count++] = node;
+  }
+  assert(ctx->edge_count == treeinfo->tree->edge_count);
+
+  ctx->precomp[0] = treeinfo->deriv_precomp;
+  for (t = 1; t < thread_count; ++t)
+  {
+    ctx->precomp[t] = (double **) calloc(treeinfo->partition_count,
+                                         sizeof(double *));
+    if (!ctx->precomp[t])
+      return PLL_FAILURE;
+
+    for (p = 0; p < treeinfo->partition_count; ++p)
+    {
+      const pll_partition_t * partition = treeinfo->partitions[p];
+
+      /* skip remote partitions */
+      if (!partition)
+        continue;
+
+      unsigned int sites_alloc = partition->sites;
+      if (partition->attributes & PLL_ATTRIB_AB_FLAG)
+        sites_alloc += partition->states;
+
+      ctx->precomp[t][p] = (double *) pll_aligned_alloc(
+                 sites_alloc * partition->rate_cats * partition->states_padded *
+                 sizeof(double), partition->alignment);
+      if (!ctx->precomp[t][p])
+        return PLL_FAILURE;
+    }
+  }
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Optimize all branch lengths, with many branches optimized concurrently.
+ *
+ * Every iteration computes the CLVs for both directions of all edges (see
+ * pllmod_treeinfo_compute_clvs_alledges(); requires edge CLV mode), and
+ * then optimizes every branch with the other branch lengths fixed
+ * (pllmod_opt_optimize_branch_lengths_edges_multi()). Branches are
+ * distributed over the treeinfo thread pool (see
+ * pllmod_treeinfo_set_thread_count()), so sumtable and derivative
+ * computations of different branches run in parallel.
+ *
+ * As in pllmod_algo_opt_brlen_treeinfo(), iterations stop after `max_iters`
+ * or once the log-likelihood improves by less than `lh_epsilon`. If an
+ * iteration decreases the log-likelihood, which can happen since all
+ * branches are updated at once, its branch lengths are reverted and the
+ * remaining iterations are done with pllmod_algo_opt_brlen_treeinfo().
+ *
+ * With a parallel reduction callback (MPI), branches are optimized one
+ * after another by the calling thread, in the same order on all ranks.
+ *
+ * @return the negative log-likelihood after optimization, or
+ *         PLL_FAILURE (0) on error
+ */
+PLL_EXPORT
+double pllmod_algo_opt_brlen_treeinfo_parallel(pllmod_treeinfo_t * treeinfo,
+                                               double min_brlen,
+                                               double max_brlen,
+                                               double lh_epsilon,
+                                               int max_iters,
+                                               int opt_method)
+{
+  const double start_time = pllmod_time_wall();
+  const unsigned int brlen_set_count =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ?
+          treeinfo->init_partition_count : 1;
+  pllmod_thread_pool_t * pool = treeinfo->parallel_reduce_cb ? NULL :
+      (pllmod_thread_pool_t *) treeinfo->thread_pool;
+  const unsigned int thread_count = pllmod_thread_pool_size(pool);
+  algo_brlen_parallel_t ctx;
+  double * saved_brlen = NULL;
+  double loglh, new_loglh;
+  double result = (double) PLL_FAILURE;
+  unsigned int i, task_count;
+
+  if (treeinfo->clv_mode != PLLMOD_TREEINFO_CLV_EDGE)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Parallel branch length optimization requires "
+                     "edge CLV mode\n");
+    return (double) PLL_FAILURE;
+  }
+
+  memset(&ctx, 0, sizeof(algo_brlen_parallel_t));
+  ctx.treeinfo = treeinfo;
+  ctx.min_brlen = min_brlen;
+  ctx.max_brlen = max_brlen;
+  ctx.opt_method = opt_method;
+
+  saved_brlen = (double *) malloc(treeinfo->tree->edge_count * brlen_set_count *
+                                  sizeof(double));
+  if (!saved_brlen || !algo_brlen_parallel_alloc(&ctx, thread_count))
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for parallel brlen optimization\n");
+    goto cleanup;
+  }
+
+  /* a few chunks per thread to balance the load */
+  task_count = PLL_MIN(ctx.edge_count, 4 * thread_count);
+  ctx.chunk_size = (ctx.edge_count + task_count - 1) / task_count;
+  task_count = (ctx.edge_count + ctx.chunk_size - 1) / ctx.chunk_size;
+
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+  if (isnan(loglh))
+    goto cleanup;
+
+  while (max_iters > 0)
+  {
+    if (!pllmod_treeinfo_compute_clvs_alledges(treeinfo))
+      goto cleanup;
+
+    for (i = 0; i < ctx.edge_count; ++i)
+    {
+      pllmod_treeinfo_get_branch_length_all(treeinfo, ctx.edges[i],
+                                            saved_brlen + i * brlen_set_count);
+    }
+
+    if (!pllmod_thread_pool_run(pool, task_count, algo_brlen_parallel_task,
+                                &ctx))
+      goto cleanup;
+
+    /* p-matrices are up-to-date, but all CLVs are outdated */
+    pllmod_treeinfo_sync_pmatrix_cache(treeinfo);
+    for (i = 0; i < treeinfo->subnode_count; ++i)
+      pllmod_treeinfo_invalidate_clv(treeinfo, treeinfo->subnodes[i]);
+
+    new_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+    if (isnan(new_loglh))
+      goto cleanup;
+
+    max_iters--;
+
+    if (new_loglh < loglh)
+    {
+      /* overshooting: continue with the sequential schedule */
+      for (i = 0; i < ctx.edge_count; ++i)
+      {
+        pllmod_treeinfo_set_branch_length_all(treeinfo, ctx.edges[i],
+                                              saved_brlen + i * brlen_set_count);
+        pllmod_treeinfo_invalidate_pmatrix(treeinfo, ctx.edges[i]);
+      }
+
+      if (isnan(pllmod_treeinfo_compute_loglh(treeinfo, 1)))
+        goto cleanup;
+
+      result = algo_opt_brlen(treeinfo, min_brlen, max_brlen, lh_epsilon,
+                              max_iters + 1, opt_method,
+                              PLLMOD_OPT_BRLEN_OPTIMIZE_ALL);
+      goto cleanup;
+    }
+
+    /* check convergence */
+    if (new_loglh - loglh < lh_epsilon)
+      max_iters = 0;
+
+    loglh = new_loglh;
+  }
+
+  result = -1 * loglh;
+
+cleanup:
+  algo_brlen_parallel_free(&ctx, thread_count);
+  free(saved_brlen);
+
+  treeinfo->stats.count[PLLMOD_TREEINFO_STATS_BRLEN]++;
+  treeinfo->stats.time[PLLMOD_TREEINFO_STATS_BRLEN] +=
+      pllmod_time_wall() - start_time;
 
+  return result;
 }
@@ -32,6 +32,10 @@
 // it's actually defined in lbfgsb.h, but not exported from the optimize module
 #define PLLMOD_ALGO_LBFGSB_ERROR       1.0e-4
 
+/* starting tree types of the multi-start search */
+#define PLLMOD_ALGO_START_RANDOM        0
+#define PLLMOD_ALGO_START_PARSIMONY     1
+
 #ifdef DEBUG
     #define DBG(fmt, ...) do { printf(fmt, ##__VA_ARGS__); } while(0)
 #else
@@ -46,6 +50,142 @@ typedef struct cutoff_info
   int lh_dec_count;
 } cutoff_info_t;
 
+/* reusable buffers of the SPR round
+ * (see pllmod_algo_spr_workspace_create()) */
+typedef struct pllmod_spr_workspace pllmod_spr_workspace_t;
+
+/* statistics of the last adaptive SPR round */
+typedef struct spr_adaptive_stats
+{
+  unsigned int subtrees;           /* pruned subtrees */
+  unsigned int subtrees_skipped;   /* subtrees skipped as hopeless */
+  unsigned int subtrees_improved;  /* subtrees with an improving regraft */
+  unsigned long regrafts;          /* regraft positions evaluated */
+  unsigned int radius;             /* default radius used in the round */
+  double drop_cutoff;              /* LH drop above which subtrees are skipped */
+} pllmod_spr_adaptive_stats_t;
+
+/* state of the adaptive SPR search, kept across rounds
+ * (see pllmod_algo_spr_adaptive_create()) */
+typedef struct spr_adaptive
+{
+  /* settings */
+  double radius_quantile;
+  double skip_quantile;
+  unsigned int skip_rounds;
+
+  pllmod_spr_adaptive_stats_t stats;
+
+  unsigned int round;
+
+  /* number of improvements found at every regraft distance so far */
+  unsigned int hist_size;
+  unsigned long * improve_hist;
+
+  /* per prune node (node_index) */
+  unsigned int node_count;
+  unsigned int * last_round;      /* last round the subtree was pruned in */
+  unsigned int * skip_round;      /* last round the subtree was skipped in */
+  unsigned int * improve_round;   /* last round with an improving regraft */
+  unsigned int * improve_dist;    /* regraft distance of the last improvement */
+  unsigned int * fail_count;      /* consecutive rounds without improvement */
+  unsigned int * regraft_count;   /* regraft positions in the last round */
+  double * best_drop;             /* LH drop of the best regraft */
+  double * drop_buf;
+} pllmod_spr_adaptive_t;
+
+/* state of a multi-round SPR search, carried across rounds
+ * (see pllmod_algo_search_session_create()) */
+typedef struct search_session
+{
+  /* settings, can be changed between rounds
+   * (ntopol_keep must not exceed its value at creation) */
+  unsigned int radius_min;
+  unsigned int radius_max;
+  unsigned int ntopol_keep;
+  pll_bool_t thorough;
+  int brlen_opt_method;
+  double bl_min;
+  double bl_max;
+  int smoothings;
+  double epsilon;
+  double subtree_cutoff;          /* 0 = no LH cutoff */
+
+  cutoff_info_t cutoff_info;
+
+  /* results of the last round */
+  unsigned int round;
+  unsigned int subtrees_skipped;  /* unchanged since their last failure */
+  double loglh;
+
+  /* internal state */
+  pllmod_treeinfo_t * treeinfo;
+  pllmod_spr_workspace_t * workspace;
+  unsigned int node_count;
+  unsigned char * node_state;     /* per prune node (node_index) */
+  unsigned int * node_back;       /* neighbor node_index after the last round */
+  unsigned int * node_dist;
+  pll_unode_t ** queue;
+  pll_bool_t warm;                /* CLVs are valid since the last round */
+} pllmod_search_session_t;
+
+/* multi-start search callback, called concurrently for different starts */
+typedef double (*pllmod_multistart_optimize_cb)(pllmod_treeinfo_t * treeinfo,
+                                                unsigned int start_index,
+                                                void * data);
+
+/* settings of the multi-start search
+ * (see pllmod_algo_multistart_search()) */
+typedef struct multistart_params
+{
+  unsigned int random_starts;
+  unsigned int parsimony_starts;
+  unsigned int random_seed;       /* seed of start i is random_seed + i */
+  unsigned int thread_count;
+
+  /* taxa, and partitions for parsimony starting trees (used read-only) */
+  unsigned int tip_count;
+  char * const * tip_names;
+  unsigned int partition_count;
+  pll_partition_t * const * partitions;
+
+  /* SPR rounds, see pllmod_algo_spr_round() */
+  unsigned int radius_min;
+  unsigned int radius_max;
+  unsigned int ntopol_keep;
+  pll_bool_t thorough;
+  int brlen_opt_method;
+  double bl_min;
+  double bl_max;
+  int smoothings;
+  double epsilon;
+  double subtree_cutoff;
+
+  /* stop after max_rounds, or when a round improves logLH by less than
+   * lh_epsilon */
+  unsigned int max_rounds;
+  double lh_epsilon;
+
+  /* partitions and model, cloned onto every starting tree (used read-only,
+   * see pllmod_treeinfo_clone_tree()) */
+  const pllmod_treeinfo_t * treeinfo;
+
+  pllmod_multistart_optimize_cb optimize_model;   /* optional */
+  void * cb_data;
+} pllmod_multistart_params_t;
+
+/* result of a single start */
+typedef struct multistart_result
+{
+  unsigned int start_index;
+  int start_type;                 /* PLLMOD_ALGO_START_* */
+  unsigned int seed;
+  unsigned int rounds;
+  double loglh;                   /* logLH of `tree` */
+  pll_utree_t * tree;             /* final tree, NULL on error */
+  int error_code;                 /* 0 if the search succeeded */
+} pllmod_multistart_result_t;
+
 typedef int (*treeinfo_param_set_cb)(pllmod_treeinfo_t * treeinfo,
                                      unsigned int  part_num,
                                      const double * param_vals,
@@ -156,6 +296,15 @@ double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
                                              double bfgs_factor,
                                              double tolerance);
 
+PLL_EXPORT
+double pllmod_algo_opt_subst_rates_treeinfo_parallel(pllmod_treeinfo_t ** treeinfo_list,
+                                                     unsigned int worker_count,
+                                                     unsigned int params_index,
+                                                     double min_rate,
+                                                     double max_rate,
+                                                     double bfgs_factor,
+                                                     double tolerance);
+
 PLL_EXPORT
 double pllmod_algo_opt_frequencies_treeinfo (pllmod_treeinfo_t * treeinfo,
                                              unsigned int params_index,
@@ -173,6 +322,16 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
                                                double bfgs_factor,
                                                double tolerance);
 
+PLL_EXPORT
+double pllmod_algo_opt_rates_weights_treeinfo_parallel(pllmod_treeinfo_t ** treeinfo_list,
+                                                       unsigned int worker_count,
+                                                       double min_rate,
+                                                       double max_rate,
+                                                       double min_brlen,
+                                                       double max_brlen,
+                                                       double bfgs_factor,
+                                                       double tolerance);
+
 PLL_EXPORT
 double pllmod_algo_opt_alpha_pinv_treeinfo(pllmod_treeinfo_t * treeinfo,
                                            unsigned int params_index,
@@ -201,6 +360,14 @@ double pllmod_algo_opt_brlen_treeinfo(pllmod_treeinfo_t * treeinfo,
                                       int opt_method,
                                       int radius);
 
+PLL_EXPORT
+double pllmod_algo_opt_brlen_treeinfo_parallel(pllmod_treeinfo_t * treeinfo,
+                                               double min_brlen,
+                                               double max_brlen,
+                                               double lh_epsilon,
+                                               int max_iters,
+                                               int opt_method);
+
 /* search */
 
 PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
@@ -216,4 +383,106 @@ PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
                                         cutoff_info_t * cutoff_info,
                                         double subtree_cutoff);
 
+PLL_EXPORT double pllmod_algo_spr_round_parallel(pllmod_treeinfo_t ** treeinfo_list,
+                                                 unsigned int worker_count,
+                                                 unsigned int radius_min,
+                                                 unsigned int radius_max,
+                                                 unsigned int ntopol_keep,
+                                                 pll_bool_t thorough,
+                                                 int brlen_opt_method,
+                                                 double bl_min,
+                                                 double bl_max,
+                                                 int smoothings,
+                                                 double epsilon,
+                                                 cutoff_info_t * cutoff_info,
+                                                 double subtree_cutoff);
+
+PLL_EXPORT pllmod_spr_workspace_t *
+pllmod_algo_spr_workspace_create(const pllmod_treeinfo_t * treeinfo,
+                                 unsigned int ntopol_keep);
+
+PLL_EXPORT void pllmod_algo_spr_workspace_destroy(pllmod_spr_workspace_t * workspace);
+
+PLL_EXPORT double pllmod_algo_spr_round_workspace(pllmod_treeinfo_t * treeinfo,
+                                                  unsigned int radius_min,
+                                                  unsigned int radius_max,
+                                                  unsigned int ntopol_keep,
+                                                  pll_bool_t thorough,
+                                                  int brlen_opt_method,
+                                                  double bl_min,
+                                                  double bl_max,
+                                                  int smoothings,
+                                                  double epsilon,
+                                                  cutoff_info_t * cutoff_info,
+                                                  double subtree_cutoff,
+                                                  pllmod_spr_workspace_t * workspace);
+
+PLL_EXPORT pllmod_spr_adaptive_t *
+pllmod_algo_spr_adaptive_create(const pllmod_treeinfo_t * treeinfo,
+                                double radius_quantile,
+                                double skip_quantile,
+                                unsigned int skip_rounds);
+
+PLL_EXPORT void pllmod_algo_spr_adaptive_destroy(pllmod_spr_adaptive_t * adaptive);
+
+PLL_EXPORT double pllmod_algo_spr_round_adaptive(pllmod_treeinfo_t * treeinfo,
+                                                 unsigned int radius_min,
+                                                 unsigned int radius_max,
+                                                 unsigned int ntopol_keep,
+                                                 pll_bool_t thorough,
+                                                 int brlen_opt_method,
+                                                 double bl_min,
+                                                 double bl_max,
+                                                 int smoothings,
+                                                 double epsilon,
+                                                 cutoff_info_t * cutoff_info,
+                                                 double subtree_cutoff,
+                                                 pllmod_spr_adaptive_t * adaptive);
+
+PLL_EXPORT pllmod_search_session_t *
+pllmod_algo_search_session_create(pllmod_treeinfo_t * treeinfo,
+                                  unsigned int radius_min,
+                                  unsigned int radius_max,
+                                  unsigned int ntopol_keep,
+                                  pll_bool_t thorough,
+                                  int brlen_opt_method,
+                                  double bl_min,
+                                  double bl_max,
+                                  int smoothings,
+                                  double epsilon,
+                                  double subtree_cutoff);
+
+PLL_EXPORT double pllmod_algo_search_session_round(pllmod_search_session_t * session);
+
+PLL_EXPORT void pllmod_algo_search_session_reset(pllmod_search_session_t * session);
+
+PLL_EXPORT void pllmod_algo_search_session_destroy(pllmod_search_session_t * session);
+
+PLL_EXPORT pllmod_multistart_result_t *
+pllmod_algo_multistart_search(const pllmod_multistart_params_t * params);
+
+PLL_EXPORT void pllmod_algo_multistart_destroy(pllmod_multistart_result_t * results,
+                                               unsigned int count);
+
+PLL_EXPORT double pllmod_algo_tbr_round(pllmod_treeinfo_t * treeinfo,
+                                        unsigned int radius_min,
+                                        unsigned int radius_max,
+                                        unsigned int ntopol_keep,
+                                        pll_bool_t thorough,
+                                        int brlen_opt_method,
+                                        double bl_min,
+                                        double bl_max,
+                                        int smoothings,
+                                        double epsilon,
+                                        cutoff_info_t * cutoff_info,
+                                        double subtree_cutoff);
+
+PLL_EXPORT double pllmod_algo_nni_round(pllmod_treeinfo_t * treeinfo,
+                                        pll_bool_t thorough,
+                                        int brlen_opt_method,
+                                        double bl_min,
+                                        double bl_max,
+                                        int smoothings,
+                                        double epsilon);
+
 #endif
@@ -118,6 +118,10 @@ PLL_EXPORT double pllmod_opt_minimize_newton(double xmin,
  * and it requires 4 parameters: (1) custom data (if needed), (2) the value at
  * which derivatives are computed, and (3,4) lower and upper bounds.
  *
+ * Converged functions are dropped from the iteration, so a step only costs as
+ * much as the functions still being optimized. The derivative function can
+ * skip them too, through the `converged` flags.
+ *
  * @param  xnum       number of functions/variables to optimize
  * @param  xmin       lower bound
  * @param  xguess     in=first guess for the free variables, out=optimized values
@@ -142,9 +146,9 @@ PLL_EXPORT int pllmod_opt_minimize_newton_multi(unsigned int xnum,
                                                           double *,
                                                           double *, double *))
 {
-  unsigned int i;
+  unsigned int i, k;
   unsigned int iter = 0;
-  int all_converged = 0;
+  unsigned int active_count = 0;
   int error_flag = 0;
 
   double dxmax = xmax / max_iters;
@@ -153,6 +157,8 @@ PLL_EXPORT int pllmod_opt_minimize_newton_multi(unsigned int xnum,
   double * xh = (double *) calloc(xnum, sizeof(double));
   double * f = (double *) calloc(xnum, sizeof(double));
   double * df = (double *) calloc(xnum, sizeof(double));
+  unsigned int * active = (unsigned int *) calloc(xnum, sizeof(unsigned int));
+  int * done = (int *) calloc(xnum, sizeof(int));
   int * int_converged = NULL;
   double * x = xguess;
 
@@ -165,15 +171,26 @@ PLL_EXPORT int pllmod_opt_minimize_newton_multi(unsigned int xnum,
     converged = int_converged;
   }
 
-  for (i = 0; i < xnum; i++)
+  if (xnum && (!xl || !xh || !f || !df || !active || !done || !converged))
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for Newton-Raphson buffers");
+    error_flag = 1;
+  }
+
+  for (i = 0; i < xnum && !error_flag; i++)
   {
     x[i] = PLL_MAX(PLL_MIN(x[i], xmax), xmin);
 
     xl[i] = xmin;
     xh[i] = xmax;
+
+    /* only functions which are not converged yet are iterated */
+    if (!converged[i])
+      active[active_count++] = i;
   }
 
-  while (!all_converged && !error_flag)
+  while (active_count && !error_flag)
   {
     if (iter++ > max_iters)
     {
@@ -186,15 +203,9 @@ PLL_EXPORT int pllmod_opt_minimize_newton_multi(unsigned int xnum,
     /* compute derivative for *all* functions in parallel */
     deriv_func((void *)params, x, f, df);
 
-    /* for every function: check convergence and make the next guess */
-    all_converged = 1;
-    for (i = 0; i < xnum; i++)
+    for (k = 0; k < active_count; k++)
     {
-      double dx;
-
-      if (converged[i])
-        continue;
-
+      i = active[k];
       if (!isfinite(f[i]) || !isfinite(df[i]))
       {
         DBG("[it=%u][NR deriv][p=%u] BL=%.9f   f=%.12f  df=%.12f\n",
@@ -204,57 +215,60 @@ PLL_EXPORT int pllmod_opt_minimize_newton_multi(unsigned int xnum,
         error_flag = 1;
         break;
       }
+    }
 
-      if (df[i] > 0.0)
-      {
-        if (fabs (f[i]) < tolerance)
-        {
-          converged[i] = 1;
-          continue;
-        }
+    if (error_flag)
+      break;
 
-        if (f[i] < 0.0)
-          xl[i] = x[i];
-        else
-          xh[i] = x[i];
+    /* Newton step for all active functions at once: branch-free, so that
+     * the compiler can vectorize it. The bracket is only narrowed where the
+     * function is convex, elsewhere we walk downhill */
+    for (k = 0; k < active_count; k++)
+    {
+      i = active[k];
 
-        dx = -1 * f[i] / df[i];
-      }
-      else
-      {
-        dx = -1 * f[i] / fabs(df[i]);
-      }
+      const int convex = df[i] > 0.0;
+      double dx = -1 * f[i] / fabs(df[i]);
+
+      done[k] = convex && fabs(f[i]) < tolerance;
+      xl[i] = (convex && f[i] < 0.0) ? x[i] : xl[i];
+      xh[i] = (convex && f[i] >= 0.0) ? x[i] : xh[i];
 
       dx = PLL_MAX(PLL_MIN(dx, dxmax), -dxmax);
+      dx = PLL_MIN(PLL_MAX(dx, xl[i] - x[i]), xh[i] - x[i]);
 
-      if (x[i]+dx < xl[i]) dx = xl[i]-x[i];
-      if (x[i]+dx > xh[i]) dx = xh[i]-x[i];
+      done[k] |= fabs(dx) < tolerance;
 
-      if (fabs (dx) < tolerance)
-      {
+      x[i] = done[k] ? x[i] : PLL_MAX(PLL_MIN(x[i] + dx, xmax), xmin);
+    }
+
+    /* drop converged functions from the active set */
+    unsigned int next_count = 0;
+    for (k = 0; k < active_count; k++)
+    {
+      i = active[k];
+      if (done[k])
         converged[i] = 1;
-        continue;
+      else
+      {
+        DBG("[it=%u][NR deriv][p=%u] f=%.12f  df=%.12f  nextBL=%.9f\n",
+            iter, i, f[i], df[i], x[i]);
+        active[next_count++] = i;
       }
-
-      DBG("[it=%u][NR deriv][p=%u] BL=%.9f   f=%.12f  df=%.12f  nextBL=%.9f\n",
-          iter, i, x[i], f[i], df[i], x[i]+dx);
-
-      x[i] += dx;
-
-      x[i] = PLL_MAX(PLL_MIN(x[i], xmax), xmin);
-
-      all_converged &= converged[i];
     }
+    active_count = next_count;
   }
 
   free(xl);
   free(xh);
   free(f);
   free(df);
+  free(active);
+  free(done);
   if (int_converged)
     free(int_converged);
 
-  if (all_converged && !error_flag)
+  if (!active_count && !error_flag)
     return PLL_SUCCESS;
   else
     return PLL_FAILURE;
@@ -388,46 +402,61 @@ PLL_EXPORT double pllmod_opt_minimize_newton_old(double x1,
 /* L-BFGS-B OPTIMIZATION */
 /******************************************************************************/
 
-/**
- * Minimize a multi-parameter function using L-BFGS-B.
- *
- * The target function must compute the score at a certain state,
- * and it requires 2 parameters: (1) custom data (if needed),
- * and (2) the values at which score is computed.
- *
- * @param  x[in,out]   first guess and result of the minimization process
- * @param  xmin        lower bound for each of the variables
- * @param  xmax        upper bound for each of the variables
- * @param  bound       bound type (PLL_LBFGSB_BOUND_[NONE|LOWER|UPPER|BOTH]
- * @param  n           number of variables
- * @param  factr       convergence tolerance for L-BFGS-B relative to machine epsilon
- * @param  pgtol       absolute gradient tolerance for L-BFGS-B
- * @param  params      custom parameters required by the target function
- * @param  target_funk target function
- *
- * `factr` is a double precision variable. The iteration will stop when
- * (f^k - f^{k+1})/max{|f^k|,|f^{k+1}|,1} <= factr*epsmch
- * where epsmch is the machine epsilon
- *
- * `pgtol` is a double precision variable. The iteration will stop when
- * max{|proj g_i | i = 1, ..., n} <= pgtol
- * where pg_i is the ith component of the projected gradient.
- *
- * @return             the minimal score found
- */
-PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
-                                             double * xmin,
-                                             double * xmax,
-                                             int * bound,
-                                             unsigned int n,
-                                             double factr,
-                                             double pgtol,
-                                             void * params,
-                                             double (*target_funk)(
-                                                     void *,
-                                                     double *))
+/* finite-difference gradient evaluated concurrently: every thread perturbs
+ * its own copy of x and calls the target function with its own parameters */
+typedef struct lbfgsb_fd_context
+{
+  void ** params;
+  double (*target_funk)(void *, double *);
+  unsigned int n;
+  double * xbuf;    /* copy of x for each thread */
+  double * g;
+  double score;
+} lbfgsb_fd_context_t;
+
+static int lbfgsb_fd_task(void * data,
+                          unsigned int task_index,
+                          unsigned int thread_index)
+{
+  lbfgsb_fd_context_t * fd = (lbfgsb_fd_context_t *) data;
+  double * x = fd->xbuf + (size_t) thread_index * fd->n;
+  const unsigned int i = task_index;
+  double h, temp;
+
+  temp = x[i];
+  h = PLL_LBFGSB_ERROR * fabs (temp);
+  if (h < 1e-12)
+    h = PLL_LBFGSB_ERROR;
+
+  x[i] = temp + h;
+  h = x[i] - temp;
+  double lnderiv = fd->target_funk(fd->params[thread_index], x);
+
+  fd->g[i] = (lnderiv - fd->score) / h;
+
+  /* reset variable */
+  x[i] = temp;
+
+  return PLL_SUCCESS;
+}
+
+static double minimize_lbfgsb(double * x,
+                              double * xmin,
+                              double * xmax,
+                              int * bound,
+                              unsigned int n,
+                              double factr,
+                              double pgtol,
+                              void * params,
+                              void ** thread_params,
+                              pllmod_thread_pool_t * pool,
+                              double (*target_funk)(void *, double *))
 {
   unsigned int i;
+  const unsigned int thread_count = thread_params ?
+                                        pllmod_thread_pool_size(pool) : 0;
+  int failed = 0;
+  lbfgsb_fd_context_t fd;
 
   /* L-BFGS-B parameters */
   //  double initial_score;
@@ -476,6 +505,26 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
     return (double) -INFINITY;
   }
 
+  fd.params = thread_params;
+  fd.target_funk = target_funk;
+  fd.n = n;
+  fd.xbuf = NULL;
+  fd.g = g;
+
+  if (thread_count)
+  {
+    fd.xbuf = (double *) calloc ((size_t) thread_count * n, sizeof(double));
+    if (!fd.xbuf)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for l-bfgs-b variables");
+      free (g);
+      free (iwa);
+      free (wa);
+      return (double) -INFINITY;
+    }
+  }
+
 //  double initial_score = target_funk (params, x);
   int continue_opt = 1;
   while (continue_opt)
@@ -497,8 +546,21 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
       if (is_nan(score) || d_equals(score, (double) -INFINITY))
         break;
 
+      if (thread_count)
+      {
+        /* perturbed points are independent -> evaluate them concurrently */
+        for (i = 0; i < thread_count; i++)
+          memcpy(fd.xbuf + (size_t) i * n, x, n * sizeof(double));
+        fd.score = score;
+        if (!pllmod_thread_pool_run(pool, n, lbfgsb_fd_task, &fd))
+        {
+          failed = 1;
+          break;
+        }
+      }
+
       double h, temp;
-      for (i = 0; i < n; i++)
+      for (i = 0; i < n && !thread_count; i++)
       {
         temp = x[i];
         h = PLL_LBFGSB_ERROR * fabs (temp);
@@ -520,8 +582,9 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
   }
 
   /* fix optimal parameters */
-  score = target_funk(params, x);
+  score = failed ? (double) -INFINITY : target_funk(params, x);
 
+  free (fd.xbuf);
   free (iwa);
   free (wa);
   free (g);
@@ -537,6 +600,87 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
   }
 
   return score;
+}
+
+/**
+ * Minimize a multi-parameter function using L-BFGS-B.
+ *
+ * The target function must compute the score at a certain state,
+ * and it requires 2 parameters: (1) custom data (if needed),
+ * and (2) the values at which score is computed.
+ *
+ * @param  x[in,out]   first guess and result of the minimization process
+ * @param  xmin        lower bound for each of the variables
+ * @param  xmax        upper bound for each of the variables
+ * @param  bound       bound type (PLL_LBFGSB_BOUND_[NONE|LOWER|UPPER|BOTH]
+ * @param  n           number of variables
+ * @param  factr       convergence tolerance for L-BFGS-B relative to machine epsilon
+ * @param  pgtol       absolute gradient tolerance for L-BFGS-B
+ * @param  params      custom parameters required by the target function
+ * @param  target_funk target function
+ *
+ * `factr` is a double precision variable. The iteration will stop when
+ * (f^k - f^{k+1})/max{|f^k|,|f^{k+1}|,1} <= factr*epsmch
+ * where epsmch is the machine epsilon
+ *
+ * `pgtol` is a double precision variable. The iteration will stop when
+ * max{|proj g_i | i = 1, ..., n} <= pgtol
+ * where pg_i is the ith component of the projected gradient.
+ *
+ * @return             the minimal score found
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
+                                             double * xmin,
+                                             double * xmax,
+                                             int * bound,
+                                             unsigned int n,
+                                             double factr,
+                                             double pgtol,
+                                             void * params,
+                                             double (*target_funk)(
+                                                     void *,
+                                                     double *))
+{
+  return minimize_lbfgsb(x, xmin, xmax, bound, n, factr, pgtol, params,
+                         NULL, NULL,
+                         target_funk);
+}
+
+/**
+ * Minimize a multi-parameter function using L-BFGS-B, evaluating the
+ * finite-difference gradient with multiple threads.
+ *
+ * Same as pllmod_opt_minimize_lbfgsb(), but the `n` perturbed points of
+ * every gradient are evaluated concurrently on the caller's thread pool.
+ * Thread t of the pool calls `target_funk(thread_params[t], ...)`, so every
+ * element of `thread_params` must refer to its own likelihood workspace
+ * (e.g. a cloned partition) with the same data and model, which must not
+ * use `pool` itself. All other calls use `params`, which holds the result.
+ * The numerical method is not changed.
+ *
+ * @param  params         target function parameters
+ * @param  thread_params  target function parameters, one per pool thread
+ * @param  pool           thread pool (pllmod_thread_pool_t), NULL = serial
+ *
+ * @return             the minimal score found
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_par(double * x,
+                                                 double * xmin,
+                                                 double * xmax,
+                                                 int * bound,
+                                                 unsigned int n,
+                                                 double factr,
+                                                 double pgtol,
+                                                 void * params,
+                                                 void ** thread_params,
+                                                 void * pool,
+                                                 double (*target_funk)(
+                                                         void *,
+                                                         double *))
+{
+  return minimize_lbfgsb(x, xmin, xmax, bound, n, factr, pgtol, params,
+                         thread_params, (pllmod_thread_pool_t *) pool,
+                         target_funk);
 } /* pllmod_opt_minimize_lbfgsb */
 
 struct bfgs_multi_opt
@@ -617,6 +761,156 @@ static void destroy_bfgs_opt(struct bfgs_multi_opt * opt)
   }
 }
 
+/* same as lbfgsb_fd_task(), for one perturbed variable of all functions */
+typedef struct lbfgsb_multi_fd_context
+{
+  void ** params;
+  double (*target_funk)(void *, double **, double *, int *);
+  unsigned int xnum;
+  unsigned int * n;
+  double ** x;
+  const double * lh_old;
+  const int * skip;
+  double ** g;
+  double *** xbuf;    /* copy of x for each thread */
+  double ** lh_buf;   /* function values for each thread */
+  int ** skip_buf;    /* skip flags for each thread */
+} lbfgsb_multi_fd_context_t;
+
+static int lbfgsb_multi_fd_task(void * data,
+                                unsigned int task_index,
+                                unsigned int thread_index)
+{
+  lbfgsb_multi_fd_context_t * fd = (lbfgsb_multi_fd_context_t *) data;
+  double ** x = fd->xbuf[thread_index];
+  double * lh_new = fd->lh_buf[thread_index];
+  int * skip = fd->skip_buf[thread_index];
+  const unsigned int i = task_index;
+  unsigned int p;
+  double h, temp;
+
+  for (p = 0; p < fd->xnum; p++)
+  {
+    /* partitions with less parameters than i are skipped */
+    skip[p] = fd->skip[p] || i >= fd->n[p];
+
+    if (skip[p])
+      continue;
+
+    temp = fd->x[p][i];
+    h = PLL_LBFGSB_ERROR * fabs (temp);
+    if (h < 1e-12)
+      h = PLL_LBFGSB_ERROR;
+
+    x[p][i] = temp + h;
+  }
+
+  fd->target_funk(fd->params[thread_index], x, lh_new, skip);
+
+  for (p = 0; p < fd->xnum; p++)
+  {
+    if (skip[p])
+      continue;
+
+    /* compute partial derivative */
+    h = x[p][i] - fd->x[p][i];
+    fd->g[p][i] = (lh_new[p] - fd->lh_old[p]) / h;
+
+    /* reset variable */
+    x[p][i] = fd->x[p][i];
+  }
+
+  return PLL_SUCCESS;
+}
+
+static void lbfgsb_multi_fd_destroy(lbfgsb_multi_fd_context_t * fd,
+                                    unsigned int thread_count)
+{
+  unsigned int t;
+
+  for (t = 0; t < thread_count; t++)
+  {
+    if (fd->xbuf && fd->xbuf[t])
+    {
+      free(fd->xbuf[t][fd->xnum]);
+      free(fd->xbuf[t]);
+    }
+    if (fd->lh_buf)
+      free(fd->lh_buf[t]);
+    if (fd->skip_buf)
+      free(fd->skip_buf[t]);
+  }
+
+  free(fd->xbuf);
+  free(fd->lh_buf);
+  free(fd->skip_buf);
+}
+
+static int lbfgsb_multi_fd_init(lbfgsb_multi_fd_context_t * fd,
+                                unsigned int thread_count)
+{
+  unsigned int t, p;
+  size_t xsize = 0;
+
+  for (p = 0; p < fd->xnum; p++)
+  {
+    if (fd->x[p])
+      xsize += fd->n[p];
+  }
+
+  fd->xbuf = (double ***) calloc((size_t) thread_count, sizeof(double **));
+  fd->lh_buf = (double **) calloc((size_t) thread_count, sizeof(double *));
+  fd->skip_buf = (int **) calloc((size_t) thread_count, sizeof(int *));
+  if (!fd->xbuf || !fd->lh_buf || !fd->skip_buf)
+    goto error;
+
+  for (t = 0; t < thread_count; t++)
+  {
+    fd->xbuf[t] = (double **) calloc((size_t) fd->xnum+1, sizeof(double *));
+    fd->lh_buf[t] = (double *) calloc((size_t) fd->xnum, sizeof(double));
+    fd->skip_buf[t] = (int *) calloc((size_t) fd->xnum+1, sizeof(int));
+    if (!fd->xbuf[t] || !fd->lh_buf[t] || !fd->skip_buf[t])
+      goto error;
+
+    /* all copies of x of a thread share one block (stored at the end),
+     * remote partitions stay NULL */
+    double * block = (double *) calloc(xsize + 1, sizeof(double));
+    if (!block)
+      goto error;
+
+    fd->xbuf[t][fd->xnum] = block;
+    for (p = 0; p < fd->xnum; p++)
+    {
+      if (!fd->x[p])
+        continue;
+      fd->xbuf[t][p] = block;
+      block += fd->n[p];
+    }
+  }
+
+  return PLL_SUCCESS;
+
+error:
+  pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                   "Cannot allocate memory for l-bfgs-b variables");
+  return PLL_FAILURE;
+}
+
+static void lbfgsb_multi_fd_copy_x(lbfgsb_multi_fd_context_t * fd,
+                                   unsigned int thread_count)
+{
+  unsigned int t, p;
+
+  for (t = 0; t < thread_count; t++)
+  {
+    for (p = 0; p < fd->xnum; p++)
+    {
+      if (fd->x[p])
+        memcpy(fd->xbuf[t][p], fd->x[p], fd->n[p] * sizeof(double));
+    }
+  }
+}
+
 static int setulb_multi(struct bfgs_multi_opt * opt)
 {
   return setulb ((int *)&opt->n, &opt->max_corrections, opt->x, opt->xmin,
@@ -625,22 +919,31 @@ static int setulb_multi(struct bfgs_multi_opt * opt)
                  &opt->csave, opt->lsave, opt->isave, opt->dsave);
 }
 
-PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
-                                                   double ** x,
-                                                   double ** xmin,
-                                                   double ** xmax,
-                                                   int ** bound,
-                                                   unsigned int * n,
-                                                   unsigned int nmax,
-                                                   double factr,
-                                                   double pgtol,
-                                                   void * params,
-                                                   double (*target_funk)(void *,
-                                                                         double **,
-                                                                         double *,
-                                                                         int *))
+static double minimize_lbfgsb_multi(unsigned int xnum,
+                                    double ** x,
+                                    double ** xmin,
+                                    double ** xmax,
+                                    int ** bound,
+                                    unsigned int * n,
+                                    unsigned int nmax,
+                                    double factr,
+                                    double pgtol,
+                                    void * params,
+                                    void ** thread_params,
+                                    pllmod_thread_pool_t * pool,
+                                    double (*target_funk)(void *,
+                                                          double **,
+                                                          double *,
+                                                          int *),
+                                    int (*grad_funk)(void *,
+                                                     double **,
+                                                     double **,
+                                                     int *))
 {
   unsigned int i, p;
+  const unsigned int thread_count = thread_params ?
+                                        pllmod_thread_pool_size(pool) : 0;
+  lbfgsb_multi_fd_context_t fd;
 
   double score = (double) -INFINITY;
 
@@ -648,17 +951,32 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
   double * lh_new = (double *) calloc ((size_t) xnum, sizeof(double));
   int * converged = (int *) calloc ((size_t) xnum+1, sizeof(int));
   int * skip = (int *) calloc ((size_t) xnum+1, sizeof(int));
+  double ** g = (double **) calloc ((size_t) xnum, sizeof(double *));
 
   struct bfgs_multi_opt ** opts = (struct bfgs_multi_opt **)
                            calloc((size_t) xnum, sizeof(struct bfgs_multi_opt *));
 
-  if (!lh_old || !lh_new || !converged || !skip || !opts)
+  memset(&fd, 0, sizeof(fd));
+
+  if (!lh_old || !lh_new || !converged || !skip || !g || !opts)
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
                      "Cannot allocate memory for l-bfgs-b variables");
     goto cleanup;
   }
 
+  fd.params = thread_params;
+  fd.target_funk = target_funk;
+  fd.xnum = xnum;
+  fd.n = n;
+  fd.x = x;
+  fd.lh_old = lh_old;
+  fd.skip = skip;
+  fd.g = g;
+
+  if (thread_count && !lbfgsb_multi_fd_init(&fd, thread_count))
+    goto cleanup;
+
   for (p = 0; p < xnum; p++)
   {
     if(!x[p])
@@ -679,6 +997,8 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
     if (!init_bfgs_opt(opts[p], n[p], x[p], xmin[p], xmax[p], bound[p], factr,
                        pgtol))
       goto cleanup;
+
+    g[p] = opts[p]->g;
   }
 
   /* reset errno */
@@ -731,7 +1051,26 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
           opts[p]->score = lh_old[p];
       }
 
-      for (i = 0; i < nmax; i++)
+      /* analytic gradient if available, finite differences otherwise */
+      if (grad_funk && !grad_funk(params, x, g, skip))
+      {
+        /* gradient is not supported for this model -> do not try again */
+        grad_funk = NULL;
+        pll_errno = 0;
+      }
+
+      if (!grad_funk && thread_count)
+      {
+        /* perturbed points are independent -> evaluate them concurrently */
+        lbfgsb_multi_fd_copy_x(&fd, thread_count);
+        if (!pllmod_thread_pool_run(pool, nmax, lbfgsb_multi_fd_task, &fd))
+        {
+          score = (double) -INFINITY;
+          goto cleanup;
+        }
+      }
+
+      for (i = 0; i < nmax && !grad_funk && !thread_count; i++)
       {
         for (p = 0; p < xnum; p++)
         {
@@ -778,6 +1117,7 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
   score = target_funk (params, x, NULL, NULL);
 
 cleanup:
+  lbfgsb_multi_fd_destroy(&fd, thread_count);
   if (lh_old)
     free(lh_old);
   if (lh_new)
@@ -786,6 +1126,8 @@ cleanup:
     free(converged);
   if (skip)
     free(skip);
+  if (g)
+    free(g);
   if (opts)
   {
     for (p = 0; p < xnum; p++)
@@ -804,6 +1146,110 @@ cleanup:
   }
 
   return score;
+}
+
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
+                                                   double ** x,
+                                                   double ** xmin,
+                                                   double ** xmax,
+                                                   int ** bound,
+                                                   unsigned int * n,
+                                                   unsigned int nmax,
+                                                   double factr,
+                                                   double pgtol,
+                                                   void * params,
+                                                   double (*target_funk)(void *,
+                                                                         double **,
+                                                                         double *,
+                                                                         int *))
+{
+  return minimize_lbfgsb_multi(xnum, x, xmin, xmax, bound, n, nmax, factr,
+                               pgtol, params, NULL, NULL, target_funk, NULL);
+}
+
+/**
+ * Minimize multiple independent multi-parameter functions with L-BFGS-B,
+ * using gradients computed by `grad_funk`.
+ *
+ * Same as pllmod_opt_minimize_lbfgsb_multi(), but instead of finite
+ * differences (one `target_funk` call per free parameter), the gradient is
+ * requested from `grad_funk(params, x, g, skip)` right after `target_funk`
+ * was evaluated at the same `x`. It must fill g[p][0..n[p]-1] for every
+ * partition p with skip[p] == 0, and return PLL_SUCCESS. If it returns
+ * PLL_FAILURE, e.g. when the gradient is not available for the current
+ * model, finite differences are used for the rest of the optimization.
+ *
+ * @return the final score (see pllmod_opt_minimize_lbfgsb_multi())
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_grad(unsigned int xnum,
+                                                        double ** x,
+                                                        double ** xmin,
+                                                        double ** xmax,
+                                                        int ** bound,
+                                                        unsigned int * n,
+                                                        unsigned int nmax,
+                                                        double factr,
+                                                        double pgtol,
+                                                        void * params,
+                                                        double (*target_funk)(void *,
+                                                                              double **,
+                                                                              double *,
+                                                                              int *),
+                                                        int (*grad_funk)(void *,
+                                                                         double **,
+                                                                         double **,
+                                                                         int *))
+{
+  return minimize_lbfgsb_multi(xnum, x, xmin, xmax, bound, n, nmax, factr,
+                               pgtol, params, NULL, NULL, target_funk,
+                               grad_funk);
+}
+
+/**
+ * Minimize multiple independent multi-parameter functions with L-BFGS-B,
+ * evaluating finite-difference gradients with multiple threads.
+ *
+ * Same as pllmod_opt_minimize_lbfgsb_multi_grad() (`grad_funk` can be
+ * NULL), but the perturbed points of a finite-difference gradient, one per
+ * free parameter, are evaluated concurrently on the caller's thread pool.
+ * Thread t of the pool calls `target_funk(thread_params[t], ...)`, so every
+ * element of `thread_params` must refer to its own likelihood workspace
+ * (e.g. a treeinfo clone) with the same data and model parameters, which
+ * must not use `pool` itself. All other calls, including convergence checks
+ * and `grad_funk`, use `params`, which holds the result. Function values and
+ * gradients are the same as in the serial version.
+ *
+ * @param  params         target function parameters
+ * @param  thread_params  target function parameters, one per pool thread
+ * @param  pool           thread pool (pllmod_thread_pool_t), NULL = serial
+ *
+ * @return the final score (see pllmod_opt_minimize_lbfgsb_multi())
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_par(unsigned int xnum,
+                                                       double ** x,
+                                                       double ** xmin,
+                                                       double ** xmax,
+                                                       int ** bound,
+                                                       unsigned int * n,
+                                                       unsigned int nmax,
+                                                       double factr,
+                                                       double pgtol,
+                                                       void * params,
+                                                       void ** thread_params,
+                                                       void * pool,
+                                                       double (*target_funk)(void *,
+                                                                             double **,
+                                                                             double *,
+                                                                             int *),
+                                                       int (*grad_funk)(void *,
+                                                                        double **,
+                                                                        double **,
+                                                                        int *))
+{
+  return minimize_lbfgsb_multi(xnum, x, xmin, xmax, bound, n, nmax, factr,
+                               pgtol, params, thread_params,
+                               (pllmod_thread_pool_t *) pool, target_funk,
+                               grad_funk);
 } /* pllmod_opt_minimize_lbfgsb */
 
 /******************************************************************************/
@@ -1162,6 +1162,85 @@ PLL_EXPORT void pllmod_opt_derivative_func(void * parameters,
  *  multi-partition optimization routines
  */
 
+/* sum up edge log-likelihoods over partitions; in reproducible mode, the
+ * per-partition values are stored in `reduce_buffer` (at least
+ * `partition_count` entries, NULL=allocate internally) */
+static double compute_edge_loglikelihood_multi(
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              unsigned int parent_clv_index,
+                                              int parent_scaler_index,
+                                              unsigned int child_clv_index,
+                                              int child_scaler_index,
+                                              unsigned int matrix_index,
+                                              unsigned int ** const params_indices,
+                                              int sum_mode,
+                                              double * reduce_buffer,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  double total_loglh = 0.;
+  double * partition_loglh = NULL;
+
+  if (sum_mode == PLLMOD_COMMON_SUM_REPRODUCIBLE)
+  {
+    if (reduce_buffer)
+    {
+      partition_loglh = reduce_buffer;
+      memset(partition_loglh, 0, partition_count * sizeof(double));
+    }
+    else
+    {
+      partition_loglh = (double *) calloc(partition_count, sizeof(double));
+      if (!partition_loglh)
+      {
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                         "Cannot allocate memory for reduction buffer");
+        return (double) PLL_FAILURE;
+      }
+    }
+  }
+
+  size_t p;
+  for (p = 0; p < partition_count; ++p)
+  {
+    /* skip remote partitions */
+    if (!partitions[p])
+      continue;
+
+    double p_loglh = pll_compute_edge_loglikelihood(partitions[p],
+                                                    parent_clv_index,
+                                                    parent_scaler_index,
+                                                    child_clv_index,
+                                                    child_scaler_index,
+                                                    matrix_index,
+                                                    params_indices[p],
+                                                    NULL);
+
+    if (partition_loglh)
+      partition_loglh[p] = p_loglh;
+    else
+      total_loglh += p_loglh;
+  }
+
+  if (partition_loglh)
+  {
+    if (!pllmod_reduce_sum_reproducible(partition_loglh, partition_count, 1,
+                                        &total_loglh, parallel_context,
+                                        parallel_reduce_cb))
+      total_loglh = (double) PLL_FAILURE;
+    if (partition_loglh != reduce_buffer)
+      free(partition_loglh);
+  }
+  else if (parallel_reduce_cb)
+    parallel_reduce_cb(parallel_context, &total_loglh, 1, PLLMOD_COMMON_REDUCE_SUM);
+
+  return total_loglh;
+}
+
 /**
  * Compute the likelihood score at a given edge on a multiple partition
  *
@@ -1195,29 +1274,67 @@ PLL_EXPORT double pllmod_opt_compute_edge_loglikelihood_multi(
                                                                          size_t,
                                                                          int))
 {
-  double total_loglh = 0.;
-
-  size_t p;
-  for (p = 0; p < partition_count; ++p)
-  {
-    /* skip remote partitions */
-    if (!partitions[p])
-      continue;
-
-    total_loglh += pll_compute_edge_loglikelihood(partitions[p],
-                                                  parent_clv_index,
-                                                  parent_scaler_index,
-                                                  child_clv_index,
-                                                  child_scaler_index,
-                                                  matrix_index,
-                                                  params_indices[p],
-                                                  NULL);
-  }
+  return compute_edge_loglikelihood_multi(partitions,
+                                          partition_count,
+                                          parent_clv_index,
+                                          parent_scaler_index,
+                                          child_clv_index,
+                                          child_scaler_index,
+                                          matrix_index,
+                                          params_indices,
+                                          PLLMOD_COMMON_SUM_FAST,
+                                          NULL,
+                                          parallel_context,
+                                          parallel_reduce_cb);
+}
 
-  if (parallel_reduce_cb)
-    parallel_reduce_cb(parallel_context, &total_loglh, 1, PLLMOD_COMMON_REDUCE_SUM);
+/**
+ * Compute the likelihood score at a given edge on a multiple partition,
+ * using the given summation mode.
+ *
+ * Same as `pllmod_opt_compute_edge_loglikelihood_multi`, without the unused
+ * `persite_lnl` buffer and with:
+ *
+ * @param  sum_mode            summation mode (see PLLMOD_COMMON_SUM_* constants)
+ */
+PLL_EXPORT double pllmod_opt_compute_edge_loglikelihood_multi_mode(
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              unsigned int parent_clv_index,
+                                              int parent_scaler_index,
+                                              unsigned int child_clv_index,
+                                              int child_scaler_index,
+                                              unsigned int matrix_index,
+                                              unsigned int ** const params_indices,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  return compute_edge_loglikelihood_multi(partitions,
+                                          partition_count,
+                                          parent_clv_index,
+                                          parent_scaler_index,
+                                          child_clv_index,
+                                          child_scaler_index,
+                                          matrix_index,
+                                          params_indices,
+                                          sum_mode,
+                                          NULL,
+                                          parallel_context,
+                                          parallel_reduce_cb);
+}
 
-  return total_loglh;
+/* sumtable of the branch being optimized */
+static inline double * sumtable_buffer(const pll_newton_tree_params_multi_t * params,
+                                       unsigned int p)
+{
+  if (params->sumtable_cache)
+    return params->sumtable_cache->sumtables[p][params->tree->pmatrix_index];
+  else
+    return params->precomp_buffers[p];
 }
 
 static void utree_derivative_func_multi (void * parameters, double * proposal,
@@ -1227,6 +1344,9 @@ static void utree_derivative_func_multi (void * parameters, double * proposal,
                                 (pll_newton_tree_params_multi_t *) parameters;
   size_t p;
   int unlinked = (params->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED) ? 1 : 0;
+  int repro = (params->sum_mode == PLLMOD_COMMON_SUM_REPRODUCIBLE) ? 1 : 0;
+  const size_t count = params->partition_count;
+  double * buf = params->reduce_buffer;
 
   if (unlinked)
   {
@@ -1236,6 +1356,9 @@ static void utree_derivative_func_multi (void * parameters, double * proposal,
   else
     *df = *ddf = 0;
 
+  if (repro)
+    memset(buf, 0, 2 * count * sizeof(double));
+
   /* simply iterate over partitions and add up the derivatives */
   for (p = 0; p < params->partition_count; ++p)
   {
@@ -1243,6 +1366,11 @@ static void utree_derivative_func_multi (void * parameters, double * proposal,
     if (!params->partitions[p])
       continue;
 
+    /* unlinked: Newton does not look at converged partitions anymore
+     * (flags are the same on all ranks, since derivatives are reduced) */
+    if (unlinked && params->converged && params->converged[p])
+      continue;
+
     double p_df, p_ddf;
     double s = params->brlen_scalers ? params->brlen_scalers[p] : 1.;
     double p_brlen =  s * (unlinked ? proposal[p] : proposal[0]);
@@ -1251,7 +1379,7 @@ static void utree_derivative_func_multi (void * parameters, double * proposal,
                                         params->tree->back->scaler_index,
                                         p_brlen,
                                         params->params_indices[p],
-                                        params->precomp_buffers[p],
+                                        sumtable_buffer(params, p),
                                         &p_df, &p_ddf);
 
     /* chain rule! */
@@ -1260,6 +1388,12 @@ static void utree_derivative_func_multi (void * parameters, double * proposal,
       df[p] = s * p_df;
       ddf[p] = s * s * p_ddf;
     }
+    else if (repro)
+    {
+      /* keep per-partition terms, they will be summed up below */
+      buf[p] = s * p_df;
+      buf[count + p] = s * s * p_ddf;
+    }
     else
     {
       df[0] += s * p_df;
@@ -1267,7 +1401,37 @@ static void utree_derivative_func_multi (void * parameters, double * proposal,
     }
   }
 
-  if (params->parallel_reduce_cb)
+  if (repro)
+  {
+    int retval;
+
+    if (unlinked)
+    {
+      /* reduce each partition separately */
+      memcpy(buf, df, count * sizeof(double));
+      memcpy(buf + count, ddf, count * sizeof(double));
+      retval = pllmod_reduce_sum_reproducible(buf, 1, 2 * count, buf,
+                                              params->parallel_context,
+                                              params->parallel_reduce_cb);
+      memcpy(df, buf, count * sizeof(double));
+      memcpy(ddf, buf + count, count * sizeof(double));
+    }
+    else
+    {
+      /* sum up the per-partition terms (and not the local sums!), so that
+       * the result does not depend on how partitions are distributed */
+      double d[2];
+      retval = pllmod_reduce_sum_reproducible(buf, count, 2, d,
+                                              params->parallel_context,
+                                              params->parallel_reduce_cb);
+      *df = d[0];
+      *ddf = d[1];
+    }
+
+    if (!retval)
+      *df = *ddf = (double) NAN;
+  }
+  else if (params->parallel_reduce_cb)
   {
     if (unlinked)
     {
@@ -1323,7 +1487,7 @@ static void update_prob_matrices(pll_partition_t ** partitions,
 
 static int allocate_buffers(pll_newton_tree_params_multi_t * params)
 {
-  if (!params->precomp_buffers)
+  if (!params->precomp_buffers && !params->sumtable_cache)
   {
     params->precomp_buffers =  (double **) calloc(params->partition_count,
                                                   sizeof(double *));
@@ -1388,9 +1552,105 @@ static int allocate_buffers(pll_newton_tree_params_multi_t * params)
       return PLL_FAILURE;
   }
 
+  if (params->sum_mode == PLLMOD_COMMON_SUM_REPRODUCIBLE)
+  {
+    params->reduce_buffer = (double *) calloc(2 * params->partition_count,
+                                              sizeof(double));
+    if (!params->reduce_buffer)
+      return PLL_FAILURE;
+  }
+
   return PLL_SUCCESS;
 }
 
+static void init_params_multi(pll_newton_tree_params_multi_t * params,
+                              pll_partition_t ** partitions,
+                              size_t partition_count,
+                              pll_unode_t * tree,
+                              unsigned int ** params_indices,
+                              double ** precomp_buffers,
+                              double ** brlen_buffers,
+                              double * brlen_scalers,
+                              double branch_length_min,
+                              double branch_length_max,
+                              int opt_method,
+                              int brlen_linkage,
+                              int sum_mode,
+                              void * parallel_context,
+                              void (*parallel_reduce_cb)(void *,
+                                                         double *,
+                                                         size_t,
+                                                         int))
+{
+  params->partitions        = partitions;
+  params->partition_count   = partition_count;
+  params->tree              = tree;
+  params->params_indices    = params_indices;
+  params->branch_length_min = (branch_length_min>0)?
+                              branch_length_min:
+                              PLLMOD_OPT_MIN_BRANCH_LEN;
+  params->branch_length_max = (branch_length_max>0)?
+                              branch_length_max:
+                              PLLMOD_OPT_MAX_BRANCH_LEN;
+  params->tolerance         = (branch_length_min>0)?
+                              branch_length_min/10.0:
+                              PLLMOD_OPT_TOL_BRANCH_LEN;
+  params->precomp_buffers   = precomp_buffers;
+  params->brlen_buffers     = brlen_buffers;
+  params->brlen_scalers     = brlen_scalers;
+  params->opt_method        = opt_method;
+  params->brlen_linkage     = (partition_count > 1) ?
+                              brlen_linkage : PLLMOD_COMMON_BRLEN_LINKED;
+  params->max_newton_iters  = 30;
+
+  params->brlen_orig        = NULL;
+  params->brlen_guess       = NULL;
+  params->converged         = NULL;
+  params->reduce_buffer     = NULL;
+  params->sumtable_cache    = NULL;
+  params->sum_mode          = sum_mode;
+
+  params->parallel_context = parallel_context;
+  params->parallel_reduce_cb = parallel_reduce_cb;
+}
+
+/* free buffers allocated by allocate_buffers() */
+static void free_params_multi(pll_newton_tree_params_multi_t * params,
+                              double ** precomp_buffers,
+                              double ** brlen_buffers)
+{
+  size_t p;
+
+  /* deallocate sumtable */
+  if (!precomp_buffers && params->precomp_buffers)
+  {
+    for (p = 0; p < params->partition_count; ++p)
+    {
+      if (params->precomp_buffers[p])
+        free(params->precomp_buffers[p]);
+    }
+    pll_aligned_free(params->precomp_buffers);
+  }
+
+  if (params->brlen_buffers && !brlen_buffers)
+  {
+    free(params->brlen_buffers[0]);
+    free(params->brlen_buffers);
+  }
+
+  if (params->converged)
+    free(params->converged);
+
+  if (params->brlen_guess)
+    free(params->brlen_guess);
+
+  if (params->brlen_orig)
+    free(params->brlen_orig);
+
+  if (params->reduce_buffer)
+    free(params->reduce_buffer);
+}
+
 /* if keep_update, P-matrices are updated after each branch length opt */
 static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
                                   int radius,
@@ -1411,6 +1671,7 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
          *xguess;       /* initial guess / current branch length value */
 
   unsigned int pmatrix_index;
+  pllmod_opt_sumtable_cache_t * cache;
 
   int unlinked      = params->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED ? 1 : 0;
   int apply_change  = 0;
@@ -1458,20 +1719,28 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
   /* check branch length integrity */
   assert(d_equals(tr_p->length, tr_p->back->length));
 
-  /* prepare sumtable for current branch */
-  for (p = 0; p < params->partition_count; ++p)
+  /* prepare sumtable for current branch, unless CLVs at both ends are
+   * the same as when it was computed */
+  cache = params->sumtable_cache;
+  if (!cache || cache->stamp[pmatrix_index] != cache->version)
   {
-    /* skip remote partitions */
-    if (!params->partitions[p])
-      continue;
+    for (p = 0; p < params->partition_count; ++p)
+    {
+      /* skip remote partitions */
+      if (!params->partitions[p])
+        continue;
+
+      pll_update_sumtable (params->partitions[p],
+                           tr_p->clv_index,
+                           tr_p->back->clv_index,
+                           tr_p->scaler_index,
+                           tr_p->back->scaler_index,
+                           params->params_indices[p],
+                           sumtable_buffer(params, p));
+    }
 
-    pll_update_sumtable (params->partitions[p],
-                         tr_p->clv_index,
-                         tr_p->back->clv_index,
-                         tr_p->scaler_index,
-                         tr_p->back->scaler_index,
-                         params->params_indices[p],
-                         params->precomp_buffers[p]);
+    if (cache)
+      cache->stamp[pmatrix_index] = cache->version;
   }
 
   /* set N-R parameters */
@@ -1576,6 +1845,13 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
     if (!unlinked)
       tr_p->length = tr_p->back->length = xguess[0];
 
+    /* all CLVs change, except for the ones at the ends of this branch */
+    if (cache)
+    {
+      cache->version++;
+      cache->stamp[pmatrix_index] = cache->version;
+    }
+
     /* update pmatrix for the new branch length */
     if (keep_update)
     {
@@ -1589,7 +1865,7 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
       assert(keep_update);
 
       /* check and compare likelihood */
-      double eval_loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi(
+      double eval_loglikelihood = compute_edge_loglikelihood_multi(
                                                         params->partitions,
                                                         params->partition_count,
                                                         tr_p->clv_index,
@@ -1598,7 +1874,8 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
                                                         tr_p->back->scaler_index,
                                                         tr_p->pmatrix_index,
                                                         params->params_indices,
-                                                        NULL,
+                                                        params->sum_mode,
+                                                        params->reduce_buffer,
                                                         params->parallel_context,
                                                         params->parallel_reduce_cb);
 
@@ -1638,7 +1915,7 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
     DBG(" Optimized branch %3d - %3d (%.12f -> %.12f)\n",
         tr_p->clv_index, tr_p->back->clv_index, xorig[0], tr_p->length);
 
-    double new_loglh = pllmod_opt_compute_edge_loglikelihood_multi(
+    double new_loglh = compute_edge_loglikelihood_multi(
                                                       params->partitions,
                                                       params->partition_count,
                                                       tr_p->clv_index,
@@ -1647,7 +1924,8 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
                                                       tr_p->back->scaler_index,
                                                       tr_p->pmatrix_index,
                                                       params->params_indices,
-                                                      NULL,
+                                                      params->sum_mode,
+                                                      params->reduce_buffer,
                                                       params->parallel_context,
                                                       params->parallel_reduce_cb);
 
@@ -1711,37 +1989,13 @@ static int recomp_iterative_multi(pll_newton_tree_params_multi_t * params,
 
 } /* recomp_iterative */
 
-/**
- * Optimize branch lengths locally around a given edge using Newton-Raphson
- * minimization algorithm on a multiple partition.
- *
- * Check `pllmod_opt_optimize_branch_lengths_local` documentation.
- *
- * @param[in,out]  partitions list of partitions
- * @param  partition_count    number of partitions in `partitions`
- * @param[in,out]  tree       the PLL unrooted tree structure
- * @param  params_indices     the indices of the parameter sets
- * @param  precomp_buffers    buffer for sumtable (NULL=allocate internally)
- * @param  brlen_buffers      buffer for branch lengths (NULL=allocate internally)
- * @param  brlen_scalers      branch length scalers
- * @param  branch_length_min  lower bound for branch lengths
- * @param  branch_length_max  upper bound for branch lengths
- * @param  tolerance          tolerance for Newton-Raphson algorithm
- * @param  smoothings         number of iterations over the branches
- * @param  radius             radius from the virtual root
- * @param  keep_update        if true, branch lengths are iteratively updated in the tree structure
- * @param  opt_method         optimization method to use (see PLLMOD_OPT_BLO_* constants)
- * @param  parallel_context   context for parallel computation
- * @param  parallel_reduce_cb callback function for parallel reduction
- *
- * @return                   the likelihood score after optimizing branch lengths
- */
-PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
+static double optimize_branch_lengths_local_multi (
                                               pll_partition_t ** partitions,
                                               size_t partition_count,
                                               pll_unode_t * tree,
                                               unsigned int ** params_indices,
                                               double ** precomp_buffers,
+                                              pllmod_opt_sumtable_cache_t * sumtable_cache,
                                               double ** brlen_buffers,
                                               double * brlen_scalers,
                                               double branch_length_min,
@@ -1752,6 +2006,7 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
                                               int keep_update,
                                               int opt_method,
                                               int brlen_linkage,
+                                              int sum_mode,
                                               void * parallel_context,
                                               void (*parallel_reduce_cb)(void *,
                                                                          double *,
@@ -1760,7 +2015,6 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
 {
   unsigned int iters;
   double loglikelihood = 0.0, new_loglikelihood;
-  size_t p;
   double result = (double) PLL_FAILURE;
 
   pllmod_reset_error();
@@ -1771,12 +2025,14 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
    *    (2) Pmatrix indices must be **unique** for each branch
    */
 
+  /* NEWTON_SCHEDULED is implemented by pllmod_algo_opt_brlen_treeinfo() */
   if (opt_method == PLLMOD_OPT_BLO_NEWTON_FALLBACK ||
-      opt_method == PLLMOD_OPT_BLO_NEWTON_GLOBAL)
+      opt_method == PLLMOD_OPT_BLO_NEWTON_GLOBAL ||
+      opt_method == PLLMOD_OPT_BLO_NEWTON_SCHEDULED)
   {
     pllmod_set_error(PLLMOD_ERROR_NOT_IMPLEMENTED,
                      "Optimization method not implemented: "
-                     "NEWTON_FALLBACK, NEWTON_GLOBAL");
+                     "NEWTON_FALLBACK, NEWTON_GLOBAL, NEWTON_SCHEDULED");
     return (double)PLL_FAILURE;
   }
 
@@ -1787,12 +2043,29 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
     return (double)PLL_FAILURE;
   }
 
+  /* set parameters for N-R optimization */
+  pll_newton_tree_params_multi_t params;
+  init_params_multi(&params, partitions, partition_count, tree, params_indices,
+                    precomp_buffers, brlen_buffers, brlen_scalers,
+                    branch_length_min, branch_length_max, opt_method,
+                    brlen_linkage, sum_mode, parallel_context,
+                    parallel_reduce_cb);
+  params.sumtable_cache = sumtable_cache;
+
+  /* allocate the sumtable if needed */
+  if (!allocate_buffers(&params))
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for brlen opt variables");
+    goto cleanup;
+  }
+
   /* make sure p-matrices are up-to-date */
   update_prob_matrices(partitions, partition_count, params_indices,
                        brlen_buffers, brlen_scalers, tree);
 
   /* get the initial likelihood score */
-  loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+  loglikelihood = compute_edge_loglikelihood_multi(
                                                       partitions,
                                                       partition_count,
                                                       tree->back->clv_index,
@@ -1801,51 +2074,14 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
                                                       tree->scaler_index,
                                                       tree->pmatrix_index,
                                                       params_indices,
-                                                      NULL,
+                                                      params.sum_mode,
+                                                      params.reduce_buffer,
                                                       parallel_context,
                                                       parallel_reduce_cb);
 
   DBG("\nStarting BLO_multi: radius: %d, max_iters: %d, lh_eps: %f, old LH: %.9f\n",
       radius, max_iters, lh_epsilon, loglikelihood);
 
-  /* set parameters for N-R optimization */
-  pll_newton_tree_params_multi_t params;
-  params.partitions        = partitions;
-  params.partition_count   = partition_count;
-  params.tree              = tree;
-  params.params_indices    = params_indices;
-  params.branch_length_min = (branch_length_min>0)?
-                              branch_length_min:
-                              PLLMOD_OPT_MIN_BRANCH_LEN;
-  params.branch_length_max = (branch_length_max>0)?
-                              branch_length_max:
-                              PLLMOD_OPT_MAX_BRANCH_LEN;
-  params.tolerance         = (branch_length_min>0)?
-                              branch_length_min/10.0:
-                              PLLMOD_OPT_TOL_BRANCH_LEN;
-  params.precomp_buffers   = precomp_buffers;
-  params.brlen_buffers     = brlen_buffers;
-  params.brlen_scalers     = brlen_scalers;
-  params.opt_method        = opt_method;
-  params.brlen_linkage     = (partition_count > 1) ?
-                             brlen_linkage : PLLMOD_COMMON_BRLEN_LINKED;
-  params.max_newton_iters  = 30;
-
-  params.brlen_orig        = NULL;
-  params.brlen_guess       = NULL;
-  params.converged         = NULL;
-
-  params.parallel_context = parallel_context;
-  params.parallel_reduce_cb = parallel_reduce_cb;
-
-  /* allocate the sumtable if needed */
-  if (!allocate_buffers(&params))
-  {
-    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                     "Cannot allocate memory for brlen opt variables");
-    goto cleanup;
-  }
-
   iters = (unsigned int) max_iters;
   while (iters)
   {
@@ -1871,7 +2107,7 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
     }
 
     /* compute likelihood after optimization */
-    new_loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+    new_loglikelihood = compute_edge_loglikelihood_multi(
                                                         partitions,
                                                         partition_count,
                                                         tree->back->clv_index,
@@ -1880,7 +2116,8 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
                                                         tree->scaler_index,
                                                         tree->pmatrix_index,
                                                         params_indices,
-                                                        NULL,
+                                                        params.sum_mode,
+                                                        params.reduce_buffer,
                                                         parallel_context,
                                                         parallel_reduce_cb);
 
@@ -1921,31 +2158,371 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
   result = -1*loglikelihood;
 
 cleanup:
-  /* deallocate sumtable */
-  if (!precomp_buffers)
+  free_params_multi(&params, precomp_buffers, brlen_buffers);
+
+  return result;
+} /* pllmod_opt_optimize_branch_lengths_local */
+
+/**
+ * Optimize branch lengths locally around a given edge using Newton-Raphson
+ * minimization algorithm on a multiple partition.
+ *
+ * Check `pllmod_opt_optimize_branch_lengths_local` documentation.
+ *
+ * @param[in,out]  partitions list of partitions
+ * @param  partition_count    number of partitions in `partitions`
+ * @param[in,out]  tree       the PLL unrooted tree structure
+ * @param  params_indices     the indices of the parameter sets
+ * @param  precomp_buffers    buffer for sumtable (NULL=allocate internally)
+ * @param  brlen_buffers      buffer for branch lengths (NULL=allocate internally)
+ * @param  brlen_scalers      branch length scalers
+ * @param  branch_length_min  lower bound for branch lengths
+ * @param  branch_length_max  upper bound for branch lengths
+ * @param  tolerance          tolerance for Newton-Raphson algorithm
+ * @param  smoothings         number of iterations over the branches
+ * @param  radius             radius from the virtual root
+ * @param  keep_update        if true, branch lengths are iteratively updated in the tree structure
+ * @param  opt_method         optimization method to use (see PLLMOD_OPT_BLO_* constants)
+ * @param  brlen_linkage      branch length linkage mode (see PLLMOD_COMMON_BRLEN_* constants)
+ * @param  parallel_context   context for parallel computation
+ * @param  parallel_reduce_cb callback function for parallel reduction
+ *
+ * @return                   the likelihood score after optimizing branch lengths
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double lh_epsilon,
+                                              int max_iters,
+                                              int radius,
+                                              int keep_update,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  return optimize_branch_lengths_local_multi(partitions,
+                                             partition_count,
+                                             tree,
+                                             params_indices,
+                                             precomp_buffers,
+                                             NULL,
+                                             brlen_buffers,
+                                             brlen_scalers,
+                                             branch_length_min,
+                                             branch_length_max,
+                                             lh_epsilon,
+                                             max_iters,
+                                             radius,
+                                             keep_update,
+                                             opt_method,
+                                             brlen_linkage,
+                                             PLLMOD_COMMON_SUM_FAST,
+                                             parallel_context,
+                                             parallel_reduce_cb);
+}
+
+/**
+ * Optimize branch lengths locally around a given edge on a multiple
+ * partition, using the given summation mode for reductions.
+ *
+ * Check `pllmod_opt_optimize_branch_lengths_local_multi` documentation.
+ *
+ * @param[in,out]  partitions list of partitions
+ * @param  partition_count    number of partitions in `partitions`
+ * @param[in,out]  tree       the PLL unrooted tree structure
+ * @param  params_indices     the indices of the parameter sets
+ * @param  precomp_buffers    buffer for sumtable (NULL=allocate internally)
+ * @param  brlen_buffers      buffer for branch lengths (NULL=allocate internally)
+ * @param  brlen_scalers      branch length scalers
+ * @param  branch_length_min  lower bound for branch lengths
+ * @param  branch_length_max  upper bound for branch lengths
+ * @param  tolerance          tolerance for Newton-Raphson algorithm
+ * @param  smoothings         number of iterations over the branches
+ * @param  radius             radius from the virtual root
+ * @param  keep_update        if true, branch lengths are iteratively updated in the tree structure
+ * @param  opt_method         optimization method to use (see PLLMOD_OPT_BLO_* constants)
+ * @param  brlen_linkage      branch length linkage mode (see PLLMOD_COMMON_BRLEN_* constants)
+ * @param  sum_mode           summation mode (see PLLMOD_COMMON_SUM_* constants)
+ * @param  parallel_context   context for parallel computation
+ * @param  parallel_reduce_cb callback function for parallel reduction
+ *
+ * @return                   the likelihood score after optimizing branch lengths
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi_mode (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double lh_epsilon,
+                                              int max_iters,
+                                              int radius,
+                                              int keep_update,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  return optimize_branch_lengths_local_multi(partitions,
+                                             partition_count,
+                                             tree,
+                                             params_indices,
+                                             precomp_buffers,
+                                             NULL,
+                                             brlen_buffers,
+                                             brlen_scalers,
+                                             branch_length_min,
+                                             branch_length_max,
+                                             lh_epsilon,
+                                             max_iters,
+                                             radius,
+                                             keep_update,
+                                             opt_method,
+                                             brlen_linkage,
+                                             sum_mode,
+                                             parallel_context,
+                                             parallel_reduce_cb);
+}
+
+/**
+ * Optimize branch lengths locally around a given edge, reusing sumtables.
+ *
+ * Same as `pllmod_opt_optimize_branch_lengths_local_multi`, but sumtables
+ * are kept per branch in `sumtable_cache`. The sumtable of a branch only
+ * depends on the CLVs at its ends, which change whenever another branch
+ * length (or the topology, or the model) changes. Therefore,
+ * `sumtable_cache->version` is incremented on every branch length update
+ * applied here, and a branch whose sumtable was computed at the current
+ * version skips the sumtable update. This is the common case in late
+ * smoothing iterations, where only a few branch lengths still change.
+ *
+ * The caller must increment `sumtable_cache->version` whenever CLVs may
+ * have changed between calls.
+ *
+ * @param  sumtable_cache     per-branch sumtables and their versions
+ *
+ * Other parameters and return value: see
+ * `pllmod_opt_optimize_branch_lengths_local_multi`.
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_cached (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              pllmod_opt_sumtable_cache_t * sumtable_cache,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double lh_epsilon,
+                                              int max_iters,
+                                              int radius,
+                                              int keep_update,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  if (!sumtable_cache)
   {
-    for (p = 0; p < partition_count; ++p)
-    {
-      if (params.precomp_buffers[p])
-        free(params.precomp_buffers[p]);
-    }
-    pll_aligned_free(params.precomp_buffers);
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID, "Sumtable cache is NULL");
+    return (double) PLL_FAILURE;
+  }
+
+  return optimize_branch_lengths_local_multi(partitions,
+                                             partition_count,
+                                             tree,
+                                             params_indices,
+                                             NULL,
+                                             sumtable_cache,
+                                             brlen_buffers,
+                                             brlen_scalers,
+                                             branch_length_min,
+                                             branch_length_max,
+                                             lh_epsilon,
+                                             max_iters,
+                                             radius,
+                                             keep_update,
+                                             opt_method,
+                                             brlen_linkage,
+                                             sum_mode,
+                                             parallel_context,
+                                             parallel_reduce_cb);
+}
+
+/**
+ * Optimize the lengths of a set of branches independently of each other
+ * (Jacobi-style update) on multiple partitions.
+ *
+ * Every branch in `edges` is optimized with Newton-Raphson while all other
+ * branch lengths are kept fixed, using the CLVs at both ends of the branch,
+ * which must be up-to-date (e.g. computed with
+ * pllmod_treeinfo_compute_clvs_alledges()). CLVs are never updated, and
+ * only the sumtable, p-matrix and length of the branch being optimized are
+ * written. Therefore, disjoint sets of branches can be optimized
+ * concurrently by different threads, as long as every thread passes its
+ * own `precomp_buffers` and the eigendecompositions are up-to-date.
+ *
+ * Unlike in pllmod_opt_optimize_branch_lengths_local_multi(), the new
+ * lengths are not jointly optimal: the caller has to repeat the update
+ * until the tree log-likelihood converges.
+ *
+ * @param[in,out]  partitions list of partitions
+ * @param  partition_count    number of partitions in `partitions`
+ * @param  edges              branches to optimize (either direction)
+ * @param  edge_count         number of branches in `edges`
+ * @param[out] edge_loglh     log-likelihood at every branch after its
+ *                            update (NULL=not needed)
+ * @param  params_indices     the indices of the parameter sets
+ * @param  precomp_buffers    buffer for sumtable (NULL=allocate internally)
+ * @param[in,out]  brlen_buffers  branch lengths indexed by p-matrix index
+ * @param  brlen_scalers      branch length scalers
+ * @param  branch_length_min  lower bound for branch lengths
+ * @param  branch_length_max  upper bound for branch lengths
+ * @param  opt_method         optimization method to use (see PLLMOD_OPT_BLO_* constants)
+ * @param  brlen_linkage      branch length linkage mode (see PLLMOD_COMMON_BRLEN_* constants)
+ * @param  sum_mode           summation mode (see PLLMOD_COMMON_SUM_* constants)
+ * @param  parallel_context   context for parallel computation
+ * @param  parallel_reduce_cb callback function for parallel reduction
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_opt_optimize_branch_lengths_edges_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t ** edges,
+                                              unsigned int edge_count,
+                                              double * edge_loglh,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  unsigned int i;
+  int retval = PLL_FAILURE;
+
+  pllmod_reset_error();
+
+  /* NEWTON_SCHEDULED is implemented by pllmod_algo_opt_brlen_treeinfo() */
+  if (opt_method == PLLMOD_OPT_BLO_NEWTON_FALLBACK ||
+      opt_method == PLLMOD_OPT_BLO_NEWTON_GLOBAL ||
+      opt_method == PLLMOD_OPT_BLO_NEWTON_SCHEDULED)
+  {
+    pllmod_set_error(PLLMOD_ERROR_NOT_IMPLEMENTED,
+                     "Optimization method not implemented: "
+                     "NEWTON_FALLBACK, NEWTON_GLOBAL, NEWTON_SCHEDULED");
+    return PLL_FAILURE;
   }
 
-  if (params.brlen_buffers && !brlen_buffers)
+  if (!brlen_buffers)
   {
-    free(params.brlen_buffers[0]);
-    free(params.brlen_buffers);
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Branch length buffers are required");
+    return PLL_FAILURE;
   }
 
-  if (params.converged)
-    free(params.converged);
+  pll_newton_tree_params_multi_t params;
+  init_params_multi(&params, partitions, partition_count, NULL, params_indices,
+                    precomp_buffers, brlen_buffers, brlen_scalers,
+                    branch_length_min, branch_length_max, opt_method,
+                    brlen_linkage, sum_mode, parallel_context,
+                    parallel_reduce_cb);
 
-  if (params.brlen_guess)
-    free(params.brlen_guess);
+  if (!allocate_buffers(&params))
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for brlen opt variables");
+    goto cleanup;
+  }
 
-  if (params.brlen_orig)
-    free(params.brlen_orig);
+  for (i = 0; i < edge_count; ++i)
+  {
+    /* inner node side first, as in the local optimization */
+    pll_unode_t * edge = edges[i]->next ? edges[i] : edges[i]->back;
+    double loglikelihood = 0.;
 
-  return result;
-} /* pllmod_opt_optimize_branch_lengths_local */
+    /* reference score for the LH improvement check; it does not depend on
+     * other branches, since CLVs at both ends are not updated */
+    if (check_loglh_improvement(opt_method))
+    {
+      loglikelihood = compute_edge_loglikelihood_multi(
+                                                        partitions,
+                                                        partition_count,
+                                                        edge->clv_index,
+                                                        edge->scaler_index,
+                                                        edge->back->clv_index,
+                                                        edge->back->scaler_index,
+                                                        edge->pmatrix_index,
+                                                        params_indices,
+                                                        params.sum_mode,
+                                                        params.reduce_buffer,
+                                                        parallel_context,
+                                                        parallel_reduce_cb);
+    }
+
+    params.tree = edge;
+    if (!recomp_iterative_multi(&params, 0, &loglikelihood, 1))
+    {
+      assert(pll_errno);
+      goto cleanup;
+    }
+
+    /* with the improvement check, the score is already up-to-date */
+    if (edge_loglh)
+    {
+      edge_loglh[i] = check_loglh_improvement(opt_method) ? loglikelihood :
+          compute_edge_loglikelihood_multi(partitions,
+                                           partition_count,
+                                           edge->clv_index,
+                                           edge->scaler_index,
+                                           edge->back->clv_index,
+                                           edge->back->scaler_index,
+                                           edge->pmatrix_index,
+                                           params_indices,
+                                           params.sum_mode,
+                                           params.reduce_buffer,
+                                           parallel_context,
+                                           parallel_reduce_cb);
+    }
+  }
+
+  retval = PLL_SUCCESS;
+
+cleanup:
+  free_params_multi(&params, precomp_buffers, brlen_buffers);
+
+  return retval;
+}
@@ -81,6 +81,8 @@
 #define PLLMOD_OPT_BLO_NEWTON_SAFE        1 /* NR with per-branch LH check */
 #define PLLMOD_OPT_BLO_NEWTON_FALLBACK    2 /* NR-FAST with fallback to NR-SAFE */
 #define PLLMOD_OPT_BLO_NEWTON_GLOBAL      3 /* NR variant which looks for local optima */
+#define PLLMOD_OPT_BLO_NEWTON_SCHEDULED   4 /* NR-SAFE on a queue of edges ordered by
+                                               expected LH gain (treeinfo only) */
 
 #define PLLMOD_OPT_BLO_NEWTON_OLDFAST     10 /* old Newton-Raphson (a la IQTree) */
 #define PLLMOD_OPT_BLO_NEWTON_OLDSAFE     11 /* old NR with per-branch LH check */
@@ -161,6 +163,16 @@ typedef struct
   int opt_method;          /* see PLLMOD_OPT_BLO_* constants above */
 } pll_newton_tree_params_t;
 
+/* sumtables of individual branches, which stay valid as long as the CLVs
+ * at both ends of the branch do not change (see
+ * pllmod_opt_optimize_branch_lengths_local_cached) */
+typedef struct
+{
+  double *** sumtables;    /* [partition][pmatrix_index] */
+  unsigned long * stamp;   /* [pmatrix_index]: version of the sumtable */
+  unsigned long version;   /* current CLV version, incremented on changes */
+} pllmod_opt_sumtable_cache_t;
+
 typedef struct
 {
   pll_unode_t * tree;
@@ -179,6 +191,9 @@ typedef struct
   int max_newton_iters;
   int opt_method;          /* see PLLMOD_OPT_BLO_* constants above */
   int brlen_linkage;
+  int sum_mode;            /* see PLLMOD_COMMON_SUM_* constants */
+  double * reduce_buffer;  /* per-partition terms (reproducible sum) */
+  pllmod_opt_sumtable_cache_t * sumtable_cache;  /* NULL = no caching */
   void * parallel_context;
   void (*parallel_reduce_cb)(void *,
                              double *,
@@ -238,6 +253,20 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb(double *x,
                                                     void *,
                                                     double *));
 
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_par(double *x,
+                                                double *xmin,
+                                                double *xmax,
+                                                int *bound,
+                                                unsigned int n,
+                                                double factr,
+                                                double pgtol,
+                                                void *params,
+                                                void **thread_params,
+                                                void *pool,
+                                                double (*target_funk)(
+                                                        void *,
+                                                        double *));
+
 /* core Brent optimization function */
 PLL_EXPORT double pllmod_opt_minimize_brent(double xmin,
                                            double xguess,
@@ -321,6 +350,73 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
                                                                          size_t,
                                                                          int));
 
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi_mode (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** sumtable_buffers,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double lh_epsilon,
+                                              int max_iters,
+                                              int radius,
+                                              int keep_update,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int));
+
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_cached (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              pllmod_opt_sumtable_cache_t * sumtable_cache,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double lh_epsilon,
+                                              int max_iters,
+                                              int radius,
+                                              int keep_update,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int));
+
+PLL_EXPORT int pllmod_opt_optimize_branch_lengths_edges_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t ** edges,
+                                              unsigned int edge_count,
+                                              double * edge_loglh,
+                                              unsigned int ** params_indices,
+                                              double ** sumtable_buffers,
+                                              double ** brlen_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              int opt_method,
+                                              int brlen_linkage,
+                                              int sum_mode,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int));
+
 PLL_EXPORT int pllmod_opt_minimize_brent_multi(unsigned int xnum,
                                                int * opt_mask,
                                                double * xmin,
@@ -353,6 +449,46 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
                                                                          double *,
                                                                          int *));
 
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_grad(unsigned int xnum,
+                                                        double ** x,
+                                                        double ** xmin,
+                                                        double ** xmax,
+                                                        int ** bound,
+                                                        unsigned int * n,
+                                                        unsigned int nmax,
+                                                        double factr,
+                                                        double pgtol,
+                                                        void * params,
+                                                        double (*target_funk)(void *,
+                                                                              double **,
+                                                                              double *,
+                                                                              int *),
+                                                        int (*grad_funk)(void *,
+                                                                         double **,
+                                                                         double **,
+                                                                         int *));
+
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_par(unsigned int xnum,
+                                                       double ** x,
+                                                       double ** xmin,
+                                                       double ** xmax,
+                                                       int ** bound,
+                                                       unsigned int * n,
+                                                       unsigned int nmax,
+                                                       double factr,
+                                                       double pgtol,
+                                                       void * params,
+                                                       void ** thread_params,
+                                                       void * pool,
+                                                       double (*target_funk)(void *,
+                                                                             double **,
+                                                                             double *,
+                                                                             int *),
+                                                       int (*grad_funk)(void *,
+                                                                        double **,
+                                                                        double **,
+                                                                        int *));
+
 
 
 #endif /* PLL_OPTIMIZE_H_ */
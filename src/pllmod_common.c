@@ -23,11 +23,17 @@
   * @file rtree_operations.c
   *
   * @brief Common functions for PLL modules
+ *
+ * Error handling, a minimal pthreads-based worker pool and reproducible
+ * reductions.
   *
   * @author Diego Darriba
   * @author Alexey Kozlov
   */
 #include <stdarg.h>
+#include <float.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "pll.h"
 #include "pllmod_common.h"
@@ -60,3 +66,400 @@ void pllmod_reset_error()
   pll_errno = 0;
   strcpy(pll_errmsg, "");
 }
+
+/******************************************************************************/
+/* thread pool */
+
+typedef struct pllmod_thread_worker
+{
+  pllmod_thread_pool_t * pool;
+  unsigned int thread_index;
+} pllmod_thread_worker_t;
+
+struct pllmod_thread_pool
+{
+  unsigned int thread_count;
+  pthread_t * threads;
+  pllmod_thread_worker_t * workers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  unsigned long generation;
+  int shutdown;
+
+  /* current job */
+  pllmod_thread_task_cb task_cb;
+  void * task_data;
+  unsigned int task_count;
+  unsigned int next_task;
+  unsigned int busy_workers;
+
+  /* error raised by the failed task with the lowest index */
+  unsigned int error_task;
+  int error_code;
+  char error_msg[PLLMOD_ERRMSG_LEN];
+};
+
+static void thread_pool_process_tasks(pllmod_thread_pool_t * pool,
+                                      unsigned int thread_index)
+{
+  unsigned int task_index;
+
+  while (1)
+  {
+    pthread_mutex_lock(&pool->mutex);
+    task_index = pool->next_task++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (task_index >= pool->task_count)
+      break;
+
+    pllmod_reset_error();
+
+    if (!pool->task_cb(pool->task_data, task_index, thread_index))
+    {
+      /* pll_errno is thread-local, so keep a copy for the calling thread */
+      pthread_mutex_lock(&pool->mutex);
+      if (task_index < pool->error_task)
+      {
+        pool->error_task = task_index;
+        pool->error_code = pll_errno ? pll_errno : PLLMOD_ERROR_THREAD_INIT;
+        strncpy(pool->error_msg, pll_errmsg, PLLMOD_ERRMSG_LEN - 1);
+        pool->error_msg[PLLMOD_ERRMSG_LEN - 1] = '\0';
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
+  }
+}
+
+static void * thread_pool_worker(void * arg)
+{
+  pllmod_thread_worker_t * worker = (pllmod_thread_worker_t *) arg;
+  pllmod_thread_pool_t * pool = worker->pool;
+  unsigned long generation = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1)
+  {
+    while (!pool->shutdown && pool->generation == generation)
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+    if (pool->shutdown)
+      break;
+
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+
+    thread_pool_process_tasks(pool, worker->thread_index);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->busy_workers == 0)
+      pthread_cond_signal(&pool->done_cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+/**
+ * Create a pool of worker threads.
+ *
+ * The calling thread takes part in every job as thread 0, hence only
+ * `thread_count-1` additional threads are started. Threads are kept alive
+ * until the pool is destroyed.
+ *
+ * @param thread_count total number of threads (including the caller)
+ *
+ * @return the new pool, or NULL on error (pll_errno is set)
+ */
+pllmod_thread_pool_t * pllmod_thread_pool_create(unsigned int thread_count)
+{
+  unsigned int i;
+
+  if (!thread_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Thread count must be positive\n");
+    return NULL;
+  }
+
+  pllmod_thread_pool_t * pool =
+      (pllmod_thread_pool_t *) calloc(1, sizeof(pllmod_thread_pool_t));
+  if (!pool)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for thread pool\n");
+    return NULL;
+  }
+
+  pool->thread_count = 1;
+  pool->error_task = ~0u;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  if (thread_count > 1)
+  {
+    pool->threads = (pthread_t *) calloc(thread_count, sizeof(pthread_t));
+    pool->workers = (pllmod_thread_worker_t *)
+                          calloc(thread_count, sizeof(pllmod_thread_worker_t));
+    if (!pool->threads || !pool->workers)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for worker threads\n");
+      pllmod_thread_pool_destroy(pool);
+      return NULL;
+    }
+
+    for (i = 1; i < thread_count; ++i)
+    {
+      pool->workers[i].pool = pool;
+      pool->workers[i].thread_index = i;
+      if (pthread_create(&pool->threads[i], NULL, thread_pool_worker,
+                         &pool->workers[i]))
+      {
+        pllmod_set_error(PLLMOD_ERROR_THREAD_INIT,
+                         "Cannot start worker thread %u\n", i);
+        pllmod_thread_pool_destroy(pool);
+        return NULL;
+      }
+      pool->thread_count++;
+    }
+  }
+
+  return pool;
+}
+
+/**
+ * Return the number of threads in the pool (including the caller).
+ */
+unsigned int pllmod_thread_pool_size(const pllmod_thread_pool_t * pool)
+{
+  return pool ? pool->thread_count : 1;
+}
+
+/**
+ * Run `task_count` independent tasks on the pool and wait for completion.
+ *
+ * Tasks are handed out dynamically, so the thread that executes a given task
+ * is not fixed; callbacks must only use per-thread state indexed by
+ * `thread_index` and per-task state indexed by `task_index`.
+ * A NULL pool executes all tasks sequentially in the calling thread.
+ *
+ * @param pool the thread pool (can be NULL)
+ * @param task_count number of tasks
+ * @param task_cb task callback
+ * @param data user data passed to the callback
+ *
+ * @return PLL_SUCCESS if all tasks succeeded, PLL_FAILURE otherwise. In the
+ * latter case the error of the failed task with the lowest index is set
+ */
+int pllmod_thread_pool_run(pllmod_thread_pool_t * pool,
+                           unsigned int task_count,
+                           pllmod_thread_task_cb task_cb,
+                           void * data)
+{
+  unsigned int i;
+
+  if (!pool || pool->thread_count == 1 || task_count < 2)
+  {
+    for (i = 0; i < task_count; ++i)
+    {
+      if (!task_cb(data, i, 0))
+        return PLL_FAILURE;
+    }
+    return PLL_SUCCESS;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->task_cb = task_cb;
+  pool->task_data = data;
+  pool->task_count = task_count;
+  pool->next_task = 0;
+  pool->busy_workers = pool->thread_count - 1;
+  pool->error_task = ~0u;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  thread_pool_process_tasks(pool, 0);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->busy_workers > 0)
+    pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (pool->error_task != ~0u)
+  {
+    pllmod_set_error(pool->error_code, "%s", pool->error_msg);
+    return PLL_FAILURE;
+  }
+
+  pllmod_reset_error();
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Stop all worker threads and deallocate the pool.
+ */
+void pllmod_thread_pool_destroy(pllmod_thread_pool_t * pool)
+{
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (i = 1; i < pool->thread_count; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->mutex);
+
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+}
+
+/* bits per bin of the reproducible sum: up to 2^(53-BITS) values (summed over
+ * all ranks) can be accumulated in a bin without any rounding error */
+#define REPRO_BIN_BITS   32
+#define REPRO_BIN_COUNT  3
+
+/**
+ * Compute reproducible sums of `vector_count` vectors of `count` values each,
+ * over all local values and all parallel ranks.
+ *
+ * Every value is split into REPRO_BIN_COUNT parts which are integer multiples
+ * of fixed quanta derived from the global maximum magnitude. Those parts are
+ * added up exactly, hence the result is bit-identical for any order of
+ * summation and any distribution of the values among threads or ranks
+ * (up to 2^21 non-zero values per vector). Relative to the largest value,
+ * the truncation error is below 2^-96.
+ *
+ * @param values input values, vector v is stored at values[v*count]
+ * @param count number of values per vector
+ * @param vector_count number of vectors
+ * @param[out] sums resulting sums, one per vector (may alias `values` if
+ *                  count == 1)
+ * @param parallel_context context for parallel computation
+ * @param parallel_reduce_cb callback function for parallel reduction (or NULL)
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE (memory allocation error)
+ */
+int pllmod_reduce_sum_reproducible(const double * values,
+                                   size_t count,
+                                   size_t vector_count,
+                                   double * sums,
+                                   void * parallel_context,
+                                   void (*parallel_reduce_cb)(void *,
+                                                              double *,
+                                                              size_t,
+                                                              int))
+{
+  size_t v, i;
+  unsigned int b;
+
+  double * max_abs = (double *) calloc(vector_count * (REPRO_BIN_COUNT + 1),
+                                       sizeof(double));
+  if (!max_abs)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for reduction buffer\n");
+    return PLL_FAILURE;
+  }
+
+  double * bins = max_abs + vector_count;
+
+  /* 1st pass: find global maximum magnitude which defines the quanta */
+  for (v = 0; v < vector_count; ++v)
+  {
+    const double * x = values + v * count;
+    for (i = 0; i < count; ++i)
+    {
+      const double a = fabs(x[i]);
+      if (a > max_abs[v] || isnan(a))
+        max_abs[v] = a;
+    }
+  }
+
+  if (parallel_reduce_cb)
+  {
+    parallel_reduce_cb(parallel_context, max_abs, vector_count,
+                       PLLMOD_COMMON_REDUCE_MAX);
+  }
+
+  /* 2nd pass: split values into bins; bin sums are exact */
+  for (v = 0; v < vector_count; ++v)
+  {
+    const double * x = values + v * count;
+    double * vbins = bins + v * REPRO_BIN_COUNT;
+
+    if (max_abs[v] == 0.)
+      continue;
+    else if (!isfinite(max_abs[v]))
+    {
+      /* let NaN and infinity propagate */
+      for (i = 0; i < count; ++i)
+        vbins[0] += x[i];
+      continue;
+    }
+
+    int max_exp;
+    frexp(max_abs[v], &max_exp);
+
+    for (i = 0; i < count; ++i)
+    {
+      double r = x[i];
+      double quantum = ldexp(1., max_exp - REPRO_BIN_BITS);
+
+      for (b = 0; b < REPRO_BIN_COUNT && quantum >= DBL_MIN; ++b)
+      {
+        const double part = quantum * trunc(r / quantum);
+        vbins[b] += part;
+        r -= part;
+        quantum = ldexp(quantum, -REPRO_BIN_BITS);
+      }
+    }
+  }
+
+  if (parallel_reduce_cb)
+  {
+    parallel_reduce_cb(parallel_context, bins, vector_count * REPRO_BIN_COUNT,
+                       PLLMOD_COMMON_REDUCE_SUM);
+  }
+
+  /* combine bins in fixed order */
+  for (v = 0; v < vector_count; ++v)
+  {
+    const double * vbins = bins + v * REPRO_BIN_COUNT;
+    double sum = 0.;
+    for (b = 0; b < REPRO_BIN_COUNT; ++b)
+      sum += vbins[b];
+    sums[v] = sum;
+  }
+
+  free(max_abs);
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Monotonic wall-clock time in seconds, for measuring time intervals.
+ */
+double pllmod_time_wall(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
@@ -22,6 +22,8 @@
 #ifndef PLLMOD_COMMON_H_
 #define PLLMOD_COMMON_H_
 
+#include <stddef.h>
+
 #define PLLMOD_COMMON_BRLEN_LINKED    0
 #define PLLMOD_COMMON_BRLEN_SCALED    1
 #define PLLMOD_COMMON_BRLEN_UNLINKED  2
@@ -30,6 +32,10 @@
 #define PLLMOD_COMMON_REDUCE_MAX     1
 #define PLLMOD_COMMON_REDUCE_MIN     2
 
+/* summation mode for reductions over partitions and parallel ranks */
+#define PLLMOD_COMMON_SUM_FAST          0
+#define PLLMOD_COMMON_SUM_REPRODUCIBLE  1
+
 #define PLLMOD_UNUSED(expr) do { (void)(expr); } while (0)
 
 #define PLLMOD_ERRMSG_LEN 200
@@ -39,8 +45,37 @@
 #define PLLMOD_ERROR_INVALID_NODE_TYPE            1002
 #define PLLMOD_ERROR_INVALID_INDEX                1003
 #define PLLMOD_ERROR_NOT_IMPLEMENTED              1004
+#define PLLMOD_ERROR_THREAD_INIT                  1005
+
+/* pool of worker threads shared by the modules (see pllmod_common.c) */
+typedef struct pllmod_thread_pool pllmod_thread_pool_t;
+
+/* task callback: returns PLL_SUCCESS or PLL_FAILURE (with pll_errno set) */
+typedef int (*pllmod_thread_task_cb)(void * data,
+                                     unsigned int task_index,
+                                     unsigned int thread_index);
 
 void pllmod_set_error(int errno, const char* errmsg_fmt, ...);
 void pllmod_reset_error();
 
+pllmod_thread_pool_t * pllmod_thread_pool_create(unsigned int thread_count);
+unsigned int pllmod_thread_pool_size(const pllmod_thread_pool_t * pool);
+int pllmod_thread_pool_run(pllmod_thread_pool_t * pool,
+                           unsigned int task_count,
+                           pllmod_thread_task_cb task_cb,
+                           void * data);
+void pllmod_thread_pool_destroy(pllmod_thread_pool_t * pool);
+
+double pllmod_time_wall(void);
+
+int pllmod_reduce_sum_reproducible(const double * values,
+                                   size_t count,
+                                   size_t vector_count,
+                                   double * sums,
+                                   void * parallel_context,
+                                   void (*parallel_reduce_cb)(void *,
+                                                              double *,
+                                                              size_t,
+                                                              int));
+
 #endif
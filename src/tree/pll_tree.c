@@ -119,8 +119,9 @@ PLL_EXPORT int pllmod_utree_tbr(pll_unode_t * b_edge,
     rollback_info->rearrange_type     = PLLMOD_TREE_REARRANGE_TBR;
     rollback_info->rooted             = 0;
     rollback_info->TBR.bisect_edge    = (void *) b_edge;
-    rollback_info->TBR.reconn_edge.edge.utree.parent = b_edge->next->next;
-    rollback_info->TBR.reconn_edge.edge.utree.child  = b_edge->back->next->next;
+    /* original neighbours: reconnecting there undoes the move */
+    rollback_info->TBR.reconn_edge.edge.utree.parent = b_edge->next->back;
+    rollback_info->TBR.reconn_edge.edge.utree.child  = b_edge->back->next->back;
     rollback_info->TBR.reconn_edge.length = b_edge->length;
 
     rollback_info->TBR.bisect_left_bl = r_edge->edge.utree.parent->length;
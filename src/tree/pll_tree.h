@@ -65,6 +65,29 @@
 
 #define PLLMOD_TREEINFO_PARTITION_ALL -1
 
+/* profiling categories, see pllmod_treeinfo_get_stats() */
+#define PLLMOD_TREEINFO_STATS_CLV       0  /* CLV updates */
+#define PLLMOD_TREEINFO_STATS_PMATRIX   1  /* p-matrix updates */
+#define PLLMOD_TREEINFO_STATS_LOGLH     2  /* edge log-likelihood evaluations */
+#define PLLMOD_TREEINFO_STATS_REGRAFT   3  /* SPR regraft scoring calls */
+#define PLLMOD_TREEINFO_STATS_BRLEN     4  /* branch length optimization calls */
+#define PLLMOD_TREEINFO_STATS_MODEL     5  /* model parameter target evaluations */
+#define PLLMOD_TREEINFO_STATS_BRLEN_SKIP 6 /* edge visits saved by scheduled BLO */
+#define PLLMOD_TREEINFO_STATS_COUNT     7
+
+/* CLV storage modes: one CLV per inner node, per directed edge, or a bounded
+ * pool of CLV slots shared by all inner nodes */
+#define PLLMOD_TREEINFO_CLV_NODE  0
+#define PLLMOD_TREEINFO_CLV_EDGE  1
+#define PLLMOD_TREEINFO_CLV_POOL  2
+
+/* offsets in the per-partition model gradient of a rate matrix with the given
+ * number of states, see pllmod_treeinfo_compute_model_gradient() */
+#define PLLMOD_TREEINFO_GRAD_FREQS(states) ((states) * ((states) - 1) / 2)
+#define PLLMOD_TREEINFO_GRAD_ALPHA(states) (PLLMOD_TREEINFO_GRAD_FREQS(states) + (states))
+#define PLLMOD_TREEINFO_GRAD_PINV(states)  (PLLMOD_TREEINFO_GRAD_ALPHA(states) + 1)
+#define PLLMOD_TREEINFO_GRAD_SIZE(states)  (PLLMOD_TREEINFO_GRAD_PINV(states) + 1)
+
 #define HASH_KEY_UNDEF ((unsigned int) -1)
 
 typedef unsigned int pll_split_base_t;
@@ -205,6 +228,27 @@ typedef struct treeinfo_topology
   double ** branch_lengths;
 } pllmod_treeinfo_topology_t;
 
+/* operation counts and wall-clock time (in seconds) per category, see
+ * PLLMOD_TREEINFO_STATS_* constants */
+typedef struct treeinfo_stats
+{
+  unsigned long count[PLLMOD_TREEINFO_STATS_COUNT];
+  double time[PLLMOD_TREEINFO_STATS_COUNT];
+} pllmod_treeinfo_stats_t;
+
+/* site range of a partition which is processed as a single work unit */
+typedef struct treeinfo_shard
+{
+  unsigned int partition_index;
+  unsigned int site_offset;
+  unsigned int sites;
+  pll_partition_t * partition;  /* the partition itself, or a view on sites
+                                   [site_offset, site_offset+sites) of it */
+  pll_partition_t parent;  /* parent partition at the last view update */
+  double loglh;
+  pllmod_treeinfo_stats_t stats;  /* collected by tasks, see treeinfo.c */
+} pllmod_treeinfo_shard_t;
+
 typedef struct treeinfo
 {
   // dimensions
@@ -239,14 +283,37 @@ typedef struct treeinfo
 
   /* tree topology constraint */
   unsigned int * constraint;
+  /* cached constraint groups for regrafting one subtree, see
+   * pllmod_treeinfo_set_constraint_subtree() and treeinfo.c */
+  void * constraint_index;
 
   /* precomputation buffers for derivatives (aka "sumtable") */
   double ** deriv_precomp;
+  /* optional per-branch sumtables [partition][pmatrix_index], reused by
+   * branch length optimization while CLVs do not change, see
+   * pllmod_treeinfo_set_sumtable_cache() */
+  double *** deriv_precomp_edges;
+  unsigned long * deriv_precomp_stamp;  /* clv_version of each sumtable */
+  unsigned long clv_version;  /* incremented whenever CLVs might change */
 
   // invalidation flags
   char ** clv_valid;
   char ** pmatrix_valid;
 
+  /* (scaled) branch lengths p-matrices were computed for, NAN = unknown;
+   * invalid p-matrices are not recomputed if their branch length is the same */
+  double ** pmatrix_brlen;
+
+  /* CLV storage mode, see PLLMOD_TREEINFO_CLV_* constants */
+  int clv_mode;
+  /* 1 = CLVs for both directions of all edges are valid (edge mode only) */
+  int clv_alledges_valid;
+
+  /* CLV slot allocator (pool mode only), see treeinfo.c */
+  void * clv_pool;
+  unsigned long clv_pool_evictions;       /* valid CLVs dropped from the pool */
+  unsigned long clv_pool_recomputations;  /* dropped CLVs computed again */
+
   // buffers
   pll_unode_t ** travbuffer;
   unsigned int * matrix_indices;
@@ -258,9 +325,29 @@ typedef struct treeinfo
   // general-purpose counter
   unsigned int counter;
 
+  /* profiling: CLV, p-matrix and likelihood work per partition, and
+   * regraft/branch length/model optimization calls for the whole tree */
+  pllmod_treeinfo_stats_t * partition_stats;
+  pllmod_treeinfo_stats_t stats;
+
   // parallelization stuff
   void * parallel_context;
   void (*parallel_reduce_cb)(void *, double *, size_t, int);
+  int sum_mode;  /* see PLLMOD_COMMON_SUM_* constants */
+
+  /* shared-memory parallelization (see pllmod_treeinfo_set_thread_count) */
+  void * thread_pool;
+  unsigned int * partition_order;  /* local partitions, most expensive first */
+
+  /* partitions with more than shard_sites sites are split into site ranges
+   * (see pllmod_treeinfo_set_shard_sites), 0 = do not split */
+  unsigned int shard_sites;
+  unsigned int shard_count;
+  pllmod_treeinfo_shard_t * shards;  /* work units, most expensive first */
+
+  /* tip data shared with other clones (see pllmod_treeinfo_clone),
+   * NULL = partitions are owned by the caller */
+  void * tipdata;
 } pllmod_treeinfo_t;
 
 typedef struct
@@ -592,6 +679,24 @@ int pllmod_treeinfo_set_parallel_context(pllmod_treeinfo_t * treeinfo,
                                                                     size_t,
                                                                     int op));
 
+PLL_EXPORT int pllmod_treeinfo_set_sum_mode(pllmod_treeinfo_t * treeinfo,
+                                            int sum_mode);
+
+PLL_EXPORT int pllmod_treeinfo_set_thread_count(pllmod_treeinfo_t * treeinfo,
+                                                unsigned int thread_count);
+
+PLL_EXPORT int pllmod_treeinfo_set_sumtable_cache(pllmod_treeinfo_t * treeinfo,
+                                                  int enable);
+
+PLL_EXPORT int pllmod_treeinfo_get_stats(const pllmod_treeinfo_t * treeinfo,
+                                         int partition_index,
+                                         pllmod_treeinfo_stats_t * stats);
+
+PLL_EXPORT void pllmod_treeinfo_reset_stats(pllmod_treeinfo_t * treeinfo);
+
+PLL_EXPORT int pllmod_treeinfo_set_shard_sites(pllmod_treeinfo_t * treeinfo,
+                                               unsigned int shard_sites);
+
 PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
                                            unsigned int partition_index,
                                            pll_partition_t * partition,
@@ -642,11 +747,20 @@ int pllmod_treeinfo_set_topology(pllmod_treeinfo_t * treeinfo,
 PLL_EXPORT
 int pllmod_treeinfo_destroy_topology(pllmod_treeinfo_topology_t * topol);
 
+PLL_EXPORT
+int pllmod_treeinfo_copy_model(pllmod_treeinfo_t * dst,
+                               const pllmod_treeinfo_t * src);
+
 PLL_EXPORT int pllmod_treeinfo_destroy_partition(pllmod_treeinfo_t * treeinfo,
                                                  unsigned int partition_index);
 
 PLL_EXPORT void pllmod_treeinfo_destroy(pllmod_treeinfo_t * treeinfo);
 
+PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_clone(const pllmod_treeinfo_t * treeinfo);
+
+PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_clone_tree(const pllmod_treeinfo_t * treeinfo,
+                                                          const pll_utree_t * tree);
+
 PLL_EXPORT int pllmod_treeinfo_update_prob_matrices(pllmod_treeinfo_t * treeinfo,
                                                     int update_all);
 
@@ -659,6 +773,8 @@ PLL_EXPORT int pllmod_treeinfo_validate_clvs(pllmod_treeinfo_t * treeinfo,
 PLL_EXPORT void pllmod_treeinfo_invalidate_pmatrix(pllmod_treeinfo_t * treeinfo,
                                                    const pll_unode_t * edge);
 
+PLL_EXPORT void pllmod_treeinfo_sync_pmatrix_cache(pllmod_treeinfo_t * treeinfo);
+
 PLL_EXPORT void pllmod_treeinfo_invalidate_clv(pllmod_treeinfo_t * treeinfo,
                                                const pll_unode_t * edge);
 
@@ -673,6 +789,35 @@ PLL_EXPORT double pllmod_treeinfo_compute_loglh_persite(pllmod_treeinfo_t * tree
                                                         int incremental,
                                                         double ** persite_lnl);
 
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_masked(pllmod_treeinfo_t * treeinfo,
+                                                       int incremental,
+                                                       const int * partition_mask);
+
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_regraft(pllmod_treeinfo_t * treeinfo,
+                                                        pll_unode_t * pruned_edge,
+                                                        pll_unode_t * regraft_edge,
+                                                        double min_brlen);
+
+PLL_EXPORT int pllmod_treeinfo_compute_loglh_batch(pllmod_treeinfo_t * treeinfo,
+                                                   pll_utree_t ** trees,
+                                                   unsigned int tree_count,
+                                                   double * tree_loglh,
+                                                   double *** persite_lnl);
+
+PLL_EXPORT int pllmod_treeinfo_set_clv_mode(pllmod_treeinfo_t * treeinfo,
+                                            int clv_mode);
+
+PLL_EXPORT int pllmod_treeinfo_compute_clvs_alledges(pllmod_treeinfo_t * treeinfo);
+
+PLL_EXPORT int pllmod_treeinfo_compute_loglh_alledges(pllmod_treeinfo_t * treeinfo,
+                                                      double * edge_loglh);
+
+PLL_EXPORT int pllmod_treeinfo_compute_model_gradient(pllmod_treeinfo_t * treeinfo,
+                                                      unsigned int params_index,
+                                                      double ** gradient);
+
+PLL_EXPORT void pllmod_treeinfo_invalidate_outward_clvs(pllmod_treeinfo_t * treeinfo);
+
 PLL_EXPORT
 int pllmod_treeinfo_scale_branches_all(pllmod_treeinfo_t * treeinfo, double scaler);
 
@@ -697,6 +842,13 @@ PLL_EXPORT int pllmod_treeinfo_check_constraint(pllmod_treeinfo_t * treeinfo,
                                                 pll_unode_t * subtree,
                                                 pll_unode_t * regraft_edge);
 
+PLL_EXPORT int pllmod_treeinfo_set_constraint_subtree(pllmod_treeinfo_t * treeinfo,
+                                                      pll_unode_t * subtree);
+
+PLL_EXPORT int pllmod_treeinfo_check_constraint_region(pllmod_treeinfo_t * treeinfo,
+                                                       pll_unode_t * subtree,
+                                                       pll_unode_t * edge);
+
 PLL_EXPORT pllmod_ancestral_t * pllmod_treeinfo_compute_ancestral(pllmod_treeinfo_t * treeinfo);
 
 PLL_EXPORT void pllmod_treeinfo_destroy_ancestral(pllmod_ancestral_t * ancestral);
@@ -23,9 +23,80 @@
 
 #include "../pllmod_common.h"
 
+#include <pthread.h>
+
+/* CLV pool mode: inner nodes borrow one of slot_count CLV/scaler slots while
+ * their CLV is needed and lose it to LRU eviction afterwards, so partitions
+ * can be allocated with (much) fewer CLV buffers than there are inner nodes */
+typedef struct treeinfo_clv_pool
+{
+  unsigned int slot_count;
+  pll_unode_t ** slot_node;    /* slot owner (any subnode), NULL = free */
+  unsigned int * slot_pins;    /* > 0: slot is still read by the traversal */
+  unsigned long * slot_stamp;  /* last use, for LRU eviction */
+  unsigned long * slot_wanted; /* = serial: CLV is needed by the traversal */
+  int * node_slot;             /* node_index -> slot, -1 = not resident */
+  unsigned int * need;         /* node_index -> slots needed to compute CLV */
+  char * evicted;              /* node_index -> valid CLV has been evicted */
+  unsigned long clock;
+  unsigned long serial;
+} treeinfo_clv_pool_t;
+
+/* tip data (tip CLVs or tipchars, pattern weights) shared read-only between
+ * treeinfo clones, see pllmod_treeinfo_clone(). The buffers are copied from
+ * the partitions of the cloned treeinfo once, and freed with the last clone */
+typedef struct treeinfo_tipdata
+{
+  pthread_mutex_t mutex;
+  unsigned int refcount;
+  unsigned int partition_count;
+  unsigned int * attributes;       /* attributes of partition, 0 = inactive */
+  unsigned int * tips;
+  void *** tip_buffers;            /* tip CLVs, or tipchars in pattern tip mode */
+  unsigned int ** pattern_weights;
+} treeinfo_tipdata_t;
+
+/* constraint groups of directed subtrees (find_cons_id() results), cached
+ * while one subtree is regrafted onto many branches of an otherwise fixed
+ * tree, see pllmod_treeinfo_set_constraint_subtree() */
+typedef struct treeinfo_cons_index
+{
+  pll_unode_t * subtree;      /* subtree being regrafted, NULL = no caching */
+  unsigned int group;         /* constraint group of the subtree */
+  unsigned int epoch;         /* incremented on every set_constraint_subtree */
+  unsigned int * stamp;       /* node_index -> epoch of the cached group */
+  unsigned int * node_group;  /* node_index -> cached group */
+} treeinfo_cons_index_t;
+
 static int treeinfo_check_tree(pllmod_treeinfo_t * treeinfo,
                                pll_utree_t * tree);
 static int treeinfo_init_tree(pllmod_treeinfo_t * treeinfo);
+static int treeinfo_check_clv_buffers(const pllmod_treeinfo_t * treeinfo,
+                                      const pll_partition_t * partition);
+static void treeinfo_assign_clv_indices(pllmod_treeinfo_t * treeinfo);
+static void treeinfo_sort_partitions(pllmod_treeinfo_t * treeinfo);
+static int treeinfo_create_shards(pllmod_treeinfo_t * treeinfo,
+                                  unsigned int partition_index);
+static void treeinfo_sync_shard(pllmod_treeinfo_t * treeinfo,
+                                pllmod_treeinfo_shard_t * shard);
+static void treeinfo_destroy_shards(pllmod_treeinfo_t * treeinfo);
+static int treeinfo_check_pool_buffers(const pllmod_treeinfo_t * treeinfo,
+                                       const pll_partition_t * partition);
+static void treeinfo_pool_reset(pllmod_treeinfo_t * treeinfo);
+static void treeinfo_pool_destroy(treeinfo_clv_pool_t * pool);
+static void treeinfo_clone_partition_destroy(pll_partition_t * partition);
+static void treeinfo_tipdata_release(treeinfo_tipdata_t * tipdata);
+static void treeinfo_cons_index_destroy(treeinfo_cons_index_t * index);
+static int treeinfo_sumtable_cache_alloc(pllmod_treeinfo_t * treeinfo,
+                                         unsigned int partition_index);
+static void treeinfo_sumtable_cache_free(pllmod_treeinfo_t * treeinfo,
+                                         unsigned int partition_index);
+static int treeinfo_pool_traverse(pllmod_treeinfo_t * treeinfo,
+                                  pll_unode_t ** targets,
+                                  unsigned int target_count,
+                                  pll_unode_t * scratch,
+                                  unsigned int * trav_size,
+                                  unsigned int * ops_count);
 
 /* a callback function for performing a full traversal */
 static int cb_full_traversal(pll_unode_t * node)
@@ -67,6 +138,29 @@ static int treeinfo_partition_active(pllmod_treeinfo_t * treeinfo,
           treeinfo->active_partition == (int) partition_index);
 }
 
+/* partition is excluded from the computation by partition_mask[p] == 0,
+ * see pllmod_treeinfo_compute_loglh_masked() */
+static int treeinfo_partition_masked(const int * partition_mask,
+                                     unsigned int partition_index)
+{
+  return partition_mask && !partition_mask[partition_index];
+}
+
+/* account for count operations of the given category which started at
+ * start_time, and return the current time */
+static double treeinfo_stats_add(pllmod_treeinfo_stats_t * stats,
+                                 int category,
+                                 unsigned long count,
+                                 double start_time)
+{
+  double now = pllmod_time_wall();
+
+  stats->count[category] += count;
+  stats->time[category] += now - start_time;
+
+  return now;
+}
+
 PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
                                                       unsigned int tips,
                                                       unsigned int partitions,
@@ -139,11 +233,15 @@ PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
   treeinfo->deriv_precomp = (double **) calloc(partitions, sizeof(double*));
   treeinfo->clv_valid = (char **) calloc(partitions, sizeof(char*));
   treeinfo->pmatrix_valid = (char **) calloc(partitions, sizeof(char*));
+  treeinfo->pmatrix_brlen = (double **) calloc(partitions, sizeof(double*));
   treeinfo->partition_loglh = (double *) calloc(partitions, sizeof(double));
+  treeinfo->partition_stats = (pllmod_treeinfo_stats_t *) calloc(partitions,
+                                              sizeof(pllmod_treeinfo_stats_t));
 
   treeinfo->init_partition_count = 0;
   treeinfo->init_partition_idx = (unsigned int *) calloc(partitions, sizeof(unsigned int));
   treeinfo->init_partitions = (pll_partition_t **) calloc(partitions, sizeof(pll_partition_t *));
+  treeinfo->partition_order = (unsigned int *) calloc(partitions, sizeof(unsigned int));
 
   /* allocate array for storing linked/average branch lengths */
   treeinfo->linked_branch_lengths = (double *) malloc(branch_count * sizeof(double));
@@ -158,8 +256,10 @@ PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
   if (!treeinfo->partitions || !treeinfo->alphas || !treeinfo->param_indices ||
       !treeinfo->subst_matrix_symmetries || !treeinfo->branch_lengths ||
       !treeinfo->deriv_precomp || !treeinfo->clv_valid || !treeinfo->pmatrix_valid ||
-      !treeinfo->linked_branch_lengths || !treeinfo->partition_loglh ||
+      !treeinfo->pmatrix_brlen || !treeinfo->linked_branch_lengths ||
+      !treeinfo->partition_loglh || !treeinfo->partition_stats ||
       !treeinfo->gamma_mode || !treeinfo->init_partition_idx ||
+      !treeinfo->partition_order ||
       (brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED && !treeinfo->brlen_scalers))
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
@@ -226,6 +326,245 @@ int pllmod_treeinfo_set_parallel_context(pllmod_treeinfo_t * treeinfo,
   return PLL_SUCCESS;
 }
 
+PLL_EXPORT int pllmod_treeinfo_set_sum_mode(pllmod_treeinfo_t * treeinfo,
+                                            int sum_mode)
+{
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Treeinfo structure is NULL\n");
+    return PLL_FAILURE;
+  }
+  else if (sum_mode != PLLMOD_COMMON_SUM_FAST &&
+           sum_mode != PLLMOD_COMMON_SUM_REPRODUCIBLE)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Invalid summation mode: %d\n", sum_mode);
+    return PLL_FAILURE;
+  }
+
+  treeinfo->sum_mode = sum_mode;
+
+  return PLL_SUCCESS;
+}
+
+PLL_EXPORT int pllmod_treeinfo_set_thread_count(pllmod_treeinfo_t * treeinfo,
+                                                unsigned int thread_count)
+{
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Treeinfo structure is NULL\n");
+    return PLL_FAILURE;
+  }
+  else if (!thread_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Thread count must be positive\n");
+    return PLL_FAILURE;
+  }
+
+  pllmod_thread_pool_t * pool = (pllmod_thread_pool_t *) treeinfo->thread_pool;
+
+  if (thread_count == (pool ? pllmod_thread_pool_size(pool) : 1))
+    return PLL_SUCCESS;
+
+  pllmod_thread_pool_destroy(pool);
+  treeinfo->thread_pool = NULL;
+
+  /* with a single thread, partitions are processed inline */
+  if (thread_count > 1)
+  {
+    treeinfo->thread_pool = pllmod_thread_pool_create(thread_count);
+    if (!treeinfo->thread_pool)
+      return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int treeinfo_sumtable_cache_alloc(pllmod_treeinfo_t * treeinfo,
+                                         unsigned int partition_index)
+{
+  const pll_partition_t * partition = treeinfo->partitions[partition_index];
+  const unsigned int edge_count = treeinfo->tree->edge_count;
+  unsigned int sites_alloc, precomp_size, m;
+  double ** sumtables;
+
+  sumtables = (double **) calloc(edge_count, sizeof(double *));
+  if (!sumtables)
+    return PLL_FAILURE;
+
+  treeinfo->deriv_precomp_edges[partition_index] = sumtables;
+
+  sites_alloc = partition->sites;
+  if (partition->attributes & PLL_ATTRIB_AB_FLAG)
+    sites_alloc += partition->states;
+  precomp_size = sites_alloc * partition->rate_cats * partition->states_padded;
+
+  for (m = 0; m < edge_count; ++m)
+  {
+    sumtables[m] = (double *) pll_aligned_alloc(precomp_size * sizeof(double),
+                                                partition->alignment);
+    if (!sumtables[m])
+      return PLL_FAILURE;
+  }
+
+  /* the new partition has no valid sumtables yet */
+  treeinfo->clv_version++;
+
+  return PLL_SUCCESS;
+}
+
+static void treeinfo_sumtable_cache_free(pllmod_treeinfo_t * treeinfo,
+                                         unsigned int partition_index)
+{
+  double ** sumtables = treeinfo->deriv_precomp_edges[partition_index];
+  unsigned int m;
+
+  if (!sumtables)
+    return;
+
+  for (m = 0; m < treeinfo->tree->edge_count; ++m)
+    pll_aligned_free(sumtables[m]);
+
+  free(sumtables);
+  treeinfo->deriv_precomp_edges[partition_index] = NULL;
+}
+
+/**
+ * Enable or disable caching of sumtables for all branches.
+ *
+ * With the cache enabled, branch length optimization keeps the sumtable of
+ * every branch and recomputes it only if the CLVs at the ends of the branch
+ * might have changed since, i.e. if another branch length, the topology or
+ * the model has changed (see `clv_version`). Later smoothing passes thus
+ * skip the sumtables of branches that are not affected by changes.
+ *
+ * NOTE: the cache needs one sumtable per branch and partition, which is
+ * about as much memory as the CLVs of all inner nodes.
+ *
+ * @param enable 1 = allocate and use the cache, 0 = free it
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_treeinfo_set_sumtable_cache(pllmod_treeinfo_t * treeinfo,
+                                                  int enable)
+{
+  unsigned int i, p;
+
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Treeinfo structure is NULL\n");
+    return PLL_FAILURE;
+  }
+
+  if (enable && !treeinfo->deriv_precomp_edges)
+  {
+    treeinfo->deriv_precomp_edges = (double ***) calloc(treeinfo->partition_count,
+                                                        sizeof(double **));
+    treeinfo->deriv_precomp_stamp = (unsigned long *) calloc(
+                              treeinfo->tree->edge_count, sizeof(unsigned long));
+
+    if (!treeinfo->deriv_precomp_edges || !treeinfo->deriv_precomp_stamp)
+      goto error;
+
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      if (!treeinfo_sumtable_cache_alloc(treeinfo, treeinfo->init_partition_idx[i]))
+        goto error;
+    }
+  }
+  else if (!enable)
+  {
+    for (p = 0; treeinfo->deriv_precomp_edges && p < treeinfo->partition_count; ++p)
+      treeinfo_sumtable_cache_free(treeinfo, p);
+
+    free(treeinfo->deriv_precomp_edges);
+    free(treeinfo->deriv_precomp_stamp);
+    treeinfo->deriv_precomp_edges = NULL;
+    treeinfo->deriv_precomp_stamp = NULL;
+  }
+
+  return PLL_SUCCESS;
+
+error:
+  pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                   "Cannot allocate memory for sumtable cache\n");
+  pllmod_treeinfo_set_sumtable_cache(treeinfo, 0);
+  return PLL_FAILURE;
+}
+
+PLL_EXPORT int pllmod_treeinfo_set_shard_sites(pllmod_treeinfo_t * treeinfo,
+                                               unsigned int shard_sites)
+{
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Treeinfo structure is NULL\n");
+    return PLL_FAILURE;
+  }
+
+  /* NOTE: only affects partitions initialized after this call. Shard size
+   * does not depend on the number of threads, hence the likelihood is
+   * summed up in the same order no matter how many threads are used */
+  treeinfo->shard_sites = shard_sites;
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Get profiling statistics: number of operations and wall-clock time spent
+ * per PLLMOD_TREEINFO_STATS_* category.
+ *
+ * For a single partition, only CLV, p-matrix and log-likelihood categories
+ * are reported. For PLLMOD_TREEINFO_PARTITION_ALL, these are summed up over
+ * all local partitions, and regraft scoring, branch length optimization and
+ * model parameter optimization are added. Statistics are local to this
+ * process, time of concurrent threads is summed up.
+ */
+PLL_EXPORT int pllmod_treeinfo_get_stats(const pllmod_treeinfo_t * treeinfo,
+                                         int partition_index,
+                                         pllmod_treeinfo_stats_t * stats)
+{
+  unsigned int p, k;
+
+  if (partition_index != PLLMOD_TREEINFO_PARTITION_ALL &&
+      (partition_index < 0 ||
+       (unsigned int) partition_index >= treeinfo->partition_count))
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Partition %d is out of bounds\n", partition_index);
+    return PLL_FAILURE;
+  }
+
+  if (partition_index != PLLMOD_TREEINFO_PARTITION_ALL)
+  {
+    *stats = treeinfo->partition_stats[partition_index];
+    return PLL_SUCCESS;
+  }
+
+  *stats = treeinfo->stats;
+  for (p = 0; p < treeinfo->partition_count; ++p)
+  {
+    for (k = 0; k < PLLMOD_TREEINFO_STATS_COUNT; ++k)
+    {
+      stats->count[k] += treeinfo->partition_stats[p].count[k];
+      stats->time[k] += treeinfo->partition_stats[p].time[k];
+    }
+  }
+
+  return PLL_SUCCESS;
+}
+
+PLL_EXPORT void pllmod_treeinfo_reset_stats(pllmod_treeinfo_t * treeinfo)
+{
+  memset(&treeinfo->stats, 0, sizeof(pllmod_treeinfo_stats_t));
+  memset(treeinfo->partition_stats, 0,
+         treeinfo->partition_count * sizeof(pllmod_treeinfo_stats_t));
+}
+
 
 PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
                                            unsigned int partition_index,
@@ -254,6 +593,12 @@ PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
               "Partition %d is already initialized\n", partition_index);
     return PLL_FAILURE;
   }
+  else if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE &&
+           !treeinfo_check_clv_buffers(treeinfo, partition))
+    return PLL_FAILURE;
+  else if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL &&
+           !treeinfo_check_pool_buffers(treeinfo, partition))
+    return PLL_FAILURE;
 
   unsigned int local_partition_index = treeinfo->init_partition_count++;
   treeinfo->partitions[partition_index] = partition;
@@ -263,6 +608,8 @@ PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
   treeinfo->gamma_mode[partition_index] = gamma_mode;
   treeinfo->alphas[partition_index] = alpha;
 
+  treeinfo_sort_partitions(treeinfo);
+
   /* compute some derived dimensions */
   unsigned int inner_nodes_count = treeinfo->tip_count - 2;
   unsigned int nodes_count       = inner_nodes_count + treeinfo->tip_count;
@@ -275,16 +622,22 @@ PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
       (char *) calloc(utree_count, sizeof(char));
   treeinfo->pmatrix_valid[partition_index] = (
       char *) calloc(pmatrix_count, sizeof(char));
+  treeinfo->pmatrix_brlen[partition_index] =
+      (double *) malloc(pmatrix_count * sizeof(double));
 
   /* check memory allocation */
   if (!treeinfo->clv_valid[partition_index] ||
-      !treeinfo->pmatrix_valid[partition_index])
+      !treeinfo->pmatrix_valid[partition_index] ||
+      !treeinfo->pmatrix_brlen[partition_index])
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
                      "Cannot allocate memory for parameter indices\n");
     return PLL_FAILURE;
   }
 
+  for (unsigned int m = 0; m < pmatrix_count; ++m)
+    treeinfo->pmatrix_brlen[partition_index][m] = (double) NAN;
+
   /* allocate param_indices array and initialize it to all 0s,
    * i.e. per default, all rate categories will use
    * the same substitution matrix and same base frequencies */
@@ -348,6 +701,22 @@ PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
 
   memset(treeinfo->deriv_precomp[partition_index], 0, precomp_size * sizeof(double));
 
+  if (treeinfo->deriv_precomp_edges &&
+      !treeinfo_sumtable_cache_alloc(treeinfo, partition_index))
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                  "Cannot allocate memory for sumtable cache\n");
+    return PLL_FAILURE;
+  }
+
+  /* register partition (or its site ranges) as work unit(s) */
+  if (!treeinfo_create_shards(treeinfo, partition_index))
+    return PLL_FAILURE;
+
+  /* pool size is limited by the smallest partition */
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+    treeinfo_pool_reset(treeinfo);
+
   return PLL_SUCCESS;
 }
 
@@ -564,7 +933,6 @@ pllmod_treeinfo_topology_t * pllmod_treeinfo_get_topology(const pllmod_treeinfo_
 
     topol->edge_count = treeinfo->tree->edge_count;
     topol->brlen_set_count = brlen_set_count;
-    topol->root_index = treeinfo->root->node_index;
     topol->edges = (pllmod_treeinfo_edge_t *) calloc(topol->edge_count,
                                                      sizeof(pllmod_treeinfo_edge_t));
     if (!topol->edges)
@@ -609,6 +977,8 @@ pllmod_treeinfo_topology_t * pllmod_treeinfo_get_topology(const pllmod_treeinfo_
     return PLL_FAILURE;
   }
 
+  topol->root_index = treeinfo->root->node_index;
+
   // save topology as a list of edges
   unsigned int edge_num = 0;
   for (unsigned int i = 0; i < treeinfo->subnode_count; ++i)
@@ -718,6 +1088,87 @@ int pllmod_treeinfo_destroy_topology(pllmod_treeinfo_topology_t * topol)
   return PLL_SUCCESS;
 }
 
+/**
+ * Copy the model parameters of `src` to `dst`.
+ *
+ * Substitution rates, frequencies, proportion of invariant sites, rate
+ * categories and weights, alphas and branch length scalers of all local
+ * partitions are copied. Both treeinfos must have been created for the same
+ * partitions (e.g. with pllmod_treeinfo_clone()). If any parameter changed,
+ * all CLVs and p-matrices of `dst` are invalidated.
+ */
+PLL_EXPORT
+int pllmod_treeinfo_copy_model(pllmod_treeinfo_t * dst,
+                               const pllmod_treeinfo_t * src)
+{
+  unsigned int p, m;
+  int changed = 0;
+
+  if (!dst || !src || dst->partition_count != src->partition_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "treeinfo structures are empty or do not match\n");
+    return PLL_FAILURE;
+  }
+
+  for (p = 0; p < src->partition_count; ++p)
+  {
+    const pll_partition_t * from = src->partitions[p];
+    pll_partition_t * to = dst->partitions[p];
+
+    /* remote partition -> skip */
+    if (!from || !to || from == to)
+      continue;
+
+    const unsigned int states = from->states;
+    const size_t rates_size = (states * (states-1) / 2) * sizeof(double);
+    const size_t cats_size = from->rate_cats * sizeof(double);
+
+    for (m = 0; m < from->rate_matrices; ++m)
+    {
+      /* avoid useless eigen decompositions */
+      if (memcmp(to->subst_params[m], from->subst_params[m], rates_size))
+      {
+        pll_set_subst_params(to, m, from->subst_params[m]);
+        changed = 1;
+      }
+      if (memcmp(to->frequencies[m], from->frequencies[m],
+                 states * sizeof(double)))
+      {
+        pll_set_frequencies(to, m, from->frequencies[m]);
+        changed = 1;
+      }
+      if (to->prop_invar[m] != from->prop_invar[m])
+      {
+        if (!pll_update_invariant_sites_proportion(to, m, from->prop_invar[m]))
+          return PLL_FAILURE;
+        changed = 1;
+      }
+    }
+
+    if (memcmp(to->rates, from->rates, cats_size) ||
+        memcmp(to->rate_weights, from->rate_weights, cats_size))
+    {
+      pll_set_category_rates(to, from->rates);
+      pll_set_category_weights(to, from->rate_weights);
+      changed = 1;
+    }
+
+    dst->alphas[p] = src->alphas[p];
+    if (src->brlen_scalers && dst->brlen_scalers &&
+        dst->brlen_scalers[p] != src->brlen_scalers[p])
+    {
+      dst->brlen_scalers[p] = src->brlen_scalers[p];
+      changed = 1;
+    }
+  }
+
+  if (changed)
+    pllmod_treeinfo_invalidate_all(dst);
+
+  return PLL_SUCCESS;
+}
+
 PLL_EXPORT int pllmod_treeinfo_destroy_partition(pllmod_treeinfo_t * treeinfo,
                                                   unsigned int partition_index)
 {
@@ -746,6 +1197,12 @@ PLL_EXPORT int pllmod_treeinfo_destroy_partition(pllmod_treeinfo_t * treeinfo,
     treeinfo->pmatrix_valid[partition_index] = NULL;
   }
 
+  if (treeinfo->pmatrix_brlen[partition_index])
+  {
+    free(treeinfo->pmatrix_brlen[partition_index]);
+    treeinfo->pmatrix_brlen[partition_index] = NULL;
+  }
+
   if (treeinfo->param_indices[partition_index])
   {
     free(treeinfo->param_indices[partition_index]);
@@ -764,6 +1221,9 @@ PLL_EXPORT int pllmod_treeinfo_destroy_partition(pllmod_treeinfo_t * treeinfo,
     treeinfo->deriv_precomp[partition_index] = NULL;
   }
 
+  if (treeinfo->deriv_precomp_edges)
+    treeinfo_sumtable_cache_free(treeinfo, partition_index);
+
   return PLL_SUCCESS;
 }
 
@@ -794,9 +1254,12 @@ PLL_EXPORT void pllmod_treeinfo_destroy(pllmod_treeinfo_t * treeinfo)
   if(treeinfo->constraint)
     free(treeinfo->constraint);
 
+  treeinfo_cons_index_destroy((treeinfo_cons_index_t *) treeinfo->constraint_index);
+
   /* free invalidation arrays */
   free(treeinfo->clv_valid);
   free(treeinfo->pmatrix_valid);
+  free(treeinfo->pmatrix_brlen);
 
   free(treeinfo->linked_branch_lengths);
 
@@ -807,293 +1270,3209 @@ PLL_EXPORT void pllmod_treeinfo_destroy(pllmod_treeinfo_t * treeinfo)
   free(treeinfo->param_indices);
   free(treeinfo->branch_lengths);
   free(treeinfo->partition_loglh);
+  free(treeinfo->partition_stats);
   free(treeinfo->deriv_precomp);
+  free(treeinfo->deriv_precomp_edges);
+  free(treeinfo->deriv_precomp_stamp);
 
   if(treeinfo->brlen_scalers)
     free(treeinfo->brlen_scalers);
 
+  /* shard views refer to the partitions, so they go first */
+  treeinfo_destroy_shards(treeinfo);
+
+  /* clones own their partitions, except for the shared tip data */
+  if (treeinfo->tipdata)
+  {
+    for (p = 0; p < treeinfo->init_partition_count; ++p)
+      treeinfo_clone_partition_destroy(treeinfo->init_partitions[p]);
+  }
+
   /* deallocate partition array */
   free(treeinfo->partitions);
   free(treeinfo->init_partitions);
   free(treeinfo->init_partition_idx);
+  free(treeinfo->partition_order);
+
+  pllmod_thread_pool_destroy((pllmod_thread_pool_t *) treeinfo->thread_pool);
+  treeinfo_pool_destroy((treeinfo_clv_pool_t *) treeinfo->clv_pool);
 
   if (treeinfo->tree)
   {
-    free(treeinfo->tree->nodes);
-    free(treeinfo->tree);
+    /* tree of a clone is a copy owned by the treeinfo */
+    if (treeinfo->tipdata)
+      pll_utree_destroy(treeinfo->tree, NULL);
+    else
+    {
+      free(treeinfo->tree->nodes);
+      free(treeinfo->tree);
+    }
   }
 
+  treeinfo_tipdata_release((treeinfo_tipdata_t *) treeinfo->tipdata);
+
   /* finally, deallocate treeinfo object itself */
   free(treeinfo);
 }
 
-PLL_EXPORT int pllmod_treeinfo_update_prob_matrices(pllmod_treeinfo_t * treeinfo,
-                                                    int update_all)
+static void treeinfo_tipdata_free(treeinfo_tipdata_t * tipdata)
 {
-  unsigned int p, m;
-  unsigned int updated = 0;
-  unsigned int pmatrix_count = treeinfo->tree->edge_count;
+  unsigned int i, p;
 
-  for (p = 0; p < treeinfo->partition_count; ++p)
+  if (!tipdata)
+    return;
+
+  for (p = 0; p < tipdata->partition_count; ++p)
   {
-    /* only selected partitioned will be affected */
-    if (treeinfo_partition_active(treeinfo, p) && treeinfo->partitions[p])
+    if (tipdata->tip_buffers && tipdata->tip_buffers[p])
     {
-
-      for (m = 0; m < pmatrix_count; ++m)
+      for (i = 0; i < tipdata->tips[p]; ++i)
       {
-        if (treeinfo->pmatrix_valid[p][m] && !update_all)
-          continue;
-
-        double p_brlen = treeinfo->branch_lengths[p][m];
-        if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
-          p_brlen *= treeinfo->brlen_scalers[p];
-
-        int ret = pll_update_prob_matrices (treeinfo->partitions[p],
-                                  treeinfo->param_indices[p],
-                                  &m,
-                                  &p_brlen,
-                                  1);
-
-        if (!ret)
-          return PLL_FAILURE;
-
-        treeinfo->pmatrix_valid[p][m] = 1;
-        updated++;
+        if (tipdata->attributes[p] & PLL_ATTRIB_PATTERN_TIP)
+          free(tipdata->tip_buffers[p][i]);
+        else
+          pll_aligned_free(tipdata->tip_buffers[p][i]);
       }
+      free(tipdata->tip_buffers[p]);
     }
+    if (tipdata->pattern_weights)
+      free(tipdata->pattern_weights[p]);
   }
 
-  return PLL_SUCCESS;
+  free(tipdata->attributes);
+  free(tipdata->tips);
+  free(tipdata->tip_buffers);
+  free(tipdata->pattern_weights);
+  free(tipdata);
 }
 
-PLL_EXPORT void pllmod_treeinfo_invalidate_all(pllmod_treeinfo_t * treeinfo)
+/* copy tip data of all active partitions of treeinfo */
+static treeinfo_tipdata_t * treeinfo_tipdata_create(const pllmod_treeinfo_t * treeinfo)
 {
-  unsigned int i, m;
-  unsigned int clv_count = treeinfo->tip_count + (treeinfo->tip_count - 2) * 3;
-  unsigned int pmatrix_count = treeinfo->tree->edge_count;
-
-  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  unsigned int i, j, p;
+  treeinfo_tipdata_t * tipdata;
+
+  tipdata = (treeinfo_tipdata_t *) calloc(1, sizeof(treeinfo_tipdata_t));
+  if (!tipdata)
+    goto error;
+
+  tipdata->partition_count = treeinfo->partition_count;
+  tipdata->attributes = (unsigned int *) calloc(treeinfo->partition_count,
+                                                sizeof(unsigned int));
+  tipdata->tips = (unsigned int *) calloc(treeinfo->partition_count,
+                                          sizeof(unsigned int));
+  tipdata->tip_buffers = (void ***) calloc(treeinfo->partition_count,
+                                           sizeof(void **));
+  tipdata->pattern_weights = (unsigned int **) calloc(treeinfo->partition_count,
+                                                      sizeof(unsigned int *));
+  if (!tipdata->attributes || !tipdata->tips || !tipdata->tip_buffers ||
+      !tipdata->pattern_weights)
+    goto error;
+
+  for (j = 0; j < treeinfo->init_partition_count; ++j)
   {
-    unsigned int p = treeinfo->init_partition_idx[i];
-
-    /* only selected partitioned will be affected */
-    if (treeinfo_partition_active(treeinfo, p))
+    const pll_partition_t * partition = treeinfo->init_partitions[j];
+    const unsigned int sites_alloc = partition->asc_bias_alloc ?
+                          partition->sites + partition->states : partition->sites;
+
+    p = treeinfo->init_partition_idx[j];
+    tipdata->attributes[p] = partition->attributes;
+    tipdata->tips[p] = partition->tips;
+    tipdata->tip_buffers[p] = (void **) calloc(partition->tips, sizeof(void *));
+    tipdata->pattern_weights[p] = (unsigned int *) malloc(sites_alloc *
+                                                          sizeof(unsigned int));
+    if (!tipdata->tip_buffers[p] || !tipdata->pattern_weights[p])
+      goto error;
+
+    memcpy(tipdata->pattern_weights[p], partition->pattern_weights,
+           sites_alloc * sizeof(unsigned int));
+
+    for (i = 0; i < partition->tips; ++i)
     {
-      for (m = 0; m < pmatrix_count; ++m)
-        treeinfo->pmatrix_valid[p][m] = 0;
-
-      for (m = 0; m < clv_count; ++m)
-        treeinfo->clv_valid[p][m] = 0;
+      if (partition->attributes & PLL_ATTRIB_PATTERN_TIP)
+      {
+        const size_t size = sites_alloc * sizeof(unsigned char);
+        tipdata->tip_buffers[p][i] = malloc(size);
+        if (!tipdata->tip_buffers[p][i])
+          goto error;
+        memcpy(tipdata->tip_buffers[p][i], partition->tipchars[i], size);
+      }
+      else
+      {
+        const size_t size = pll_get_clv_size(partition, i) * sizeof(double);
+        tipdata->tip_buffers[p][i] = pll_aligned_alloc(size,
+                                                       partition->alignment);
+        if (!tipdata->tip_buffers[p][i])
+          goto error;
+        memcpy(tipdata->tip_buffers[p][i], partition->clv[i], size);
+      }
     }
   }
+
+  if (pthread_mutex_init(&tipdata->mutex, NULL))
+    goto error;
+
+  return tipdata;
+
+error:
+  treeinfo_tipdata_free(tipdata);
+  pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                   "Cannot allocate memory for shared tip data\n");
+  return NULL;
 }
 
-PLL_EXPORT int pllmod_treeinfo_validate_clvs(pllmod_treeinfo_t * treeinfo,
-                                             pll_unode_t ** travbuffer,
-                                             unsigned int travbuffer_size)
+/* take a reference on the tip data of a clone, or create it from the
+ * partitions of an original treeinfo */
+static treeinfo_tipdata_t * treeinfo_tipdata_acquire(const pllmod_treeinfo_t * treeinfo)
 {
-  for (unsigned int i = 0; i < treeinfo->init_partition_count; ++i)
-  {
-    unsigned int p = treeinfo->init_partition_idx[i];
+  treeinfo_tipdata_t * tipdata = (treeinfo_tipdata_t *) treeinfo->tipdata;
 
-    /* only selected partitioned will be affected */
-    if (treeinfo_partition_active(treeinfo, p))
-    {
-      for (unsigned int j = 0; j < travbuffer_size; ++j)
-      {
-        const pll_unode_t * node = travbuffer[j];
-        if (node->next)
-        {
-          treeinfo->clv_valid[p][node->node_index] = 1;
+  if (!tipdata)
+    tipdata = treeinfo_tipdata_create(treeinfo);
 
-          /* since we have only 1 CLV vector per inner node,
-           * we must invalidate CLVs for other 2 directions */
-          treeinfo->clv_valid[p][node->next->node_index] = 0;
-          treeinfo->clv_valid[p][node->next->next->node_index] = 0;
-        }
-      }
-    }
+  if (!tipdata)
+    return NULL;
+
+  pthread_mutex_lock(&tipdata->mutex);
+  tipdata->refcount++;
+  pthread_mutex_unlock(&tipdata->mutex);
+
+  return tipdata;
+}
+
+static void treeinfo_tipdata_release(treeinfo_tipdata_t * tipdata)
+{
+  unsigned int refcount;
+
+  if (!tipdata)
+    return;
+
+  pthread_mutex_lock(&tipdata->mutex);
+  refcount = --tipdata->refcount;
+  pthread_mutex_unlock(&tipdata->mutex);
+
+  if (!refcount)
+  {
+    pthread_mutex_destroy(&tipdata->mutex);
+    treeinfo_tipdata_free(tipdata);
+  }
+}
+
+/* number of elements of the tip-tip lookup table, as allocated by libpll */
+static size_t treeinfo_ttlookup_size(const pll_partition_t * partition)
+{
+  if ((partition->states == 4) &&
+      (partition->attributes & PLL_ATTRIB_ARCH_AVX))
+    return 1024 * partition->rate_cats;
+  else
+  {
+    unsigned int l2_maxstates =
+      (unsigned int) ceil(log2(partition->maxstates));
+    return ((size_t) 1 << (2 * l2_maxstates)) *
+           (partition->states_padded * partition->rate_cats);
+  }
+}
+
+/* detach shared tip data, so that it is not freed with the partition */
+static void treeinfo_clone_partition_destroy(pll_partition_t * partition)
+{
+  unsigned int i;
+
+  if (!partition)
+    return;
+
+  for (i = 0; i < partition->tips; ++i)
+  {
+    if (partition->attributes & PLL_ATTRIB_PATTERN_TIP)
+      partition->tipchars[i] = NULL;
+    else
+      partition->clv[i] = NULL;
+  }
+  partition->pattern_weights = NULL;
+
+  pll_partition_destroy(partition);
+}
+
+/* create a partition with the same dimensions and model as src, which uses
+ * the shared tip data of partition partition_index instead of a private copy */
+static pll_partition_t * treeinfo_clone_partition(const pll_partition_t * src,
+                                                  const treeinfo_tipdata_t * tipdata,
+                                                  unsigned int partition_index)
+{
+  unsigned int i;
+  pll_partition_t * partition;
+
+  partition = pll_partition_create(src->tips,
+                                   src->clv_buffers,
+                                   src->states,
+                                   src->sites,
+                                   src->rate_matrices,
+                                   src->prob_matrices,
+                                   src->rate_cats,
+                                   src->scale_buffers,
+                                   src->attributes);
+  if (!partition)
+    return NULL;
+
+  if (partition->attributes & PLL_ATTRIB_PATTERN_TIP)
+  {
+    if (!partition->tipchars)
+    {
+      partition->tipchars = (unsigned char **) calloc(partition->tips,
+                                                      sizeof(unsigned char *));
+      if (!partition->tipchars)
+      {
+        pll_partition_destroy(partition);
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                         "Cannot allocate space for storing tip characters.\n");
+        return NULL;
+      }
+    }
+
+    for (i = 0; i < partition->tips; ++i)
+    {
+      free(partition->tipchars[i]);
+      partition->tipchars[i] =
+          (unsigned char *) tipdata->tip_buffers[partition_index][i];
+    }
+  }
+  else
+  {
+    for (i = 0; i < partition->tips; ++i)
+    {
+      pll_aligned_free(partition->clv[i]);
+      partition->clv[i] = (double *) tipdata->tip_buffers[partition_index][i];
+    }
+  }
+
+  /* pattern weights also hold ascertainment bias correction weights */
+  free(partition->pattern_weights);
+  partition->pattern_weights = tipdata->pattern_weights[partition_index];
+  partition->pattern_weight_sum = src->pattern_weight_sum;
+
+  /* tip state encoding is copied, tip-tip lookup table is a private buffer
+   * (it is recomputed from the p-matrices) */
+  if (partition->attributes & PLL_ATTRIB_PATTERN_TIP)
+  {
+    if (!partition->charmap)
+      partition->charmap = (unsigned char *) calloc(PLL_ASCII_SIZE,
+                                                    sizeof(unsigned char));
+    if (!partition->tipmap)
+      partition->tipmap = (pll_state_t *) calloc(PLL_ASCII_SIZE,
+                                                 sizeof(pll_state_t));
+    if (!partition->charmap || !partition->tipmap)
+    {
+      treeinfo_clone_partition_destroy(partition);
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate charmap for tip-tip precomputation.\n");
+      return NULL;
+    }
+
+    if (src->charmap)
+      memcpy(partition->charmap, src->charmap,
+             PLL_ASCII_SIZE * sizeof(unsigned char));
+    if (src->tipmap)
+      memcpy(partition->tipmap, src->tipmap,
+             PLL_ASCII_SIZE * sizeof(pll_state_t));
+    partition->maxstates = src->maxstates;
+
+    if (src->ttlookup && !partition->ttlookup)
+    {
+      size_t alloc_size = treeinfo_ttlookup_size(partition);
+      partition->ttlookup = pll_aligned_alloc(alloc_size * sizeof(double),
+                                              partition->alignment);
+      if (!partition->ttlookup)
+      {
+        treeinfo_clone_partition_destroy(partition);
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                "Cannot allocate space for storing precomputed tip-tip CLVs.\n");
+        return NULL;
+      }
+    }
+  }
+
+  /* copy model parameters, eigen decomposition is recomputed on demand */
+  for (i = 0; i < src->rate_matrices; ++i)
+  {
+    pll_set_subst_params(partition, i, src->subst_params[i]);
+    pll_set_frequencies(partition, i, src->frequencies[i]);
+    if (!pll_update_invariant_sites_proportion(partition, i,
+                                               src->prop_invar[i]))
+    {
+      treeinfo_clone_partition_destroy(partition);
+      return NULL;
+    }
+  }
+  pll_set_category_rates(partition, src->rates);
+  pll_set_category_weights(partition, src->rate_weights);
+
+  return partition;
+}
+
+/* clone treeinfo with a copy of tree, or of the tree of treeinfo if NULL */
+static pllmod_treeinfo_t * treeinfo_clone(const pllmod_treeinfo_t * treeinfo,
+                                          const pll_utree_t * tree)
+{
+  unsigned int i, p;
+  pll_utree_t * clone_tree;
+  pllmod_treeinfo_t * clone;
+  treeinfo_tipdata_t * tipdata;
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    if (treeinfo->init_partitions[i]->attributes & PLL_ATTRIB_SITE_REPEATS)
+    {
+      pllmod_set_error(PLLMOD_ERROR_NOT_IMPLEMENTED,
+                       "Cloning partitions with site repeats is not supported\n");
+      return NULL;
+    }
+  }
+
+  /* clones of a clone share its tip data */
+  tipdata = treeinfo_tipdata_acquire(treeinfo);
+  if (!tipdata)
+    return NULL;
+
+  clone_tree = pll_utree_clone(tree ? tree : treeinfo->tree);
+  if (!clone_tree)
+  {
+    treeinfo_tipdata_release(tipdata);
+    return NULL;
+  }
+
+  clone = pllmod_treeinfo_create(clone_tree->vroot,
+                                 treeinfo->tip_count,
+                                 treeinfo->partition_count,
+                                 treeinfo->brlen_linkage);
+  if (!clone)
+  {
+    pll_utree_destroy(clone_tree, NULL);
+    treeinfo_tipdata_release(tipdata);
+    return NULL;
+  }
+
+  /* nodes are now owned by the tree wrapper of the clone */
+  free(clone_tree->nodes);
+  free(clone_tree);
+
+  clone->tipdata = tipdata;
+  clone->sum_mode = treeinfo->sum_mode;
+
+  const unsigned int branch_count = treeinfo->tree->edge_count;
+
+  /* branch lengths of another tree were collected by pllmod_treeinfo_create */
+  if (!tree)
+    memcpy(clone->linked_branch_lengths, treeinfo->linked_branch_lengths,
+           branch_count * sizeof(double));
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    p = treeinfo->init_partition_idx[i];
+
+    pll_partition_t * partition =
+        treeinfo_clone_partition(treeinfo->partitions[p], tipdata, p);
+    if (!partition)
+      goto error;
+
+    if (!pllmod_treeinfo_init_partition(clone,
+                                        p,
+                                        partition,
+                                        treeinfo->params_to_optimize[p],
+                                        treeinfo->gamma_mode[p],
+                                        treeinfo->alphas[p],
+                                        treeinfo->param_indices[p],
+                                        treeinfo->subst_matrix_symmetries[p]))
+    {
+      /* otherwise, partition is destroyed together with the clone */
+      if (clone->partitions[p] != partition)
+        treeinfo_clone_partition_destroy(partition);
+      goto error;
+    }
+
+    if (!tree && treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED)
+      memcpy(clone->branch_lengths[p], treeinfo->branch_lengths[p],
+             branch_count * sizeof(double));
+
+    if (treeinfo->brlen_scalers)
+      clone->brlen_scalers[p] = treeinfo->brlen_scalers[p];
+  }
+
+  /* constraint groups of inner nodes depend on the topology */
+  if (!tree && treeinfo->constraint)
+  {
+    const size_t cons_size = (treeinfo->tree->tip_count +
+                              treeinfo->tree->inner_count) * sizeof(unsigned int);
+
+    clone->constraint = (unsigned int *) malloc(cons_size);
+    if (!clone->constraint)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Can't allocate memory for topological constraint\n");
+      goto error;
+    }
+
+    memcpy(clone->constraint, treeinfo->constraint, cons_size);
+  }
+
+  if (!pllmod_treeinfo_set_clv_mode(clone, treeinfo->clv_mode))
+    goto error;
+
+  return clone;
+
+error:
+  pllmod_treeinfo_destroy(clone);
+  return NULL;
+}
+
+/**
+ * Create a copy of a treeinfo for an independent search on the same data.
+ *
+ * The clone gets a copy of the tree, branch lengths, model parameters and
+ * per-partition settings of `treeinfo`, and its own partitions with private
+ * inner CLVs, scalers and p-matrices. Tip CLVs (or tipchars in pattern tip
+ * mode) and pattern weights are copied when a treeinfo which is not a clone
+ * is cloned, and shared read-only by all clones made from that clone, so that
+ * further clones cost the memory of the inner part of the tree only.
+ *
+ * The shared tip data is reference-counted and freed together with the last
+ * clone in pllmod_treeinfo_destroy(), so the partitions of `treeinfo` may be
+ * changed or destroyed while clones exist. Clones can be used concurrently
+ * from different threads. Thread count, site range splitting and the
+ * parallel reduction callback are not copied.
+ *
+ * Partitions with site repeats are not supported.
+ *
+ * @return new treeinfo, or NULL on error
+ */
+PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_clone(const pllmod_treeinfo_t * treeinfo)
+{
+  if (!treeinfo)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Treeinfo structure is NULL\n");
+    return NULL;
+  }
+
+  return treeinfo_clone(treeinfo, NULL);
+}
+
+/**
+ * Create a copy of a treeinfo as in pllmod_treeinfo_clone(), but on a copy
+ * of another `tree` on the same taxa.
+ *
+ * Tip CLV indices of `tree` must match the tips of `treeinfo`. Branch lengths
+ * are taken from `tree`, all other settings and model parameters from
+ * `treeinfo`. The topological constraint is not copied.
+ *
+ * @return new treeinfo, or NULL on error
+ */
+PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_clone_tree(const pllmod_treeinfo_t * treeinfo,
+                                                          const pll_utree_t * tree)
+{
+  if (!treeinfo || !tree)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+              "Treeinfo structure or tree is NULL\n");
+    return NULL;
+  }
+
+  if (tree->tip_count != treeinfo->tip_count ||
+      tree->edge_count != treeinfo->tree->edge_count)
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE_SIZE,
+                     "Invalid tree size. Got %d instead of %d\n",
+                     tree->tip_count, treeinfo->tip_count);
+    return NULL;
+  }
+
+  return treeinfo_clone(treeinfo, tree);
+}
+
+typedef struct treeinfo_pmatrix_task
+{
+  pllmod_treeinfo_t * treeinfo;
+  int update_all;
+  const int * partition_mask;
+} treeinfo_pmatrix_task_t;
+
+/* max. number of p-matrices updated with a single libpll call */
+#define TREEINFO_PMATRIX_BATCH 64
+
+static int treeinfo_update_prob_matrices_batch(pllmod_treeinfo_t * treeinfo,
+                                               unsigned int p,
+                                               const unsigned int * indices,
+                                               const double * brlens,
+                                               unsigned int count)
+{
+  unsigned int i;
+  double start_time = pllmod_time_wall();
+
+  if (!pll_update_prob_matrices(treeinfo->partitions[p],
+                                treeinfo->param_indices[p],
+                                indices,
+                                brlens,
+                                count))
+    return PLL_FAILURE;
+
+  treeinfo_stats_add(treeinfo->partition_stats + p,
+                     PLLMOD_TREEINFO_STATS_PMATRIX, count, start_time);
+
+  for (i = 0; i < count; ++i)
+  {
+    treeinfo->pmatrix_valid[p][indices[i]] = 1;
+    treeinfo->pmatrix_brlen[p][indices[i]] = brlens[i];
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int treeinfo_update_prob_matrices_partition(void * data,
+                                                   unsigned int task_index,
+                                                   unsigned int thread_index)
+{
+  treeinfo_pmatrix_task_t * task = (treeinfo_pmatrix_task_t *) data;
+  pllmod_treeinfo_t * treeinfo = task->treeinfo;
+  unsigned int p = treeinfo->partition_order[task_index];
+  unsigned int pmatrix_count = treeinfo->tree->edge_count;
+  unsigned int m;
+  unsigned int batch_indices[TREEINFO_PMATRIX_BATCH];
+  double batch_brlens[TREEINFO_PMATRIX_BATCH];
+  unsigned int batch_size = 0;
+
+  PLLMOD_UNUSED(thread_index);
+
+  /* only selected partitioned will be affected */
+  if (!treeinfo_partition_active(treeinfo, p) ||
+      treeinfo_partition_masked(task->partition_mask, p))
+    return PLL_SUCCESS;
+
+  for (m = 0; m < pmatrix_count; ++m)
+  {
+    if (treeinfo->pmatrix_valid[p][m] && !task->update_all)
+      continue;
+
+    double p_brlen = treeinfo->branch_lengths[p][m];
+    if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
+      p_brlen *= treeinfo->brlen_scalers[p];
+
+    /* p-matrix was invalidated implicitly, but the branch length did not
+     * change since the last update -> model did not change either, otherwise
+     * update_all would be set. Explicit invalidation resets the cached length,
+     * so it never takes this shortcut */
+    if (!task->update_all && treeinfo->pmatrix_brlen[p][m] == p_brlen)
+    {
+      treeinfo->pmatrix_valid[p][m] = 1;
+      continue;
+    }
+
+    batch_indices[batch_size] = m;
+    batch_brlens[batch_size] = p_brlen;
+    batch_size++;
+
+    /* eigendecomposition is shared, so one call updates many matrices */
+    if (batch_size == TREEINFO_PMATRIX_BATCH)
+    {
+      if (!treeinfo_update_prob_matrices_batch(treeinfo, p, batch_indices,
+                                               batch_brlens, batch_size))
+        return PLL_FAILURE;
+      batch_size = 0;
+    }
+  }
+
+  if (batch_size &&
+      !treeinfo_update_prob_matrices_batch(treeinfo, p, batch_indices,
+                                           batch_brlens, batch_size))
+    return PLL_FAILURE;
+
+  return PLL_SUCCESS;
+}
+
+static int treeinfo_update_prob_matrices(pllmod_treeinfo_t * treeinfo,
+                                         int update_all,
+                                         const int * partition_mask)
+{
+  treeinfo_pmatrix_task_t task;
+
+  task.treeinfo = treeinfo;
+  task.update_all = update_all;
+  task.partition_mask = partition_mask;
+
+  if (update_all)
+    treeinfo->clv_version++;
+
+  /* partitions are independent, so they can be processed concurrently */
+  return pllmod_thread_pool_run((pllmod_thread_pool_t *) treeinfo->thread_pool,
+                                treeinfo->init_partition_count,
+                                treeinfo_update_prob_matrices_partition,
+                                &task);
+}
+
+PLL_EXPORT int pllmod_treeinfo_update_prob_matrices(pllmod_treeinfo_t * treeinfo,
+                                                    int update_all)
+{
+  return treeinfo_update_prob_matrices(treeinfo, update_all, NULL);
+}
+
+PLL_EXPORT void pllmod_treeinfo_invalidate_all(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i, m;
+  unsigned int clv_count = treeinfo->tip_count + (treeinfo->tip_count - 2) * 3;
+  unsigned int pmatrix_count = treeinfo->tree->edge_count;
+
+  treeinfo->clv_version++;
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+
+    /* only selected partitioned will be affected */
+    if (treeinfo_partition_active(treeinfo, p))
+    {
+      for (m = 0; m < pmatrix_count; ++m)
+      {
+        treeinfo->pmatrix_valid[p][m] = 0;
+        treeinfo->pmatrix_brlen[p][m] = (double) NAN;
+      }
+
+      for (m = 0; m < clv_count; ++m)
+        treeinfo->clv_valid[p][m] = 0;
+    }
+  }
+
+  /* CLVs will be recomputed anyway, so this is not a pool miss */
+  if (treeinfo->clv_pool)
+  {
+    treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+    memset(pool->evicted, 0, treeinfo->subnode_count * sizeof(char));
+  }
+
+  treeinfo->clv_alledges_valid = 0;
+}
+
+static void treeinfo_validate_clvs_partition(pllmod_treeinfo_t * treeinfo,
+                                             unsigned int p,
+                                             pll_unode_t ** travbuffer,
+                                             unsigned int travbuffer_size)
+{
+  for (unsigned int j = 0; j < travbuffer_size; ++j)
+  {
+    const pll_unode_t * node = travbuffer[j];
+    if (node->next)
+    {
+      treeinfo->clv_valid[p][node->node_index] = 1;
+
+      /* since we have only 1 CLV vector per inner node,
+       * we must invalidate CLVs for other 2 directions */
+      treeinfo->clv_valid[p][node->next->node_index] = 0;
+      treeinfo->clv_valid[p][node->next->next->node_index] = 0;
+    }
+  }
+}
+
+static void treeinfo_validate_clvs(pllmod_treeinfo_t * treeinfo,
+                                   pll_unode_t ** travbuffer,
+                                   unsigned int travbuffer_size,
+                                   const int * partition_mask)
+{
+  for (unsigned int i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+
+    /* only selected partitioned will be affected */
+    if (treeinfo_partition_active(treeinfo, p) &&
+        !treeinfo_partition_masked(partition_mask, p))
+      treeinfo_validate_clvs_partition(treeinfo, p, travbuffer, travbuffer_size);
+  }
+}
+
+PLL_EXPORT int pllmod_treeinfo_validate_clvs(pllmod_treeinfo_t * treeinfo,
+                                             pll_unode_t ** travbuffer,
+                                             unsigned int travbuffer_size)
+{
+  treeinfo_validate_clvs(treeinfo, travbuffer, travbuffer_size, NULL);
+
+  return PLL_SUCCESS;
+}
+
+PLL_EXPORT void pllmod_treeinfo_invalidate_pmatrix(pllmod_treeinfo_t * treeinfo,
+                                                   const pll_unode_t * edge)
+{
+  /* outward CLVs are like those of a previous root position: callers
+   * invalidate CLVs on the path to the root, and all-edges computation
+   * recomputes all outward CLVs anyway */
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE &&
+      treeinfo->clv_alledges_valid)
+    treeinfo->clv_alledges_valid = 0;
+  treeinfo->clv_version++;
+
+  for (unsigned int i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+    if (treeinfo->pmatrix_valid[p] && treeinfo_partition_active(treeinfo, p))
+    {
+      /* explicit invalidation always forces a recomputation */
+      treeinfo->pmatrix_valid[p][edge->pmatrix_index] = 0;
+      treeinfo->pmatrix_brlen[p][edge->pmatrix_index] = (double) NAN;
+    }
+  }
+}
+
+/* p-matrices were updated behind treeinfo's back (e.g. by pllmod_opt_*
+ * functions): valid ones correspond to the current branch lengths, but
+ * nothing is known about the invalid ones */
+PLL_EXPORT void pllmod_treeinfo_sync_pmatrix_cache(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i, m;
+  unsigned int pmatrix_count = treeinfo->tree->edge_count;
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+    double scaler = treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED ?
+                                             treeinfo->brlen_scalers[p] : 1.;
+
+    for (m = 0; m < pmatrix_count; ++m)
+    {
+      treeinfo->pmatrix_brlen[p][m] = treeinfo->pmatrix_valid[p][m] ?
+          treeinfo->branch_lengths[p][m] * scaler : (double) NAN;
+    }
+  }
+}
+
+PLL_EXPORT void pllmod_treeinfo_invalidate_clv(pllmod_treeinfo_t * treeinfo,
+                                               const pll_unode_t * edge)
+{
+  /* see pllmod_treeinfo_invalidate_pmatrix() */
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE &&
+      treeinfo->clv_alledges_valid)
+    treeinfo->clv_alledges_valid = 0;
+  treeinfo->clv_version++;
+
+  for (unsigned int i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+    if (treeinfo->clv_valid[p] && treeinfo_partition_active(treeinfo, p))
+      treeinfo->clv_valid[p][edge->node_index] = 0;
+  }
+
+  if (treeinfo->clv_pool)
+    ((treeinfo_clv_pool_t *) treeinfo->clv_pool)->evicted[edge->node_index] = 0;
+}
+
+/* sum up per-partition likelihoods from all threads (ranks) */
+static int treeinfo_reduce_partition_loglh(pllmod_treeinfo_t * treeinfo)
+{
+  if (treeinfo->sum_mode == PLLMOD_COMMON_SUM_REPRODUCIBLE)
+  {
+    /* every partition value is reduced separately, so the subsequent sum
+     * over partitions does not depend on how they are distributed */
+    return pllmod_reduce_sum_reproducible(treeinfo->partition_loglh,
+                                          1,
+                                          treeinfo->partition_count,
+                                          treeinfo->partition_loglh,
+                                          treeinfo->parallel_context,
+                                          treeinfo->parallel_reduce_cb);
+  }
+  else if (treeinfo->parallel_reduce_cb)
+  {
+    treeinfo->parallel_reduce_cb(treeinfo->parallel_context,
+                                 treeinfo->partition_loglh,
+                                 treeinfo->partition_count,
+                                 PLLMOD_COMMON_REDUCE_SUM);
+  }
+
+  return PLL_SUCCESS;
+}
+
+typedef struct treeinfo_loglh_task
+{
+  pllmod_treeinfo_t * treeinfo;
+  unsigned int ops_count;
+  double ** persite_lnl;
+  const int * partition_mask;
+} treeinfo_loglh_task_t;
+
+/* record the work done by a shard task: operations are counted in the first
+ * shard of a partition only, whereas time is summed up over all shards */
+static void treeinfo_shard_stats(pllmod_treeinfo_shard_t * shard,
+                                 unsigned int ops_count,
+                                 double start_time,
+                                 double clv_time)
+{
+  pllmod_treeinfo_stats_t * stats = &shard->stats;
+  int first = (shard->site_offset == 0);
+
+  stats->count[PLLMOD_TREEINFO_STATS_CLV] += first ? ops_count : 0;
+  stats->time[PLLMOD_TREEINFO_STATS_CLV] += clv_time - start_time;
+
+  treeinfo_stats_add(stats, PLLMOD_TREEINFO_STATS_LOGLH, first ? 1 : 0,
+                     clv_time);
+}
+
+/* shards of the same partition run concurrently, so their statistics are
+ * added to the partition afterwards */
+static void treeinfo_collect_shard_stats(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i, k;
+
+  for (i = 0; i < treeinfo->shard_count; ++i)
+  {
+    pllmod_treeinfo_shard_t * shard = treeinfo->shards + i;
+    pllmod_treeinfo_stats_t * stats =
+        treeinfo->partition_stats + shard->partition_index;
+
+    for (k = 0; k < PLLMOD_TREEINFO_STATS_COUNT; ++k)
+    {
+      stats->count[k] += shard->stats.count[k];
+      stats->time[k] += shard->stats.time[k];
+    }
+
+    memset(&shard->stats, 0, sizeof(pllmod_treeinfo_stats_t));
+  }
+}
+
+static int treeinfo_compute_loglh_shard(void * data,
+                                        unsigned int task_index,
+                                        unsigned int thread_index)
+{
+  treeinfo_loglh_task_t * task = (treeinfo_loglh_task_t *) data;
+  pllmod_treeinfo_t * treeinfo = task->treeinfo;
+  pllmod_treeinfo_shard_t * shard = treeinfo->shards + task_index;
+  unsigned int p = shard->partition_index;
+
+  PLLMOD_UNUSED(thread_index);
+
+  /* masked out: keep the log-likelihood from the last computation */
+  if (treeinfo_partition_masked(task->partition_mask, p))
+    return PLL_SUCCESS;
+
+  treeinfo_sync_shard(treeinfo, shard);
+
+  double start_time = pllmod_time_wall();
+
+  /* use the operations array to compute all ops_count inner CLVs. Operations
+     will be carried out sequentially starting from operation 0 towards
+     ops_count-1 */
+  pll_update_partials(shard->partition,
+                      treeinfo->operations,
+                      task->ops_count);
+
+  double clv_time = pllmod_time_wall();
+
+  /* compute the likelihood on an edge of the unrooted tree by specifying
+     the CLV indices at the two end-point of the branch, the probability
+     matrix index for the concrete branch length, and the index of the model
+     of whose frequency vector is to be used */
+  shard->loglh = pll_compute_edge_loglikelihood(
+                                          shard->partition,
+                                          treeinfo->root->clv_index,
+                                          treeinfo->root->scaler_index,
+                                          treeinfo->root->back->clv_index,
+                                          treeinfo->root->back->scaler_index,
+                                          treeinfo->root->pmatrix_index,
+                                          treeinfo->param_indices[p],
+                                          task->persite_lnl ?
+                                            task->persite_lnl[p] +
+                                              shard->site_offset : NULL);
+
+  treeinfo_shard_stats(shard, task->ops_count, start_time, clv_time);
+
+  return PLL_SUCCESS;
+}
+
+static double treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
+                                     int incremental,
+                                     int update_pmatrices,
+                                     double ** persite_lnl,
+                                     const int * partition_mask)
+{
+  /* tree root must be an inner node! */
+  assert(!pllmod_utree_is_tip(treeinfo->root));
+
+  unsigned int traversal_size = 0;
+  unsigned int ops_count;
+  unsigned int i, p;
+
+  const double LOGLH_NONE = (double) NAN;
+  double total_loglh = 0.0;
+  const int old_active_partition = treeinfo->active_partition;
+  treeinfo_loglh_task_t task;
+
+  /* NOTE: in unlinked brlen mode, up-to-date brlens for partition p
+   * have to be prefetched to treeinfo->branch_lengths[p] !!! */
+  int collect_brlen =
+      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED ? 0 : 1);
+
+  pllmod_treeinfo_set_active_partition(treeinfo, PLLMOD_TREEINFO_PARTITION_ALL);
+
+  /* full recomputation keeps only CLVs pointing towards the root valid;
+   * model parameters might have changed as well */
+  if (!incremental)
+  {
+    treeinfo->clv_alledges_valid = 0;
+    treeinfo->clv_version++;
+  }
+
+  /* in pool mode, full recomputation must not reuse any resident CLV, and
+   * in edge mode, outward CLVs might depend on changes which were only
+   * invalidated on the path to the previous root */
+  if (!incremental && treeinfo->clv_mode != PLLMOD_TREEINFO_CLV_NODE)
+  {
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      p = treeinfo->init_partition_idx[i];
+      memset(treeinfo->clv_valid[p], 0, treeinfo->subnode_count * sizeof(char));
+    }
+  }
+
+  /* we need full traversal in 2 cases: 1) update p-matrices, 2) update all CLVs */
+  if (!incremental || (update_pmatrices && collect_brlen))
+  {
+    /* perform a FULL postorder traversal of the unrooted tree */
+    if (!pll_utree_traverse(treeinfo->root,
+                            PLL_TREE_TRAVERSE_POSTORDER,
+                            cb_full_traversal,
+                            treeinfo->travbuffer,
+                            &traversal_size))
+      return LOGLH_NONE;
+  }
+
+  /* update p-matrices if asked for */
+  if (update_pmatrices)
+  {
+    if (collect_brlen)
+    {
+      assert(traversal_size == treeinfo->tip_count * 2 - 2);
+      for (i = 0; i < traversal_size; ++i)
+       {
+         pll_unode_t * node = treeinfo->travbuffer[i];
+         treeinfo->branch_lengths[0][node->pmatrix_index] = node->length;
+       }
+    }
+
+    treeinfo_update_prob_matrices(treeinfo, !incremental, partition_mask);
+  }
+
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+  {
+    /* allocate slots and compute invalid or evicted CLVs at both ends */
+    pll_unode_t * targets[2] = {treeinfo->root, treeinfo->root->back};
+    if (!treeinfo_pool_traverse(treeinfo, targets, 2, NULL,
+                                &traversal_size, &ops_count))
+    {
+      pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+      return LOGLH_NONE;
+    }
+  }
+  else
+  {
+    if (incremental)
+    {
+      /* compute partial traversal and update only invalid CLVs; CLVs which
+       * are invalid in masked out partitions only are recomputed for the
+       * other partitions as well */
+      if (!pll_utree_traverse(treeinfo->root,
+                              PLL_TREE_TRAVERSE_POSTORDER,
+                              cb_partial_traversal,
+                              treeinfo->travbuffer,
+                              &traversal_size))
+        return LOGLH_NONE;
+    }
+
+    /* create operations based on partial traversal obtained above */
+    pll_utree_create_operations(treeinfo->travbuffer,
+                                traversal_size,
+                                NULL,
+                                NULL,
+                                treeinfo->operations,
+                                NULL,
+                                &ops_count);
+  }
+
+  treeinfo->counter += ops_count;
+
+//  printf("Traversal size (%s): %u\n", incremental ? "part" : "full", ops_count);
+
+  /* iterate over all partitions (we assume that traversal is the same) */
+  task.treeinfo = treeinfo;
+  task.ops_count = ops_count;
+  task.persite_lnl = persite_lnl;
+  task.partition_mask = partition_mask;
+
+  if (!pllmod_thread_pool_run((pllmod_thread_pool_t *) treeinfo->thread_pool,
+                              treeinfo->shard_count,
+                              treeinfo_compute_loglh_shard,
+                              &task))
+  {
+    pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+    return LOGLH_NONE;
+  }
+
+  treeinfo_validate_clvs(treeinfo,
+                         treeinfo->travbuffer,
+                         traversal_size,
+                         partition_mask);
+
+  /* partitions which are not present locally will be computed by
+   * another thread(s) and contribute 0 to the local sum */
+  for (p = 0; p < treeinfo->partition_count; ++p)
+    treeinfo->partition_loglh[p] = 0.0;
+
+  /* shards are always summed up in the same order */
+  for (i = 0; i < treeinfo->shard_count; ++i)
+  {
+    const pllmod_treeinfo_shard_t * shard = treeinfo->shards + i;
+    treeinfo->partition_loglh[shard->partition_index] += shard->loglh;
+  }
+
+  treeinfo_collect_shard_stats(treeinfo);
+
+  /* sum up likelihood from all threads */
+  if (!treeinfo_reduce_partition_loglh(treeinfo))
+  {
+    pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+    return LOGLH_NONE;
+  }
+
+  /* accumulate loglh by summing up over all the partitions */
+  for (p = 0; p < treeinfo->partition_count; ++p)
+    total_loglh += treeinfo->partition_loglh[p];
+
+  /* restore original active partition */
+  pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+
+  assert(total_loglh < 0.);
+
+  return total_loglh;
+}
+
+PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
+                                                int incremental)
+{
+  return treeinfo_compute_loglh(treeinfo, incremental, 1, NULL, NULL);
+}
+
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_flex(pllmod_treeinfo_t * treeinfo,
+                                                     int incremental,
+                                                     int update_pmatrices)
+{
+  return treeinfo_compute_loglh(treeinfo, incremental, update_pmatrices, NULL,
+                                NULL);
+}
+
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_persite(pllmod_treeinfo_t * treeinfo,
+                                                        int incremental,
+                                                        double ** persite_lnl)
+{
+  return treeinfo_compute_loglh(treeinfo, incremental, 1, persite_lnl, NULL);
+}
+
+/**
+ * Compute the log-likelihood of the tree for a subset of partitions.
+ *
+ * Only partitions with `partition_mask[p]` != 0 are recomputed (CLVs,
+ * p-matrices and per-partition log-likelihood); the others keep CLVs and
+ * `partition_loglh[p]` from their last computation, which is included in
+ * the returned total. This is meant for per-partition optimizers that stop
+ * changing the model of a partition once it has converged, so masked out
+ * partitions must not have changed since they were last computed.
+ *
+ * In CLV pool mode, all partitions are recomputed.
+ *
+ * @param partition_mask  array of `partition_count` flags, or NULL for all
+ *
+ * @return the log-likelihood of the tree, or NAN on error
+ */
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_masked(pllmod_treeinfo_t * treeinfo,
+                                                       int incremental,
+                                                       const int * partition_mask)
+{
+  /* pool slots are shared between partitions */
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+    partition_mask = NULL;
+
+  return treeinfo_compute_loglh(treeinfo, incremental, 1, NULL, partition_mask);
+}
+
+/* collect invalid CLVs of a subtree in postorder, stopping at valid ones */
+static void treeinfo_subtree_partial_traversal(pll_unode_t * node,
+                                               pll_unode_t ** outbuffer,
+                                               unsigned int * trav_size)
+{
+  if (!cb_partial_traversal(node))
+    return;
+
+  treeinfo_subtree_partial_traversal(node->next->back, outbuffer, trav_size);
+  treeinfo_subtree_partial_traversal(node->next->next->back, outbuffer, trav_size);
+
+  outbuffer[(*trav_size)++] = node;
+}
+
+/**
+ * Compute the log-likelihood of the tree obtained by regrafting a pruned
+ * subtree into a given branch, without actually changing the tree.
+ *
+ * The regraft branch is virtually split in two halves, and the CLV of the
+ * would-be inner node is computed from the CLVs at both ends of
+ * `regraft_edge`. The log-likelihood is then evaluated at the pendant branch
+ * of the pruned subtree. Only CLVs required to evaluate `regraft_edge` are
+ * updated (the tree root is moved there), and the CLV slots of the detached
+ * node `pruned_edge` are used as scratch space.
+ *
+ * P-matrices of the tree must be up-to-date, except for the pendant branch.
+ * The p-matrix index of `pruned_edge->next->next`, which is unused after
+ * `pllmod_utree_prune()`, is used for the split branch. As in an actual
+ * regraft followed by length correction, both halves of the split branch
+ * are at least `min_brlen` long.
+ *
+ * @param treeinfo the treeinfo structure
+ * @param pruned_edge the pruned edge, as passed to `pllmod_utree_prune()`
+ * @param regraft_edge the candidate regraft branch
+ * @param min_brlen minimum branch length
+ *
+ * @return the log-likelihood of the tree, or NAN on error
+ */
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_regraft(pllmod_treeinfo_t * treeinfo,
+                                                        pll_unode_t * pruned_edge,
+                                                        pll_unode_t * regraft_edge,
+                                                        double min_brlen)
+{
+  unsigned int traversal_size = 0;
+  unsigned int ops_count;
+  unsigned int p;
+  pll_operation_t regraft_op;
+
+  const double LOGLH_NONE = (double) NAN;
+  double total_loglh = 0.0;
+  const int old_active_partition = treeinfo->active_partition;
+  const double start_time = pllmod_time_wall();
+
+  if (!pruned_edge->next || pruned_edge->next->back ||
+      pruned_edge->next->next->back)
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_SPR_INVALID_NODE,
+                     "Edge must be a pruned inner node\n");
+    return LOGLH_NONE;
+  }
+
+  const unsigned int split_pmatrix_index = pruned_edge->next->next->pmatrix_index;
+  const unsigned int regraft_pmatrix_index = regraft_edge->pmatrix_index;
+  const unsigned int pendant_pmatrix_index = pruned_edge->pmatrix_index;
+
+  /* root must be an inner node */
+  pllmod_treeinfo_set_root(treeinfo, pllmod_utree_is_tip(regraft_edge) ?
+                                         regraft_edge->back : regraft_edge);
+
+  pllmod_treeinfo_set_active_partition(treeinfo, PLLMOD_TREEINFO_PARTITION_ALL);
+
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+  {
+    /* same CLVs as below, plus a slot for the virtual regraft node */
+    pll_unode_t * targets[3] = {regraft_edge, regraft_edge->back,
+                                pruned_edge->back};
+    if (!treeinfo_pool_traverse(treeinfo, targets, 3, pruned_edge,
+                                &traversal_size, &ops_count))
+      goto error;
+  }
+  else
+  {
+    /* directional CLVs at both ends of the regraft branch */
+    if (!pll_utree_traverse(treeinfo->root,
+                            PLL_TREE_TRAVERSE_POSTORDER,
+                            cb_partial_traversal,
+                            treeinfo->travbuffer,
+                            &traversal_size))
+      goto error;
+
+    /* CLV of the pruned subtree (usually valid already) */
+    treeinfo_subtree_partial_traversal(pruned_edge->back, treeinfo->travbuffer,
+                                       &traversal_size);
+
+    pll_utree_create_operations(treeinfo->travbuffer,
+                                traversal_size,
+                                NULL,
+                                NULL,
+                                treeinfo->operations,
+                                NULL,
+                                &ops_count);
+  }
+
+  /* virtual inner node joining both halves of the regraft branch */
+  regraft_op.parent_clv_index = pruned_edge->clv_index;
+  regraft_op.parent_scaler_index = pruned_edge->scaler_index;
+  regraft_op.child1_clv_index = regraft_edge->clv_index;
+  regraft_op.child1_scaler_index = regraft_edge->scaler_index;
+  regraft_op.child1_matrix_index = split_pmatrix_index;
+  regraft_op.child2_clv_index = regraft_edge->back->clv_index;
+  regraft_op.child2_scaler_index = regraft_edge->back->scaler_index;
+  regraft_op.child2_matrix_index = split_pmatrix_index;
+
+  treeinfo->counter += ops_count + 1;
+
+  for (p = 0; p < treeinfo->partition_count; ++p)
+  {
+    if (!treeinfo->partitions[p])
+    {
+      /* this partition will be computed by another thread(s) */
+      treeinfo->partition_loglh[p] = 0.0;
+      continue;
+    }
+
+    pllmod_treeinfo_set_active_partition(treeinfo, (int)p);
+
+    pllmod_treeinfo_stats_t * stats = treeinfo->partition_stats + p;
+    unsigned int pmatrix_updates = 1;
+    double op_time = pllmod_time_wall();
+
+    pll_update_partials(treeinfo->partitions[p],
+                        treeinfo->operations,
+                        ops_count);
+
+    op_time = treeinfo_stats_add(stats, PLLMOD_TREEINFO_STATS_CLV, ops_count,
+                                 op_time);
+
+    pllmod_treeinfo_validate_clvs(treeinfo,
+                                  treeinfo->travbuffer,
+                                  traversal_size);
+
+    double split_brlen = treeinfo->branch_lengths[p][regraft_pmatrix_index] / 2.;
+    if (split_brlen < min_brlen)
+      split_brlen = min_brlen;
+    double pendant_brlen = treeinfo->branch_lengths[p][pendant_pmatrix_index];
+    if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
+    {
+      split_brlen *= treeinfo->brlen_scalers[p];
+      pendant_brlen *= treeinfo->brlen_scalers[p];
+    }
+
+    if (!pll_update_prob_matrices(treeinfo->partitions[p],
+                                  treeinfo->param_indices[p],
+                                  &split_pmatrix_index,
+                                  &split_brlen,
+                                  1))
+      goto error;
+
+    if (!treeinfo->pmatrix_valid[p][pendant_pmatrix_index])
+    {
+      if (!pll_update_prob_matrices(treeinfo->partitions[p],
+                                    treeinfo->param_indices[p],
+                                    &pendant_pmatrix_index,
+                                    &pendant_brlen,
+                                    1))
+        goto error;
+      treeinfo->pmatrix_valid[p][pendant_pmatrix_index] = 1;
+      treeinfo->pmatrix_brlen[p][pendant_pmatrix_index] = pendant_brlen;
+      pmatrix_updates++;
+    }
+
+    op_time = treeinfo_stats_add(stats, PLLMOD_TREEINFO_STATS_PMATRIX,
+                                 pmatrix_updates, op_time);
+
+    pll_update_partials(treeinfo->partitions[p], &regraft_op, 1);
+
+    op_time = treeinfo_stats_add(stats, PLLMOD_TREEINFO_STATS_CLV, 1, op_time);
+
+    treeinfo->partition_loglh[p] = pll_compute_edge_loglikelihood(
+                                            treeinfo->partitions[p],
+                                            pruned_edge->clv_index,
+                                            pruned_edge->scaler_index,
+                                            pruned_edge->back->clv_index,
+                                            pruned_edge->back->scaler_index,
+                                            pendant_pmatrix_index,
+                                            treeinfo->param_indices[p],
+                                            NULL);
+
+    treeinfo_stats_add(stats, PLLMOD_TREEINFO_STATS_LOGLH, 1, op_time);
+
+    /* scratch CLV and p-matrix do not correspond to the actual tree */
+    treeinfo->clv_valid[p][pruned_edge->node_index] = 0;
+    treeinfo->clv_valid[p][pruned_edge->next->node_index] = 0;
+    treeinfo->clv_valid[p][pruned_edge->next->next->node_index] = 0;
+    treeinfo->pmatrix_valid[p][split_pmatrix_index] = 0;
+    treeinfo->pmatrix_brlen[p][split_pmatrix_index] = (double) NAN;
+  }
+
+  /* sum up likelihood from all threads */
+  if (!treeinfo_reduce_partition_loglh(treeinfo))
+    goto error;
+
+  for (p = 0; p < treeinfo->partition_count; ++p)
+    total_loglh += treeinfo->partition_loglh[p];
+
+  pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+
+  treeinfo_stats_add(&treeinfo->stats, PLLMOD_TREEINFO_STATS_REGRAFT, 1,
+                     start_time);
+
+  return total_loglh;
+
+error:
+  pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+  return LOGLH_NONE;
+}
+
+/* CLV cache entry of pllmod_treeinfo_compute_loglh_batch(): a rooted subtree
+ * is identified by the ids of its two child subtrees and the lengths of the
+ * branches leading to them. Tip subtree ids are clv_index+1, 0 = empty slot */
+typedef struct treeinfo_batch_slot
+{
+  unsigned long long uid;
+  unsigned long long child_uid[2];
+  double child_length[2];
+  unsigned int stamp;  /* last tree which used this CLV */
+  int next;            /* next slot in the hash chain */
+  int scaler;          /* scale buffer of this CLV, -1 = none */
+  int pinned;          /* CLV is still needed by a pending operation */
+} treeinfo_batch_slot_t;
+
+typedef struct treeinfo_batch
+{
+  pllmod_treeinfo_t * treeinfo;
+
+  /* CLV cache */
+  unsigned int slot_count;
+  treeinfo_batch_slot_t * slots;
+  int * buckets;
+  unsigned int bucket_mask;
+  unsigned int clock_hand;
+  unsigned int stamp;
+  unsigned long long next_uid;
+
+  /* scale buffers are assigned to cached CLVs on demand */
+  unsigned int scaler_count;  /* 0 = no scaling */
+  int * scaler_slot;          /* slot which owns each scale buffer, -1 = free */
+  unsigned int scaler_hand;
+
+  /* current tree */
+  unsigned int ops_count;
+  unsigned int edge_count;
+  unsigned int * matrix_indices;
+  double * branch_lengths;
+  unsigned int root_clv_index;
+  int root_scaler_index;
+  const pll_unode_t * root_tip;
+  double ** persite_lnl;
+} treeinfo_batch_t;
+
+static unsigned int treeinfo_batch_hash(const treeinfo_batch_t * batch,
+                                        const unsigned long long * child_uid,
+                                        const double * child_length)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  unsigned long long bits;
+  unsigned int i;
+
+  for (i = 0; i < 2; ++i)
+  {
+    memcpy(&bits, child_length + i, sizeof(bits));
+    h = (h ^ child_uid[i]) * 1099511628211ULL;
+    h = (h ^ bits) * 1099511628211ULL;
+  }
+
+  return (unsigned int) (h ^ (h >> 32)) & batch->bucket_mask;
+}
+
+/* remove a subtree from the hash table */
+static void treeinfo_batch_unlink(treeinfo_batch_t * batch, unsigned int s)
+{
+  treeinfo_batch_slot_t * slot = batch->slots + s;
+  int * link = batch->buckets +
+               treeinfo_batch_hash(batch, slot->child_uid, slot->child_length);
+
+  while (*link != (int) s)
+    link = &batch->slots[*link].next;
+  *link = slot->next;
+  slot->uid = 0;
+}
+
+/* pick a CLV slot which is not used by the current tree ("clock" policy);
+ * the slot keeps its scale buffer, if any */
+static unsigned int treeinfo_batch_evict(treeinfo_batch_t * batch)
+{
+  for (;;)
+  {
+    unsigned int s = batch->clock_hand;
+    treeinfo_batch_slot_t * slot = batch->slots + s;
+
+    batch->clock_hand = (batch->clock_hand + 1) % batch->slot_count;
+
+    if (!slot->uid)
+      return s;
+    else if (slot->stamp != batch->stamp)
+    {
+      treeinfo_batch_unlink(batch, s);
+      return s;
+    }
+  }
+}
+
+/* assign a scale buffer to CLV slot `s`. If all buffers are in use, the one
+ * of a CLV which is not needed by a pending operation is taken over, and that
+ * CLV is dropped from the cache (the operations which used it come first) */
+static int treeinfo_batch_scaler(treeinfo_batch_t * batch, unsigned int s)
+{
+  unsigned int i;
+
+  for (i = 0; i < batch->scaler_count; ++i)
+  {
+    unsigned int sc = batch->scaler_hand;
+    int owner = batch->scaler_slot[sc];
+
+    batch->scaler_hand = (batch->scaler_hand + 1) % batch->scaler_count;
+
+    if (owner >= 0)
+    {
+      treeinfo_batch_slot_t * slot = batch->slots + owner;
+
+      if (slot->pinned)
+        continue;
+
+      if (slot->uid)
+        treeinfo_batch_unlink(batch, (unsigned int) owner);
+      slot->scaler = -1;
+    }
+
+    batch->scaler_slot[sc] = (int) s;
+    batch->slots[s].scaler = (int) sc;
+    return PLL_SUCCESS;
+  }
+
+  pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                   "Not enough scale buffers for batch evaluation: %u\n",
+                   batch->scaler_count);
+  return PLL_FAILURE;
+}
+
+static void treeinfo_batch_add_edge(treeinfo_batch_t * batch,
+                                    const pll_unode_t * edge)
+{
+  batch->matrix_indices[batch->edge_count] = edge->pmatrix_index;
+  batch->branch_lengths[batch->edge_count] = edge->length;
+  batch->edge_count++;
+}
+
+/* post-order traversal which reuses cached CLVs and creates operations for
+ * the missing ones; the returned CLV slot is pinned (-1 for tips) */
+static int treeinfo_batch_subtree(treeinfo_batch_t * batch,
+                                  const pll_unode_t * node,
+                                  unsigned long long * uid,
+                                  unsigned int * clv_index,
+                                  int * scaler_index,
+                                  int * slot_index)
+{
+  const unsigned int tip_count = batch->treeinfo->tip_count;
+  const pll_unode_t * child[2];
+  unsigned long long child_uid[2];
+  unsigned int child_clv[2];
+  int child_scaler[2];
+  int child_slot[2];
+  double child_length[2];
+  unsigned int i;
+
+  if (!node->next)
+  {
+    *uid = node->clv_index + 1;
+    *clv_index = node->clv_index;
+    *scaler_index = node->scaler_index;
+    *slot_index = -1;
+    return PLL_SUCCESS;
+  }
+
+  child[0] = node->next->back;
+  child[1] = node->next->next->back;
+
+  for (i = 0; i < 2; ++i)
+  {
+    treeinfo_batch_add_edge(batch, child[i]);
+    if (!treeinfo_batch_subtree(batch, child[i], child_uid + i, child_clv + i,
+                                child_scaler + i, child_slot + i))
+      return PLL_FAILURE;
+    child_length[i] = child[i]->length;
+  }
+
+  /* children are unordered */
+  if (child_uid[0] > child_uid[1])
+  {
+    const pll_unode_t * tmp_node = child[0];
+    unsigned long long tmp_uid = child_uid[0];
+    unsigned int tmp_clv = child_clv[0];
+    int tmp_scaler = child_scaler[0];
+    double tmp_length = child_length[0];
+
+    child[0] = child[1];
+    child_uid[0] = child_uid[1];
+    child_clv[0] = child_clv[1];
+    child_scaler[0] = child_scaler[1];
+    child_length[0] = child_length[1];
+
+    child[1] = tmp_node;
+    child_uid[1] = tmp_uid;
+    child_clv[1] = tmp_clv;
+    child_scaler[1] = tmp_scaler;
+    child_length[1] = tmp_length;
+  }
+
+  unsigned int h = treeinfo_batch_hash(batch, child_uid, child_length);
+  int s = batch->buckets[h];
+  while (s >= 0)
+  {
+    const treeinfo_batch_slot_t * slot = batch->slots + s;
+    if (slot->child_uid[0] == child_uid[0] &&
+        slot->child_uid[1] == child_uid[1] &&
+        slot->child_length[0] == child_length[0] &&
+        slot->child_length[1] == child_length[1])
+      break;
+    s = slot->next;
+  }
+
+  if (s < 0)
+  {
+    /* CLV is not in the cache -> compute it */
+    s = (int) treeinfo_batch_evict(batch);
+
+    treeinfo_batch_slot_t * slot = batch->slots + s;
+
+    /* children are still pinned, so their scalers are not taken over */
+    if (batch->scaler_count && slot->scaler < 0 &&
+        !treeinfo_batch_scaler(batch, (unsigned int) s))
+      return PLL_FAILURE;
+
+    slot->uid = batch->next_uid++;
+    for (i = 0; i < 2; ++i)
+    {
+      slot->child_uid[i] = child_uid[i];
+      slot->child_length[i] = child_length[i];
+    }
+    slot->next = batch->buckets[h];
+    batch->buckets[h] = s;
+
+    pll_operation_t * op = batch->treeinfo->operations + batch->ops_count++;
+    op->parent_clv_index = tip_count + (unsigned int) s;
+    op->parent_scaler_index = batch->scaler_count ?
+                                slot->scaler : PLL_SCALE_BUFFER_NONE;
+    op->child1_clv_index = child_clv[0];
+    op->child1_scaler_index = child_scaler[0];
+    op->child1_matrix_index = child[0]->pmatrix_index;
+    op->child2_clv_index = child_clv[1];
+    op->child2_scaler_index = child_scaler[1];
+    op->child2_matrix_index = child[1]->pmatrix_index;
+  }
+
+  /* children have been consumed by the operation above (or are not needed) */
+  for (i = 0; i < 2; ++i)
+  {
+    if (child_slot[i] >= 0)
+      batch->slots[child_slot[i]].pinned = 0;
+  }
+
+  /* protect this CLV from eviction until the current tree is done */
+  batch->slots[s].stamp = batch->stamp;
+  batch->slots[s].pinned = 1;
+
+  *uid = batch->slots[s].uid;
+  *clv_index = tip_count + (unsigned int) s;
+  *scaler_index = batch->scaler_count ?
+                    batch->slots[s].scaler : PLL_SCALE_BUFFER_NONE;
+  *slot_index = s;
+
+  return PLL_SUCCESS;
+}
+
+/* p-matrix indices are used to address the buffers of the treeinfo, check
+ * them before the tree is added to the cache */
+static int treeinfo_batch_check_tree(const treeinfo_batch_t * batch,
+                                     const pll_utree_t * tree,
+                                     unsigned int tree_index)
+{
+  const unsigned int edge_count = batch->treeinfo->tree->edge_count;
+  const unsigned int node_count = tree->tip_count + tree->inner_count;
+  unsigned int i;
+
+  for (i = 0; i < node_count; ++i)
+  {
+    const pll_unode_t * start = tree->nodes[i];
+    const pll_unode_t * node = start;
+
+    do
+    {
+      if (node->pmatrix_index >= edge_count)
+      {
+        pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE,
+                         "Tree %u: p-matrix index %u is out of range\n",
+                         tree_index, node->pmatrix_index);
+        return PLL_FAILURE;
+      }
+      node = node->next;
+    }
+    while (node && node != start);
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int treeinfo_batch_update_pmatrices(void * data,
+                                           unsigned int task_index,
+                                           unsigned int thread_index)
+{
+  treeinfo_batch_t * batch = (treeinfo_batch_t *) data;
+  pllmod_treeinfo_t * treeinfo = batch->treeinfo;
+  unsigned int p = treeinfo->partition_order[task_index];
+  unsigned int i;
+
+  PLLMOD_UNUSED(thread_index);
+
+  double start_time = pllmod_time_wall();
+
+  for (i = 0; i < batch->edge_count; ++i)
+  {
+    double p_brlen = batch->branch_lengths[i];
+    if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
+      p_brlen *= treeinfo->brlen_scalers[p];
+
+    if (!pll_update_prob_matrices(treeinfo->partitions[p],
+                                  treeinfo->param_indices[p],
+                                  batch->matrix_indices + i,
+                                  &p_brlen,
+                                  1))
+      return PLL_FAILURE;
+  }
+
+  treeinfo_stats_add(treeinfo->partition_stats + p,
+                     PLLMOD_TREEINFO_STATS_PMATRIX, batch->edge_count,
+                     start_time);
+
+  return PLL_SUCCESS;
+}
+
+static int treeinfo_batch_compute_shard(void * data,
+                                        unsigned int task_index,
+                                        unsigned int thread_index)
+{
+  treeinfo_batch_t * batch = (treeinfo_batch_t *) data;
+  pllmod_treeinfo_t * treeinfo = batch->treeinfo;
+  pllmod_treeinfo_shard_t * shard = treeinfo->shards + task_index;
+  unsigned int p = shard->partition_index;
+
+  PLLMOD_UNUSED(thread_index);
+
+  treeinfo_sync_shard(treeinfo, shard);
+
+  double start_time = pllmod_time_wall();
+
+  pll_update_partials(shard->partition,
+                      treeinfo->operations,
+                      batch->ops_count);
+
+  double clv_time = pllmod_time_wall();
+
+  shard->loglh = pll_compute_edge_loglikelihood(
+                                          shard->partition,
+                                          batch->root_clv_index,
+                                          batch->root_scaler_index,
+                                          batch->root_tip->clv_index,
+                                          batch->root_tip->scaler_index,
+                                          batch->root_tip->pmatrix_index,
+                                          treeinfo->param_indices[p],
+                                          batch->persite_lnl ?
+                                            batch->persite_lnl[p] +
+                                              shard->site_offset : NULL);
+
+  treeinfo_shard_stats(shard, batch->ops_count, start_time, clv_time);
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Compute log-likelihoods of a set of trees on the same tip set.
+ *
+ * CLVs of identical rooted subtrees (same topology and branch lengths) are
+ * computed only once and shared between the trees. To this end, every tree is
+ * rooted at the tip with clv_index 0, so that each subtree corresponds to the
+ * side of a split which does not contain this tip. The free CLV buffers of the
+ * partitions serve as a cache: it must hold at least tip_count-2 CLVs, and
+ * larger partitions (more CLV buffers) increase the hit rate when trees are
+ * dissimilar. Scale buffers are assigned to cached CLVs on demand; with fewer
+ * scale buffers than CLV buffers, a CLV drops out of the cache when its scale
+ * buffer is reused. Partitions without scale buffers are evaluated without
+ * scaling.
+ *
+ * Trees must have the same tip clv_index assignment as the treeinfo tree and
+ * unique p-matrix indices below the number of branches. Model parameters are
+ * taken from the treeinfo, branch lengths from the trees (scaled by the
+ * partition scalers in scaled mode; in unlinked mode, all partitions use the
+ * branch lengths of the tree). The treeinfo CLVs and p-matrices are
+ * overwritten and invalidated.
+ *
+ * @param treeinfo the treeinfo structure
+ * @param trees array of trees to evaluate
+ * @param tree_count number of trees
+ * @param[out] tree_loglh log-likelihood of every tree
+ * @param[out] persite_lnl if not NULL, per-site log-likelihoods of tree t and
+ *                         partition p are stored at persite_lnl[t][p]
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_treeinfo_compute_loglh_batch(pllmod_treeinfo_t * treeinfo,
+                                                   pll_utree_t ** trees,
+                                                   unsigned int tree_count,
+                                                   double * tree_loglh,
+                                                   double *** persite_lnl)
+{
+  const unsigned int tip_count = treeinfo->tip_count;
+  const unsigned int inner_count = tip_count - 2;
+  const unsigned int edge_count = treeinfo->tree->edge_count;
+  const int old_active_partition = treeinfo->active_partition;
+  treeinfo_batch_t batch;
+  unsigned int i, t, p;
+  int retval = PLL_FAILURE;
+
+  memset(&batch, 0, sizeof(treeinfo_batch_t));
+  batch.treeinfo = treeinfo;
+
+  /* all inner CLVs of the partitions can be used by the cache */
+  batch.slot_count = (unsigned int) -1;
+  batch.scaler_count = (unsigned int) -1;
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    const pll_partition_t * partition = treeinfo->init_partitions[i];
+    if (partition->clv_buffers < batch.slot_count)
+      batch.slot_count = partition->clv_buffers;
+    if (partition->scale_buffers < batch.scaler_count)
+      batch.scaler_count = partition->scale_buffers;
+  }
+  if (!treeinfo->init_partition_count)
+  {
+    batch.slot_count = inner_count;
+    batch.scaler_count = 0;
+  }
+  if (batch.scaler_count > batch.slot_count)
+    batch.scaler_count = batch.slot_count;
+
+  if (batch.slot_count < inner_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Not enough CLV buffers for batch evaluation: %u (%u needed)\n",
+                     batch.slot_count, inner_count);
+    return PLL_FAILURE;
+  }
+
+  unsigned int bucket_count = 1;
+  while (bucket_count < 2 * batch.slot_count)
+    bucket_count <<= 1;
+  batch.bucket_mask = bucket_count - 1;
+
+  batch.slots = (treeinfo_batch_slot_t *) calloc(batch.slot_count,
+                                                 sizeof(treeinfo_batch_slot_t));
+  batch.buckets = (int *) malloc(bucket_count * sizeof(int));
+  batch.matrix_indices = (unsigned int *) malloc(edge_count * sizeof(unsigned int));
+  batch.branch_lengths = (double *) malloc(edge_count * sizeof(double));
+  batch.scaler_slot = (int *) malloc((batch.scaler_count + 1) * sizeof(int));
+
+  if (!batch.slots || !batch.buckets || !batch.matrix_indices ||
+      !batch.branch_lengths || !batch.scaler_slot)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for batch evaluation\n");
+    goto cleanup;
+  }
+
+  for (i = 0; i < bucket_count; ++i)
+    batch.buckets[i] = -1;
+
+  for (i = 0; i < batch.slot_count; ++i)
+    batch.slots[i].scaler = -1;
+
+  for (i = 0; i < batch.scaler_count; ++i)
+    batch.scaler_slot[i] = -1;
+
+  batch.next_uid = tip_count + 1;
+
+  pllmod_treeinfo_set_active_partition(treeinfo, PLLMOD_TREEINFO_PARTITION_ALL);
+
+  for (t = 0; t < tree_count; ++t)
+  {
+    const pll_utree_t * tree = trees[t];
+    unsigned long long root_uid;
+    int root_slot;
+
+    if (tree->tip_count != tip_count)
+    {
+      pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE_SIZE,
+                       "Tree %u has %u tips (expected: %u)\n",
+                       t, tree->tip_count, tip_count);
+      goto cleanup;
+    }
+
+    batch.root_tip = NULL;
+    for (i = 0; i < tip_count; ++i)
+    {
+      if (tree->nodes[i]->clv_index == 0)
+      {
+        batch.root_tip = tree->nodes[i];
+        break;
+      }
+    }
+
+    if (!batch.root_tip)
+    {
+      pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE,
+                       "Tree %u has no tip with CLV index 0\n", t);
+      goto cleanup;
+    }
+
+    if (!treeinfo_batch_check_tree(&batch, tree, t))
+      goto cleanup;
+
+    batch.stamp = t + 1;
+    batch.ops_count = 0;
+    batch.edge_count = 0;
+
+    treeinfo_batch_add_edge(&batch, batch.root_tip);
+    if (!treeinfo_batch_subtree(&batch, batch.root_tip->back, &root_uid,
+                                &batch.root_clv_index, &batch.root_scaler_index,
+                                &root_slot))
+      goto cleanup;
+
+    if (root_slot >= 0)
+      batch.slots[root_slot].pinned = 0;
+
+    assert(batch.edge_count == edge_count);
+
+    treeinfo->counter += batch.ops_count;
+
+    batch.persite_lnl = persite_lnl ? persite_lnl[t] : NULL;
+
+    if (!pllmod_thread_pool_run((pllmod_thread_pool_t *) treeinfo->thread_pool,
+                                treeinfo->init_partition_count,
+                                treeinfo_batch_update_pmatrices,
+                                &batch) ||
+        !pllmod_thread_pool_run((pllmod_thread_pool_t *) treeinfo->thread_pool,
+                                treeinfo->shard_count,
+                                treeinfo_batch_compute_shard,
+                                &batch))
+      goto cleanup;
+
+    for (p = 0; p < treeinfo->partition_count; ++p)
+      treeinfo->partition_loglh[p] = 0.0;
+
+    for (i = 0; i < treeinfo->shard_count; ++i)
+    {
+      const pllmod_treeinfo_shard_t * shard = treeinfo->shards + i;
+      treeinfo->partition_loglh[shard->partition_index] += shard->loglh;
+    }
+
+    treeinfo_collect_shard_stats(treeinfo);
+
+    if (!treeinfo_reduce_partition_loglh(treeinfo))
+      goto cleanup;
+
+    tree_loglh[t] = 0.0;
+    for (p = 0; p < treeinfo->partition_count; ++p)
+      tree_loglh[t] += treeinfo->partition_loglh[p];
+  }
+
+  retval = PLL_SUCCESS;
+
+cleanup:
+  /* CLVs and p-matrices do not correspond to the treeinfo tree anymore */
+  pllmod_treeinfo_set_active_partition(treeinfo, PLLMOD_TREEINFO_PARTITION_ALL);
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+
+  free(batch.slots);
+  free(batch.buckets);
+  free(batch.matrix_indices);
+  free(batch.branch_lengths);
+  free(batch.scaler_slot);
+
+  return retval;
+}
+
+/* edge CLV mode: inner nodes need 3 CLVs and scalers each */
+static int treeinfo_check_clv_buffers(const pllmod_treeinfo_t * treeinfo,
+                                      const pll_partition_t * partition)
+{
+  const unsigned int edge_clv_count = 3 * (treeinfo->tip_count - 2);
+
+  if (partition->clv_buffers < edge_clv_count ||
+      partition->scale_buffers < edge_clv_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Edge CLV mode requires %u CLV and scale buffers per "
+                     "partition\n", edge_clv_count);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static void treeinfo_assign_clv_indices(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i;
+  unsigned int k = 0;
+  const unsigned int tip_count = treeinfo->tip_count;
+
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE)
+  {
+    /* separate CLV and scaler for each direction */
+    for (i = 0; i < treeinfo->subnode_count; ++i)
+    {
+      pll_unode_t * snode = treeinfo->subnodes[i];
+      if (snode->next)
+      {
+        snode->clv_index = tip_count + k;
+        snode->scaler_index = (int) k;
+        k++;
+      }
+    }
+  }
+  else
+  {
+    /* same CLV and scaler for all 3 directions (default libpll layout) */
+    for (i = 0; i < treeinfo->tree->inner_count; ++i)
+    {
+      pll_unode_t * snode = treeinfo->tree->nodes[tip_count + i];
+      snode->clv_index = snode->next->clv_index =
+          snode->next->next->clv_index = tip_count + i;
+      snode->scaler_index = snode->next->scaler_index =
+          snode->next->next->scaler_index = (int) i;
+    }
+  }
+}
+
+/* collect CLVs pointing away from the root in preorder, given a node whose
+ * CLV points towards the root */
+static void treeinfo_outward_traversal(pll_unode_t * node,
+                                       pll_unode_t ** outbuffer,
+                                       unsigned int * trav_size)
+{
+  if (!node->next)
+    return;
+
+  outbuffer[(*trav_size)++] = node->next;
+  outbuffer[(*trav_size)++] = node->next->next;
+
+  treeinfo_outward_traversal(node->next->back, outbuffer, trav_size);
+  treeinfo_outward_traversal(node->next->next->back, outbuffer, trav_size);
+}
+
+/* computing a CLV takes at most floor(log2(tips))+1 slots if the more
+ * expensive child subtree goes first; up to three traversal targets and the
+ * regraft scratch CLV need some more */
+static unsigned int treeinfo_pool_min_slots(unsigned int tip_count)
+{
+  unsigned int log2_tips = 0;
+  while ((1u << log2_tips) < tip_count)
+    log2_tips++;
+
+  return log2_tips + 4;
+}
+
+static int treeinfo_check_pool_buffers(const pllmod_treeinfo_t * treeinfo,
+                                       const pll_partition_t * partition)
+{
+  const unsigned int min_slots = treeinfo_pool_min_slots(treeinfo->tip_count);
+
+  if (partition->clv_buffers < min_slots ||
+      partition->scale_buffers < min_slots)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "CLV pool mode requires at least %u CLV and scale buffers "
+                     "per partition\n", min_slots);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static treeinfo_clv_pool_t * treeinfo_pool_create(const pllmod_treeinfo_t * treeinfo)
+{
+  const unsigned int inner_count = treeinfo->tip_count - 2;
+  const unsigned int subnode_count = treeinfo->subnode_count;
+
+  treeinfo_clv_pool_t * pool =
+      (treeinfo_clv_pool_t *) calloc(1, sizeof(treeinfo_clv_pool_t));
+
+  if (!pool)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for CLV pool\n");
+    return NULL;
+  }
+
+  pool->slot_node = (pll_unode_t **) calloc(inner_count, sizeof(pll_unode_t *));
+  pool->slot_pins = (unsigned int *) calloc(inner_count, sizeof(unsigned int));
+  pool->slot_stamp = (unsigned long *) calloc(inner_count, sizeof(unsigned long));
+  pool->slot_wanted = (unsigned long *) calloc(inner_count,
+                                               sizeof(unsigned long));
+  pool->node_slot = (int *) calloc(subnode_count, sizeof(int));
+  pool->need = (unsigned int *) calloc(subnode_count, sizeof(unsigned int));
+  pool->evicted = (char *) calloc(subnode_count, sizeof(char));
+
+  if (!pool->slot_node || !pool->slot_pins || !pool->slot_stamp ||
+      !pool->slot_wanted || !pool->node_slot || !pool->need || !pool->evicted)
+  {
+    free(pool->slot_node);
+    free(pool->slot_pins);
+    free(pool->slot_stamp);
+    free(pool->slot_wanted);
+    free(pool->node_slot);
+    free(pool->need);
+    free(pool->evicted);
+    free(pool);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for CLV pool\n");
+    return NULL;
+  }
+
+  return pool;
+}
+
+static void treeinfo_pool_destroy(treeinfo_clv_pool_t * pool)
+{
+  if (!pool) return;
+
+  free(pool->slot_node);
+  free(pool->slot_pins);
+  free(pool->slot_stamp);
+  free(pool->slot_wanted);
+  free(pool->node_slot);
+  free(pool->need);
+  free(pool->evicted);
+  free(pool);
+}
+
+/* release all slots and invalidate all CLVs; slot count is the smallest
+ * number of CLV/scale buffers over all initialized partitions */
+static void treeinfo_pool_reset(pllmod_treeinfo_t * treeinfo)
+{
+  treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+  const unsigned int tip_count = treeinfo->tip_count;
+  unsigned int i;
+
+  pool->slot_count = tip_count - 2;
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    const pll_partition_t * partition = treeinfo->init_partitions[i];
+    pool->slot_count = PLL_MIN(pool->slot_count, partition->clv_buffers);
+    pool->slot_count = PLL_MIN(pool->slot_count, partition->scale_buffers);
+  }
+
+  for (i = 0; i < tip_count - 2; ++i)
+  {
+    pool->slot_node[i] = NULL;
+    pool->slot_pins[i] = 0;
+    pool->slot_stamp[i] = 0;
+    pool->slot_wanted[i] = 0;
+  }
+
+  for (i = 0; i < treeinfo->subnode_count; ++i)
+  {
+    pll_unode_t * snode = treeinfo->subnodes[i];
+    pool->node_slot[i] = -1;
+    pool->evicted[i] = 0;
+
+    /* stale until the node gets a slot */
+    if (snode->next)
+    {
+      snode->clv_index = tip_count;
+      snode->scaler_index = 0;
+    }
+  }
+
+  pool->clock = pool->serial = 0;
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+    memset(treeinfo->clv_valid[p], 0, treeinfo->subnode_count * sizeof(char));
+  }
+}
+
+static unsigned int treeinfo_pool_need(pllmod_treeinfo_t * treeinfo,
+                                       pll_unode_t * node)
+{
+  treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+
+  /* tips do not occupy a slot */
+  if (!node->next)
+    return 0;
+
+  int slot = pool->node_slot[node->node_index];
+  if (slot >= 0 && !cb_partial_traversal(node))
+  {
+    /* valid CLV is resident: evict it only if nothing else is left */
+    pool->slot_wanted[slot] = pool->serial;
+    pool->need[node->node_index] = 1;
+    return 1;
+  }
+
+  unsigned int a = treeinfo_pool_need(treeinfo, node->next->back);
+  unsigned int b = treeinfo_pool_need(treeinfo, node->next->next->back);
+  unsigned int hi = PLL_MAX(a, b);
+  unsigned int lo = PLL_MIN(a, b);
+
+  /* Sethi-Ullman number: the more expensive child is computed first and
+   * kept while the other one is computed, then both are combined into a
+   * slot distinct from the children's */
+  unsigned int need = hi;
+  need = PLL_MAX(need, lo + (hi > 0 ? 1u : 0u));
+  need = PLL_MAX(need, (hi > 0 ? 1u : 0u) + (lo > 0 ? 1u : 0u) + 1u);
+
+  pool->need[node->node_index] = need;
+
+  return need;
+}
+
+/* drop the CLV held by a slot; directions that were valid are recorded, so
+ * that computing them again can be counted as a recomputation */
+static void treeinfo_pool_evict(pllmod_treeinfo_t * treeinfo,
+                                unsigned int slot)
+{
+  treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+  pll_unode_t * node = pool->slot_node[slot];
+  pll_unode_t * snode = node;
+  unsigned int i;
+
+  do
+  {
+    int valid = 0;
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      unsigned int p = treeinfo->init_partition_idx[i];
+      if (treeinfo->clv_valid[p][snode->node_index])
+      {
+        treeinfo->clv_valid[p][snode->node_index] = 0;
+        valid = 1;
+      }
+    }
+
+    if (valid)
+    {
+      pool->evicted[snode->node_index] = 1;
+      treeinfo->clv_pool_evictions++;
+    }
+
+    pool->node_slot[snode->node_index] = -1;
+    snode = snode->next;
+  }
+  while (snode != node);
+
+  pool->slot_node[slot] = NULL;
+}
+
+/* get a (pinned) slot for the CLV of node: its own slot if it has one, else
+ * a free slot, else the least recently used slot which is not needed by the
+ * current traversal, else any unpinned slot */
+static int treeinfo_pool_acquire(pllmod_treeinfo_t * treeinfo,
+                                 pll_unode_t * node)
+{
+  treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+  int slot = pool->node_slot[node->node_index];
+  unsigned int s;
+
+  if (slot < 0)
+  {
+    for (s = 0; s < pool->slot_count; ++s)
+    {
+      if (!pool->slot_node[s])
+      {
+        slot = (int) s;
+        break;
+      }
+      else if (pool->slot_pins[s])
+        continue;
+      else if (slot < 0)
+        slot = (int) s;
+      else
+      {
+        int wanted_s = (pool->slot_wanted[s] == pool->serial);
+        int wanted_slot = (pool->slot_wanted[slot] == pool->serial);
+        if (wanted_s < wanted_slot ||
+            (wanted_s == wanted_slot &&
+             pool->slot_stamp[s] < pool->slot_stamp[slot]))
+          slot = (int) s;
+      }
+    }
+
+    if (slot < 0)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "CLV pool is too small (%u slots)\n", pool->slot_count);
+      return PLL_FAILURE;
+    }
+
+    if (pool->slot_node[slot])
+      treeinfo_pool_evict(treeinfo, (unsigned int) slot);
+
+    pll_unode_t * snode = node;
+    do
+    {
+      snode->clv_index = treeinfo->tip_count + (unsigned int) slot;
+      snode->scaler_index = slot;
+      pool->node_slot[snode->node_index] = slot;
+      snode = snode->next;
+    }
+    while (snode != node);
+
+    pool->slot_node[slot] = node;
+  }
+
+  /* all directions of a node share the slot, and only one of them can be
+   * part of a traversal */
+  assert(!pool->slot_pins[slot]);
+
+  pool->slot_pins[slot]++;
+  pool->slot_stamp[slot] = ++pool->clock;
+
+  return PLL_SUCCESS;
+}
+
+static void treeinfo_pool_release(treeinfo_clv_pool_t * pool,
+                                  const pll_unode_t * node)
+{
+  if (node->next)
+  {
+    int slot = pool->node_slot[node->node_index];
+    assert(slot >= 0 && pool->slot_pins[slot]);
+    pool->slot_pins[slot]--;
+  }
+}
+
+static unsigned int treeinfo_pool_node_need(const treeinfo_clv_pool_t * pool,
+                                            const pll_unode_t * node)
+{
+  return node->next ? pool->need[node->node_index] : 0;
+}
+
+/* append the operations for computing the CLV of node (and of any invalid or
+ * evicted CLV in its subtree); the CLV stays pinned */
+static int treeinfo_pool_emit(pllmod_treeinfo_t * treeinfo,
+                              pll_unode_t * node,
+                              unsigned int * trav_size,
+                              unsigned int * ops_count)
+{
+  treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+
+  if (!node->next)
+    return PLL_SUCCESS;
+
+  int slot = pool->node_slot[node->node_index];
+  if (slot >= 0 && !cb_partial_traversal(node))
+  {
+    pool->slot_pins[slot]++;
+    pool->slot_stamp[slot] = ++pool->clock;
+    return PLL_SUCCESS;
+  }
+
+  pll_unode_t * child1 = node->next->back;
+  pll_unode_t * child2 = node->next->next->back;
+  pll_unode_t * first = child1;
+  pll_unode_t * second = child2;
+
+  if (treeinfo_pool_node_need(pool, child2) >
+      treeinfo_pool_node_need(pool, child1))
+  {
+    first = child2;
+    second = child1;
+  }
+
+  if (!treeinfo_pool_emit(treeinfo, first, trav_size, ops_count) ||
+      !treeinfo_pool_emit(treeinfo, second, trav_size, ops_count))
+    return PLL_FAILURE;
+
+  /* CLVs evicted and recomputed within one traversal could overflow the
+   * operations buffer */
+  if (*ops_count == treeinfo->tree->inner_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "CLV pool is too small (%u slots)\n", pool->slot_count);
+    return PLL_FAILURE;
+  }
+
+  if (!treeinfo_pool_acquire(treeinfo, node))
+    return PLL_FAILURE;
+
+  pll_operation_t * op = treeinfo->operations + (*ops_count)++;
+  op->parent_clv_index = node->clv_index;
+  op->parent_scaler_index = node->scaler_index;
+  op->child1_clv_index = child1->clv_index;
+  op->child1_scaler_index = child1->scaler_index;
+  op->child1_matrix_index = child1->pmatrix_index;
+  op->child2_clv_index = child2->clv_index;
+  op->child2_scaler_index = child2->scaler_index;
+  op->child2_matrix_index = child2->pmatrix_index;
+
+  treeinfo->travbuffer[(*trav_size)++] = node;
+
+  if (pool->evicted[node->node_index])
+  {
+    pool->evicted[node->node_index] = 0;
+    treeinfo->clv_pool_recomputations++;
+  }
+
+  /* operations are executed in order, so children's slots can be reused */
+  treeinfo_pool_release(pool, child1);
+  treeinfo_pool_release(pool, child2);
+
+  return PLL_SUCCESS;
+}
+
+/* pool mode replacement for partial traversal + pll_utree_create_operations:
+ * make CLVs of all targets valid and resident, and assign a slot to scratch
+ * (if any). Nodes whose CLV is computed are stored in treeinfo->travbuffer */
+static int treeinfo_pool_traverse(pllmod_treeinfo_t * treeinfo,
+                                  pll_unode_t ** targets,
+                                  unsigned int target_count,
+                                  pll_unode_t * scratch,
+                                  unsigned int * trav_size,
+                                  unsigned int * ops_count)
+{
+  treeinfo_clv_pool_t * pool = (treeinfo_clv_pool_t *) treeinfo->clv_pool;
+  unsigned int i, j;
+  int retval = PLL_SUCCESS;
+
+  *trav_size = 0;
+  *ops_count = 0;
+  pool->serial++;
+
+  for (i = 0; i < target_count; ++i)
+    treeinfo_pool_need(treeinfo, targets[i]);
+
+  /* most expensive target first */
+  for (i = 1; i < target_count; ++i)
+  {
+    pll_unode_t * target = targets[i];
+    for (j = i; j > 0 && treeinfo_pool_node_need(pool, targets[j-1]) <
+                         treeinfo_pool_node_need(pool, target); --j)
+      targets[j] = targets[j-1];
+    targets[j] = target;
+  }
+
+  for (i = 0; i < target_count && retval; ++i)
+    retval = treeinfo_pool_emit(treeinfo, targets[i], trav_size, ops_count);
+
+  if (retval && scratch)
+    retval = treeinfo_pool_acquire(treeinfo, scratch);
+
+  /* CLVs which were computed and evicted again must not be validated */
+  for (i = 0, j = 0; i < *trav_size; ++i)
+  {
+    pll_unode_t * node = treeinfo->travbuffer[i];
+    if (pool->node_slot[node->node_index] >= 0)
+      treeinfo->travbuffer[j++] = node;
+  }
+  *trav_size = j;
+
+  memset(pool->slot_pins, 0, pool->slot_count * sizeof(unsigned int));
+
+  return retval;
+}
+
+/**
+ * Set the CLV storage mode.
+ *
+ * In PLLMOD_TREEINFO_CLV_NODE mode (default), all 3 directions of an inner
+ * node share one CLV, so only CLVs pointing towards the current root can be
+ * valid. In PLLMOD_TREEINFO_CLV_EDGE mode, each direction has its own CLV and
+ * scaler; this requires 3*(tip_count-2) CLV and scale buffers per partition.
+ * In PLLMOD_TREEINFO_CLV_POOL mode, inner nodes share a pool of CLV slots,
+ * one per CLV and scale buffer available in every partition (at least
+ * ceil(log2(tip_count))+4 are required). CLVs are computed on demand, and the
+ * least recently used ones are evicted (and recomputed later if needed), so
+ * partitions can be created with fewer CLV buffers than inner nodes at the
+ * cost of extra computation, see clv_pool_evictions and
+ * clv_pool_recomputations. Inner node CLV indices are only meaningful for
+ * the CLVs at the current root, so branch lengths must be optimized with
+ * pllmod_algo_opt_brlen_treeinfo() rather than pllmod_opt_* functions.
+ * CLV and scaler indices of inner nodes are re-assigned by this function,
+ * and all CLVs are invalidated.
+ *
+ * Topological constraints are not supported in edge and pool mode.
+ */
+PLL_EXPORT int pllmod_treeinfo_set_clv_mode(pllmod_treeinfo_t * treeinfo,
+                                            int clv_mode)
+{
+  unsigned int i;
+
+  if (clv_mode != PLLMOD_TREEINFO_CLV_NODE &&
+      clv_mode != PLLMOD_TREEINFO_CLV_EDGE &&
+      clv_mode != PLLMOD_TREEINFO_CLV_POOL)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid CLV mode: %d\n", clv_mode);
+    return PLL_FAILURE;
+  }
+
+  if (clv_mode == treeinfo->clv_mode)
+    return PLL_SUCCESS;
+
+  if (clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+  {
+    if (treeinfo->constraint)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "CLV pool mode does not support topological "
+                       "constraints\n");
+      return PLL_FAILURE;
+    }
+
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      if (!treeinfo_check_pool_buffers(treeinfo, treeinfo->init_partitions[i]))
+        return PLL_FAILURE;
+    }
+
+    treeinfo->clv_pool = treeinfo_pool_create(treeinfo);
+    if (!treeinfo->clv_pool)
+      return PLL_FAILURE;
+
+    treeinfo->clv_mode = clv_mode;
+    treeinfo->clv_pool_evictions = 0;
+    treeinfo->clv_pool_recomputations = 0;
+    treeinfo->clv_alledges_valid = 0;
+    treeinfo_pool_reset(treeinfo);
+
+    return PLL_SUCCESS;
+  }
+  else if (clv_mode == PLLMOD_TREEINFO_CLV_EDGE)
+  {
+    const unsigned int inner_count = treeinfo->tip_count - 2;
+
+    if (treeinfo->constraint)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "Edge CLV mode does not support topological "
+                       "constraints\n");
+      return PLL_FAILURE;
+    }
+
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      if (!treeinfo_check_clv_buffers(treeinfo, treeinfo->init_partitions[i]))
+        return PLL_FAILURE;
+    }
+
+    /* all-edges traversal visits every inner subnode */
+    pll_unode_t ** travbuffer = (pll_unode_t **) realloc(treeinfo->travbuffer,
+                              treeinfo->subnode_count * sizeof(pll_unode_t *));
+    if (travbuffer)
+      treeinfo->travbuffer = travbuffer;
+
+    pll_operation_t * operations = (pll_operation_t *) realloc(
+        treeinfo->operations, 3 * inner_count * sizeof(pll_operation_t));
+    if (operations)
+      treeinfo->operations = operations;
+
+    if (!travbuffer || !operations)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for traversal buffers\n");
+      return PLL_FAILURE;
+    }
+  }
+
+  treeinfo_pool_destroy((treeinfo_clv_pool_t *) treeinfo->clv_pool);
+  treeinfo->clv_pool = NULL;
+
+  treeinfo->clv_mode = clv_mode;
+  treeinfo_assign_clv_indices(treeinfo);
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+    memset(treeinfo->clv_valid[p], 0, treeinfo->subnode_count * sizeof(char));
   }
+  treeinfo->clv_alledges_valid = 0;
 
   return PLL_SUCCESS;
 }
 
-PLL_EXPORT void pllmod_treeinfo_invalidate_pmatrix(pllmod_treeinfo_t * treeinfo,
-                                                   const pll_unode_t * edge)
+/**
+ * Compute CLVs for both directions of every edge (edge CLV mode only).
+ *
+ * Performs a postorder traversal towards the current root followed by a
+ * preorder traversal which computes the CLVs pointing away from the root.
+ * Afterwards, the root can be placed at any edge and the log-likelihood
+ * evaluated there without recomputing any CLV. This state lasts until the
+ * next CLV or p-matrix invalidation, or full log-likelihood recomputation.
+ *
+ * NOTE: branch length optimization with pllmod_opt_* functions bypasses
+ * treeinfo, so call pllmod_treeinfo_invalidate_outward_clvs() before it.
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_treeinfo_compute_clvs_alledges(pllmod_treeinfo_t * treeinfo)
 {
-  for (unsigned int i = 0; i < treeinfo->init_partition_count; ++i)
+  unsigned int traversal_size = 0;
+  unsigned int ops_count;
+  unsigned int i, j;
+
+  if (treeinfo->clv_mode != PLLMOD_TREEINFO_CLV_EDGE)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "All-edges CLVs require edge CLV mode\n");
+    return PLL_FAILURE;
+  }
+
+  if (treeinfo->clv_alledges_valid)
+    return PLL_SUCCESS;
+
+  /* postorder: CLVs pointing towards the root */
+  if (isnan(treeinfo_compute_loglh(treeinfo, 1, 1, NULL, NULL)))
+    return PLL_FAILURE;
+
+  /* preorder: CLVs pointing away from the root */
+  treeinfo_outward_traversal(treeinfo->root, treeinfo->travbuffer,
+                             &traversal_size);
+  treeinfo_outward_traversal(treeinfo->root->back, treeinfo->travbuffer,
+                             &traversal_size);
+
+  pll_utree_create_operations(treeinfo->travbuffer,
+                              traversal_size,
+                              NULL,
+                              NULL,
+                              treeinfo->operations,
+                              NULL,
+                              &ops_count);
+
+  treeinfo->counter += ops_count;
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
   {
     unsigned int p = treeinfo->init_partition_idx[i];
-    if (treeinfo->pmatrix_valid[p] && treeinfo_partition_active(treeinfo, p))
-      treeinfo->pmatrix_valid[p][edge->pmatrix_index] = 0;
+    double start_time = pllmod_time_wall();
+
+    pll_update_partials(treeinfo->partitions[p],
+                        treeinfo->operations,
+                        ops_count);
+
+    treeinfo_stats_add(treeinfo->partition_stats + p,
+                       PLLMOD_TREEINFO_STATS_CLV, ops_count, start_time);
+
+    for (j = 0; j < traversal_size; ++j)
+      treeinfo->clv_valid[p][treeinfo->travbuffer[j]->node_index] = 1;
   }
+
+  treeinfo->clv_alledges_valid = 1;
+
+  return PLL_SUCCESS;
 }
 
-PLL_EXPORT void pllmod_treeinfo_invalidate_clv(pllmod_treeinfo_t * treeinfo,
-                                               const pll_unode_t * edge)
+/**
+ * Compute the tree log-likelihood at every edge (edge CLV mode only).
+ *
+ * CLVs for all edges are updated if needed (see
+ * pllmod_treeinfo_compute_clvs_alledges()), after which evaluating one edge
+ * costs a single edge log-likelihood computation.
+ *
+ * @param[out] edge_loglh log-likelihood at each edge, indexed by p-matrix
+ *             index (tree->edge_count elements)
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_treeinfo_compute_loglh_alledges(pllmod_treeinfo_t * treeinfo,
+                                                      double * edge_loglh)
 {
-  for (unsigned int i = 0; i < treeinfo->init_partition_count; ++i)
+  unsigned int i, j;
+  const unsigned int edge_count = treeinfo->tree->edge_count;
+
+  if (!pllmod_treeinfo_compute_clvs_alledges(treeinfo))
+    return PLL_FAILURE;
+
+  memset(edge_loglh, 0, edge_count * sizeof(double));
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
   {
     unsigned int p = treeinfo->init_partition_idx[i];
-    if (treeinfo->clv_valid[p] && treeinfo_partition_active(treeinfo, p))
-      treeinfo->clv_valid[p][edge->node_index] = 0;
+    double start_time = pllmod_time_wall();
+
+    for (j = 0; j < treeinfo->subnode_count; ++j)
+    {
+      const pll_unode_t * parent = treeinfo->subnodes[j];
+      const pll_unode_t * child = parent->back;
+
+      /* visit each edge once, with the inner node as parent */
+      if (!parent->next || (child->next &&
+                            child->node_index < parent->node_index))
+        continue;
+
+      edge_loglh[parent->pmatrix_index] +=
+          pll_compute_edge_loglikelihood(treeinfo->partitions[p],
+                                         parent->clv_index,
+                                         parent->scaler_index,
+                                         child->clv_index,
+                                         child->scaler_index,
+                                         parent->pmatrix_index,
+                                         treeinfo->param_indices[p],
+                                         NULL);
+    }
+
+    treeinfo_stats_add(treeinfo->partition_stats + p,
+                       PLLMOD_TREEINFO_STATS_LOGLH, edge_count, start_time);
+  }
+
+  /* sum up likelihood from all threads */
+  if (treeinfo->parallel_reduce_cb)
+  {
+    treeinfo->parallel_reduce_cb(treeinfo->parallel_context,
+                                 edge_loglh,
+                                 edge_count,
+                                 PLLMOD_COMMON_REDUCE_SUM);
   }
+
+  return PLL_SUCCESS;
 }
 
-static double treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
-                                     int incremental,
-                                     int update_pmatrices,
-                                     double ** persite_lnl)
+/* accumulate the derivatives of the partition log-likelihood with respect to
+ * the p-matrix entries of every edge, and map them onto the model
+ * parameters through the eigendecomposition of the rate matrix */
+static int treeinfo_model_gradient_partition(pllmod_treeinfo_t * treeinfo,
+                                             unsigned int p,
+                                             unsigned int params_index,
+                                             double * gradient)
 {
-  /* tree root must be an inner node! */
-  assert(!pllmod_utree_is_tip(treeinfo->root));
+  const pll_partition_t * partition = treeinfo->partitions[p];
+  const unsigned int * param_indices = treeinfo->param_indices[p];
+  const unsigned int states = partition->states;
+  const unsigned int states_padded = partition->states_padded;
+  const unsigned int rate_cats = partition->rate_cats;
+  const unsigned int matrix_size = states * states;
+  const int pattern_tip = (partition->attributes & PLL_ATTRIB_PATTERN_TIP);
+
+  double * freqs_grad = gradient + PLLMOD_TREEINFO_GRAD_FREQS(states);
+  double * alpha_grad = gradient + PLLMOD_TREEINFO_GRAD_ALPHA(states);
+  double * pinv_grad = gradient + PLLMOD_TREEINFO_GRAD_PINV(states);
+
+  unsigned int i, j, k, l, c, n, s;
+  int first_edge = 1;
+  int retval = PLL_FAILURE;
+
+  /* per-category buffers: dlogL/dP, P * v, site likelihoods, rates */
+  double * dlnl_dp = (double *) calloc(rate_cats * matrix_size, sizeof(double));
+  double * pv = (double *) calloc(rate_cats * states, sizeof(double));
+  double * terma_r = (double *) calloc(rate_cats, sizeof(double));
+  double * dlnl_drate = (double *) calloc(rate_cats, sizeof(double));
+  double * rates_shift = (double *) calloc(2 * rate_cats, sizeof(double));
+  /* matrices in the eigenvector basis */
+  double * tmp = (double *) calloc(matrix_size, sizeof(double));
+  double * bmat = (double *) calloc(matrix_size, sizeof(double));
+  double * hmat = (double *) calloc(matrix_size, sizeof(double));
+  double * expd = (double *) calloc(states, sizeof(double));
+  double * tip_clv = (double *) calloc(states, sizeof(double));
+
+  if (!dlnl_dp || !pv || !terma_r || !dlnl_drate || !rates_shift || !tmp ||
+      !bmat || !hmat || !expd || !tip_clv)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for model gradient\n");
+    goto cleanup;
+  }
 
-  unsigned int traversal_size = 0;
-  unsigned int ops_count;
-  unsigned int i, p;
+  memset(gradient, 0, PLLMOD_TREEINFO_GRAD_SIZE(states) * sizeof(double));
 
-  const double LOGLH_NONE = (double) NAN;
-  double total_loglh = 0.0;
-  const int old_active_partition = treeinfo->active_partition;
+  for (n = 0; n < treeinfo->subnode_count; ++n)
+  {
+    const pll_unode_t * parent = treeinfo->subnodes[n];
+    const pll_unode_t * child = parent->back;
 
-  /* NOTE: in unlinked brlen mode, up-to-date brlens for partition p
-   * have to be prefetched to treeinfo->branch_lengths[p] !!! */
-  int collect_brlen =
-      (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_UNLINKED ? 0 : 1);
+    /* visit each edge once, with the inner node as parent */
+    if (!parent->next || (child->next &&
+                          child->node_index < parent->node_index))
+      continue;
 
-  pllmod_treeinfo_set_active_partition(treeinfo, PLLMOD_TREEINFO_PARTITION_ALL);
+    const double * parent_clv = partition->clv[parent->clv_index];
+    const double * child_clv = (pattern_tip && !child->next) ?
+                                  NULL : partition->clv[child->clv_index];
+    const double * pmatrix = partition->pmatrix[parent->pmatrix_index];
 
-  /* we need full traversal in 2 cases: 1) update p-matrices, 2) update all CLVs */
-  if (!incremental || (update_pmatrices && collect_brlen))
-  {
-    /* perform a FULL postorder traversal of the unrooted tree */
-    if (!pll_utree_traverse(treeinfo->root,
-                            PLL_TREE_TRAVERSE_POSTORDER,
-                            cb_full_traversal,
-                            treeinfo->travbuffer,
-                            &traversal_size))
-      return LOGLH_NONE;
+    double brlen = treeinfo->branch_lengths[p][parent->pmatrix_index];
+    if (treeinfo->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
+      brlen *= treeinfo->brlen_scalers[p];
+
+    memset(dlnl_dp, 0, rate_cats * matrix_size * sizeof(double));
+
+    for (s = 0; s < partition->sites; ++s)
+    {
+      const unsigned int weight = partition->pattern_weights[s];
+      double terma = 0.;
+
+      if (!weight)
+        continue;
+
+      if (!child_clv)
+      {
+        pll_state_t state = partition->tipmap[
+                                  partition->tipchars[child->clv_index][s]];
+        for (i = 0; i < states; ++i)
+          tip_clv[i] = (state >> i) & 1 ? 1. : 0.;
+      }
+
+      /* site likelihood as in pll_compute_edge_loglikelihood(): scaled CLVs
+       * plus unscaled invariant part, so that per-site scalers cancel out */
+      for (c = 0; c < rate_cats; ++c)
+      {
+        const unsigned int m = param_indices[c];
+        const double * freqs = partition->frequencies[m];
+        const double * pmat = pmatrix + c * states * states_padded;
+        const double * u = parent_clv + (s * rate_cats + c) * states_padded;
+        const double * v = child_clv ?
+                   child_clv + (s * rate_cats + c) * states_padded : tip_clv;
+        const double pinv = partition->prop_invar[m];
+
+        terma_r[c] = 0.;
+        for (i = 0; i < states; ++i)
+        {
+          double pv_i = 0.;
+          for (j = 0; j < states; ++j)
+            pv_i += pmat[i * states_padded + j] * v[j];
+          pv[c * states + i] = pv_i;
+          terma_r[c] += freqs[i] * u[i] * pv_i;
+        }
+
+        terma += partition->rate_weights[c] * (1. - pinv) * terma_r[c];
+        if (pinv > 0. && partition->invariant && partition->invariant[s] != -1)
+          terma += partition->rate_weights[c] * pinv *
+                   freqs[partition->invariant[s]];
+      }
+
+      if (!(terma > 0.))
+        continue;
+
+      const double site_factor = weight / terma;
+
+      for (c = 0; c < rate_cats; ++c)
+      {
+        const unsigned int m = param_indices[c];
+        const double * freqs = partition->frequencies[m];
+        const double * u = parent_clv + (s * rate_cats + c) * states_padded;
+        const double * v = child_clv ?
+                   child_clv + (s * rate_cats + c) * states_padded : tip_clv;
+        const double pinv = partition->prop_invar[m];
+        const double cat_factor =
+                        site_factor * partition->rate_weights[c] * (1. - pinv);
+        double * dp = dlnl_dp + c * matrix_size;
+
+        for (i = 0; i < states; ++i)
+        {
+          const double a = cat_factor * freqs[i] * u[i];
+          if (a == 0.)
+            continue;
+          for (j = 0; j < states; ++j)
+            dp[i * states + j] += a * v[j];
+        }
+
+        /* terms which do not involve p-matrices: any edge will do */
+        if (first_edge)
+        {
+          double inv_lk = 0.;
+          if (partition->invariant && partition->invariant[s] != -1)
+            inv_lk = freqs[partition->invariant[s]];
+
+          *pinv_grad += site_factor * partition->rate_weights[c] *
+                        (inv_lk - terma_r[c]);
+
+          if (m == params_index)
+          {
+            for (i = 0; i < states; ++i)
+              freqs_grad[i] += cat_factor * u[i] * pv[c * states + i];
+            if (inv_lk > 0.)
+              freqs_grad[partition->invariant[s]] +=
+                         site_factor * partition->rate_weights[c] * pinv;
+          }
+        }
+      }
+    }
+
+    /* dP/dtheta = V (F o (V^-1 dQ/dtheta V)) V^-1, hence dlogL/dtheta is
+     * the inner product of dQ/dtheta and V^-T (B o F) V^T, where
+     * B = V^T (dlogL/dP) V^-T */
+    for (c = 0; c < rate_cats; ++c)
+    {
+      const unsigned int m = param_indices[c];
+      const double * evecs = partition->eigenvecs[m];
+      const double * inv_evecs = partition->inv_eigenvecs[m];
+      const double * evals = partition->eigenvals[m];
+      const double * dp = dlnl_dp + c * matrix_size;
+      const double pinv = partition->prop_invar[m];
+      const double rate_factor = brlen / (1. - pinv);
+      const double t = partition->rates[c] * rate_factor;
+      double dlnl_dt = 0.;
+
+      for (i = 0; i < states; ++i)
+      {
+        for (l = 0; l < states; ++l)
+        {
+          double sum = 0.;
+          for (j = 0; j < states; ++j)
+            sum += dp[i * states + j] * inv_evecs[l * states_padded + j];
+          tmp[i * states + l] = sum;
+        }
+      }
+
+      for (k = 0; k < states; ++k)
+      {
+        for (l = 0; l < states; ++l)
+        {
+          double sum = 0.;
+          for (i = 0; i < states; ++i)
+            sum += evecs[i * states_padded + k] * tmp[i * states + l];
+          bmat[k * states + l] = sum;
+        }
+        expd[k] = exp(evals[k] * t);
+        dlnl_dt += bmat[k * states + k] * evals[k] * expd[k];
+      }
+
+      /* gamma rates and invariant sites rescale the branch length */
+      dlnl_drate[c] += dlnl_dt * rate_factor;
+      *pinv_grad += dlnl_dt * partition->rates[c] * rate_factor / (1. - pinv);
+
+      if (m != params_index)
+        continue;
+
+      for (k = 0; k < states; ++k)
+      {
+        for (l = 0; l < states; ++l)
+        {
+          double f;
+          if (fabs(evals[k] - evals[l]) < 1e-10)
+            f = t * expd[k];
+          else
+            f = (expd[k] - expd[l]) / (evals[k] - evals[l]);
+          hmat[k * states + l] += bmat[k * states + l] * f;
+        }
+      }
+    }
+
+    first_edge = 0;
   }
 
-  /* update p-matrices if asked for */
-  if (update_pmatrices)
+  /* back to the original basis: K = V^-T H V^T, K_ij = dlogL/dQ_ij */
   {
-    if (collect_brlen)
+    const double * evecs = partition->eigenvecs[params_index];
+    const double * inv_evecs = partition->inv_eigenvecs[params_index];
+    const double * freqs = partition->frequencies[params_index];
+    const double * subst_params = partition->subst_params[params_index];
+    double * kmat = bmat;
+    double * rmat = dlnl_dp;
+    double mean_rate = 0.;
+    double kq = 0.;
+
+    for (i = 0; i < states; ++i)
     {
-      assert(traversal_size == treeinfo->tip_count * 2 - 2);
-      for (i = 0; i < traversal_size; ++i)
-       {
-         pll_unode_t * node = treeinfo->travbuffer[i];
-         treeinfo->branch_lengths[0][node->pmatrix_index] = node->length;
-       }
+      for (l = 0; l < states; ++l)
+      {
+        double sum = 0.;
+        for (k = 0; k < states; ++k)
+          sum += inv_evecs[k * states_padded + i] * hmat[k * states + l];
+        tmp[i * states + l] = sum;
+      }
+    }
+
+    for (i = 0; i < states; ++i)
+    {
+      for (j = 0; j < states; ++j)
+      {
+        double sum = 0.;
+        for (l = 0; l < states; ++l)
+          sum += tmp[i * states + l] * evecs[j * states_padded + l];
+        kmat[i * states + j] = sum;
+      }
+    }
+
+    /* Q_ij = r_ij * pi_j / mu, Q_ii = -sum_j Q_ij, mu = mean rate */
+    for (i = 0, n = 0; i < states; ++i)
+    {
+      rmat[i * states + i] = 0.;
+      for (j = i + 1; j < states; ++j, ++n)
+        rmat[i * states + j] = rmat[j * states + i] = subst_params[n];
+    }
+
+    for (i = 0; i < states; ++i)
+    {
+      for (j = 0; j < states; ++j)
+      {
+        mean_rate += freqs[i] * rmat[i * states + j] * freqs[j];
+        kq += (kmat[i * states + j] - kmat[i * states + i]) *
+              rmat[i * states + j] * freqs[j];
+      }
     }
 
-    pllmod_treeinfo_update_prob_matrices(treeinfo, !incremental);
+    if (!(mean_rate > 0.))
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "Invalid rate matrix in model gradient\n");
+      goto cleanup;
+    }
+
+    kq /= mean_rate;
+
+    for (i = 0, n = 0; i < states; ++i)
+    {
+      for (j = i + 1; j < states; ++j, ++n)
+      {
+        gradient[n] = ((kmat[i * states + j] - kmat[i * states + i]) * freqs[j] +
+                       (kmat[j * states + i] - kmat[j * states + j]) * freqs[i] -
+                       2. * freqs[i] * freqs[j] * kq) / mean_rate;
+      }
+    }
+
+    for (j = 0; j < states; ++j)
+    {
+      double out_rate = 0.;
+      double sum = 0.;
+      for (i = 0; i < states; ++i)
+      {
+        out_rate += rmat[j * states + i] * freqs[i];
+        sum += rmat[i * states + j] * (kmat[i * states + j] - kmat[i * states + i]);
+      }
+      freqs_grad[j] += (sum - 2. * out_rate * kq) / mean_rate;
+    }
   }
 
-  if (incremental)
+  /* dr/dalpha by central differences: discrete gamma rates have no
+   * closed-form derivative */
+  if (rate_cats > 1 && treeinfo->alphas[p] > 0.)
   {
-    /* compute partial traversal and update only invalid CLVs */
-    if (!pll_utree_traverse(treeinfo->root,
-                            PLL_TREE_TRAVERSE_POSTORDER,
-                            cb_partial_traversal,
-                            treeinfo->travbuffer,
-                            &traversal_size))
-      return LOGLH_NONE;
+    const double alpha = treeinfo->alphas[p];
+    const double h = alpha * 1e-4;
+
+    if (!pll_compute_gamma_cats(alpha + h, rate_cats, rates_shift,
+                                treeinfo->gamma_mode[p]) ||
+        !pll_compute_gamma_cats(alpha - h, rate_cats, rates_shift + rate_cats,
+                                treeinfo->gamma_mode[p]))
+      goto cleanup;
+
+    for (c = 0; c < rate_cats; ++c)
+      *alpha_grad += dlnl_drate[c] *
+                     (rates_shift[c] - rates_shift[rate_cats + c]) / (2. * h);
   }
 
-  /* create operations based on partial traversal obtained above */
-  pll_utree_create_operations(treeinfo->travbuffer,
-                              traversal_size,
-                              NULL,
-                              NULL,
-                              treeinfo->operations,
-                              NULL,
-                              &ops_count);
+  retval = PLL_SUCCESS;
 
-  treeinfo->counter += ops_count;
+cleanup:
+  free(dlnl_dp);
+  free(pv);
+  free(terma_r);
+  free(dlnl_drate);
+  free(rates_shift);
+  free(tmp);
+  free(bmat);
+  free(hmat);
+  free(expd);
+  free(tip_clv);
 
-//  printf("Traversal size (%s): %u\n", incremental ? "part" : "full", ops_count);
+  return retval;
+}
 
-  /* iterate over all partitions (we assume that traversal is the same) */
-  for (p = 0; p < treeinfo->partition_count; ++p)
+typedef struct treeinfo_gradient_task
+{
+  pllmod_treeinfo_t * treeinfo;
+  unsigned int params_index;
+  double ** gradient;
+} treeinfo_gradient_task_t;
+
+static int treeinfo_model_gradient_task(void * data,
+                                        unsigned int task_index,
+                                        unsigned int thread_index)
+{
+  treeinfo_gradient_task_t * task = (treeinfo_gradient_task_t *) data;
+  unsigned int p = task->treeinfo->partition_order[task_index];
+
+  PLLMOD_UNUSED(thread_index);
+
+  if (!task->gradient[p])
+    return PLL_SUCCESS;
+
+  return treeinfo_model_gradient_partition(task->treeinfo, p,
+                                           task->params_index,
+                                           task->gradient[p]);
+}
+
+/**
+ * Compute the gradient of the per-partition log-likelihood with respect to
+ * the model parameters (edge CLV mode only).
+ *
+ * The derivatives are obtained analytically in a single pass over all
+ * edges, from the CLVs at both ends of each edge (see
+ * pllmod_treeinfo_compute_clvs_alledges()) and the eigendecomposition of the
+ * rate matrix. gradient[p] is laid out as follows (see
+ * PLLMOD_TREEINFO_GRAD_* macros):
+ *
+ *  - substitution rates of matrix `params_index`, upper triangle row-wise
+ *  - frequencies of matrix `params_index`, as independent (unnormalized)
+ *    parameters
+ *  - GAMMA shape, for rates computed from treeinfo->alphas[p]
+ *  - proportion of invariant sites, same for all rate categories
+ *
+ * Partitions are processed concurrently by the treeinfo thread pool (see
+ * pllmod_treeinfo_set_thread_count()), sites of a partition sequentially.
+ * With a parallel reduction callback, every process takes part in the
+ * reduction even if the computation failed locally, and all of them fail
+ * together.
+ *
+ * Partitions with per-rate scalers, site repeats or ascertainment bias
+ * correction are not supported.
+ *
+ * @param params_index rate matrix to compute the derivatives for
+ * @param[out] gradient PLLMOD_TREEINFO_GRAD_SIZE(states) values for each
+ *             partition, NULL = skip partition
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_treeinfo_compute_model_gradient(pllmod_treeinfo_t * treeinfo,
+                                                      unsigned int params_index,
+                                                      double ** gradient)
+{
+  unsigned int i, p;
+  double * reduce_buf;
+  size_t grad_size = 0;
+  int failed = 0;
+  treeinfo_gradient_task_t task;
+
+  for (i = 0; i < treeinfo->init_partition_count && !failed; ++i)
   {
-    if (!treeinfo->partitions[p])
+    p = treeinfo->init_partition_idx[i];
+    const pll_partition_t * partition = treeinfo->partitions[p];
+
+    if (partition->attributes & (PLL_ATTRIB_RATE_SCALERS |
+                                 PLL_ATTRIB_SITE_REPEATS |
+                                 PLL_ATTRIB_AB_FLAG))
     {
-      /* this partition will be computed by another thread(s) */
-      treeinfo->partition_loglh[p] = 0.0;
-      continue;
+      pllmod_set_error(PLLMOD_ERROR_NOT_IMPLEMENTED,
+                       "Model gradient is not implemented for per-rate "
+                       "scalers, site repeats and ascertainment bias\n");
+      failed = 1;
+    }
+    else if (params_index >= partition->rate_matrices)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "Invalid rate matrix index: %u\n", params_index);
+      failed = 1;
     }
 
-    /* all subsequent operation will affect current partition only */
-    pllmod_treeinfo_set_active_partition(treeinfo, (int)p);
-
-    /* use the operations array to compute all ops_count inner CLVs. Operations
-       will be carried out sequentially starting from operation 0 towards
-       ops_count-1 */
-    pll_update_partials(treeinfo->partitions[p],
-                        treeinfo->operations,
-                        ops_count);
+    grad_size = PLL_MAX(grad_size, PLLMOD_TREEINFO_GRAD_SIZE(partition->states));
+  }
 
-    pllmod_treeinfo_validate_clvs(treeinfo,
-                                  treeinfo->travbuffer,
-                                  traversal_size);
+  /* CLVs are computed in any case, since this involves a reduction */
+  if (!pllmod_treeinfo_compute_clvs_alledges(treeinfo))
+    failed = 1;
 
-    /* compute the likelihood on an edge of the unrooted tree by specifying
-       the CLV indices at the two end-point of the branch, the probability
-       matrix index for the concrete branch length, and the index of the model
-       of whose frequency vector is to be used */
-    treeinfo->partition_loglh[p] = pll_compute_edge_loglikelihood(
-                                            treeinfo->partitions[p],
-                                            treeinfo->root->clv_index,
-                                            treeinfo->root->scaler_index,
-                                            treeinfo->root->back->clv_index,
-                                            treeinfo->root->back->scaler_index,
-                                            treeinfo->root->pmatrix_index,
-                                            treeinfo->param_indices[p],
-                                            persite_lnl ? persite_lnl[p] : NULL);
+  if (!failed)
+  {
+    task.treeinfo = treeinfo;
+    task.params_index = params_index;
+    task.gradient = gradient;
+
+    failed = !pllmod_thread_pool_run((pllmod_thread_pool_t *) treeinfo->thread_pool,
+                                     treeinfo->init_partition_count,
+                                     treeinfo_model_gradient_task,
+                                     &task);
   }
 
-  /* sum up likelihood from all threads */
+  /* sum up gradients from all threads, partitions can be split by sites */
   if (treeinfo->parallel_reduce_cb)
   {
+    double reduce_info[2] = {(double) grad_size, (double) failed};
+    treeinfo->parallel_reduce_cb(treeinfo->parallel_context, reduce_info, 2,
+                                 PLLMOD_COMMON_REDUCE_MAX);
+    grad_size = (size_t) reduce_info[0];
+
+    if (reduce_info[1] > 0.)
+    {
+      if (!failed)
+        pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                         "Model gradient failed in another process\n");
+      return PLL_FAILURE;
+    }
+
+    reduce_buf = (double *) calloc(treeinfo->partition_count * grad_size,
+                                   sizeof(double));
+    if (!reduce_buf)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for model gradient\n");
+      return PLL_FAILURE;
+    }
+
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      p = treeinfo->init_partition_idx[i];
+      if (gradient[p])
+      {
+        memcpy(reduce_buf + p * grad_size, gradient[p],
+               PLLMOD_TREEINFO_GRAD_SIZE(treeinfo->partitions[p]->states) *
+                 sizeof(double));
+      }
+    }
+
     treeinfo->parallel_reduce_cb(treeinfo->parallel_context,
-                                 treeinfo->partition_loglh,
-                                 p,
+                                 reduce_buf,
+                                 treeinfo->partition_count * grad_size,
                                  PLLMOD_COMMON_REDUCE_SUM);
-  }
-
-  /* accumulate loglh by summing up over all the partitions */
-  for (p = 0; p < treeinfo->partition_count; ++p)
-    total_loglh += treeinfo->partition_loglh[p];
 
-  /* restore original active partition */
-  pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      p = treeinfo->init_partition_idx[i];
+      if (gradient[p])
+      {
+        memcpy(gradient[p], reduce_buf + p * grad_size,
+               PLLMOD_TREEINFO_GRAD_SIZE(treeinfo->partitions[p]->states) *
+                 sizeof(double));
+      }
+    }
 
-  assert(total_loglh < 0.);
+    free(reduce_buf);
+  }
 
-  return total_loglh;
+  return failed ? PLL_FAILURE : PLL_SUCCESS;
 }
 
-PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
-                                                int incremental)
+/**
+ * Invalidate all CLVs which do not point towards the current root.
+ *
+ * Brings the treeinfo from the all-edges state (see
+ * pllmod_treeinfo_compute_clvs_alledges()) back to the default one, where
+ * only CLVs pointing towards the root are kept. Does nothing otherwise.
+ */
+PLL_EXPORT void pllmod_treeinfo_invalidate_outward_clvs(pllmod_treeinfo_t * treeinfo)
 {
-  return treeinfo_compute_loglh(treeinfo, incremental, 1, NULL);
-}
+  unsigned int traversal_size = 0;
+  unsigned int i, j;
 
-PLL_EXPORT double pllmod_treeinfo_compute_loglh_flex(pllmod_treeinfo_t * treeinfo,
-                                                     int incremental,
-                                                     int update_pmatrices)
-{
-  return treeinfo_compute_loglh(treeinfo, incremental, update_pmatrices, NULL);
-}
+  if (!treeinfo->clv_alledges_valid)
+    return;
 
-PLL_EXPORT double pllmod_treeinfo_compute_loglh_persite(pllmod_treeinfo_t * treeinfo,
-                                                        int incremental,
-                                                        double ** persite_lnl)
-{
-  return treeinfo_compute_loglh(treeinfo, incremental, 1, persite_lnl);
+  treeinfo->clv_alledges_valid = 0;
+
+  if (!pll_utree_traverse(treeinfo->root,
+                          PLL_TREE_TRAVERSE_POSTORDER,
+                          cb_full_traversal,
+                          treeinfo->travbuffer,
+                          &traversal_size))
+  {
+    /* should never happen, but be on the safe side */
+    for (i = 0; i < treeinfo->init_partition_count; ++i)
+    {
+      unsigned int p = treeinfo->init_partition_idx[i];
+      memset(treeinfo->clv_valid[p], 0, treeinfo->subnode_count * sizeof(char));
+    }
+    return;
+  }
+
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    unsigned int p = treeinfo->init_partition_idx[i];
+    for (j = 0; j < traversal_size; ++j)
+    {
+      const pll_unode_t * node = treeinfo->travbuffer[j];
+      if (node->next)
+      {
+        treeinfo->clv_valid[p][node->next->node_index] = 0;
+        treeinfo->clv_valid[p][node->next->next->node_index] = 0;
+      }
+    }
+  }
 }
 
 PLL_EXPORT
@@ -1157,18 +4536,55 @@ int pllmod_treeinfo_normalize_brlen_scalers(pllmod_treeinfo_t * treeinfo)
   double sum_sites = 0.;
   unsigned int p;
 
-  for (p = 0; p < treeinfo->partition_count; ++p)
+  if (treeinfo->sum_mode == PLLMOD_COMMON_SUM_REPRODUCIBLE)
   {
-    if (treeinfo->partitions[p])
+    const unsigned int count = treeinfo->partition_count;
+    double sums[2];
+    double * buf = (double *) calloc(2 * count, sizeof(double));
+    if (!buf)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for reduction buffer\n");
+      return PLL_FAILURE;
+    }
+
+    /* buf[0..count) = weighted scalers, buf[count..2*count) = sites */
+    for (p = 0; p < count; ++p)
+    {
+      if (treeinfo->partitions[p])
+      {
+        const double pat_sites = treeinfo->partitions[p]->pattern_weight_sum;
+        buf[count + p] = pat_sites;
+        buf[p] = treeinfo->brlen_scalers[p] * pat_sites;
+      }
+    }
+
+    int retval = pllmod_reduce_sum_reproducible(buf, count, 2, sums,
+                                                treeinfo->parallel_context,
+                                                treeinfo->parallel_reduce_cb);
+    free(buf);
+    if (!retval)
+      return PLL_FAILURE;
+
+    sum_scalers = sums[0];
+    sum_sites = sums[1];
+  }
+  else
+  {
+    for (p = 0; p < treeinfo->partition_count; ++p)
     {
-      const double pat_sites = treeinfo->partitions[p]->pattern_weight_sum;
-      sum_sites += pat_sites;
-      sum_scalers += treeinfo->brlen_scalers[p] * pat_sites;
+      if (treeinfo->partitions[p])
+      {
+        const double pat_sites = treeinfo->partitions[p]->pattern_weight_sum;
+        sum_sites += pat_sites;
+        sum_scalers += treeinfo->brlen_scalers[p] * pat_sites;
+      }
     }
   }
 
   /* sum up scalers and sites from all threads */
-  if (treeinfo->parallel_reduce_cb)
+  if (treeinfo->parallel_reduce_cb &&
+      treeinfo->sum_mode != PLLMOD_COMMON_SUM_REPRODUCIBLE)
   {
     // TODO: although this reduce is unlikely to become a bottleneck, it can
     // be avoided by storing _total_ pattern_weight_sum in treeinfo
@@ -1194,6 +4610,258 @@ int pllmod_treeinfo_normalize_brlen_scalers(pllmod_treeinfo_t * treeinfo)
   return PLL_SUCCESS;
 }
 
+static void treeinfo_sort_partitions(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i, j;
+
+  /* order local partitions by decreasing amount of work per CLV update, so
+   * that dynamic scheduling in the thread pool starts with the largest ones
+   * (longest-processing-time-first) and threads finish at about the same time */
+  for (i = 0; i < treeinfo->init_partition_count; ++i)
+  {
+    const pll_partition_t * partition = treeinfo->init_partitions[i];
+    const double cost = (double) partition->sites * partition->rate_cats *
+                        partition->states_padded;
+
+    for (j = i; j > 0; --j)
+    {
+      const pll_partition_t * prev =
+                      treeinfo->partitions[treeinfo->partition_order[j-1]];
+      if ((double) prev->sites * prev->rate_cats * prev->states_padded >= cost)
+        break;
+      treeinfo->partition_order[j] = treeinfo->partition_order[j-1];
+    }
+    treeinfo->partition_order[j] = treeinfo->init_partition_idx[i];
+  }
+}
+
+static void treeinfo_sort_shards(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i, j;
+
+  /* same as above, but for the work units of the likelihood computation */
+  for (i = 1; i < treeinfo->shard_count; ++i)
+  {
+    pllmod_treeinfo_shard_t shard = treeinfo->shards[i];
+    const pll_partition_t * partition =
+                               treeinfo->partitions[shard.partition_index];
+    const double cost = (double) shard.sites * partition->rate_cats *
+                        partition->states_padded;
+
+    for (j = i; j > 0; --j)
+    {
+      const pllmod_treeinfo_shard_t * prev = treeinfo->shards + j - 1;
+      const pll_partition_t * prev_part =
+                               treeinfo->partitions[prev->partition_index];
+      if ((double) prev->sites * prev_part->rate_cats *
+          prev_part->states_padded >= cost)
+        break;
+      treeinfo->shards[j] = *prev;
+    }
+    treeinfo->shards[j] = shard;
+  }
+}
+
+static pll_partition_t * treeinfo_create_view(const pll_partition_t * partition)
+{
+  pll_partition_t * view = (pll_partition_t *) calloc(1, sizeof(pll_partition_t));
+
+  if (!view)
+    return NULL;
+
+  /* pointers into the CLVs, scalers and tip characters of the parent
+   * partition will be set in treeinfo_sync_shard() */
+  view->clv = (double **) calloc(partition->clv_buffers + partition->tips,
+                                 sizeof(double *));
+  view->scale_buffer = (unsigned int **) calloc(partition->scale_buffers,
+                                                sizeof(unsigned int *));
+  if (partition->tipchars)
+    view->tipchars = (unsigned char **) calloc(partition->tips,
+                                               sizeof(unsigned char *));
+
+  /* tip-tip lookup table is overwritten in every pll_update_partials() call,
+   * hence it cannot be shared between threads */
+  if (partition->ttlookup)
+  {
+    view->ttlookup = pll_aligned_alloc(treeinfo_ttlookup_size(partition) *
+                                         sizeof(double),
+                                       partition->alignment);
+  }
+
+  if (!view->clv || !view->scale_buffer ||
+      (partition->tipchars && !view->tipchars) ||
+      (partition->ttlookup && !view->ttlookup))
+  {
+    free(view->clv);
+    free(view->scale_buffer);
+    free(view->tipchars);
+    if (view->ttlookup)
+      pll_aligned_free(view->ttlookup);
+    free(view);
+    return NULL;
+  }
+
+  return view;
+}
+
+static void treeinfo_destroy_view(pll_partition_t * view)
+{
+  free(view->clv);
+  free(view->scale_buffer);
+  free(view->tipchars);
+  if (view->ttlookup)
+    pll_aligned_free(view->ttlookup);
+  free(view);
+}
+
+static int treeinfo_create_shards(pllmod_treeinfo_t * treeinfo,
+                                  unsigned int partition_index)
+{
+  pll_partition_t * partition = treeinfo->partitions[partition_index];
+  unsigned int shard_count = 1;
+  unsigned int i;
+
+  /* site repeats and ascertainment bias correction break the assumption that
+   * sites are stored contiguously and independently from each other */
+  if (treeinfo->shard_sites && partition->sites > treeinfo->shard_sites &&
+      !(partition->attributes & (PLL_ATTRIB_SITE_REPEATS | PLL_ATTRIB_AB_FLAG)))
+  {
+    shard_count = (partition->sites + treeinfo->shard_sites - 1) /
+                  treeinfo->shard_sites;
+  }
+
+  pllmod_treeinfo_shard_t * shards = (pllmod_treeinfo_shard_t *) realloc(
+                        treeinfo->shards,
+                        (treeinfo->shard_count + shard_count) *
+                          sizeof(pllmod_treeinfo_shard_t));
+
+  if (!shards)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for partition shards\n");
+    return PLL_FAILURE;
+  }
+
+  treeinfo->shards = shards;
+
+  /* distribute sites evenly among the shards */
+  unsigned int site_offset = 0;
+  for (i = 0; i < shard_count; ++i)
+  {
+    pllmod_treeinfo_shard_t * shard = treeinfo->shards + treeinfo->shard_count;
+
+    shard->partition_index = partition_index;
+    shard->site_offset = site_offset;
+    shard->sites = partition->sites / shard_count +
+                   (i < partition->sites % shard_count ? 1 : 0);
+    shard->loglh = 0.;
+    memset(&shard->stats, 0, sizeof(pllmod_treeinfo_stats_t));
+    memset(&shard->parent, 0, sizeof(pll_partition_t));
+
+    if (shard_count == 1)
+      shard->partition = partition;
+    else
+    {
+      shard->partition = treeinfo_create_view(partition);
+      if (!shard->partition)
+      {
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                         "Cannot allocate memory for partition shards\n");
+        return PLL_FAILURE;
+      }
+    }
+
+    site_offset += shard->sites;
+    treeinfo->shard_count++;
+  }
+
+  assert(site_offset == partition->sites);
+
+  treeinfo_sort_shards(treeinfo);
+
+  return PLL_SUCCESS;
+}
+
+static void treeinfo_sync_shard(pllmod_treeinfo_t * treeinfo,
+                                pllmod_treeinfo_shard_t * shard)
+{
+  const pll_partition_t * partition =
+                               treeinfo->partitions[shard->partition_index];
+  pll_partition_t * view = shard->partition;
+  unsigned int i;
+
+  if (view == partition)
+    return;
+
+  /* the view aliases all arrays of the parent partition, so it only has to
+   * be updated if libpll (re-)allocated or resized any of them */
+  if (!memcmp(&shard->parent, partition, sizeof(pll_partition_t)))
+    return;
+
+  double ** clv = view->clv;
+  unsigned int ** scale_buffer = view->scale_buffer;
+  unsigned char ** tipchars = view->tipchars;
+  double * ttlookup = view->ttlookup;
+
+  const size_t site_offset = shard->site_offset;
+  const size_t clv_offset = site_offset * partition->rate_cats *
+                            partition->states_padded;
+  const size_t scaler_offset =
+                    (partition->attributes & PLL_ATTRIB_RATE_SCALERS) ?
+                      site_offset * partition->rate_cats : site_offset;
+
+  /* model parameters, p-matrices etc. are shared with the parent partition,
+   * per-site arrays are shifted to the beginning of the shard */
+  *view = *partition;
+  view->sites = shard->sites;
+  view->clv = clv;
+  view->scale_buffer = scale_buffer;
+  view->tipchars = tipchars;
+  view->ttlookup = ttlookup;
+
+  for (i = 0; i < partition->clv_buffers + partition->tips; ++i)
+    view->clv[i] = partition->clv[i] ? partition->clv[i] + clv_offset : NULL;
+
+  for (i = 0; i < partition->scale_buffers; ++i)
+  {
+    view->scale_buffer[i] = partition->scale_buffer[i] ?
+                              partition->scale_buffer[i] + scaler_offset : NULL;
+  }
+
+  if (view->tipchars)
+  {
+    for (i = 0; i < partition->tips; ++i)
+      view->tipchars[i] = partition->tipchars[i] + site_offset;
+  }
+
+  view->pattern_weights = partition->pattern_weights + site_offset;
+  if (partition->invariant)
+    view->invariant = partition->invariant + site_offset;
+
+  view->pattern_weight_sum = 0;
+  for (i = 0; i < view->sites; ++i)
+    view->pattern_weight_sum += view->pattern_weights[i];
+
+  memcpy(&shard->parent, partition, sizeof(pll_partition_t));
+}
+
+static void treeinfo_destroy_shards(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i;
+
+  for (i = 0; i < treeinfo->shard_count; ++i)
+  {
+    pllmod_treeinfo_shard_t * shard = treeinfo->shards + i;
+    if (shard->partition &&
+        shard->partition != treeinfo->partitions[shard->partition_index])
+      treeinfo_destroy_view(shard->partition);
+  }
+
+  free(treeinfo->shards);
+  treeinfo->shards = NULL;
+  treeinfo->shard_count = 0;
+}
+
 static int treeinfo_check_tree(pllmod_treeinfo_t * treeinfo,
                                pll_utree_t * tree)
 {
@@ -1290,7 +4958,21 @@ PLL_EXPORT int pllmod_treeinfo_set_tree(pllmod_treeinfo_t * treeinfo,
   treeinfo->tree->nodes = nodes;
   memcpy(treeinfo->tree->nodes, tree->nodes, node_count*sizeof(pll_unode_t *));
 
-  return treeinfo_init_tree(treeinfo);
+  if (!treeinfo_init_tree(treeinfo))
+    return PLL_FAILURE;
+
+  treeinfo->clv_alledges_valid = 0;
+  if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_EDGE)
+    treeinfo_assign_clv_indices(treeinfo);
+  else if (treeinfo->clv_mode == PLLMOD_TREEINFO_CLV_POOL)
+    treeinfo_pool_reset(treeinfo);
+
+  if (treeinfo->constraint_index)
+    ((treeinfo_cons_index_t *) treeinfo->constraint_index)->subtree = NULL;
+
+  treeinfo->clv_version++;
+
+  return PLL_SUCCESS;
 }
 
 PLL_EXPORT int pllmod_treeinfo_set_constraint_clvmap(pllmod_treeinfo_t * treeinfo,
@@ -1300,6 +4982,13 @@ PLL_EXPORT int pllmod_treeinfo_set_constraint_clvmap(pllmod_treeinfo_t * treeinf
   const unsigned int inner_count = treeinfo->tree->inner_count;
   const size_t cons_size = (tip_count + inner_count) * sizeof(unsigned int);
 
+  if (treeinfo->clv_mode != PLLMOD_TREEINFO_CLV_NODE)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Topological constraint requires node CLV mode\n");
+    return PLL_FAILURE;
+  }
+
   if(!treeinfo->constraint)
   {
     treeinfo->constraint = malloc(cons_size);
@@ -1321,6 +5010,10 @@ PLL_EXPORT int pllmod_treeinfo_set_constraint_clvmap(pllmod_treeinfo_t * treeinf
     treeinfo->constraint[node->clv_index] = cons_group_id;
   }
 
+  /* cached groups are outdated */
+  if (treeinfo->constraint_index)
+    ((treeinfo_cons_index_t *) treeinfo->constraint_index)->subtree = NULL;
+
   return PLL_SUCCESS;
 }
 
@@ -1433,6 +5126,79 @@ static unsigned int find_cons_id(pll_unode_t * node,
   }
 }
 
+/* same as find_cons_id(node, constraint, index->group), but walks through
+ * unconstrained inner nodes are done only once per subtree and direction */
+static unsigned int find_cons_id_cached(pll_unode_t * node,
+                                        const unsigned int * constraint,
+                                        treeinfo_cons_index_t * index)
+{
+  const unsigned int s = index->group;
+  unsigned int cons_group_id = constraint[node->clv_index];
+  unsigned int left_id, right_id;
+
+  if (!node->next || cons_group_id > 0)
+    return cons_group_id;
+
+  if (index->stamp[node->node_index] == index->epoch)
+    return index->node_group[node->node_index];
+
+  left_id = find_cons_id_cached(node->next->back, constraint, index);
+  right_id = find_cons_id_cached(node->next->next->back, constraint, index);
+  if (left_id == right_id)
+    cons_group_id = left_id;
+  else
+    cons_group_id = (left_id == 0 || left_id == s) ? right_id : left_id;
+
+  index->stamp[node->node_index] = index->epoch;
+  index->node_group[node->node_index] = cons_group_id;
+
+  return cons_group_id;
+}
+
+static unsigned int treeinfo_subtree_cons_id(const pllmod_treeinfo_t * treeinfo,
+                                             pll_unode_t * subtree)
+{
+  const treeinfo_cons_index_t * index =
+      (const treeinfo_cons_index_t *) treeinfo->constraint_index;
+  unsigned int s;
+
+  if (index && index->subtree == subtree)
+    return index->group;
+
+  s = treeinfo->constraint[subtree->clv_index];
+  return s ? s : find_cons_id(subtree->back, treeinfo->constraint, 0);
+}
+
+static void treeinfo_cons_index_destroy(treeinfo_cons_index_t * index)
+{
+  if (index)
+  {
+    free(index->stamp);
+    free(index->node_group);
+    free(index);
+  }
+}
+
+static treeinfo_cons_index_t * treeinfo_cons_index_create(unsigned int node_count)
+{
+  treeinfo_cons_index_t * index =
+      (treeinfo_cons_index_t *) calloc(1, sizeof(treeinfo_cons_index_t));
+
+  if (!index)
+    return NULL;
+
+  index->stamp = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+  index->node_group = (unsigned int *) calloc(node_count, sizeof(unsigned int));
+
+  if (!index->stamp || !index->node_group)
+  {
+    treeinfo_cons_index_destroy(index);
+    return NULL;
+  }
+
+  return index;
+}
+
 PLL_EXPORT int pllmod_treeinfo_check_constraint(pllmod_treeinfo_t * treeinfo,
                                                 pll_unode_t * subtree,
                                                 pll_unode_t * regraft_edge)
@@ -1440,13 +5206,25 @@ PLL_EXPORT int pllmod_treeinfo_check_constraint(pllmod_treeinfo_t * treeinfo,
   if (treeinfo->constraint)
   {
     int res;
-    unsigned int s = treeinfo->constraint[subtree->clv_index];
-    s  = s ? s : find_cons_id(subtree->back, treeinfo->constraint, 0);
+    treeinfo_cons_index_t * index =
+        (treeinfo_cons_index_t *) treeinfo->constraint_index;
+    unsigned int s = treeinfo_subtree_cons_id(treeinfo, subtree);
 
     if (s)
     {
-      unsigned int r1 = find_cons_id(regraft_edge, treeinfo->constraint, s);
-      unsigned int r2 = find_cons_id(regraft_edge->back, treeinfo->constraint, s);
+      unsigned int r1, r2;
+
+      if (index && index->subtree == subtree)
+      {
+        r1 = find_cons_id_cached(regraft_edge, treeinfo->constraint, index);
+        r2 = find_cons_id_cached(regraft_edge->back, treeinfo->constraint,
+                                 index);
+      }
+      else
+      {
+        r1 = find_cons_id(regraft_edge, treeinfo->constraint, s);
+        r2 = find_cons_id(regraft_edge->back, treeinfo->constraint, s);
+      }
 
       res = (s == r1 || s == r2) ? PLL_SUCCESS : PLL_FAILURE;
     }
@@ -1459,6 +5237,88 @@ PLL_EXPORT int pllmod_treeinfo_check_constraint(pllmod_treeinfo_t * treeinfo,
     return PLL_SUCCESS;
 }
 
+/**
+ * Prepare repeated constraint checks for regrafting `subtree`.
+ *
+ * The constraint group of `subtree` and of the branches visited by
+ * pllmod_treeinfo_check_constraint() are cached, so that checking a
+ * regraft branch takes constant time on average, also if the tree contains
+ * unconstrained (free) taxa. The cache stays valid as long as the topology
+ * of the tree does not change, except for regrafting `subtree` and pruning
+ * it again: it has to be reset by calling this function with the next
+ * subtree (or NULL to disable caching) after an SPR move is applied.
+ *
+ * @param treeinfo treeinfo structure with a topological constraint
+ * @param subtree subtree to be regrafted (pruned or not), or NULL
+ *
+ * @return PLL_SUCCESS, or PLL_FAILURE if memory could not be allocated
+ */
+PLL_EXPORT int pllmod_treeinfo_set_constraint_subtree(pllmod_treeinfo_t * treeinfo,
+                                                      pll_unode_t * subtree)
+{
+  treeinfo_cons_index_t * index =
+      (treeinfo_cons_index_t *) treeinfo->constraint_index;
+
+  if (index)
+    index->subtree = NULL;
+
+  if (!treeinfo->constraint || !subtree)
+    return PLL_SUCCESS;
+
+  if (!index)
+  {
+    index = treeinfo_cons_index_create(treeinfo->subnode_count);
+    if (!index)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Can't allocate memory for constraint index\n");
+      return PLL_FAILURE;
+    }
+    treeinfo->constraint_index = index;
+  }
+
+  /* start a new generation, so that all cached groups become invalid */
+  if (++index->epoch == 0)
+  {
+    memset(index->stamp, 0, treeinfo->subnode_count * sizeof(unsigned int));
+    index->epoch = 1;
+  }
+
+  index->group = treeinfo_subtree_cons_id(treeinfo, subtree);
+  index->subtree = subtree;
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Check whether the region behind `edge`, i.e. the branches reachable
+ * through edge->next and edge->next->next, can contain valid regraft
+ * branches for `subtree`.
+ *
+ * Constraint groups form connected regions of the tree (possibly with
+ * unconstrained nodes in between), and SPR moves which pass
+ * pllmod_treeinfo_check_constraint() keep them connected. Hence, if the
+ * node of `edge` belongs to another group than `subtree`, no branch behind
+ * it is a valid regraft branch either, and the regraft traversal does not
+ * need to descend there.
+ *
+ * @return PLL_SUCCESS if the region must be searched, PLL_FAILURE otherwise
+ */
+PLL_EXPORT int pllmod_treeinfo_check_constraint_region(pllmod_treeinfo_t * treeinfo,
+                                                       pll_unode_t * subtree,
+                                                       pll_unode_t * edge)
+{
+  unsigned int s, e;
+
+  if (!treeinfo->constraint || !edge->next)
+    return PLL_SUCCESS;
+
+  s = treeinfo_subtree_cons_id(treeinfo, subtree);
+  e = treeinfo->constraint[edge->clv_index];
+
+  return (!s || !e || e == s) ? PLL_SUCCESS : PLL_FAILURE;
+}
+
 
 static pllmod_ancestral_t * pllmod_treeinfo_create_ancestral(const pllmod_treeinfo_t * treeinfo)
 {
@@ -1600,11 +5460,12 @@ pllmod_ancestral_t * pllmod_treeinfo_compute_ancestral(pllmod_treeinfo_t * treei
 
       ancestral->partition_indices[p] = pidx;
 
+      /* CLV indices of the treeinfo nodes are up-to-date in pool mode */
       if (!pll_compute_node_ancestral(partition,
-                                      node->clv_index,
-                                      node->scaler_index,
-                                      node->back->clv_index,
-                                      node->back->scaler_index,
+                                      treeinfo_node->clv_index,
+                                      treeinfo_node->scaler_index,
+                                      treeinfo_node->back->clv_index,
+                                      treeinfo_node->back->scaler_index,
                                       node->pmatrix_index,
                                       treeinfo->param_indices[pidx],
                                       ancp))
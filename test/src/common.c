@@ -100,6 +100,86 @@ void show_rtree (pll_rnode_t * tree, int SHOW_ASCII_TREE)
   }
 }
 
+pll_partition_t * load_partition(const char * fasta_file,
+                                 const pll_utree_t * tree,
+                                 unsigned int clv_buffers,
+                                 unsigned int rate_cats,
+                                 double alpha,
+                                 unsigned int attributes)
+{
+  unsigned int i, j;
+  int sites = -1;
+  char * seq = NULL;
+  char * hdr = NULL;
+  long seqlen, hdrlen, seqno;
+  pll_partition_t * partition;
+  const unsigned int tip_count = tree->tip_count;
+  char ** seqdata = (char **) calloc(tip_count, sizeof(char *));
+  double frequencies[4] = {0.25, 0.25, 0.25, 0.25};
+  double subst_params[6] = {1, 1, 1, 1, 1, 1};
+  double * rates = (double *) calloc(rate_cats, sizeof(double));
+
+  pll_fasta_t * fp = pll_fasta_open(fasta_file, pll_map_fasta);
+  if (!fp)
+    fatal("%s does not exist", fasta_file);
+
+  /* sequences are stored at the CLV index of the tip with the same label */
+  for (i = 0; pll_fasta_getnext(fp, &hdr, &hdrlen, &seq, &seqlen, &seqno); ++i)
+  {
+    if (i >= tip_count)
+      fatal("FASTA file contains more sequences than expected");
+
+    if (sites != -1 && sites != seqlen)
+      fatal("FASTA file does not contain equal size sequences");
+    sites = seqlen;
+
+    for (j = 0; j < tip_count; ++j)
+      if (!strcmp(tree->nodes[j]->label, hdr))
+        break;
+
+    if (j == tip_count)
+      fatal("Sequence with header %s does not appear in the tree", hdr);
+
+    seqdata[tree->nodes[j]->clv_index] = seq;
+    free(hdr);
+  }
+
+  if (pll_errno != PLL_ERROR_FILE_EOF)
+    fatal("Error in %s", fasta_file);
+
+  pll_fasta_close(fp);
+
+  if (i != tip_count)
+    fatal("Some taxa are missing from FASTA file");
+
+  partition = pll_partition_create(tip_count,
+                                   clv_buffers,
+                                   4,
+                                   (unsigned int) sites,
+                                   1,
+                                   tree->edge_count,
+                                   rate_cats,
+                                   clv_buffers,
+                                   attributes);
+  if (!partition)
+    fatal("Cannot create partition: %s", pll_errmsg);
+
+  for (i = 0; i < tip_count; ++i)
+  {
+    pll_set_tip_states(partition, i, pll_map_nt, seqdata[i]);
+    free(seqdata[i]);
+  }
+  free(seqdata);
+
+  pll_set_frequencies(partition, 0, frequencies);
+  pll_set_subst_params(partition, 0, subst_params);
+  pll_compute_gamma_cats(alpha, rate_cats, rates, PLL_GAMMA_RATES_MEAN);
+  pll_set_category_rates(partition, rates);
+  free(rates);
+
+  return partition;
+}
+
 void fatal(const char * format, ...)
 {
   va_list argptr;
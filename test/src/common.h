@@ -38,6 +38,16 @@ int cb_rfull_traversal (pll_rnode_t * node);
 /* displays a tree */
 void show_tree (pll_unode_t * tree, int SHOW_ASCII_TREE);
 void show_rtree (pll_rnode_t * tree, int SHOW_ASCII_TREE);
+/* create a partition with the sequences of a FASTA file (DNA) at the tips
+ * of tree, with clv_buffers inner CLVs and scalers, one p-matrix per branch,
+ * equal frequencies and rates, and mean gamma rates with shape alpha */
+pll_partition_t * load_partition(const char * fasta_file,
+                                 const pll_utree_t * tree,
+                                 unsigned int clv_buffers,
+                                 unsigned int rate_cats,
+                                 double alpha,
+                                 unsigned int attributes);
+
 /* print error and exit */
 void fatal(const char * format, ...) __attribute__ ((noreturn));
 
@@ -0,0 +1,267 @@
+#include "pll_tree.h"
+#include "pllmod_common.h"
+#include "../common.h"
+
+#include <math.h>
+
+#define RATE_CATS 4
+#define STATES    4
+#define RATES     (STATES * (STATES - 1) / 2)
+
+#define FASTAFILE "testdata/small.fas"
+#define TREEFILE  "testdata/small.tree"
+
+/* relative finite difference step and tolerance */
+#define FD_STEP        1e-5
+#define GRAD_TOLERANCE 1e-3
+
+typedef struct
+{
+  const char * name;
+  int brlen_linkage;
+  double brlen_scaler;
+  const int * symmetries;
+  const double * subst_params;
+  double pinv;
+  unsigned int attributes;
+} gradient_case_t;
+
+static const double gtr_rates[RATES] = {1.0, 2.0, 0.5, 1.5, 3.0, 1.0};
+static const double hky_rates[RATES] = {1.0, 2.5, 1.0, 1.0, 2.5, 1.0};
+static const int hky_symmetries[RATES] = {0, 1, 0, 0, 1, 0};
+static const double frequencies[STATES] = {0.1, 0.2, 0.3, 0.4};
+static const double alpha = 0.8;
+
+static const gradient_case_t cases[] = {
+  {"GTR", PLLMOD_COMMON_BRLEN_LINKED, 1., NULL, gtr_rates, 0., 0},
+  {"HKY symmetries", PLLMOD_COMMON_BRLEN_LINKED, 1., hky_symmetries,
+    hky_rates, 0., 0},
+  {"GTR+G+I", PLLMOD_COMMON_BRLEN_LINKED, 1., NULL, gtr_rates, 0.2, 0},
+  {"Scaled branch lengths", PLLMOD_COMMON_BRLEN_SCALED, 1.5, NULL,
+    gtr_rates, 0.2, 0},
+  {"Unlinked branch lengths", PLLMOD_COMMON_BRLEN_UNLINKED, 1., NULL,
+    gtr_rates, 0.2, 0},
+  {"Pattern tips", PLLMOD_COMMON_BRLEN_LINKED, 1., NULL, gtr_rates, 0.2,
+    PLL_ATTRIB_PATTERN_TIP}
+};
+
+static double recompute_loglh(pllmod_treeinfo_t * treeinfo)
+{
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  return pllmod_treeinfo_compute_loglh(treeinfo, 0);
+}
+
+static const char * check_grad(double grad, double lh_plus, double lh_minus,
+                               double h)
+{
+  double fd_grad = (lh_plus - lh_minus) / (2. * h);
+  return (fabs(grad - fd_grad) < GRAD_TOLERANCE * PLL_MAX(1., fabs(fd_grad))) ?
+         "OK" : "FAIL";
+}
+
+static void check_rates(pllmod_treeinfo_t * treeinfo,
+                        const gradient_case_t * c,
+                        const double * gradient)
+{
+  pll_partition_t * partition = treeinfo->partitions[0];
+  double params[RATES];
+  double grad, h, lh_plus, lh_minus;
+  int g, group_count = 0;
+  unsigned int n;
+
+  for (n = 0; n < RATES; ++n)
+    group_count = PLL_MAX(group_count, c->symmetries ? c->symmetries[n] + 1 :
+                                                       (int) n + 1);
+
+  /* the rates of a symmetry group are changed together, so the derivative
+   * is the sum of the per-rate entries */
+  for (g = 0; g < group_count; ++g)
+  {
+    grad = 0.;
+    h = 0.;
+    for (n = 0; n < RATES; ++n)
+    {
+      if ((c->symmetries ? c->symmetries[n] : (int) n) == g)
+      {
+        grad += gradient[n];
+        h = c->subst_params[n] * FD_STEP;
+      }
+    }
+
+    for (n = 0; n < RATES; ++n)
+      params[n] = c->subst_params[n] +
+                  ((c->symmetries ? c->symmetries[n] : (int) n) == g ? h : 0.);
+    pll_set_subst_params(partition, 0, params);
+    lh_plus = recompute_loglh(treeinfo);
+
+    for (n = 0; n < RATES; ++n)
+      params[n] = c->subst_params[n] -
+                  ((c->symmetries ? c->symmetries[n] : (int) n) == g ? h : 0.);
+    pll_set_subst_params(partition, 0, params);
+    lh_minus = recompute_loglh(treeinfo);
+
+    printf("%s: rate group %d... %s\n", c->name, g,
+           check_grad(grad, lh_plus, lh_minus, h));
+  }
+
+  pll_set_subst_params(partition, 0, c->subst_params);
+}
+
+static void check_frequencies(pllmod_treeinfo_t * treeinfo,
+                              const gradient_case_t * c,
+                              const double * gradient)
+{
+  pll_partition_t * partition = treeinfo->partitions[0];
+  const double * freqs_grad = gradient + PLLMOD_TREEINFO_GRAD_FREQS(STATES);
+  double freqs[STATES];
+  double h, lh_plus, lh_minus;
+  unsigned int i;
+
+  /* frequencies are independent parameters, i.e. not renormalized */
+  for (i = 0; i < STATES; ++i)
+  {
+    memcpy(freqs, frequencies, STATES * sizeof(double));
+    h = frequencies[i] * FD_STEP;
+
+    freqs[i] = frequencies[i] + h;
+    pll_set_frequencies(partition, 0, freqs);
+    lh_plus = recompute_loglh(treeinfo);
+
+    freqs[i] = frequencies[i] - h;
+    pll_set_frequencies(partition, 0, freqs);
+    lh_minus = recompute_loglh(treeinfo);
+
+    printf("%s: frequency %u... %s\n", c->name, i,
+           check_grad(freqs_grad[i], lh_plus, lh_minus, h));
+  }
+
+  pll_set_frequencies(partition, 0, frequencies);
+}
+
+static void check_alpha(pllmod_treeinfo_t * treeinfo,
+                        const gradient_case_t * c,
+                        const double * gradient)
+{
+  pll_partition_t * partition = treeinfo->partitions[0];
+  double rates[RATE_CATS];
+  double h = alpha * FD_STEP;
+  double lh_plus, lh_minus;
+
+  pll_compute_gamma_cats(alpha + h, RATE_CATS, rates, PLL_GAMMA_RATES_MEAN);
+  pll_set_category_rates(partition, rates);
+  lh_plus = recompute_loglh(treeinfo);
+
+  pll_compute_gamma_cats(alpha - h, RATE_CATS, rates, PLL_GAMMA_RATES_MEAN);
+  pll_set_category_rates(partition, rates);
+  lh_minus = recompute_loglh(treeinfo);
+
+  printf("%s: alpha... %s\n", c->name,
+         check_grad(gradient[PLLMOD_TREEINFO_GRAD_ALPHA(STATES)],
+                    lh_plus, lh_minus, h));
+
+  pll_compute_gamma_cats(alpha, RATE_CATS, rates, PLL_GAMMA_RATES_MEAN);
+  pll_set_category_rates(partition, rates);
+}
+
+static void check_pinv(pllmod_treeinfo_t * treeinfo,
+                       const gradient_case_t * c,
+                       const double * gradient)
+{
+  pll_partition_t * partition = treeinfo->partitions[0];
+  double h = c->pinv * FD_STEP;
+  double lh_plus, lh_minus;
+
+  pll_update_invariant_sites_proportion(partition, 0, c->pinv + h);
+  lh_plus = recompute_loglh(treeinfo);
+
+  pll_update_invariant_sites_proportion(partition, 0, c->pinv - h);
+  lh_minus = recompute_loglh(treeinfo);
+
+  printf("%s: pinv... %s\n", c->name,
+         check_grad(gradient[PLLMOD_TREEINFO_GRAD_PINV(STATES)],
+                    lh_plus, lh_minus, h));
+
+  pll_update_invariant_sites_proportion(partition, 0, c->pinv);
+}
+
+static void check_case(const gradient_case_t * c, unsigned int attributes)
+{
+  unsigned int param_indices[RATE_CATS] = {0, 0, 0, 0};
+  double gradient[PLLMOD_TREEINFO_GRAD_SIZE(STATES)];
+  double * gradients[1] = {gradient};
+
+  pll_utree_t * tree = pll_utree_parse_newick(TREEFILE);
+  if (!tree)
+    fatal("Error parsing %s", TREEFILE);
+
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(tree->vroot,
+                                                        tree->tip_count,
+                                                        1,
+                                                        c->brlen_linkage);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  /* edge CLV mode needs 3 CLVs per inner node */
+  pll_partition_t * partition = load_partition(FASTAFILE,
+                                               tree,
+                                               3 * tree->inner_count,
+                                               RATE_CATS,
+                                               alpha,
+                                               attributes | c->attributes);
+
+  pll_set_subst_params(partition, 0, c->subst_params);
+  pll_set_frequencies(partition, 0, frequencies);
+  if (c->pinv > 0.)
+    pll_update_invariant_sites_proportion(partition, 0, c->pinv);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, alpha,
+                                      param_indices, c->symmetries))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  if (c->brlen_linkage == PLLMOD_COMMON_BRLEN_SCALED)
+    treeinfo->brlen_scalers[0] = c->brlen_scaler;
+
+  if (!pllmod_treeinfo_set_clv_mode(treeinfo, PLLMOD_TREEINFO_CLV_EDGE))
+    fatal("Cannot set edge CLV mode: %s", pll_errmsg);
+
+  /* analytic gradient at the original parameters */
+  recompute_loglh(treeinfo);
+  if (!pllmod_treeinfo_compute_model_gradient(treeinfo, 0, gradients))
+    fatal("Cannot compute model gradient: %s", pll_errmsg);
+
+  check_rates(treeinfo, c, gradient);
+  check_frequencies(treeinfo, c, gradient);
+  check_alpha(treeinfo, c, gradient);
+  if (c->pinv > 0.)
+    check_pinv(treeinfo, c, gradient);
+
+  /* clean up */
+  pll_partition_destroy(partition);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i;
+
+  unsigned int attributes = get_attributes(argc, argv);
+
+  /* site repeats are not supported by the model gradient */
+  if (attributes & PLL_ATTRIB_SITE_REPEATS)
+  {
+    skip_test();
+  }
+
+  printf("Tree: %s\n", TREEFILE);
+  printf("Alignment: %s\n", FASTAFILE);
+
+  for (i = 0; i < sizeof(cases) / sizeof(gradient_case_t); ++i)
+  {
+    printf("\n");
+    check_case(cases + i, attributes);
+  }
+
+  return (0);
+}
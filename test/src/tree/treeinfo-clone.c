@@ -0,0 +1,118 @@
+#include "pll_tree.h"
+#include "pllmod_common.h"
+#include "../common.h"
+
+#include <math.h>
+
+#define RATE_CATS 4
+
+#define FASTAFILE "testdata/medium.fas"
+#define TREEFILE  "testdata/medium.tree"
+
+#define PARTITION_COUNT 2
+#define NEW_BRLEN       0.3
+#define LH_TOLERANCE    1e-6
+
+static const char * check_lh(double loglh, double ref_loglh)
+{
+  return (fabs(loglh - ref_loglh) < LH_TOLERANCE) ? "OK" : "FAIL";
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int p;
+  unsigned int param_indices[RATE_CATS] = {0, 0, 0, 0};
+  double alphas[PARTITION_COUNT] = {0.5, 1.0};
+  double start_loglh, loglh;
+
+  unsigned int attributes = get_attributes(argc, argv);
+
+  /* clones do not support site repeats */
+  if (attributes & PLL_ATTRIB_SITE_REPEATS)
+  {
+    skip_test();
+  }
+
+  printf("Parsing tree: %s\n", TREEFILE);
+  pll_utree_t * tree = pll_utree_parse_newick(TREEFILE);
+  if (!tree)
+    fatal("Error parsing %s", TREEFILE);
+
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(tree->vroot,
+                                                        tree->tip_count,
+                                                        PARTITION_COUNT,
+                                                        PLLMOD_COMMON_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  printf("Reading FASTA file: %s\n", FASTAFILE);
+  for (p = 0; p < PARTITION_COUNT; ++p)
+  {
+    pll_partition_t * partition = load_partition(FASTAFILE,
+                                                 tree,
+                                                 tree->inner_count,
+                                                 RATE_CATS,
+                                                 alphas[p],
+                                                 attributes);
+
+    if (!pllmod_treeinfo_init_partition(treeinfo, p, partition, 0,
+                                        PLL_GAMMA_RATES_MEAN, alphas[p],
+                                        param_indices, NULL))
+      fatal("Cannot initialize partition %u: %s", p, pll_errmsg);
+  }
+
+  start_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  /* the first clone copies the tip data, its clone shares it */
+  pllmod_treeinfo_t * clone = pllmod_treeinfo_clone(treeinfo);
+  if (!clone)
+    fatal("Cannot clone treeinfo: %s", pll_errmsg);
+
+  pllmod_treeinfo_t * clone2 = pllmod_treeinfo_clone(clone);
+  if (!clone2)
+    fatal("Cannot clone treeinfo: %s", pll_errmsg);
+
+  printf("\nClone the treeinfo, then clone the clone\n");
+  loglh = pllmod_treeinfo_compute_loglh(clone, 0);
+  printf("Clone vs. original log-L check... %s\n",
+         check_lh(loglh, start_loglh));
+  loglh = pllmod_treeinfo_compute_loglh(clone2, 0);
+  printf("Clone of clone vs. original log-L check... %s\n",
+         check_lh(loglh, start_loglh));
+
+  /* clones have their own tree and branch lengths */
+  pll_unode_t * edge = clone->tree->nodes[clone->tip_count];
+  pllmod_treeinfo_set_branch_length(clone, edge, NEW_BRLEN);
+  pllmod_treeinfo_invalidate_all(clone);
+  loglh = pllmod_treeinfo_compute_loglh(clone, 0);
+
+  printf("\nChange a branch length of the clone\n");
+  printf("Clone log-L changed... %s\n",
+         fabs(loglh - start_loglh) > LH_TOLERANCE ? "OK" : "FAIL");
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("Original log-L unchanged... %s\n", check_lh(loglh, start_loglh));
+
+  /* shared tip data outlives the original and the first clone */
+  for (p = 0; p < PARTITION_COUNT; ++p)
+    pll_partition_destroy(treeinfo->partitions[p]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+
+  printf("\nDestroy the original treeinfo\n");
+  pllmod_treeinfo_invalidate_all(clone2);
+  loglh = pllmod_treeinfo_compute_loglh(clone2, 0);
+  printf("Clone of clone log-L check... %s\n", check_lh(loglh, start_loglh));
+
+  pllmod_treeinfo_destroy(clone);
+
+  printf("\nDestroy the first clone\n");
+  pllmod_treeinfo_invalidate_all(clone2);
+  loglh = pllmod_treeinfo_compute_loglh(clone2, 0);
+  printf("Clone of clone log-L check... %s\n", check_lh(loglh, start_loglh));
+
+  /* clean up */
+  pllmod_treeinfo_destroy(clone2);
+
+  return (0);
+}
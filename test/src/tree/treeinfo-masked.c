@@ -0,0 +1,99 @@
+#include "pll_tree.h"
+#include "pllmod_common.h"
+#include "../common.h"
+
+#include <math.h>
+
+#define RATE_CATS 4
+
+#define FASTAFILE "testdata/medium.fas"
+#define TREEFILE  "testdata/medium.tree"
+
+#define PARTITION_COUNT 2
+#define LH_TOLERANCE    1e-6
+
+static const char * check_lh(double loglh, double ref_loglh)
+{
+  return (fabs(loglh - ref_loglh) < LH_TOLERANCE) ? "OK" : "FAIL";
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int p;
+  unsigned int param_indices[RATE_CATS] = {0, 0, 0, 0};
+  double alphas[PARTITION_COUNT] = {0.5, 1.0};
+  double rates[RATE_CATS];
+  double full_loglh, masked_loglh, ref_loglh, old_loglh;
+  int mask[PARTITION_COUNT] = {0, 1};
+
+  unsigned int attributes = get_attributes(argc, argv);
+
+  printf("Parsing tree: %s\n", TREEFILE);
+  pll_utree_t * tree = pll_utree_parse_newick(TREEFILE);
+  if (!tree)
+    fatal("Error parsing %s", TREEFILE);
+
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(tree->vroot,
+                                                        tree->tip_count,
+                                                        PARTITION_COUNT,
+                                                        PLLMOD_COMMON_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  /* the same alignment twice, with different alpha */
+  printf("Reading FASTA file: %s\n", FASTAFILE);
+  for (p = 0; p < PARTITION_COUNT; ++p)
+  {
+    pll_partition_t * partition = load_partition(FASTAFILE,
+                                                 tree,
+                                                 tree->inner_count,
+                                                 RATE_CATS,
+                                                 alphas[p],
+                                                 attributes);
+
+    if (!pllmod_treeinfo_init_partition(treeinfo, p, partition, 0,
+                                        PLL_GAMMA_RATES_MEAN, alphas[p],
+                                        param_indices, NULL))
+      fatal("Cannot initialize partition %u: %s", p, pll_errmsg);
+  }
+
+  full_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  old_loglh = treeinfo->partition_loglh[0];
+
+  /* change the model of partition 1 only */
+  printf("\nChange alpha of partition 1\n");
+  pll_compute_gamma_cats(2.0, RATE_CATS, rates, PLL_GAMMA_RATES_MEAN);
+  pll_set_category_rates(treeinfo->partitions[1], rates);
+  pllmod_treeinfo_set_active_partition(treeinfo, 1);
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  pllmod_treeinfo_set_active_partition(treeinfo,
+                                       PLLMOD_TREEINFO_PARTITION_ALL);
+
+  masked_loglh = pllmod_treeinfo_compute_loglh_masked(treeinfo, 1, mask);
+  printf("Masked partition unchanged... %s\n",
+         check_lh(treeinfo->partition_loglh[0], old_loglh));
+  printf("Model change affects logL... %s\n",
+         fabs(masked_loglh - full_loglh) > LH_TOLERANCE ? "OK" : "FAIL");
+
+  /* the masked result must match a full recomputation of all partitions */
+  ref_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("Masked vs. full log-L check... %s\n",
+         check_lh(masked_loglh, ref_loglh));
+
+  /* without a mask, all partitions are computed */
+  pllmod_treeinfo_set_active_partition(treeinfo, 0);
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  pllmod_treeinfo_set_active_partition(treeinfo,
+                                       PLLMOD_TREEINFO_PARTITION_ALL);
+  masked_loglh = pllmod_treeinfo_compute_loglh_masked(treeinfo, 1, NULL);
+  printf("Unmasked vs. full log-L check... %s\n",
+         check_lh(masked_loglh, ref_loglh));
+
+  /* clean up */
+  for (p = 0; p < PARTITION_COUNT; ++p)
+    pll_partition_destroy(treeinfo->partitions[p]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+
+  return (0);
+}
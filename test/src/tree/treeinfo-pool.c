@@ -0,0 +1,128 @@
+#include "pll_tree.h"
+#include "pllmod_common.h"
+#include "../common.h"
+
+#include <math.h>
+
+#define RATE_CATS 4
+#define ALPHA     0.5
+
+#define FASTAFILE "testdata/medium.fas"
+#define TREEFILE  "testdata/medium.tree"
+
+#define NEW_BRLEN    0.3
+#define LH_TOLERANCE 1e-6
+
+static const char * check_lh(double loglh, double ref_loglh)
+{
+  return (fabs(loglh - ref_loglh) < LH_TOLERANCE) ? "OK" : "FAIL";
+}
+
+static pllmod_treeinfo_t * create_treeinfo(pll_utree_t * tree,
+                                           unsigned int clv_buffers,
+                                           unsigned int attributes)
+{
+  unsigned int param_indices[RATE_CATS] = {0, 0, 0, 0};
+
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(tree->vroot,
+                                                        tree->tip_count,
+                                                        1,
+                                                        PLLMOD_COMMON_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  pll_partition_t * partition = load_partition(FASTAFILE,
+                                               tree,
+                                               clv_buffers,
+                                               RATE_CATS,
+                                               ALPHA,
+                                               attributes);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, ALPHA,
+                                      param_indices, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  return treeinfo;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i;
+  unsigned int pool_buffers = 4;
+  unsigned int mismatches = 0;
+  double node_loglh, pool_loglh;
+
+  unsigned int attributes = get_attributes(argc, argv);
+
+  printf("Tree: %s\n", TREEFILE);
+  printf("Alignment: %s\n", FASTAFILE);
+
+  pll_utree_t * node_tree = pll_utree_parse_newick(TREEFILE);
+  pll_utree_t * pool_tree = pll_utree_parse_newick(TREEFILE);
+  if (!node_tree || !pool_tree)
+    fatal("Error parsing %s", TREEFILE);
+
+  /* smallest pool allowed: ceil(log2(tip_count)) + 4 slots */
+  for (i = 1; i < node_tree->tip_count; i *= 2)
+    pool_buffers++;
+
+  if (pool_buffers >= node_tree->inner_count)
+    fatal("Tree is too small to use fewer CLV buffers than inner nodes");
+
+  pllmod_treeinfo_t * node_treeinfo = create_treeinfo(node_tree,
+                                                      node_tree->inner_count,
+                                                      attributes);
+  pllmod_treeinfo_t * pool_treeinfo = create_treeinfo(pool_tree,
+                                                      pool_buffers,
+                                                      attributes);
+
+  if (!pllmod_treeinfo_set_clv_mode(pool_treeinfo, PLLMOD_TREEINFO_CLV_POOL))
+    fatal("Cannot set CLV pool mode: %s", pll_errmsg);
+
+  node_loglh = pllmod_treeinfo_compute_loglh(node_treeinfo, 0);
+  pool_loglh = pllmod_treeinfo_compute_loglh(pool_treeinfo, 0);
+
+  printf("\nFull traversal with fewer CLV buffers than inner nodes\n");
+  printf("Pool vs. node mode log-L check... %s\n",
+         check_lh(pool_loglh, node_loglh));
+
+  /* move the root around the tree and change the branch at the new root:
+   * evicted CLVs have to be recomputed */
+  for (i = node_tree->tip_count;
+       i < node_tree->tip_count + node_tree->inner_count; ++i)
+  {
+    pll_unode_t * node_edge = node_tree->nodes[i];
+    pll_unode_t * pool_edge = pool_tree->nodes[i];
+
+    pllmod_treeinfo_set_root(node_treeinfo, node_edge);
+    pllmod_treeinfo_set_root(pool_treeinfo, pool_edge);
+
+    pllmod_treeinfo_set_branch_length(node_treeinfo, node_edge, NEW_BRLEN);
+    pllmod_treeinfo_set_branch_length(pool_treeinfo, pool_edge, NEW_BRLEN);
+    pllmod_treeinfo_invalidate_pmatrix(node_treeinfo, node_edge);
+    pllmod_treeinfo_invalidate_pmatrix(pool_treeinfo, pool_edge);
+
+    node_loglh = pllmod_treeinfo_compute_loglh(node_treeinfo, 1);
+    pool_loglh = pllmod_treeinfo_compute_loglh(pool_treeinfo, 1);
+
+    if (fabs(pool_loglh - node_loglh) > LH_TOLERANCE)
+      mismatches++;
+  }
+
+  printf("\nIncremental traversals after moving the root\n");
+  printf("Pool vs. node mode log-L check... %s\n", mismatches ? "FAIL" : "OK");
+  printf("CLVs evicted and recomputed... %s\n",
+         pool_treeinfo->clv_pool_evictions > 0 &&
+         pool_treeinfo->clv_pool_recomputations > 0 ? "OK" : "FAIL");
+
+  /* clean up */
+  pll_partition_destroy(node_treeinfo->partitions[0]);
+  pll_partition_destroy(pool_treeinfo->partitions[0]);
+  pllmod_treeinfo_destroy(node_treeinfo);
+  pllmod_treeinfo_destroy(pool_treeinfo);
+  pll_utree_destroy(node_tree, NULL);
+  pll_utree_destroy(pool_tree, NULL);
+
+  return (0);
+}
@@ -0,0 +1,160 @@
+#include "pll_tree.h"
+#include "pllmod_common.h"
+#include "../common.h"
+
+#include <math.h>
+
+#define RATE_CATS 4
+#define ALPHA     0.5
+#define MIN_BRLEN 1e-6
+
+#define FASTAFILE "testdata/medium.fas"
+#define TREEFILE  "testdata/medium.tree"
+
+#define LH_TOLERANCE 1e-6
+
+/* regraft candidates: one subnode per edge of the pruned tree */
+static int is_candidate(const pll_unode_t * node, const pll_unode_t * p_edge)
+{
+  if (node == p_edge || node == p_edge->back ||
+      node == p_edge->next || node == p_edge->next->next)
+    return 0;
+
+  return node->back && node->node_index < node->back->node_index;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i;
+  unsigned int param_indices[RATE_CATS] = {0, 0, 0, 0};
+  unsigned int candidates = 0;
+  unsigned int mismatches = 0;
+  double start_loglh, virtual_loglh, real_loglh, half_length;
+  double orig_length[2];
+  pll_unode_t * p_edge = NULL;
+  pll_unode_t * orig_prune_edge;
+
+  unsigned int attributes = get_attributes(argc, argv);
+
+  printf("Parsing tree: %s\n", TREEFILE);
+  pll_utree_t * tree = pll_utree_parse_newick(TREEFILE);
+  if (!tree)
+    fatal("Error parsing %s", TREEFILE);
+
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(tree->vroot,
+                                                        tree->tip_count,
+                                                        1,
+                                                        PLLMOD_COMMON_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  printf("Reading FASTA file: %s\n", FASTAFILE);
+  pll_partition_t * partition = load_partition(FASTAFILE,
+                                               tree,
+                                               tree->inner_count,
+                                               RATE_CATS,
+                                               ALPHA,
+                                               attributes);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, ALPHA,
+                                      param_indices, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  start_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  /* prune a tip away from the root node */
+  for (i = tree->tip_count; i < tree->tip_count + tree->inner_count; ++i)
+  {
+    pll_unode_t * node = tree->nodes[i];
+    if (node == treeinfo->root || node->next == treeinfo->root ||
+        node->next->next == treeinfo->root)
+      continue;
+
+    if (!node->back->next)
+      p_edge = node;
+    else if (!node->next->back->next)
+      p_edge = node->next;
+    else if (!node->next->next->back->next)
+      p_edge = node->next->next;
+
+    if (p_edge)
+      break;
+  }
+
+  if (!p_edge)
+    fatal("No inner node with a tip found");
+
+  printf("\nPrune a tip and regraft it into every branch\n");
+  orig_length[0] = p_edge->next->length;
+  orig_length[1] = p_edge->next->next->length;
+  orig_prune_edge = pllmod_utree_prune(p_edge);
+  if (!orig_prune_edge)
+    fatal("Cannot prune: %s", pll_errmsg);
+  pllmod_treeinfo_set_branch_length(treeinfo, orig_prune_edge,
+                                    orig_prune_edge->length);
+  pllmod_treeinfo_set_root(treeinfo, orig_prune_edge);
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  pllmod_treeinfo_update_prob_matrices(treeinfo, 0);
+
+  /* score every insertion branch virtually, then regraft for real */
+  for (i = 0; i < treeinfo->subnode_count; ++i)
+  {
+    pll_unode_t * r_edge = treeinfo->subnodes[i];
+    pll_unode_t * pruned_tree;
+
+    if (!is_candidate(r_edge, p_edge))
+      continue;
+
+    candidates++;
+
+    virtual_loglh = pllmod_treeinfo_compute_loglh_regraft(treeinfo, p_edge,
+                                                          r_edge, MIN_BRLEN);
+    if (isnan(virtual_loglh))
+      fatal("Cannot compute regraft log-L: %s", pll_errmsg);
+
+    half_length = PLL_MAX(r_edge->length / 2., MIN_BRLEN);
+    if (!pllmod_utree_regraft(p_edge, r_edge))
+      fatal("Cannot regraft: %s", pll_errmsg);
+    pllmod_treeinfo_set_branch_length(treeinfo, p_edge->next, half_length);
+    pllmod_treeinfo_set_branch_length(treeinfo, p_edge->next->next,
+                                      half_length);
+    pllmod_treeinfo_set_root(treeinfo, p_edge);
+    pllmod_treeinfo_invalidate_all(treeinfo);
+    real_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+    if (fabs(virtual_loglh - real_loglh) > LH_TOLERANCE)
+      mismatches++;
+
+    /* roll back */
+    pruned_tree = pllmod_utree_prune(p_edge);
+    pllmod_treeinfo_set_branch_length(treeinfo, pruned_tree,
+                                      2. * half_length);
+    pllmod_treeinfo_set_root(treeinfo, pruned_tree);
+    pllmod_treeinfo_invalidate_all(treeinfo);
+    pllmod_treeinfo_update_prob_matrices(treeinfo, 0);
+  }
+
+  printf("Regraft candidates found... %s\n", candidates > 0 ? "OK" : "FAIL");
+  printf("Virtual vs. real regraft log-L check... %s\n",
+         mismatches ? "FAIL" : "OK");
+
+  /* the tip returns to its original branch */
+  if (!pllmod_utree_regraft(p_edge, orig_prune_edge))
+    fatal("Cannot regraft: %s", pll_errmsg);
+  pllmod_treeinfo_set_branch_length(treeinfo, p_edge->next, orig_length[0]);
+  pllmod_treeinfo_set_branch_length(treeinfo, p_edge->next->next,
+                                    orig_length[1]);
+  pllmod_treeinfo_set_root(treeinfo, p_edge);
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  real_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("Original tree log-L check... %s\n",
+         fabs(real_loglh - start_loglh) < LH_TOLERANCE ? "OK" : "FAIL");
+
+  /* clean up */
+  pll_partition_destroy(partition);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+
+  return (0);
+}
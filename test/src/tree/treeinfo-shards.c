@@ -0,0 +1,134 @@
+#include "pll_tree.h"
+#include "pllmod_common.h"
+#include "../common.h"
+
+#include <math.h>
+
+#define RATE_CATS 4
+#define ALPHA     0.5
+
+#define FASTAFILE "testdata/medium.fas"
+#define TREEFILE  "testdata/medium.tree"
+
+#define SHARD_SITES  64
+#define THREAD_COUNT 4
+#define NEW_BRLEN    0.3
+
+#define LH_TOLERANCE 1e-6
+
+#define TREEINFO_COUNT 3
+
+static const char * check_lh(double loglh, double ref_loglh)
+{
+  return (fabs(loglh - ref_loglh) < LH_TOLERANCE) ? "OK" : "FAIL";
+}
+
+static pllmod_treeinfo_t * create_treeinfo(pll_utree_t * tree,
+                                           pll_partition_t * partition,
+                                           unsigned int shard_sites,
+                                           unsigned int thread_count)
+{
+  unsigned int param_indices[RATE_CATS] = {0, 0, 0, 0};
+
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(tree->vroot,
+                                                        tree->tip_count,
+                                                        1,
+                                                        PLLMOD_COMMON_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  /* shard size only applies to partitions initialized afterwards */
+  if (!pllmod_treeinfo_set_shard_sites(treeinfo, shard_sites) ||
+      !pllmod_treeinfo_set_thread_count(treeinfo, thread_count))
+    fatal("Cannot set up threads: %s", pll_errmsg);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, ALPHA,
+                                      param_indices, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  return treeinfo;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i;
+  double loglh[TREEINFO_COUNT];
+  pll_utree_t * tree[TREEINFO_COUNT];
+  pll_partition_t * partition[TREEINFO_COUNT];
+  pllmod_treeinfo_t * treeinfo[TREEINFO_COUNT];
+
+  unsigned int attributes = get_attributes(argc, argv);
+
+  printf("Tree: %s\n", TREEFILE);
+  printf("Alignment: %s\n", FASTAFILE);
+
+  /* every treeinfo needs its own tree and partition */
+  for (i = 0; i < TREEINFO_COUNT; ++i)
+  {
+    tree[i] = pll_utree_parse_newick(TREEFILE);
+    if (!tree[i])
+      fatal("Error parsing %s", TREEFILE);
+
+    partition[i] = load_partition(FASTAFILE,
+                                  tree[i],
+                                  tree[i]->inner_count,
+                                  RATE_CATS,
+                                  ALPHA,
+                                  attributes);
+  }
+
+  /* unsharded reference, sharded with 1 and with several threads */
+  treeinfo[0] = create_treeinfo(tree[0], partition[0], 0, 1);
+  treeinfo[1] = create_treeinfo(tree[1], partition[1], SHARD_SITES, 1);
+  treeinfo[2] = create_treeinfo(tree[2], partition[2], SHARD_SITES,
+                                THREAD_COUNT);
+
+  for (i = 0; i < TREEINFO_COUNT; ++i)
+    loglh[i] = pllmod_treeinfo_compute_loglh(treeinfo[i], 0);
+
+  printf("\nFull traversal\n");
+  printf("Sharded vs. unsharded log-L check... %s\n",
+         check_lh(loglh[1], loglh[0]));
+  printf("Sharded log-L independent of threads... %s\n",
+         loglh[2] == loglh[1] ? "OK" : "FAIL");
+
+  /* same change on every tree, rooted at the changed branch so that only
+   * CLVs pointing towards it have to be recomputed */
+  for (i = 0; i < TREEINFO_COUNT; ++i)
+  {
+    pll_unode_t * edge = tree[i]->nodes[tree[i]->tip_count];
+    pllmod_treeinfo_set_root(treeinfo[i], edge);
+    pllmod_treeinfo_set_branch_length(treeinfo[i], edge, NEW_BRLEN);
+    pllmod_treeinfo_invalidate_pmatrix(treeinfo[i], edge);
+    loglh[i] = pllmod_treeinfo_compute_loglh(treeinfo[i], 1);
+  }
+
+  printf("\nIncremental traversal after a branch length change\n");
+  printf("Sharded vs. unsharded log-L check... %s\n",
+         check_lh(loglh[1], loglh[0]));
+  printf("Sharded log-L independent of threads... %s\n",
+         loglh[2] == loglh[1] ? "OK" : "FAIL");
+
+  /* shard views refer to the partition, which must survive the treeinfo */
+  printf("\nDestroy the sharded treeinfos\n");
+  for (i = 1; i < TREEINFO_COUNT; ++i)
+  {
+    pllmod_treeinfo_destroy(treeinfo[i]);
+    treeinfo[i] = create_treeinfo(tree[i], partition[i], 0, 1);
+    loglh[i] = pllmod_treeinfo_compute_loglh(treeinfo[i], 0);
+  }
+  printf("Partitions intact after destroy... %s\n",
+         loglh[1] == loglh[2] && fabs(loglh[1] - loglh[0]) < LH_TOLERANCE ?
+         "OK" : "FAIL");
+
+  /* clean up */
+  for (i = 0; i < TREEINFO_COUNT; ++i)
+  {
+    pllmod_treeinfo_destroy(treeinfo[i]);
+    pll_partition_destroy(partition[i]);
+    pll_utree_destroy(tree[i], NULL);
+  }
+
+  return (0);
+}
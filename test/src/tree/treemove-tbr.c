@@ -21,6 +21,29 @@ typedef struct
   int clv_valid;
 } node_info_t;
 
+/* store the length of every branch at edge_len[a * node_count + b], where a
+ * and b are the CLV indices of its end nodes (-1 = no branch) */
+static void get_edges(pll_utree_t * tree, unsigned int node_count,
+                      double * edge_len)
+{
+  unsigned int i;
+
+  for (i = 0; i < node_count * node_count; ++i)
+    edge_len[i] = -1;
+
+  for (i = 0; i < node_count; ++i)
+  {
+    pll_unode_t * node = tree->nodes[i];
+    do
+    {
+      edge_len[node->clv_index * node_count + node->back->clv_index] =
+          node->length;
+      node = node->next;
+    }
+    while (node && node != tree->nodes[i]);
+  }
+}
+
 int main (int argc, char * argv[])
 {
   unsigned int i;
@@ -28,6 +51,8 @@ int main (int argc, char * argv[])
   unsigned int matrix_count, ops_count;
   unsigned int * matrix_indices;
   double * branch_lengths;
+  double * orig_edges, * rb_edges;
+  pll_tree_rollback_t rollback_info;
   pll_partition_t * partition;
   pll_operation_t * operations;
   pll_unode_t ** travbuffer;
@@ -261,6 +286,13 @@ int main (int argc, char * argv[])
 
   printf ("Log-L at %s-%s: %f\n", tree->label, tree->back->label, logl);
 
+  double orig_logl = logl;
+
+  /* store the original topology and branch lengths */
+  orig_edges = (double *) malloc (nodes_count * nodes_count * sizeof(double));
+  rb_edges = (double *) malloc (nodes_count * nodes_count * sizeof(double));
+  get_edges (parsed_tree, nodes_count, orig_edges);
+
   /* Test TBR */
 
   unsigned int distance = 3;
@@ -309,7 +341,7 @@ int main (int argc, char * argv[])
           reconnect.edge.utree.child->back->label);
   reconnect.length = 0.555;
 
-  if (!pllmod_utree_tbr (bisect_edge, &reconnect, 0))
+  if (!pllmod_utree_tbr (bisect_edge, &reconnect, &rollback_info))
     fatal ("TBR move cannot be applied");
 
   tree = reconnect.edge.utree.parent;
@@ -371,6 +403,43 @@ int main (int argc, char * argv[])
 
   printf ("  Log-L at %s-%s: %f\n", tree->label, tree->back->label, logl);
 
+  /* Test TBR rollback */
+
+  printf ("\nRollback TBR move\n");
+  if (!pllmod_tree_rollback (&rollback_info))
+    fatal ("TBR move cannot be rolled back");
+
+  printf ("Integrity check... ");
+  fflush(stdout);
+  if (!pll_utree_check_integrity (parsed_tree))
+    fatal ("Tree is not consistent");
+  printf ("OK\n");
+
+  printf ("Topology and branch lengths check... ");
+  fflush(stdout);
+  get_edges (parsed_tree, nodes_count, rb_edges);
+  for (i = 0; i < nodes_count * nodes_count; ++i)
+  {
+    if (orig_edges[i] != rb_edges[i])
+      fatal ("Branch %u-%u differs after rollback: %f (expected %f)",
+             i / nodes_count, i % nodes_count, rb_edges[i], orig_edges[i]);
+  }
+  printf ("OK\n");
+
+  printf ("Log-L check... ");
+  fflush(stdout);
+  logl = pllmod_utree_compute_lk(partition,
+                          tree,
+                          params_indices,
+                          1,
+                          1);
+  if (fabs (logl - orig_logl) > 1e-6)
+    fatal ("Log-L after rollback is %f (expected %f)", logl, orig_logl);
+  printf ("OK\n");
+
+  free (orig_edges);
+  free (rb_edges);
+
   /* destroy all structures allocated for the concrete PLL partition instance */
   pll_partition_destroy (partition);
 